@@ -32,6 +32,15 @@ export ARCH?=x86_64
 
 include BuildScripts/Arch.mk
 
+# Physical memory allocator backend: BUDDY or BITMAP (overridable from the environment)
+export PMM_BACKEND?=BUDDY
+
+# Lock contention statistics (see Kernel/Sync/LockStats.h): YES or NO (overridable from the environment)
+export LOCK_STATS?=NO
+
+# Boot-time benchmarks (see Kernel/Benchmarks/Benchmarks.h): YES or NO (overridable from the environment)
+export BENCHMARKS?=NO
+
 # ==== Download links =========================================================
 
 OVMF_URL:=https://github.com/rust-osdev/ovmf-prebuilt/releases/download/edk2-stable202511-r1/edk2-stable202511-r1-bin.tar.xz
@@ -51,7 +60,8 @@ export K_ASMFLAGS:=-f elf64 -g3 -F dwarf
 export K_CFLAGS:=-g -Wall -Wextra -std=c2x -O0 \
 	-ffreestanding -fsanitize=undefined \
 	-mno-red-zone -mcmodel=large -mgeneral-regs-only \
-	-DMUGOS_MAJOR=$(MUGOS_MAJOR) -DMUGOS_MINOR=$(MUGOS_MINOR)
+	-DMUGOS_MAJOR=$(MUGOS_MAJOR) -DMUGOS_MINOR=$(MUGOS_MINOR) -DLOCK_STATS_$(LOCK_STATS) \
+	-DBENCHMARKS_$(BENCHMARKS)
 export K_LDFLAGS:=-nostdlib -static -znoexecstack -L$(BUILD_DIR)
 export K_LDLIBS:=-lkernel
 
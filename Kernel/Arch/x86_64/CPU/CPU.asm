@@ -95,3 +95,36 @@ cpuidWrapperWithSubleaf:
 	leave
 	ret
 ;
+
+global ArchContext_switch
+global startContext
+
+; void ArchContext_switch(uintptr_t* prev, uintptr_t next);
+; Only the callee-saved registers need to be saved: the caller saves the others
+ArchContext_switch:
+	push rbx
+	push rbp
+	push r12
+	push r13
+	push r14
+	push r15
+
+	mov [rdi], rsp		; *prev = rsp
+	mov rsp, rsi		; rsp = next
+
+	pop r15
+	pop r14
+	pop r13
+	pop r12
+	pop rbp
+	pop rbx
+	ret
+;
+
+; Entry point of new contexts (see ArchContext_init): call rbx(r12), which must not return
+; The stack top is 16 bytes aligned here, as the ABI requires before a call
+startContext:
+	mov rdi, r12
+	call rbx
+	ud2
+;
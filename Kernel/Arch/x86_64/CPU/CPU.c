@@ -53,6 +53,11 @@ static void parseCpuid_0x01(struct CPU* cpu){
 	cpu->brandIndex = (ebx & 0x000000ff);
 	cpu->cflushLineSize = (ebx & 0x0000ff00) >> 8;
 	cpu->maxAddressableCpuIds = (ebx & 0x00ff0000) >> 16;
+	// Default topology (refined by leaf 0x0b): no hyper-threading, one package
+	cpu->smtShift = 0;
+	cpu->packageShift = 0;
+	while ((1 << cpu->packageShift) < cpu->maxAddressableCpuIds)
+		cpu->packageShift++;
 	// EDX & EXC
 	cpu->features.leaves.leaf_0x01.ecx = ecx;
 	cpu->features.leaves.leaf_0x01.edx = edx;
@@ -88,6 +93,25 @@ static void parseCpuid_0x07(struct CPU* cpu){
 	}
 }
 
+// CPUID.EAX = 0x0B: Extended topology enumeration
+static void parseCpuid_0x0b(struct CPU* cpu){
+	uint32_t eax, ebx, ecx, edx;
+
+	// One sub-leaf per topology level, until an invalid one
+	for (int subleaf=0 ; ; subleaf++){
+		cpuidWrapperWithSubleaf(0x0b, subleaf, &eax, &ebx, &ecx, &edx);
+		int level_type = (ecx & 0x0000ff00) >> 8;
+		if (level_type == 0)
+			break;
+
+		// EAX: number of APIC ID bits to shift to get the next level's ID
+		if (level_type == 1)
+			cpu->smtShift = (eax & 0x0000001f);
+		else if (level_type == 2)
+			cpu->packageShift = (eax & 0x0000001f);
+	}
+}
+
 // CPUID.EAX = 0x15: Time Stamp Counter & Nominal Core Crystal Clock information
 static void parseCpuid_0x15(struct CPU* cpu){
 	uint32_t eax, ebx, ecx, edx;
@@ -230,6 +254,9 @@ void CPU_init(struct CPU* cpu){
 	case 0x0d:
 	case 0x0c:
 	case 0x0b:
+		// Extended topology enumeration
+		parseCpuid_0x0b(cpu);
+		// Fall through
 	case 0x0a:
 	case 0x09:
 	case 0x08:
@@ -352,6 +352,8 @@ struct CPU {
 	uint8_t brandIndex;
 	uint8_t cflushLineSize;
 	uint8_t maxAddressableCpuIds;
+	uint8_t smtShift; // Number of APIC ID bits identifying a logical processor in its core
+	uint8_t packageShift; // Number of APIC ID bits identifying a logical processor in its package
 	union Features features;
 	union ExtendedFeatures extFeatures;
 
@@ -0,0 +1,27 @@
+#include <stdint.h>
+
+#include "HAL/Scheduler/ArchContext.h"
+
+// CPU.asm
+extern void startContext();
+
+// Stack frame restored by ArchContext_switch
+struct SwitchFrame {
+	uint64_t r15, r14, r13, r12, rbp, rbx;
+	uint64_t rip;
+};
+
+uintptr_t ArchContext_init(void* stack_top, void (*start)(void* arg), void* arg){
+	struct SwitchFrame* frame = (struct SwitchFrame*) stack_top - 1;
+
+	// startContext calls rbx(r12)
+	frame->r15 = 0;
+	frame->r14 = 0;
+	frame->r13 = 0;
+	frame->r12 = (uint64_t) arg;
+	frame->rbp = 0;
+	frame->rbx = (uint64_t) start;
+	frame->rip = (uint64_t) startContext;
+
+	return (uintptr_t) frame;
+}
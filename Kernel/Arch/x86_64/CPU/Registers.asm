@@ -6,6 +6,8 @@ global Registers_readMSR
 global Registers_writeMSR
 global Registers_readCR0
 global Registers_writeCR0
+global Registers_readCR3
+global Registers_writeCR3
 global Registers_readCR4
 global Registers_writeCR4
 
@@ -54,6 +56,16 @@ Registers_writeCR0:
 	ret
 ;
 
+Registers_readCR3:
+	mov rax, cr3
+	ret
+;
+
+Registers_writeCR3:
+	mov cr3, rdi
+	ret
+;
+
 Registers_readCR4:
 	mov rax, cr4
 	ret
@@ -31,6 +31,7 @@
 #define MSR_ADDR_IA32_MISC_ENABLE		0x000001a0
 #define MSR_ADDR_IA32_APIC_BASE			0x0000001b
 #define MSR_ADDR_IA32_TSC_DEADLINE		0x000006e0
+#define MSR_ADDR_IA32_PAT				0x00000277
 #define MSR_ADDR_IA32_EFER				0xc0000080
 #define MSR_ADDR_IA32_FS_BASE			0xc0000100
 #define MSR_ADDR_IA32_GS_BASE			0xc0000101
@@ -45,10 +46,16 @@ uint64_t Registers_readMSR(int msr);
 void Registers_writeMSR(int msr, uint64_t value);
 
 uint64_t Registers_readCR0();
+uint64_t Registers_readCR3();
 uint64_t Registers_readCR4();
 void Registers_writeCR0(uint64_t val);
+void Registers_writeCR3(uint64_t val);
 void Registers_writeCR4(uint64_t val);
 
+// CR3 bits, when CR4.PCIDE is set
+#define CR3_PCID_MASK		0x0000000000000fff
+#define CR3_NOFLUSH			(1ul << 63) // Keep the TLB entries of the loaded PCID
+
 // ================ Registers bitfields ================
 
 union CR0 {
@@ -13,6 +13,7 @@
 #include "Drivers/IrqChip/i8259.h"
 #include "Drivers/IrqChip/IOAPIC.h"
 #include "Drivers/Timers/TSC.h"
+#include "HAL/Halt.h"
 
 #include "APIC.h"
 #define MODULE "APIC"
@@ -333,6 +334,20 @@ static void scheduleEventTsc(unsigned long ticks){
 	Registers_writeMSR(MSR_ADDR_IA32_TSC_DEADLINE, TSC_read() + ticks);
 }
 
+// Setup the current CPU's timer, once the frequency is known
+static void setupTimer(){
+	union TimerRegister timerReg = { 0 };
+	timerReg.bits.vector = IRQ_APIC_TIMER;
+	timerReg.bits.timerMode = m_tscDeadlineMode ? APIC_TIMER_MODE_TSCDEADLINE : APIC_TIMER_MODE_ONESHOT;
+	timerReg.bits.masked = false;
+	writeRegister32(APIC_REG_TIMER, timerReg.value);
+
+	// As the initial count register is 32 bits, we divide the frequency a little
+	// to allow for longer periodic intervals
+	if (!m_tscDeadlineMode)
+		writeRegister32(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVISOR_16);
+}
+
 static void initTimerNoTsc(){
 	// Setup the timer
 	union TimerRegister timerReg = { 0 };
@@ -344,12 +359,7 @@ static void initTimerNoTsc(){
 	uint64_t freq = findFrequency();
 
 	// After frequency calibration, we can enable IRQs
-	timerReg.bits.masked = false;
-	writeRegister32(APIC_REG_TIMER, timerReg.value);
-
-	// As the initial count register is 32 bits, we divide the frequency a little
-	// to allow for longer periodic intervals
-	writeRegister32(APIC_REG_TIMER_DIVIDE, APIC_TIMER_DIVISOR_16);
+	setupTimer();
 	m_apicTimer.frequency = freq / 16;
 	m_apicTimer.minTick = 1;
 	m_apicTimer.maxTick = UINT32_MAX;
@@ -357,12 +367,7 @@ static void initTimerNoTsc(){
 }
 
 static void initTimerTsc(){
-	// Setup the timer
-	union TimerRegister timerReg = { 0 };
-	timerReg.bits.vector = IRQ_APIC_TIMER;
-	timerReg.bits.timerMode = APIC_TIMER_MODE_TSCDEADLINE;
-	timerReg.bits.masked = false;
-	writeRegister32(APIC_REG_TIMER, timerReg.value);
+	setupTimer();
 
 	m_apicTimer.frequency = TSC_getFrequency();
 	m_apicTimer.minTick = 1;
@@ -409,6 +414,7 @@ void APIC_initLAPIC(){
 	uint32_t acpi_processor_id = getAcpiProcessorId(lapicId);
 
 	PerCPU_setCPUInfoMember(apicID, lapicId);
+	PerCPU_setCPUInfoMember(node, PMM_getNodeOfAPIC(lapicId));
 
 	configurePins(acpi_processor_id);
 
@@ -452,7 +458,7 @@ void APIC_initTimers(){
 	m_tscDeadlineMode = g_CPU.features.bits.TSC_Deadline;
 
 	// Call the appropriate initialization function
-	// Note: for now, multiple CPU is NOT supported. We only initialize the BSP
+	// Note: this initializes the BSP's timer ; the APs setup theirs with APIC_initTimerAP
 	m_tscDeadlineMode ? initTimerTsc() : initTimerNoTsc();
 
 	IRQ_installHandler(IRQ_APIC_TIMER, timerIrq);
@@ -465,12 +471,30 @@ void APIC_initTimers(){
 		m_apicTimer.frequency / 1000000, m_apicTimer.frequency % 1000000 / 1000);
 }
 
+void APIC_initTimerAP(){
+	// The APs timers have the same frequency as the BSP's
+	if (m_apicTimer.scheduleEvent != NULL)
+		setupTimer();
+}
+
 void APIC_sendEIO(int){
 	writeRegister32(APIC_REG_EOI, 0);
 }
 
-void APIC_wakeCPU(int lapicID, paddr_t entry){
-	// Send an INIT IPI
+// Wait for the previous IPI to be sent
+static void waitIPISent(){
+	union InterruptCommandRegister icr;
+
+	do {
+		icr.value = readRegister32(APIC_REG_ICR);
+		if (icr.bits.pending)
+			pause();
+	} while (icr.bits.pending);
+}
+
+void APIC_sendInit(int lapicID){
+	waitIPISent();
+
 	union InterruptCommandRegister icr;
 	icr.value = 0;
 	icr.bits.vector = 0; // ignored
@@ -482,18 +506,34 @@ void APIC_wakeCPU(int lapicID, paddr_t entry){
 	icr.bits.destinationShorthand = 0b00;
 	icr.bits.destination = lapicID; // INIT CPU#cpu
 	writeRegister64(APIC_REG_ICR, icr.value);
+}
 
-	msleep(10);
+void APIC_sendStartup(int lapicID, paddr_t entry){
+	waitIPISent();
 
-	// Then, send SIPI
-	// Destination and triggerMode don't differ from previous call
+	union InterruptCommandRegister icr;
+	icr.value = 0;
 	icr.bits.vector = (uintptr_t) entry >> PAGE_SHIFT;
 	icr.bits.deliveryMode = APIC_DELIVERY_STARTUP;
+	icr.bits.destinationMode = 0; // physical
 	icr.bits.level = 1;
+	icr.bits.triggerMode = 0; // edge
+	icr.bits.destinationShorthand = 0b00;
+	icr.bits.destination = lapicID;
 	writeRegister64(APIC_REG_ICR, icr.value);
+}
 
-	msleep(10);
+void APIC_sendIPI(int lapicID, int vector){
+	waitIPISent();
 
-	// Second SIPI, same parameters
+	union InterruptCommandRegister icr;
+	icr.value = 0;
+	icr.bits.vector = vector;
+	icr.bits.deliveryMode = APIC_DELIVERY_FIXED;
+	icr.bits.destinationMode = 0; // physical
+	icr.bits.level = 1;
+	icr.bits.triggerMode = 0; // edge
+	icr.bits.destinationShorthand = 0b00;
+	icr.bits.destination = lapicID;
 	writeRegister64(APIC_REG_ICR, icr.value);
 }
@@ -13,16 +13,29 @@ void APIC_init();
 /// @note It is NOT necessary to call it for the BSP's, this is done by `APIC_init`
 void APIC_initLAPIC();
 
-/// @brief Initialize all CPU's APIC timers
-/// @note SMP must have been initialized beforehand
+/// @brief Initialize the APIC timer (the BSP's one)
 void APIC_initTimers();
 
+/// @brief Initialize the current AP's APIC timer, like the BSP's one
+void APIC_initTimerAP();
+
 /// @brief Send EOI (end of interrupt) to the local APIC
 void APIC_sendEIO(int irq);
 
-/// @brief Wake (starts) a local CPU, by sending an INIT IPI interrupt
+/// @brief Send an INIT IPI to a local CPU, which then waits for a startup IPI
+/// @param lapicID The local APIC ID of the CPU to start
+void APIC_sendInit(int lapicID);
+
+/// @brief Send a startup IPI (SIPI) to a local CPU, that received an INIT IPI: it starts executing
+/// in real mode at `entry`
 /// @param lapicID The local APIC ID of the CPU to start
-/// @param entry The entry point for the awoken CPU, as a (page-aligned) physical address
-void APIC_wakeCPU(int lapicID, paddr_t entry);
+/// @param entry The entry point for the awoken CPU, as a (page-aligned) physical address below 1 MiB
+void APIC_sendStartup(int lapicID, paddr_t entry);
+
+/// @brief Send an IPI (inter-processor interrupt) to a local CPU
+/// @param lapicID The local APIC ID of the destination CPU
+/// @param vector The interrupt vector to raise on it
+/// @note IRQs must be disabled
+void APIC_sendIPI(int lapicID, int vector);
 
 #endif
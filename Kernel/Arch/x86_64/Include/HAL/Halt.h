@@ -10,6 +10,10 @@
 /// @brief Halt (stops until next interrupt) the processor
 #define halt() __asm__ volatile("hlt")
 
+/// @brief Enable interrupts and halt. No interrupt can fire in between (sti only takes effect
+/// after the next instruction): one that makes the condition waited for true wakes the processor
+#define enableAndHalt() __asm__ volatile("sti; hlt")
+
 /// @brief Stops DEFINITELY the processor (interrupts are masked)
 #define haltAndCatchFire() __asm__ volatile("cli; 1: hlt; jmp 1b")
 
@@ -17,6 +17,8 @@
 
 // Programmed IRQs (we can choose those)
 #define IRQ_APIC_TIMER		0x30
+#define IRQ_TLB_SHOOTDOWN	0xf0 // Inter-processor interrupt
+#define IRQ_RESCHEDULE		0xf1 // Inter-processor interrupt: wake an idle CPU (see Scheduler.c)
 #define IRQ_APIC_SPURIOUS	0xff
 
 // Flags manipulations
@@ -1,7 +1,12 @@
 #ifndef __PAGING_H__
 #define __PAGING_H__
 
+#include <stdbool.h>
+#include <stdatomic.h>
 #include "Memory/Memory.h"
+#include "mugOS/List.h"
+#include "Sync/Spinlock.h"
+#include "HAL/SMP/PerCPU.h"
 
 // Flags for the VMM_map/Paging_map method
 #define PAGE_READ					0x00000000 // Protection flag: page is readable (default)
@@ -12,6 +17,48 @@
 #define PAGE_CACHE_DISABLED			0x00000008 // Map flag: cache is disabled
 #define PAGE_CACHE_WRITETHROUGH		0x00000010 // Map flag: cache is write-through
 #define PAGE_CACHE_WRITEBACK		0x00000000 // Map flag: cache is write-back (default)
+#define PAGE_CACHE_WRITECOMBINING	0x00000020 // Map flag: uncached, but writes are combined (framebuffers)
+
+// An address space: a set of page tables. The kernel's one holds the kernel mappings ; they are
+// global pages, kept in the TLB across address space switches. Other address spaces are tagged
+// with a PCID when the CPU supports it, so that switching to them doesn't flush the TLB either
+struct AddressSpace {
+	paddr_t root; // Physical address of the root table (PML4, or PML5 with 5-level paging)
+	uint64_t id; // Unique (never reused), identifies the address space in the per-CPU PCID caches
+	_Atomic cpumask_t cpus; // CPUs that may have its translations cached
+	list_t vmas; // Virtual memory areas (see Memory/VMA.h)
+	spinlock_t vmaLock; // Protects the VMAs list
+};
+
+extern struct AddressSpace g_kernelAddressSpace;
+
+// A physically contiguous memory range (e.g. a scatter-gather list entry, for DMA)
+struct PhysicalRange {
+	paddr_t address;
+	uint64_t length;
+};
+
+// TLB invalidation batch (mmu_gather-like). Unmapping only records the ranges to invalidate, and
+// the page tables that became empty ; they are all invalidated at once by Paging_flushTLBBatch,
+// one invlpg per entry, or with a full TLB flush (CR3 reload) when there are too many of them.
+// The emptied tables are freed after the invalidation, so that no stale walk can reach them
+#define TLB_BATCH_MAX_RANGES		16
+#define TLB_FLUSH_ALL_THRESHOLD		32 // #entries above which the whole TLB is flushed
+
+struct TLBRange {
+	vaddr_t start;
+	uint64_t n_entries;
+	uint64_t entrySize; // SIZE_4KB, SIZE_2MB or SIZE_1GB
+};
+
+struct TLBBatch {
+	struct AddressSpace* space; // The address space the entries are in
+	bool flushAll;
+	uint64_t n_entries;
+	int n_ranges;
+	struct TLBRange ranges[TLB_BATCH_MAX_RANGES];
+	list_t tables; // Pages to free (emptied tables, collapsed pages), chained by their Page node
+};
 
 /// @brief Initializes the tables (allocate, and map everything needed).
 /// @note `Paging_map` becomes callable after tables have been prepared
@@ -20,10 +67,103 @@ void Paging_initTables();
 /// @brief Actually loads CR3 with our root page table. Call `Paging_initTables` first !
 void Paging_enable();
 
-void Paging_unmap(vaddr_t virt, uint64_t n_pages);
+/// @brief Enable the BSP's paging features on the current CPU (an AP), and load the kernel tables
+/// @note Call it after `TLB_initCPU`
+void Paging_initCPU();
+
+/// @brief Copy the kernel root table to `dst` (a page), e.g. for a root table below 4 GiB
+void Paging_copyKernelRoot(void* dst);
 
-/// @brief Map `n_pages` pages from physical address `phys` to virtual `virt`.
+/// @brief Unmap `n_pages` pages starting at `virt`, and invalidate them in the TLB
+/// @return false if a huge page partially in the range couldn't be split, for lack of memory:
+/// nothing is unmapped then
+bool Paging_unmap(vaddr_t virt, uint64_t n_pages);
+
+/// @brief Unmap `n_pages` pages starting at `virt` in the address space of `batch`, but only add
+/// them to `batch` for invalidation. They must not be reused before `batch` is flushed
+/// @return false if nothing could be unmapped (see `Paging_unmap`)
+bool Paging_unmapBatched(vaddr_t virt, uint64_t n_pages, struct TLBBatch* batch);
+
+/// @brief Initialize a batch, for entries of `space`
+void Paging_initTLBBatch(struct TLBBatch* batch, struct AddressSpace* space);
+
+/// @brief Add `n_entries` TLB entries of `entry_size` bytes, starting at `virt`, to invalidate
+void Paging_addTLBRange(struct TLBBatch* batch, vaddr_t virt, uint64_t n_entries, uint64_t entry_size);
+
+/// @brief Invalidate all the TLB entries of `batch`, free its tables, and reset it
+void Paging_flushTLBBatch(struct TLBBatch* batch);
+
+/// @brief Map `n_pages` pages from physical address `phys` to virtual `virt`, in the kernel tables.
 /// See the `PAGE_`-prefixed macros for flag informations
 void Paging_map(paddr_t phys, vaddr_t virt, uint64_t n_pages, int flags);
 
+/// @brief Map the 4KB page `virt` of `space` to `phys`, unless it is already mapped
+/// @return Whether the page was mapped
+bool Paging_mapPage(struct AddressSpace* space, paddr_t phys, vaddr_t virt, int flags);
+
+/// @brief Whether the 2MB range at `virt` of `space` has no page mapped (a hint: mapping it may
+/// still fail, if another CPU maps part of it meanwhile)
+bool Paging_canMapHugePage(struct AddressSpace* space, vaddr_t virt);
+
+/// @brief Map the 2MB page `virt` of `space` to `phys` (both 2MB aligned), unless part of the
+/// range is already mapped
+/// @return Whether the page was mapped
+bool Paging_mapHugePage(struct AddressSpace* space, paddr_t phys, vaddr_t virt, int flags);
+
+/// @brief Unmap the whole page (of any size) that maps `virt`, in the address space of `batch`.
+/// Huge pages are unmapped at once, instead of being split
+/// @param page Set to the physical range of the page
+/// @return false if `virt` isn't mapped
+bool Paging_unmapPage(vaddr_t virt, struct TLBBatch* batch, struct PhysicalRange* page);
+
+/// @brief First step of the collapse of the 4KB pages of the 2MB range `virt` into a huge page:
+/// write-protect them, so that they can be copied
+/// @return false if they can't be collapsed: they must all be mapped with the same rights,
+/// managed by the PMM, and not shared
+bool Paging_prepareCollapse(struct AddressSpace* space, vaddr_t virt);
+
+/// @brief Copy the pages prepared by `Paging_prepareCollapse` into `huge` (2MB aligned), and
+/// replace them by it. The old pages are freed when `batch` is flushed
+/// @return false if the pages changed meanwhile ; `huge` is left unused
+/// @note The pages must belong to the caller (e.g. a VMA), which must keep them from being
+/// unmapped and reused for something else meanwhile
+bool Paging_collapse(struct AddressSpace* space, vaddr_t virt, paddr_t huge, struct TLBBatch* batch);
+
+/// @brief Get the physical address `virt` is mapped to in `space`
+/// @return false if `virt` isn't mapped
+bool Paging_toPhysical(struct AddressSpace* space, vaddr_t virt, paddr_t* phys);
+
+/// @brief Translate the `length` bytes at `virt` into physically contiguous ranges, in one walk
+/// @return The number of ranges written to `ranges`, or -1 if part of the region isn't mapped,
+/// or if it needs more than `max_ranges` ranges
+/// @note The region must not be unmapped concurrently
+int Paging_toPhysicalRanges(struct AddressSpace* space, vaddr_t virt, uint64_t length,
+	struct PhysicalRange* ranges, int max_ranges);
+
+/// @brief Initialize an address space, whose root table is at `root`
+void Paging_initAddressSpace(struct AddressSpace* space, paddr_t root);
+
+/// @brief Create an empty address space (sharing the kernel mappings)
+/// @return false if we are out of memory
+bool Paging_createAddressSpace(struct AddressSpace* space);
+
+/// @brief Create `dst` as a copy-on-write clone of `src`: the user half tables are copied, and
+/// its pages shared read-only until either address space writes to them
+/// @return false if we are out of memory
+bool Paging_cloneAddressSpace(struct AddressSpace* dst, struct AddressSpace* src);
+
+/// @brief Free the user half tables of `space`, and release its pages
+/// @note `space` must not be loaded on any CPU anymore
+void Paging_destroyAddressSpace(struct AddressSpace* space);
+
+/// @brief Handle a write fault on a present page of `space`, by copying it if it is copy-on-write
+/// @return Whether the fault was handled ; false means the access is invalid
+bool Paging_handleWriteFault(struct AddressSpace* space, vaddr_t virt);
+
+/// @brief Load `space` on the current CPU
+void Paging_switchAddressSpace(struct AddressSpace* space);
+
+/// @brief Get the address space loaded on the current CPU
+struct AddressSpace* Paging_getCurrentAddressSpace();
+
 #endif
@@ -0,0 +1,52 @@
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <stdint.h>
+#include "HAL/SMP/PerCPU.h"
+#include "HAL/Memory/Paging.h"
+
+// TLB.h: TLB invalidation, cross-CPU shootdowns and PCIDs
+// Other CPUs may have cached the translations we remove. The initiator of an invalidation sends
+// them one IPI per batch of ranges, invalidates its own TLB meanwhile, then waits for them to
+// acknowledge (i.e. to have invalidated the batch too)
+
+// Each CPU keeps the last address spaces it used in a small cache, one PCID per slot (PCID 0
+// is the kernel address space's). Their translations stay in the TLB while they are cached
+#define TLB_N_PCIDS		6
+
+/// @brief Enable global pages and PCIDs, if the CPU supports them
+/// @note Called by the paging initialization
+void TLB_initFeatures();
+
+/// @brief Initialize the shootdowns, and register the current CPU (the BSP)
+/// @note The IRQs and the per-CPU data must have been initialized beforehand
+void TLB_init();
+
+/// @brief Register the current CPU as using the kernel page tables: it will receive shootdowns.
+/// Call it on each AP, once it can receive IPIs. It also enables PCIDs on it, like on the BSP
+/// @note It is NOT necessary to call it for the BSP, this is done by `TLB_init`
+void TLB_initCPU();
+
+/// @brief Get the CPUs using the kernel page tables
+cpumask_t TLB_getActiveCPUs();
+
+/// @brief Make `space` the current address space of this CPU, giving it a PCID if needed
+/// @return The value to load in CR3
+/// @note IRQs must be disabled
+uint64_t TLB_activate(struct AddressSpace* space);
+
+/// @brief Get the current address space of this CPU
+struct AddressSpace* TLB_getCurrentAddressSpace();
+
+/// @brief Invalidate the entries of `batch` in the current CPU's TLB
+void TLB_invalidateLocal(const struct TLBBatch* batch);
+
+/// @brief Ask the CPUs of `cpus` (the current one excluded) to invalidate the entries of `batch`.
+/// It returns without waiting for them: call `TLB_waitShootdown` to do so
+/// @note IRQs must be disabled, and `batch` left untouched, until `TLB_waitShootdown` returns
+void TLB_startShootdown(const struct TLBBatch* batch, cpumask_t cpus);
+
+/// @brief Wait for all the CPUs targeted by the last `TLB_startShootdown` to acknowledge it
+void TLB_waitShootdown();
+
+#endif
@@ -4,9 +4,30 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Number of CPUs, IDs 0 to g_nCPUs-1. Once `ArchSMP_startCPUs` returns, only the ones online: the
+// APs that failed to start are left out
 extern int g_nCPUs;
 
+// Distance between two CPUs in the topology, from the closest to the farthest
+enum CPUDistance {
+	CPU_DISTANCE_SAME_CORE,		// Hyper-threads of the same core: they share all the caches
+	CPU_DISTANCE_SAME_PACKAGE,	// Share the last level cache
+	CPU_DISTANCE_SAME_NODE,		// Same NUMA node
+	CPU_DISTANCE_REMOTE,
+	CPU_N_DISTANCES
+};
+
 void ArchSMP_init();
+
+/// @brief Start the APs ; lowers `g_nCPUs` to the number of CPUs online if some fail to start
 void ArchSMP_startCPUs();
 
+/// @brief Get the distance between the CPUs `a` and `b` (CPU IDs)
+/// @note Both must have initialized their local APIC
+enum CPUDistance ArchSMP_getDistance(int a, int b);
+
+/// @brief Send the inter-processor interrupt `vector` to the CPU `cpu` (CPU ID)
+/// @note It must have initialized its local APIC
+void ArchSMP_sendIPI(int cpu, int vector);
+
 #endif
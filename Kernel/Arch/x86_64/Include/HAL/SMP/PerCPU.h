@@ -2,10 +2,22 @@
 #define __PER_CPU_H__
 
 #include <stdint.h>
+#include "Memory/PMM.h"
+
+#define MAX_CPUS 64
+
+// Set of CPUs, bit i is CPU#i
+typedef uint64_t cpumask_t;
 
 struct CPUInfo {
 	uint32_t ID; // the actual ID we use, from 0 to #CPUS-1
 	uint32_t apicID;
+	struct CPUInfo* self; // Pointer to this structure, see PerCPU_getCPUInfo
+	uint32_t node; // NUMA node
+
+	struct PMMPageCache pageCache;
+	int noReclaim; // Nesting depth of PMM_disableReclaim
+	int preemptCount; // Nesting depth of Scheduler_disablePreemption
 };
 
 /// @brief Get the value of the `member` (of type `type`) from the per-CPU struct CPUInfo instance
@@ -29,11 +41,34 @@ do { \
 		: "memory"); \
 } while (0)
 
+/// @brief Add `value` to the `member` in the per-CPU struct CPUInfo instance, in one instruction:
+/// the caller can't be moved to another CPU halfway
+#define PerCPU_addCPUInfoMember(member, value) \
+do { \
+	__typeof__(((struct CPUInfo*) 0)->member) __val = (value); \
+	__asm__ volatile ("add %0, %%gs:%c1" \
+		: /* No outputs */ \
+		: "r" (__val), "i" (offsetof(struct CPUInfo, member)) \
+		: "memory", "cc"); \
+} while (0)
+
 #define PerCPU_getCpuId() PerCPU_getCPUInfoMember(ID)
 
+/// @brief Get a pointer to the current CPU's struct CPUInfo instance
+/// @note The caller must not be migrated to another CPU while using it (e.g. have IRQs disabled)
+#define PerCPU_getCPUInfo() PerCPU_getCPUInfoMember(self)
+
+/// @brief Get the struct CPUInfo instance of the CPU `cpu` (CPU ID)
+/// @note The per-CPU datas must have been initialized
+struct CPUInfo* PerCPU_getCPUInfoOf(int cpu);
+
 /// @brief Sets up the BSP's per-CPU info for early boot
 void PerCPU_wake();
 
+/// @brief Sets up the per-CPU info of the current AP, whose CPU ID is `cpu`
+/// @note `PerCPU_init` must have been called
+void PerCPU_wakeAP(int cpu);
+
 /// @brief Initialize the per-CPU datas for SMP, replacing the early boot state
 /// @param nCpus Number of CPUs on the system
 void PerCPU_init(int nCpus);
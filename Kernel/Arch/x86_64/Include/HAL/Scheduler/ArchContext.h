@@ -0,0 +1,18 @@
+#ifndef __ARCH_CONTEXT_H__
+#define __ARCH_CONTEXT_H__
+
+#include <stdint.h>
+
+// ArchContext.h: architecture-specific threads contexts
+// A switched out thread's context is saved on its own stack: the context is the stack pointer
+
+/// @brief Prepare the stack of a new thread, so that switching to it calls `start(arg)`
+/// @param stack_top Top of the stack (16 bytes aligned)
+/// @return The initial context of the thread
+uintptr_t ArchContext_init(void* stack_top, void (*start)(void* arg), void* arg);
+
+/// @brief Save the current context to `*prev`, and switch to `next`
+/// @note IRQs must be disabled. It returns when the context saved in `*prev` is switched back to
+void ArchContext_switch(uintptr_t* prev, uintptr_t next);
+
+#endif
@@ -6,6 +6,9 @@ global enablePaging
 global setPML4
 global setPML5
 global flushTLB
+global flushTLBAll
+global flushTLBGlobal
+global invalidatePCID
 
 ; void enablePaging(void* pageTable, uint16_t ktextSegment, uint16_t kdataSegment);
 ; 					rdi=pageTable,   rsi=ktextSegment,      rdx=kdataSegment
@@ -108,3 +111,42 @@ flushTLB:
 	invlpg [rdi]
 	ret
 ;
+
+; void flushTLBAll();
+; Flush all the (non-global) TLB entries of the current PCID, by reloading cr3
+flushTLBAll:
+	mov rax, cr3
+	mov cr3, rax
+	ret
+;
+
+; void flushTLBGlobal();
+; Flush all the TLB entries, global ones and all PCIDs included, by toggling CR4.PGE
+flushTLBGlobal:
+	mov rax, cr4
+	test rax, (1 << 7)		; CR4.PGE
+	jz .noGlobal
+	mov rcx, rax
+	and rcx, ~(1 << 7)
+	mov cr4, rcx
+	mov cr4, rax
+	ret
+
+	; Without global pages (and thus without PCIDs), reloading cr3 is enough
+	.noGlobal:
+	mov rax, cr3
+	mov cr3, rax
+	ret
+;
+
+; void invalidatePCID(int type, uint64_t pcid, vaddr_t addr);
+;                     rdi=type,     rsi=pcid,    rdx=addr
+; Invalidate TLB entries with the invpcid instruction (see INVPCID_* in TLB.c)
+invalidatePCID:
+	; Build the 128-bit descriptor on the stack: [pcid, addr]
+	push rdx
+	push rsi
+	invpcid rdi, [rsp]
+	add rsp, 16
+	ret
+;
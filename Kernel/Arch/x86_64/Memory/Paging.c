@@ -1,3 +1,4 @@
+#include <stdatomic.h>
 #include "string.h"
 #include "assert.h"
 #include "mugOS/Preprocessor.h"
@@ -6,9 +7,12 @@
 #include "Memory/MemoryMap.h"
 #include "Memory/PMM.h"
 #include "Memory/VMM.h"
+#include "Memory/Page.h"
 #include "CPU/CPU.h"
 #include "CPU/Registers.h"
 #include "Platform/GDT.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "HAL/Memory/TLB.h"
 
 #include "HAL/Memory/Paging.h"
 #define MODULE "Paging"
@@ -29,9 +33,11 @@
 // 5 levels paging => 57 bits virtual addresses (512^5 * 4096 == 2**57)
 
 // Indexing (when referencing a 4KB page ; that's the getIndex... maccros):
-// Virtual address = [ [ PML4 ] [ Directory Ptr ] [ Directory ] [ Table ] [ Offset ] ]
-//            bits = [ 47    39 38             30 29         21 20     12 11       0 ]
+// Virtual address = [ [ PML5 ] [ PML4 ] [ Directory Ptr ] [ Directory ] [ Table ] [ Offset ] ]
+//            bits = [ 56    48 47    39 38             30 29         21 20     12 11       0 ]
+// The root table is the PML5 with 5-level paging (CR4.LA57 set by the bootloader), the PML4 otherwise
 
+#define getIndexPML5(addr) 						( ( (vaddr_t )addr & 0x01ff000000000000) >> 48 )
 #define getIndexPML4(addr) 						( ( (vaddr_t )addr & 0x0000ff8000000000) >> 39 )
 #define getIndexPageDirectoryPointerTable(addr)	( ( (vaddr_t )addr & 0x0000007fc0000000) >> 30 )
 #define getIndexPageDirectory(addr)				( ( (vaddr_t )addr & 0x000000003fe00000) >> 21 )
@@ -47,9 +53,42 @@
 #define PRIVILEGE_KERNEL 0
 #define PRIVILEGE_USER 1
 
+// PAT memory types
+#define PAT_UNCACHEABLE			0x00
+#define PAT_WRITE_COMBINING		0x01
+#define PAT_WRITE_THROUGH		0x04
+#define PAT_WRITE_BACK			0x06
+#define PAT_UNCACHED			0x07 // UC-: like UC, but the MTRRs can make it WC
+
+// The PAT entries, selected by the PAT, PCD and PWT bits of the pages (index = PAT:PCD:PWT)
+// Entries 0-3 are the power-on ones, so pages without the PAT bit keep their usual meaning ;
+// entry 4 (PAT bit only) is write-combining
+#define PAT_VALUE ( \
+	(uint64_t) PAT_WRITE_BACK			<< 0  | (uint64_t) PAT_WRITE_THROUGH	<< 8  | \
+	(uint64_t) PAT_UNCACHED				<< 16 | (uint64_t) PAT_UNCACHEABLE		<< 24 | \
+	(uint64_t) PAT_WRITE_COMBINING		<< 32 | (uint64_t) PAT_WRITE_THROUGH	<< 40 | \
+	(uint64_t) PAT_UNCACHED				<< 48 | (uint64_t) PAT_UNCACHEABLE		<< 56 )
+
+// The kernel half of the address spaces (root entries 256-511) is shared: the tables it references
+// are allocated at initialization, referenced by all the root tables, and never freed
+#define KERNEL_ROOT_START (TABLE_SIZE/2)
+
 // PML5 table entry, references a PML4 table
 struct PML4Descriptor {
-	uint64_t unimplemented;
+	uint64_t present : 1;
+	uint64_t writable : 1;
+	uint64_t privilege : 1;
+	uint64_t writeThrough : 1;
+	uint64_t cacheDisabled : 1;
+	uint64_t accessed : 1;
+	uint64_t ignored0 : 1;
+	uint64_t reserved0 : 1;
+	uint64_t ignored1 : 3;
+	uint64_t restart : 1; // Used if using HLAT paging
+	paddr_t address : ADDRESS_SIZE-12;
+	uint64_t reserved1 : 52-ADDRESS_SIZE;
+	uint64_t ignored2 : 11;
+	uint64_t executeDisabled : 1;
 } packed;
 
 // PML4 table entry, references a PageDirectoryPointerTable
@@ -99,7 +138,8 @@ struct PageDescriptor1GB {
 	uint64_t dirty : 1;
 	uint64_t pageSize : 1; // Must be one (otherwise, this would be a PageDirectoryDescriptor)
 	uint64_t global : 1;
-	uint64_t ignored0 : 2;
+	uint64_t cow : 1; // Software: read-only because shared, copy on write
+	uint64_t ignored0 : 1;
 	uint64_t restart : 1; // Used if using HLAT paging
 	uint64_t pat : 1;
 	uint64_t reserved0 : 17;
@@ -145,7 +185,8 @@ struct PageDescriptor2MB {
 	uint64_t dirty : 1;
 	uint64_t pageSize : 1; // Must be one (otherwise, this would be a PageTableDescriptor)
 	uint64_t global : 1;
-	uint64_t ignored0 : 2;
+	uint64_t cow : 1; // Software: read-only because shared, copy on write
+	uint64_t ignored0 : 1;
 	uint64_t restart : 1; // Used if using HLAT paging
 	uint64_t pat : 1;
 	uint64_t reserved0 : 8;
@@ -173,7 +214,8 @@ struct PageDescriptor4KB {
 	uint64_t dirty : 1;
 	uint64_t pat: 1;
 	uint64_t global : 1;
-	uint64_t ignored0 : 2;
+	uint64_t cow : 1; // Software: read-only because shared, copy on write
+	uint64_t ignored0 : 1;
 	uint64_t restart : 1; // Used if HLAT set
 	paddr_t address : ADDRESS_SIZE-12; // @phys of the 4KB page (ADDRESS_SIZE-12 bits)
 	uint64_t reserved : 52-ADDRESS_SIZE;
@@ -190,11 +232,21 @@ compile_assert(sizeof(struct PageDescriptor4KB) == 8);
 
 #pragma endregion
 
-static bool m_enabled = false;
 static bool m_has1GBPages = false;
+static bool m_hasPAT = false;
+static int m_levels = 4; // 4 or 5 levels paging
 
-aligned(PAGE_SIZE) static struct PDTPDescriptor m_pml4[TABLE_SIZE];
-compile_assert(sizeof(m_pml4) == PAGE_SIZE);
+// The kernel's root table: a PML4, or a PML5 (struct PML4Descriptor entries, same layout)
+aligned(PAGE_SIZE) static struct PDTPDescriptor m_root[TABLE_SIZE];
+compile_assert(sizeof(m_root) == PAGE_SIZE);
+
+struct AddressSpace g_kernelAddressSpace = {
+	.root = 0, .id = 0, .cpus = 0,
+	.vmas = LIST_STATIC_INIT(g_kernelAddressSpace.vmas), .vmaLock = SPINLOCK_INIT("Kernel VMAs")
+};
+static atomic_uint_fast64_t m_nextAddressSpaceID = 1; // 0 is the kernel's
+static ticketlock_t m_lock = TICKETLOCK_INIT("Paging"); // Protects the page tables modifications
+static struct LockStats m_vmaLockStats = { .name = "VMAs" }; // Shared by the other address spaces
 
 // Note:
 // When the most restrictive bit applies, we set the most permissive
@@ -204,60 +256,184 @@ compile_assert(sizeof(m_pml4) == PAGE_SIZE);
 // -> Concerns bits PWT "writeThrough", PCD "cacheDisabled"
 
 // Paging.asm
-bool setPML4(paddr_t pml4);
 void flushTLB(void* addr);
+void flushTLBGlobal();
+
+static inline void lock(){
+	TicketLock_lock(&m_lock);
+}
+
+static inline void unlock(){
+	TicketLock_unlock(&m_lock);
+}
+
+// ================ Address spaces ================
+
+// Get the root table (PML4 or PML5) of an address space
+// Note: the kernel's one isn't in the direct map (it is in the kernel image)
+static inline void* getRoot(const struct AddressSpace* space){
+	if (space == &g_kernelAddressSpace)
+		return m_root;
+	return (void*) VMM_toHHDM(space->root);
+}
+
+// Index of `virt` in the root table
+static inline uint64_t getRootIndex(vaddr_t virt){
+	return (m_levels == 5) ? getIndexPML5(virt) : getIndexPML4(virt);
+}
+
+void Paging_initAddressSpace(struct AddressSpace* space, paddr_t root){
+	space->root = root;
+	space->id = atomic_fetch_add_explicit(&m_nextAddressSpaceID, 1, memory_order_relaxed);
+	atomic_init(&space->cpus, 0);
+	List_init(&space->vmas);
+	Spinlock_init(&space->vmaLock, &m_vmaLockStats);
+}
+
+void Paging_switchAddressSpace(struct AddressSpace* space){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	Registers_writeCR3(TLB_activate(space));
+	IRQ_restore(flags);
+}
+
+struct AddressSpace* Paging_getCurrentAddressSpace(){
+	return TLB_getCurrentAddressSpace();
+}
+
+// ================ TLB invalidation ================
+
+static void resetTLBBatch(struct TLBBatch* batch){
+	batch->flushAll = false;
+	batch->n_entries = 0;
+	batch->n_ranges = 0;
+	List_init(&batch->tables);
+}
+
+void Paging_initTLBBatch(struct TLBBatch* batch, struct AddressSpace* space){
+	batch->space = space;
+	resetTLBBatch(batch);
+}
+
+void Paging_addTLBRange(struct TLBBatch* batch, vaddr_t virt, uint64_t n_entries, uint64_t entry_size){
+	batch->n_entries += n_entries;
+	if (batch->flushAll || batch->n_entries > TLB_FLUSH_ALL_THRESHOLD){
+		batch->flushAll = true;
+		return;
+	}
+
+	// Extend the last range if this one follows it
+	if (batch->n_ranges > 0){
+		struct TLBRange* last = &batch->ranges[batch->n_ranges-1];
+		if (last->entrySize == entry_size && last->start + last->n_entries*entry_size == virt){
+			last->n_entries += n_entries;
+			return;
+		}
+	}
+
+	if (batch->n_ranges == TLB_BATCH_MAX_RANGES){
+		batch->flushAll = true;
+		return;
+	}
+
+	batch->ranges[batch->n_ranges++] = (struct TLBRange) {
+		.start = virt, .n_entries = n_entries, .entrySize = entry_size
+	};
+}
+
+void Paging_flushTLBBatch(struct TLBBatch* batch){
+	unsigned long flags;
+
+	// Kernel mappings are shared by all CPUs, other address spaces' ones are only cached by
+	// the CPUs that used them: shoot them down there, and invalidate this CPU's TLB meanwhile
+	// Note: invlpg also invalidates the paging-structure caches, so the emptied tables
+	// are not referenced anymore after this either
+	IRQ_disableSave(flags);
+	cpumask_t cpus = TLB_getActiveCPUs();
+	if (batch->space != &g_kernelAddressSpace)
+		cpus &= atomic_load(&batch->space->cpus);
+	TLB_startShootdown(batch, cpus);
+	TLB_invalidateLocal(batch);
+	TLB_waitShootdown();
+	IRQ_restore(flags);
+
+	while (!List_isEmpty(&batch->tables)){
+		struct Page* table = List_getObject(batch->tables.head, struct Page, node);
+		List_popFront(&batch->tables);
+		PMM_freePages(Page_toAddress(table), 1);
+	}
+
+	resetTLBBatch(batch);
+}
 
 // ================ Paging_map ================
 
-// Dynamic dynamic tables.
-// Those are used by Paging_map when needing to access/modify tables.
-// We have 3 pages permanently map, that are switched dynamically to a table
-// when said table needs to be accessed. It avoids mapping permanenlty all tables :)
-static constexpr vaddr_t m_dynamicPDPT = 0xffffffffffffd000;
-static constexpr vaddr_t m_dynamicPD   = 0xffffffffffffe000;
-static constexpr vaddr_t m_dynamicPT   = 0xfffffffffffff000;
-// PageTable in which the dynamic tables are mapped in (for dynamically mapping said tables)
-static struct PageTableDescriptor* m_dynamicTablesHost = (void*) 0xffffffffffffc000;
+// Page tables are accessed through the direct map (HHDM), which maps all the usable memory
+static inline void* getTable(paddr_t addr){
+	return (void*) VMM_toHHDM(addr);
+}
 
-static inline void* mapDynamicPDPT(paddr_t addr){
-	if (!m_enabled)
-		return (void*) VMM_mapInHHDM(addr);
+// Size of the memory referenced by the entries of a table of `level` (1: PT, 2: PD, 3: PDPT,
+// 4: PML4, 5: PML5)
+static inline uint64_t getEntrySize(int level){
+	return 1ul << (PAGE_SHIFT + 9*(level-1));
+}
 
-	m_dynamicTablesHost[509].address = getTableEntryAddress(addr);
-	flushTLB((void*)m_dynamicPDPT);
-	return (void*) m_dynamicPDPT;
+// Note: PML4 and PML5 entries always reference a table
+static inline bool isLeaf(void* entry, int level){
+	return level == 1 || (level <= 3 && ((struct PageDescriptor2MB*) entry)->pageSize);
 }
 
-static inline void* mapDynamicPD(paddr_t addr){
-	if (!m_enabled)
-		return (void*) VMM_mapInHHDM(addr);
+// Get the physical address of the page referenced by a leaf entry of `size`
+static inline paddr_t getLeafAddress(void* entry, uint64_t size){
+	switch (size){
+	case SIZE_1GB:
+		return (paddr_t) ((struct PageDescriptor1GB*) entry)->address << 30;
+	case SIZE_2MB:
+		return (paddr_t) ((struct PageDescriptor2MB*) entry)->address << 21;
+	default:
+		return getEntryAddress(((struct PageDescriptor4KB*) entry)->address);
+	}
+}
 
-	m_dynamicTablesHost[510].address = getTableEntryAddress(addr);
-	flushTLB((void*)m_dynamicPD);
-	return (void*) m_dynamicPD;
+// Get the `PAGE_`-prefixed flags of a leaf entry of `size`
+static int getLeafFlags(void* entry, uint64_t size){
+	const struct PageDescriptor4KB* leaf = entry;
+	bool pat = (size == SIZE_4KB) ? leaf->pat : ((struct PageDescriptor2MB*) entry)->pat;
+
+	int flags = PAGE_READ;
+	if (leaf->writable) flags |= PAGE_WRITE;
+	if (!leaf->executeDisabled) flags |= PAGE_EXEC;
+	if (leaf->privilege) flags |= PAGE_USER;
+	if (leaf->writeThrough) flags |= PAGE_CACHE_WRITETHROUGH;
+	if (leaf->cacheDisabled) flags |= PAGE_CACHE_DISABLED;
+	if (pat) flags |= PAGE_CACHE_WRITECOMBINING;
+	return flags;
 }
 
-static inline void* mapDynamicPT(paddr_t addr){
-	if (!m_enabled)
-		return (void*) VMM_mapInHHDM(addr);
+// Write-combining uses the PAT entry 4 ; without PAT, fall back to uncached
+static inline bool isWriteCombining(int flags){
+	return m_hasPAT && (flags & PAGE_CACHE_WRITECOMBINING);
+}
 
-	m_dynamicTablesHost[511].address = getTableEntryAddress(addr);
-	flushTLB((void*)m_dynamicPT);
-	return (void*) m_dynamicPT;
+static inline bool isCacheDisabled(int flags){
+	return (flags & PAGE_CACHE_DISABLED) || (!m_hasPAT && (flags & PAGE_CACHE_WRITECOMBINING));
 }
 
-static void set4KBPage(struct PageDescriptor4KB* entry, paddr_t addr, int flags){
+static void set4KBPage(struct PageDescriptor4KB* entry, paddr_t addr, int flags, bool global){
 	assert(!entry->present);
 
 	entry->present = true;
 	entry->writable = ((flags & PAGE_WRITE) != 0);
 	entry->privilege = ((flags & PAGE_USER) != 0);
 	entry->writeThrough = ((flags & PAGE_CACHE_WRITETHROUGH) != 0);
-	entry->cacheDisabled = ((flags & PAGE_CACHE_DISABLED) != 0);
+	entry->cacheDisabled = isCacheDisabled(flags);
 	entry->accessed = 0;
 	entry->dirty = 0;
-	entry->pat = 0;
-	entry->global = false;
+	entry->pat = isWriteCombining(flags);
+	entry->global = global;
+	entry->cow = false;
 	entry->restart = false;
 	entry->address = get4KBEntryAddress(addr);
 	entry->reserved = 0b0000;
@@ -265,20 +441,21 @@ static void set4KBPage(struct PageDescriptor4KB* entry, paddr_t addr, int flags)
 	entry->executeDisabled = !(flags & PAGE_EXEC);
 }
 
-static void set2MBPage(struct PageDescriptor2MB* entry, paddr_t addr, int flags){
+static void set2MBPage(struct PageDescriptor2MB* entry, paddr_t addr, int flags, bool global){
 	assert(!entry->present);
 
 	entry->present = true;
 	entry->writable = ((flags & PAGE_WRITE) != 0);
 	entry->privilege = ((flags & PAGE_USER) != 0);
 	entry->writeThrough = ((flags & PAGE_CACHE_WRITETHROUGH) != 0);
-	entry->cacheDisabled = ((flags & PAGE_CACHE_DISABLED) != 0);
+	entry->cacheDisabled = isCacheDisabled(flags);
 	entry->accessed = 0;
 	entry->dirty = 0;
 	entry->pageSize = 1;
-	entry->global = false;
+	entry->global = global;
+	entry->cow = false;
 	entry->restart = false;
-	entry->pat = 0;
+	entry->pat = isWriteCombining(flags);
 	entry->reserved0 = 0;
 	entry->address = get2MBEntryAddress(addr);
 	entry->reserved1 = 0;
@@ -286,7 +463,7 @@ static void set2MBPage(struct PageDescriptor2MB* entry, paddr_t addr, int flags)
 	entry->executeDisabled = !(flags & PAGE_EXEC);
 }
 
-static void set1GBPage(struct PageDescriptor1GB* entry, paddr_t addr, int flags){
+static void set1GBPage(struct PageDescriptor1GB* entry, paddr_t addr, int flags, bool global){
 	assert(!entry->present);
 	assert(m_has1GBPages);
 
@@ -294,13 +471,14 @@ static void set1GBPage(struct PageDescriptor1GB* entry, paddr_t addr, int flags)
 	entry->writable = ((flags & PAGE_WRITE) != 0);
 	entry->privilege = ((flags & PAGE_USER) != 0);
 	entry->writeThrough = ((flags & PAGE_CACHE_WRITETHROUGH) != 0);
-	entry->cacheDisabled = ((flags & PAGE_CACHE_DISABLED) != 0);
+	entry->cacheDisabled = isCacheDisabled(flags);
 	entry->accessed = 0;
 	entry->dirty = 0;
 	entry->pageSize = 1;
-	entry->global = false;
+	entry->global = global;
+	entry->cow = false;
 	entry->restart = false;
-	entry->pat = 0;
+	entry->pat = isWriteCombining(flags);
 	entry->reserved0 = 0;
 	entry->address = get1GBEntryAddress(addr);
 	entry->reserved1 = 0;
@@ -308,8 +486,17 @@ static void set1GBPage(struct PageDescriptor1GB* entry, paddr_t addr, int flags)
 	entry->executeDisabled = !(flags & PAGE_EXEC);
 }
 
-static paddr_t allocatePageOrPanic(){
+// Allocate a page table
+static paddr_t allocateTable(){
+	// Note: reclaim could unmap pages, while we hold the lock
+	PMM_disableReclaim();
 	paddr_t res = PMM_allocatePages(1);
+	PMM_enableReclaim();
+	return res;
+}
+
+static paddr_t allocatePageOrPanic(){
+	paddr_t res = allocateTable();
 	if (!res){
 		log(PANIC, MODULE, "Could not allocate necessary paging structure !");
 		panic();
@@ -318,12 +505,49 @@ static paddr_t allocatePageOrPanic(){
 	return res;
 }
 
+// Get the PML4 that maps `virt`: the root table itself with 4-level paging, otherwise the one
+// referenced by the root PML5
+// @return NULL if it isn't present and `alloc` is false
+static inline struct PDTPDescriptor* getPML4(void* root, vaddr_t virt, bool alloc){
+	struct PML4Descriptor* entry = (struct PML4Descriptor*) root + getIndexPML5(virt);
+	struct PDTPDescriptor* pml4;
+	paddr_t page_phys;
+
+	if (m_levels == 4)
+		return root;
+
+	if (entry->present)
+		return getTable(getEntryAddress(entry->address));
+
+	if (!alloc)
+		return NULL;
+
+	// Allocate a new table
+	page_phys = allocatePageOrPanic();
+	pml4 = getTable(page_phys);
+	memset(pml4, 0, PAGE_SIZE);
+
+	entry->present = true;
+	entry->writable = true;
+	entry->privilege = PRIVILEGE_USER;
+	entry->writeThrough = false;
+	entry->cacheDisabled = false;
+	entry->accessed = false;
+	entry->reserved0 = 0b0;
+	entry->restart = false;
+	entry->address = getTableEntryAddress(page_phys);
+	entry->reserved1 = 0b0000;
+	entry->executeDisabled = false;
+
+	return pml4;
+}
+
 static inline union PageDirectoryPointerTableEntry* getPDP(struct PDTPDescriptor* entry, bool alloc){
 	union PageDirectoryPointerTableEntry* pdp;
 	paddr_t page_phys;
 
 	if (entry->present)
-		return mapDynamicPDPT(getEntryAddress(entry->address));
+		return getTable(getEntryAddress(entry->address));
 
 	if (!alloc){
 		log(PANIC, MODULE, "Tried to retrieve a non-present page directory pointer table");
@@ -332,7 +556,7 @@ static inline union PageDirectoryPointerTableEntry* getPDP(struct PDTPDescriptor
 
 	// Allocate a new table
 	page_phys = allocatePageOrPanic();
-	pdp = mapDynamicPDPT(page_phys);
+	pdp = getTable(page_phys);
 	memset(pdp, 0, PAGE_SIZE);
 
 	entry->present = true;
@@ -355,7 +579,7 @@ static inline union PageDirectoryEntry* getPD(union PageDirectoryPointerTableEnt
 	paddr_t page_phys;
 
 	if (entry->pageDirectory.present)
-		return mapDynamicPD(getEntryAddress(entry->pageDirectory.address));
+		return getTable(getEntryAddress(entry->pageDirectory.address));
 
 	if (!alloc){
 		log(PANIC, MODULE, "Tried to retrieve a non-present page directory");
@@ -364,7 +588,7 @@ static inline union PageDirectoryEntry* getPD(union PageDirectoryPointerTableEnt
 
 	// Allocate a new table
 	page_phys = allocatePageOrPanic();
-	pd = mapDynamicPD(page_phys);
+	pd = getTable(page_phys);
 	memset(pd, 0, PAGE_SIZE);
 
 	entry->pageDirectory.present = true;
@@ -387,7 +611,7 @@ static inline struct PageDescriptor4KB* getPT(union PageDirectoryEntry* entry, b
 	paddr_t page_phys;
 
 	if (entry->pageTable.present)
-		return mapDynamicPT(getEntryAddress(entry->pageTable.address));
+		return getTable(getEntryAddress(entry->pageTable.address));
 
 	if (!alloc){
 		log(PANIC, MODULE, "Tried to retrieve a non-present page table");
@@ -396,7 +620,7 @@ static inline struct PageDescriptor4KB* getPT(union PageDirectoryEntry* entry, b
 
 	// Allocate a new table
 	page_phys = allocatePageOrPanic();
-	pt = mapDynamicPT(page_phys);
+	pt = getTable(page_phys);
 	memset(pt, 0, PAGE_SIZE);
 
 	entry->pageTable.present = true;
@@ -414,6 +638,8 @@ static inline struct PageDescriptor4KB* getPT(union PageDirectoryEntry* entry, b
 	return pt;
 }
 
+// Note: we only map over non-present entries, which are never cached in the TLB (nor in the
+// paging-structure caches), so there is nothing to invalidate
 void Paging_map(paddr_t phys, vaddr_t virt, uint64_t n_pages, int flags){
 	union PageDirectoryPointerTableEntry* cur_pdp;
 	union PageDirectoryEntry* cur_pd;
@@ -424,6 +650,14 @@ void Paging_map(paddr_t phys, vaddr_t virt, uint64_t n_pages, int flags){
 	uint64_t mappable;
 	uint64_t pages_remaining = n_pages; // in 4KB pages
 
+	// Kernel mappings are the same in all address spaces: make them survive CR3 reloads
+	// Note: the bit is ignored when CR4.PGE is clear
+	bool global = VMM_isKernelAddress(virt);
+	unsigned long irq_flags;
+
+	IRQ_disableSave(irq_flags);
+	lock();
+
 	while (pages_remaining > 0){
 		uint64_t pml4_index = getIndexPML4(virt_cur);
 		uint64_t pdp_index = getIndexPageDirectoryPointerTable(virt_cur);
@@ -431,14 +665,13 @@ void Paging_map(paddr_t phys, vaddr_t virt, uint64_t n_pages, int flags){
 		uint64_t pt_index = getIndexPageTable(virt_cur);
 
 		// Get PDP in the PML4
-		cur_pdp = getPDP(m_pml4 + pml4_index, true);
+		cur_pdp = getPDP(getPML4(m_root, virt_cur, true) + pml4_index, true);
 
 		// Try to map as 1GB pages (if addr is 1GB aligned AND we have more than 1GB to map)
 		if (m_has1GBPages && phys_cur % SIZE_1GB == 0 && pages_remaining >= SIZE_1GB/PAGE_SIZE){
 			mappable = min(TABLE_SIZE - pdp_index, pages_remaining*SIZE_4KB / SIZE_1GB);
 			for (uint64_t i=0 ; i<mappable ; i++){
-				set1GBPage(&cur_pdp->page1GB+pdp_index+i, phys_cur, flags);
-				flushTLB((void*) virt_cur);
+				set1GBPage(&cur_pdp->page1GB+pdp_index+i, phys_cur, flags, global);
 				phys_cur += SIZE_1GB;
 				virt_cur += SIZE_1GB;
 			}
@@ -453,8 +686,7 @@ void Paging_map(paddr_t phys, vaddr_t virt, uint64_t n_pages, int flags){
 		if (phys_cur % SIZE_2MB == 0 && pages_remaining >= SIZE_2MB/PAGE_SIZE){
 			mappable = min(TABLE_SIZE - pd_index, pages_remaining*SIZE_4KB / SIZE_2MB);
 			for (uint64_t i=0 ; i<mappable ; i++){
-				set2MBPage(&cur_pd->page2MB+pd_index+i, phys_cur, flags);
-				flushTLB((void*) virt_cur);
+				set2MBPage(&cur_pd->page2MB+pd_index+i, phys_cur, flags, global);
 				phys_cur += SIZE_2MB;
 				virt_cur += SIZE_2MB;
 			}
@@ -468,17 +700,67 @@ void Paging_map(paddr_t phys, vaddr_t virt, uint64_t n_pages, int flags){
 		// Map 4KB pages in the page table
 		mappable = min(TABLE_SIZE - pt_index, pages_remaining);
 		for (uint64_t i=0 ; i<mappable ; i++){
-			set4KBPage(cur_pt+pt_index+i, phys_cur, flags);
-			flushTLB((void*) virt_cur);
+			set4KBPage(cur_pt+pt_index+i, phys_cur, flags, global);
 			phys_cur += PAGE_SIZE;
 			virt_cur += PAGE_SIZE;
 		}
 		pages_remaining -= mappable;
 	}
+
+	unlock();
+	IRQ_restore(irq_flags);
+}
+
+// Get the 4KB page entry of `virt`, allocating the tables on the way
+// @return NULL if `virt` is in a 1GB or 2MB page
+static struct PageDescriptor4KB* getPageEntry(void* root, vaddr_t virt){
+	union PageDirectoryPointerTableEntry* pdp_entry;
+	union PageDirectoryEntry* pd_entry;
+	struct PDTPDescriptor* pml4 = getPML4(root, virt, true);
+
+	pdp_entry = getPDP(pml4 + getIndexPML4(virt), true) + getIndexPageDirectoryPointerTable(virt);
+	if (pdp_entry->page1GB.present && pdp_entry->page1GB.pageSize)
+		return NULL;
+
+	pd_entry = getPD(pdp_entry, true) + getIndexPageDirectory(virt);
+	if (pd_entry->page2MB.present && pd_entry->page2MB.pageSize)
+		return NULL;
+
+	return getPT(pd_entry, true) + getIndexPageTable(virt);
+}
+
+bool Paging_mapPage(struct AddressSpace* space, paddr_t phys, vaddr_t virt, int flags){
+	unsigned long irq_flags;
+	bool mapped = false;
+
+	IRQ_disableSave(irq_flags);
+	lock();
+
+	struct PageDescriptor4KB* entry = getPageEntry(getRoot(space), virt);
+	if (entry != NULL && !entry->present){
+		set4KBPage(entry, phys, flags, VMM_isKernelAddress(virt));
+		mapped = true;
+	}
+
+	unlock();
+	IRQ_restore(irq_flags);
+	return mapped;
 }
 
 // ================ Paging_unmap ================
 
+// Tables needed to split the huge pages at both ends of an unmapped range: a 1GB page into 2MB
+// pages, and then one of these into 4KB pages
+#define MAX_SPLIT_TABLES		4
+
+// Tables allocated before an unmap modifies anything, for its splits: it can't fail halfway
+struct SplitTables {
+	paddr_t tables[MAX_SPLIT_TABLES];
+	int count;
+};
+
+static void* getLeafEntry(void* root, vaddr_t virt, uint64_t* size);
+
 static inline bool tableIsEmpty(void* table){
 	struct PageDescriptor4KB* polymorphic_table = table;
 
@@ -489,43 +771,172 @@ static inline bool tableIsEmpty(void* table){
 	return true;
 }
 
-static void freeTable(void* table){
-	struct PageDescriptor4KB* polymorphic_table = table;
-	polymorphic_table->present = false;
+// Remove the table referenced by `entry`. It is freed when `batch` is flushed
+static void freeTable(void* entry, struct TLBBatch* batch){
+	struct PageDescriptor4KB* polymorphic_entry = entry;
+	polymorphic_entry->present = false;
+
+	paddr_t phys = getEntryAddress(polymorphic_entry->address);
+	List_pushBack(&batch->tables, &Page_fromAddress(phys)->node);
+}
 
-	paddr_t phys = getEntryAddress(polymorphic_table->address);
-	PMM_freePages(phys, 1);
+// Count the tables needed to split the page that maps `addr`, until the range [start, end) only
+// covers whole pages
+static int countSplits(void* root, vaddr_t addr, vaddr_t start, vaddr_t end){
+	uint64_t size;
+	int n_splits = 0;
+
+	if (getLeafEntry(root, addr, &size) == NULL)
+		return 0;
+
+	for ( ; size>SIZE_4KB ; size/=TABLE_SIZE){
+		vaddr_t page = addr & ~(size-1);
+		if (page >= start && page + size <= end)
+			break;
+		n_splits++;
+	}
+
+	return n_splits;
+}
+
+static void freeSplitTables(struct SplitTables* split){
+	for (int i=0 ; i<split->count ; i++)
+		PMM_freePages(split->tables[i], 1);
+	split->count = 0;
+}
+
+// Allocate the tables needed to unmap [virt, virt + n_pages*PAGE_SIZE) (possibly a few more)
+// @return false if we are out of memory ; none is left allocated then
+// Note: the lock must be held
+static bool allocateSplitTables(void* root, vaddr_t virt, uint64_t n_pages, struct SplitTables* split){
+	vaddr_t end = virt + n_pages*PAGE_SIZE;
+	int n_tables = countSplits(root, virt, virt, end) + countSplits(root, end - 1, virt, end);
+
+	split->count = 0;
+	while (split->count < n_tables){
+		paddr_t table = allocateTable();
+		if (table == (paddr_t) NULL){
+			freeSplitTables(split);
+			return false;
+		}
+		split->tables[split->count++] = table;
+	}
+
+	return true;
+}
+
+/// @brief Split the huge page of `entry` (in a table of `level`: 3 for a 1GB page, 2 for a 2MB one)
+/// into a table of smaller pages, so that part of it can be unmapped. The table is taken from
+/// `split`
+/// @note The lock must be held
+static void splitPage(void* entry, int level, vaddr_t virt, struct TLBBatch* batch,
+		struct SplitTables* split){
+	struct PageDescriptor4KB* leaf = entry;
+	uint64_t size = getEntrySize(level);
+	uint64_t child_size = getEntrySize(level-1);
+	paddr_t phys = getLeafAddress(entry, size);
+	int flags = getLeafFlags(entry, size);
+
+	// Copy-on-write pages are accounted for as a whole
+	assert(!leaf->cow);
+
+	assert(split->count > 0);
+	paddr_t table_phys = split->tables[--split->count];
+	void* table = getTable(table_phys);
+	memset(table, 0, PAGE_SIZE);
+	for (int i=0 ; i<TABLE_SIZE ; i++){
+		if (level == 2)
+			set4KBPage((struct PageDescriptor4KB*) table + i, phys + i*child_size, flags, leaf->global);
+		else
+			set2MBPage((struct PageDescriptor2MB*) table + i, phys + i*child_size, flags, leaf->global);
+	}
+
+	// Replace the leaf at once (a PageDirectoryDescriptor has the same layout)
+	union PageDirectoryEntry table_entry = { .pageTable = {
+		.present = true,
+		.writable = true,
+		.privilege = PRIVILEGE_USER,
+		.address = getTableEntryAddress(table_phys),
+	}};
+	*(union PageDirectoryEntry*) entry = table_entry;
+
+	// The new translations are the same, but the huge one must not stay cached alongside them
+	Paging_addTLBRange(batch, virt & ~(size-1), 1, size);
 }
 
-void Paging_unmap(vaddr_t virt, uint64_t n_pages){
+// Remove the PDPT `pdp` of `virt` if it is empty, and then its PML4 too with 5-level paging
+// Note: the tables referenced by the kernel half of the root table are shared, and never freed
+static void freeEmptyPDP(void* root, vaddr_t virt, union PageDirectoryPointerTableEntry* pdp,
+		struct TLBBatch* batch){
+	struct PDTPDescriptor* pml4 = getPML4(root, virt, false);
+	bool shared = (getRootIndex(virt) >= KERNEL_ROOT_START);
+
+	if (!tableIsEmpty(pdp) || (m_levels == 4 && shared))
+		return;
+	freeTable(pml4 + getIndexPML4(virt), batch);
+
+	if (m_levels == 5 && !shared && tableIsEmpty(pml4))
+		freeTable((struct PML4Descriptor*) root + getIndexPML5(virt), batch);
+}
+
+bool Paging_unmap(vaddr_t virt, uint64_t n_pages){
+	struct TLBBatch batch;
+
+	Paging_initTLBBatch(&batch, &g_kernelAddressSpace);
+	bool unmapped = Paging_unmapBatched(virt, n_pages, &batch);
+	Paging_flushTLBBatch(&batch);
+
+	return unmapped;
+}
+
+// @return false if a huge page couldn't be split, for lack of memory: nothing is unmapped then
+// Note: the lock must be held
+static bool unmapLocked(vaddr_t virt, uint64_t n_pages, struct TLBBatch* batch){
 	union PageDirectoryPointerTableEntry* cur_pdp;
 	union PageDirectoryEntry* cur_pd;
 	struct PageDescriptor4KB* cur_pt;
+	struct SplitTables split;
+	void* root = getRoot(batch->space);
 	vaddr_t virt_cur = virt;
 
 	uint64_t removable;
 	uint64_t pages_remaining = n_pages; // in 4KB pages
 
+	if (n_pages == 0)
+		return true;
+	if (!allocateSplitTables(root, virt, n_pages, &split))
+		return false;
+
 	while (pages_remaining > 0){
+		vaddr_t virt_start = virt_cur;
 		uint64_t pml4_index = getIndexPML4(virt_cur);
 		uint64_t pdp_index = getIndexPageDirectoryPointerTable(virt_cur);
 		uint64_t pd_index = getIndexPageDirectory(virt_cur);
 		uint64_t pt_index = getIndexPageTable(virt_cur);
 
 		// Get PDP in the PML4
-		cur_pdp = getPDP(m_pml4 + pml4_index, false);
+		struct PDTPDescriptor* cur_pml4 = getPML4(root, virt_cur, false);
+		if (cur_pml4 == NULL){
+			log(PANIC, MODULE, "Tried to retrieve a non-present PML4");
+			panic();
+		}
+		cur_pdp = getPDP(cur_pml4 + pml4_index, false);
+
+		// Partially unmapped 1GB page: split it
+		if (cur_pdp[pdp_index].page1GB.pageSize == 1 &&
+			(virt_cur % SIZE_1GB != 0 || pages_remaining < SIZE_1GB/PAGE_SIZE))
+			splitPage(cur_pdp + pdp_index, 3, virt_cur, batch, &split);
 
 		// Mapped as 1GB pages
-		if (cur_pdp->page1GB.pageSize == 1){
+		if (cur_pdp[pdp_index].page1GB.pageSize == 1){
 			removable = min(TABLE_SIZE - pdp_index, pages_remaining*SIZE_4KB / SIZE_1GB);
 			for (uint64_t i=0 ; i<removable ; i++){
 				assert(cur_pdp[pdp_index+i].page1GB.present == true);
 				cur_pdp[pdp_index+i].page1GB.present = false;
-				flushTLB((void*) virt_cur);
-				virt_cur += SIZE_1GB;
 			}
-			if (tableIsEmpty(cur_pdp))
-				freeTable(m_pml4 + pml4_index);
+			Paging_addTLBRange(batch, virt_cur, removable, SIZE_1GB);
+			virt_cur += removable * SIZE_1GB;
+			freeEmptyPDP(root, virt_start, cur_pdp, batch);
 			pages_remaining -= removable * SIZE_1GB/PAGE_SIZE;
 			continue;
 		}
@@ -533,19 +944,23 @@ void Paging_unmap(vaddr_t virt, uint64_t n_pages){
 		// Get Page Directory in PDP
 		cur_pd = getPD(cur_pdp + pdp_index, false);
 
+		// Partially unmapped 2MB page: split it
+		if (cur_pd[pd_index].page2MB.pageSize == 1 &&
+			(virt_cur % SIZE_2MB != 0 || pages_remaining < SIZE_2MB/PAGE_SIZE))
+			splitPage(cur_pd + pd_index, 2, virt_cur, batch, &split);
+
 		// Mapped as 2MB pages
-		if (cur_pd->page2MB.pageSize == 1){
+		if (cur_pd[pd_index].page2MB.pageSize == 1){
 			removable = min(TABLE_SIZE - pd_index, pages_remaining*SIZE_4KB / SIZE_2MB);
 			for (uint64_t i=0 ; i<removable ; i++){
 				assert(cur_pd[pd_index+i].page2MB.present == true);
 				cur_pd[pd_index+i].page2MB.present = false;
-				flushTLB((void*) virt_cur);
-				virt_cur += SIZE_2MB;
 			}
+			Paging_addTLBRange(batch, virt_cur, removable, SIZE_2MB);
+			virt_cur += removable * SIZE_2MB;
 			if (tableIsEmpty(cur_pd)){
-				freeTable(cur_pdp + pdp_index);
-				if (tableIsEmpty(cur_pdp))
-					freeTable(m_pml4 + pml4_index);
+				freeTable(cur_pdp + pdp_index, batch);
+				freeEmptyPDP(root, virt_start, cur_pdp, batch);
 			}
 			pages_remaining -= removable * SIZE_2MB/PAGE_SIZE;
 			continue;
@@ -559,19 +974,514 @@ void Paging_unmap(vaddr_t virt, uint64_t n_pages){
 		for (uint64_t i=0 ; i<removable ; i++){
 			assert(cur_pt[pt_index+i].present == true);
 			cur_pt[pt_index+i].present = false;
-			flushTLB((void*) virt_cur);
-			virt_cur += PAGE_SIZE;
 		}
+		Paging_addTLBRange(batch, virt_cur, removable, SIZE_4KB);
+		virt_cur += removable * PAGE_SIZE;
 		if (tableIsEmpty(cur_pt)){
-			freeTable(cur_pd + pd_index);
+			freeTable(cur_pd + pd_index, batch);
 			if (tableIsEmpty(cur_pd)){
-				freeTable(cur_pdp + pdp_index);
-				if (tableIsEmpty(cur_pdp))
-					freeTable(m_pml4 + pml4_index);
+				freeTable(cur_pdp + pdp_index, batch);
+				freeEmptyPDP(root, virt_start, cur_pdp, batch);
 			}
 		}
 		pages_remaining -= removable;
 	}
+
+	// Both ends may be in the same huge page: fewer tables may have been needed
+	freeSplitTables(&split);
+	return true;
+}
+
+bool Paging_unmapBatched(vaddr_t virt, uint64_t n_pages, struct TLBBatch* batch){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	lock();
+	bool unmapped = unmapLocked(virt, n_pages, batch);
+	unlock();
+	IRQ_restore(flags);
+
+	if (!unmapped)
+		log(ERROR, MODULE, "Out of memory to split a huge page, %#lx not unmapped", virt);
+	return unmapped;
+}
+
+// ================ Paging_toPhysical ================
+
+// Note: translations don't take the lock. Page tables are only freed after the TLB flush, so
+// a walk never reaches a freed table, as long as its address isn't being unmapped
+
+// Find the leaf entry mapping `virt`
+// @return The entry (a PageDescriptor of `size`), NULL if `virt` isn't mapped
+// @param size Set to the size of the leaf page
+static void* getLeafEntry(void* root, vaddr_t virt, uint64_t* size){
+	struct PDTPDescriptor* pml4 = getPML4(root, virt, false);
+	if (pml4 == NULL)
+		return NULL;
+
+	struct PDTPDescriptor* pml4_entry = pml4 + getIndexPML4(virt);
+	if (!pml4_entry->present)
+		return NULL;
+
+	union PageDirectoryPointerTableEntry* pdp = getTable(getEntryAddress(pml4_entry->address));
+	union PageDirectoryPointerTableEntry* pdp_entry = pdp + getIndexPageDirectoryPointerTable(virt);
+	if (!pdp_entry->page1GB.present)
+		return NULL;
+	if (pdp_entry->page1GB.pageSize){
+		*size = SIZE_1GB;
+		return pdp_entry;
+	}
+
+	union PageDirectoryEntry* pd = getTable(getEntryAddress(pdp_entry->pageDirectory.address));
+	union PageDirectoryEntry* pd_entry = pd + getIndexPageDirectory(virt);
+	if (!pd_entry->page2MB.present)
+		return NULL;
+	if (pd_entry->page2MB.pageSize){
+		*size = SIZE_2MB;
+		return pd_entry;
+	}
+
+	struct PageDescriptor4KB* pt = getTable(getEntryAddress(pd_entry->pageTable.address));
+	struct PageDescriptor4KB* pt_entry = pt + getIndexPageTable(virt);
+	if (!pt_entry->present)
+		return NULL;
+
+	*size = SIZE_4KB;
+	return pt_entry;
+}
+
+bool Paging_toPhysical(struct AddressSpace* space, vaddr_t virt, paddr_t* phys){
+	uint64_t size;
+
+	void* entry = getLeafEntry(getRoot(space), virt, &size);
+	if (entry == NULL)
+		return false;
+
+	*phys = getLeafAddress(entry, size) + (virt & (size - 1));
+	return true;
+}
+
+int Paging_toPhysicalRanges(struct AddressSpace* space, vaddr_t virt, uint64_t length,
+		struct PhysicalRange* ranges, int max_ranges){
+	void* root = getRoot(space);
+	int n_ranges = 0;
+
+	while (length > 0){
+		uint64_t size;
+		void* entry = getLeafEntry(root, virt, &size);
+		if (entry == NULL)
+			return -1;
+
+		uint64_t offset = virt & (size - 1);
+		paddr_t phys = getLeafAddress(entry, size) + offset;
+		uint64_t n_bytes = min(size - offset, length);
+
+		// Take the following pages of the same page table too, as long as they are contiguous,
+		// without walking again
+		if (size == SIZE_4KB){
+			struct PageDescriptor4KB* next = entry;
+			uint64_t index = getIndexPageTable(virt);
+			while (n_bytes < length && ++index < TABLE_SIZE){
+				next++;
+				if (!next->present || getEntryAddress(next->address) != phys + n_bytes)
+					break;
+				n_bytes += min((uint64_t) SIZE_4KB, length - n_bytes);
+			}
+		}
+
+		// Extend the last range if contiguous, otherwise start a new one
+		if (n_ranges > 0 && ranges[n_ranges-1].address + ranges[n_ranges-1].length == phys){
+			ranges[n_ranges-1].length += n_bytes;
+		}
+		else {
+			if (n_ranges == max_ranges)
+				return -1;
+			ranges[n_ranges++] = (struct PhysicalRange) { .address = phys, .length = n_bytes };
+		}
+
+		virt += n_bytes;
+		length -= n_bytes;
+	}
+
+	return n_ranges;
+}
+
+// ================ Huge pages ================
+
+// Get the page directory entry of `virt`, NULL if there is no page directory
+static union PageDirectoryEntry* getPDEntry(void* root, vaddr_t virt){
+	struct PDTPDescriptor* pml4 = getPML4(root, virt, false);
+	if (pml4 == NULL)
+		return NULL;
+
+	struct PDTPDescriptor* pml4_entry = pml4 + getIndexPML4(virt);
+	if (!pml4_entry->present)
+		return NULL;
+
+	union PageDirectoryPointerTableEntry* pdp = getTable(getEntryAddress(pml4_entry->address));
+	union PageDirectoryPointerTableEntry* pdp_entry = pdp + getIndexPageDirectoryPointerTable(virt);
+	if (!pdp_entry->pageDirectory.present || pdp_entry->pageDirectory.pageSize)
+		return NULL;
+
+	union PageDirectoryEntry* pd = getTable(getEntryAddress(pdp_entry->pageDirectory.address));
+	return pd + getIndexPageDirectory(virt);
+}
+
+// Get the page table of the 2MB range `virt`, NULL if it isn't mapped with 4KB pages
+static struct PageDescriptor4KB* getPageTable(void* root, vaddr_t virt){
+	union PageDirectoryEntry* pd_entry = getPDEntry(root, virt);
+	if (pd_entry == NULL || !pd_entry->pageTable.present || pd_entry->pageTable.pageSize)
+		return NULL;
+
+	return getTable(getEntryAddress(pd_entry->pageTable.address));
+}
+
+// Whether a page table only maps pages that are exclusive to this address space (not shared,
+// see `struct Page`) and managed by the PMM, all with the same rights
+// Note: pages protected by Paging_prepareCollapse are considered writable
+static bool canCollapse(struct PageDescriptor4KB* pt){
+	bool writable = (pt->writable || pt->cow);
+
+	for (int i=0 ; i<TABLE_SIZE ; i++){
+		struct PageDescriptor4KB* entry = pt + i;
+		paddr_t page = getEntryAddress(entry->address);
+		if (!entry->present || !Page_isManaged(page))
+			return false;
+		if (atomic_load(&Page_fromAddress(page)->shares) > 0)
+			return false;
+		if ((entry->writable || entry->cow) != writable || entry->privilege != pt->privilege ||
+			entry->executeDisabled != pt->executeDisabled || entry->writeThrough != pt->writeThrough ||
+			entry->cacheDisabled != pt->cacheDisabled || entry->pat != pt->pat ||
+			entry->global != pt->global)
+			return false;
+	}
+
+	return true;
+}
+
+bool Paging_canMapHugePage(struct AddressSpace* space, vaddr_t virt){
+	union PageDirectoryEntry* pd_entry = getPDEntry(getRoot(space), virt);
+	return (pd_entry == NULL || !pd_entry->page2MB.present);
+}
+
+bool Paging_mapHugePage(struct AddressSpace* space, paddr_t phys, vaddr_t virt, int flags){
+	union PageDirectoryPointerTableEntry* pdp_entry;
+	union PageDirectoryEntry* pd_entry;
+	unsigned long irq_flags;
+	bool mapped = false;
+
+	IRQ_disableSave(irq_flags);
+	lock();
+
+	struct PDTPDescriptor* pml4 = getPML4(getRoot(space), virt, true);
+	pdp_entry = getPDP(pml4 + getIndexPML4(virt), true) + getIndexPageDirectoryPointerTable(virt);
+	if (!pdp_entry->page1GB.present || !pdp_entry->page1GB.pageSize){
+		pd_entry = getPD(pdp_entry, true) + getIndexPageDirectory(virt);
+		if (!pd_entry->page2MB.present){
+			set2MBPage(&pd_entry->page2MB, phys, flags, VMM_isKernelAddress(virt));
+			mapped = true;
+		}
+	}
+
+	unlock();
+	IRQ_restore(irq_flags);
+	return mapped;
+}
+
+bool Paging_unmapPage(vaddr_t virt, struct TLBBatch* batch, struct PhysicalRange* page){
+	unsigned long flags;
+	uint64_t size;
+
+	IRQ_disableSave(flags);
+	lock();
+
+	void* entry = getLeafEntry(getRoot(batch->space), virt, &size);
+	if (entry != NULL){
+		page->address = getLeafAddress(entry, size);
+		page->length = size;
+		// A whole leaf: no split is needed, this can't fail
+		unmapLocked(virt & ~(size-1), size / PAGE_SIZE, batch);
+	}
+
+	unlock();
+	IRQ_restore(flags);
+	return (entry != NULL);
+}
+
+bool Paging_prepareCollapse(struct AddressSpace* space, vaddr_t virt){
+	struct TLBBatch batch;
+	unsigned long flags;
+
+	Paging_initTLBBatch(&batch, space);
+	IRQ_disableSave(flags);
+	lock();
+
+	// Write-protect the pages as if they were copy-on-write (but they aren't shared): a write
+	// makes them writable again (see Paging_handleWriteFault), which aborts the collapse
+	struct PageDescriptor4KB* pt = getPageTable(getRoot(space), virt);
+	bool collapsible = (pt != NULL && canCollapse(pt));
+	if (collapsible){
+		for (int i=0 ; i<TABLE_SIZE ; i++){
+			if (pt[i].writable){
+				pt[i].writable = false;
+				pt[i].cow = true;
+			}
+		}
+		Paging_addTLBRange(&batch, virt, TABLE_SIZE, SIZE_4KB);
+	}
+
+	unlock();
+	IRQ_restore(flags);
+
+	Paging_flushTLBBatch(&batch);
+	return collapsible;
+}
+
+bool Paging_collapse(struct AddressSpace* space, vaddr_t virt, paddr_t huge, struct TLBBatch* batch){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	lock();
+
+	// None of the pages must have been written (or changed) since Paging_prepareCollapse
+	union PageDirectoryEntry* pd_entry = getPDEntry(getRoot(space), virt);
+	struct PageDescriptor4KB* pt = getPageTable(getRoot(space), virt);
+	bool collapsible = (pt != NULL && canCollapse(pt));
+	for (int i=0 ; i<TABLE_SIZE && collapsible ; i++)
+		collapsible = !pt[i].writable;
+
+	if (collapsible){
+		int page_flags = getLeafFlags(pt, SIZE_4KB) | (pt->cow ? PAGE_WRITE : 0);
+		union PageDirectoryEntry huge_entry = {};
+		set2MBPage(&huge_entry.page2MB, huge, page_flags, pt->global);
+
+		// The old pages and their table are freed once they aren't in any TLB anymore
+		for (int i=0 ; i<TABLE_SIZE ; i++){
+			paddr_t page = getEntryAddress(pt[i].address);
+			memcpy(getTable(huge + i*PAGE_SIZE), getTable(page), PAGE_SIZE);
+			List_pushBack(&batch->tables, &Page_fromAddress(page)->node);
+		}
+		List_pushBack(&batch->tables, &Page_fromAddress(getEntryAddress(pd_entry->pageTable.address))->node);
+
+		*pd_entry = huge_entry;
+		Paging_addTLBRange(batch, virt, TABLE_SIZE, SIZE_4KB);
+	}
+
+	unlock();
+	IRQ_restore(flags);
+	return collapsible;
+}
+
+// ================ Address spaces copy-on-write ================
+
+static inline void setLeafAddress(void* entry, paddr_t addr, uint64_t size){
+	switch (size){
+	case SIZE_1GB:
+		((struct PageDescriptor1GB*) entry)->address = get1GBEntryAddress(addr);
+		break;
+	case SIZE_2MB:
+		((struct PageDescriptor2MB*) entry)->address = get2MBEntryAddress(addr);
+		break;
+	default:
+		((struct PageDescriptor4KB*) entry)->address = get4KBEntryAddress(addr);
+		break;
+	}
+}
+
+// Drop an address space's reference to a page, and free it if it was the last one
+static void releasePage(paddr_t addr, uint64_t size){
+	if (!Page_isManaged(addr))
+		return;
+
+	if (!Page_unshare(Page_fromAddress(addr)))
+		PMM_freePages(addr, size / PAGE_SIZE);
+}
+
+// Release the pages referenced by a table of `level`, and the table itself
+static void destroyTable(paddr_t table_phys, int level){
+	struct PageDescriptor4KB* table = getTable(table_phys);
+
+	for (int i=0 ; i<TABLE_SIZE ; i++){
+		if (!table[i].present)
+			continue;
+
+		if (isLeaf(table + i, level))
+			releasePage(getLeafAddress(table + i, getEntrySize(level)), getEntrySize(level));
+		else
+			destroyTable(getEntryAddress(table[i].address), level-1);
+	}
+
+	PMM_freePages(table_phys, 1);
+}
+
+/// @brief Copy a table of `level` mapping `virt`, and its sub-tables. The pages are shared: the
+/// writable ones are made read-only (copy-on-write) in both address spaces
+/// @return The physical address of the copy, 0 if we are out of memory
+/// @note The lock must be held
+static paddr_t cloneTable(paddr_t src_phys, int level, vaddr_t virt, struct TLBBatch* batch){
+	paddr_t dst_phys = allocateTable();
+	if (dst_phys == 0)
+		return 0;
+
+	struct PageDescriptor4KB* src = getTable(src_phys);
+	struct PageDescriptor4KB* dst = getTable(dst_phys);
+	uint64_t entry_size = getEntrySize(level);
+	memset(dst, 0, PAGE_SIZE);
+
+	for (int i=0 ; i<TABLE_SIZE ; i++){
+		vaddr_t entry_virt = virt + i*entry_size;
+		if (!src[i].present)
+			continue;
+
+		if (!isLeaf(src + i, level)){
+			paddr_t child = cloneTable(getEntryAddress(src[i].address), level-1, entry_virt, batch);
+			if (child == 0){
+				destroyTable(dst_phys, level);
+				return 0;
+			}
+			dst[i] = src[i];
+			dst[i].address = getTableEntryAddress(child);
+			continue;
+		}
+
+		// Leaf: share the page. Unmanaged memory (e.g. MMIO) is shared as is
+		paddr_t page = getLeafAddress(src + i, entry_size);
+		if (Page_isManaged(page)){
+			Page_share(Page_fromAddress(page));
+			if (src[i].writable){
+				src[i].writable = false;
+				src[i].cow = true;
+				Paging_addTLBRange(batch, entry_virt, 1, entry_size);
+			}
+		}
+		dst[i] = src[i];
+	}
+
+	return dst_phys;
+}
+
+bool Paging_createAddressSpace(struct AddressSpace* space){
+	paddr_t root = allocateTable();
+	if (root == 0)
+		return false;
+
+	// Empty user half, shared kernel half
+	struct PDTPDescriptor* table = getTable(root);
+	memset(table, 0, KERNEL_ROOT_START * sizeof(struct PDTPDescriptor));
+	memcpy(table + KERNEL_ROOT_START, m_root + KERNEL_ROOT_START,
+		(TABLE_SIZE - KERNEL_ROOT_START) * sizeof(struct PDTPDescriptor));
+
+	Paging_initAddressSpace(space, root);
+	return true;
+}
+
+bool Paging_cloneAddressSpace(struct AddressSpace* dst, struct AddressSpace* src){
+	struct TLBBatch batch;
+	unsigned long flags;
+	bool success = true;
+
+	if (!Paging_createAddressSpace(dst))
+		return false;
+
+	// Root entries have the same layout with 4 and 5 levels (see struct PML4Descriptor)
+	struct PDTPDescriptor* src_root = getRoot(src);
+	struct PDTPDescriptor* dst_root = getRoot(dst);
+	Paging_initTLBBatch(&batch, src);
+
+	IRQ_disableSave(flags);
+	lock();
+	for (int i=0 ; i<KERNEL_ROOT_START && success ; i++){
+		if (!src_root[i].present)
+			continue;
+
+		paddr_t table = cloneTable(getEntryAddress(src_root[i].address), m_levels-1,
+			i * getEntrySize(m_levels), &batch);
+		if (table == 0){
+			success = false;
+			break;
+		}
+		dst_root[i] = src_root[i];
+		dst_root[i].address = getTableEntryAddress(table);
+	}
+	unlock();
+	IRQ_restore(flags);
+
+	// The source's pages may be cached as writable: they must not be written anymore
+	Paging_flushTLBBatch(&batch);
+
+	if (!success)
+		Paging_destroyAddressSpace(dst);
+	return success;
+}
+
+void Paging_destroyAddressSpace(struct AddressSpace* space){
+	struct PDTPDescriptor* root = getRoot(space);
+
+	for (int i=0 ; i<KERNEL_ROOT_START ; i++){
+		if (root[i].present)
+			destroyTable(getEntryAddress(root[i].address), m_levels-1);
+	}
+
+	PMM_freePages(space->root, 1);
+}
+
+bool Paging_handleWriteFault(struct AddressSpace* space, vaddr_t virt){
+	void* root = getRoot(space);
+	struct TLBBatch batch;
+	unsigned long flags;
+	uint64_t size, cur_size;
+
+	// Only copy-on-write pages are handled ; the fault may also be spurious, if another CPU
+	// resolved it while we had the translation cached
+	struct PageDescriptor4KB* entry = getLeafEntry(root, virt, &size);
+	if (entry == NULL || !entry->cow)
+		return (entry != NULL && entry->writable);
+
+	// Allocate the copy beforehand: we can't reclaim memory with the lock held
+	paddr_t copy = PMM_allocateAlignedPages(size / PAGE_SIZE, size);
+	if (copy == (paddr_t) NULL){
+		log(ERROR, MODULE, "Out of memory while copying page %#lx", virt);
+		return false;
+	}
+
+	Paging_initTLBBatch(&batch, space);
+	IRQ_disableSave(flags);
+	lock();
+
+	bool handled = true;
+	entry = getLeafEntry(root, virt, &cur_size);
+	if (entry == NULL || cur_size != size || !entry->cow){
+		handled = (entry != NULL && entry->writable);
+	}
+	else {
+		// Copy the page if it is still used by other address spaces, otherwise we can have it
+		paddr_t page = getLeafAddress(entry, size);
+		bool shared = (atomic_load(&Page_fromAddress(page)->shares) > 0);
+		if (shared){
+			memcpy(getTable(copy), getTable(page), size);
+			shared = Page_unshare(Page_fromAddress(page));
+		}
+		if (shared){
+			setLeafAddress(entry, copy, size);
+			copy = (paddr_t) NULL;
+		}
+		entry->writable = true;
+		entry->cow = false;
+
+		// The old page may be cached by the CPUs using this address space
+		// Note: no need to do so when only the rights were upgraded
+		if (copy == (paddr_t) NULL)
+			Paging_addTLBRange(&batch, virt & ~(size-1), 1, size);
+	}
+
+	unlock();
+	IRQ_restore(flags);
+
+	if (handled)
+		Paging_flushTLBBatch(&batch);
+	if (copy != (paddr_t) NULL)
+		PMM_freePages(copy, size / PAGE_SIZE);
+	return handled;
 }
 
 // ================ Paging initialization ================
@@ -604,13 +1514,21 @@ static void initializeFeatures(){
 	// Check if we can use 1GB pages
 	m_has1GBPages = g_CPU.extFeatures.bits.PAGES_1GB;
 
-	// Note: whether or not the global (G) bit (<=> PGE feature) is supported, we disable it
-	// as we don't use it.
-	// Note 2: feature presence is determined by `g_CPU.features.bits.PGE`
-	cr4.bits.PGE = false;
+	// Program the PAT, for write-combining
+	// Note: the page tables are reloaded (with a full TLB flush) right after, by Paging_enable
+	m_hasPAT = g_CPU.features.bits.PAT;
+	if (m_hasPAT)
+		Registers_writeMSR(MSR_ADDR_IA32_PAT, PAT_VALUE);
+
+	// The paging mode is chosen by the bootloader (see g_pagingModeReq), and can't be changed
+	// without leaving long mode: use the one we were booted with
+	m_levels = cr4.bits.LA57 ? 5 : 4;
 
 	Registers_writeCR4(cr4.value);
 	Registers_writeMSR(MSR_ADDR_IA32_EFER, efer.value);
+
+	// Global pages (PGE) and PCIDs
+	TLB_initFeatures();
 }
 
 static inline void mapKernel(){
@@ -637,36 +1555,23 @@ static inline void mapKernel(){
 	Paging_map(data_phys, (vaddr_t) &__data_start, data_size, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
 }
 
-void mapDynamicTables(){
-	// Finally, we can prepare mappings for the temporary directories
-	Paging_map(0xfffffffffffff000, m_dynamicPDPT, 1, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
-	Paging_map(0xfffffffffffff000, m_dynamicPD, 1, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
-	Paging_map(0xfffffffffffff000, m_dynamicPT, 1, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
-
-	// Now get the physical address of the allocated page table for those last 3 pages
-	// Note: if in the future, we happen to not have HHDM setup by the bootloader,
-	// instead of calling Paging_map, we simply need to map manually the pages here to
-	// get the page table physical address
-	uint64_t pml4_index = getIndexPML4(m_dynamicPDPT);
-	uint64_t pdp_index = getIndexPageDirectoryPointerTable(m_dynamicPDPT);
-	uint64_t pd_index = getIndexPageDirectory(m_dynamicPDPT);
-	struct PDTPDescriptor* pdpt = (void*) VMM_toHHDM(getEntryAddress(m_pml4[pml4_index].address));
-	struct PageTableDescriptor* pd = (void*) VMM_toHHDM(getEntryAddress(pdpt[pdp_index].address));
-	paddr_t pt_phys = getEntryAddress(pd[pd_index].address);
-
-	// Now that we have our physical address, map it
-	Paging_map(pt_phys, (vaddr_t) m_dynamicTablesHost, 1, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
-}
-
 void Paging_initTables(){
-	// Clear the PML4 (sets all entries to invalid)
-	memset(m_pml4, 0, PAGE_SIZE);
+	// Clear the root table (sets all entries to invalid)
+	memset(m_root, 0, PAGE_SIZE);
 
 	// Assert that we have the features we need, and enable them
 	initializeFeatures();
 
+	// Allocate the kernel half tables (PDPTs, or PML4s with 5 levels), shared by all the
+	// address spaces
+	for (int i=KERNEL_ROOT_START ; i<TABLE_SIZE ; i++){
+		if (m_levels == 5)
+			getPML4(m_root, i * getEntrySize(5), true);
+		else
+			getPDP(m_root + i, true);
+	}
+
 	mapKernel();
-	mapDynamicTables();
 
 	// Map the HHDM & framebuffer
 	for (int i=0 ; i<g_memoryMap.size ; i++){
@@ -674,17 +1579,18 @@ void Paging_initTables(){
 		uint64_t n_pages = (cur->length + PAGE_SIZE-1) / PAGE_SIZE; // round up
 		switch (cur->type){
 		case MEMORY_USABLE:
-			// HHDM (deprecated)
-			// Paging_map(cur->address, VMM_toHHDM(cur->address), n_pages,
-			// 	PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
+			// Direct map: the page tables, and the memmap are accessed through it
+			Paging_map(cur->address, VMM_toHHDM(cur->address), n_pages,
+				PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
 			break;
 		case MEMORY_RESERVED:
 		case MEMORY_KERNEL:
 			break;
 		case MEMORY_FRAMEBUFFER:
 			// Framebuffer is/are mapped in the HHDM
+			// Note: write-combining, we only write to it (and flush with writeMemoryBarrier)
 			Paging_map(cur->address, VMM_toHHDM(cur->address), n_pages,
-				PAGE_READ|PAGE_WRITE|PAGE_KERNEL|PAGE_CACHE_DISABLED);
+				PAGE_READ|PAGE_WRITE|PAGE_KERNEL|PAGE_CACHE_WRITECOMBINING);
 			break;
 		case MEMORY_ACPI_NVS:
 		case MEMORY_ACPI_RECLAIMABLE:
@@ -699,22 +1605,40 @@ void Paging_initTables(){
 	}
 }
 
+void Paging_initCPU(){
+	// The AP trampoline copied the BSP's CR0, CR4 and EFER: only the PAT is left
+	if (m_hasPAT)
+		Registers_writeMSR(MSR_ADDR_IA32_PAT, PAT_VALUE);
+
+	// The trampoline loaded the kernel root table already ; load it again through the TLB, which
+	// tracks the CPUs using the address spaces
+	Paging_switchAddressSpace(&g_kernelAddressSpace);
+}
+
+void Paging_copyKernelRoot(void* dst){
+	memcpy(dst, m_root, PAGE_SIZE);
+}
+
 void Paging_enable(){
 	extern uint8_t LOAD_ADDRESS;
 	paddr_t kphys = g_memoryMap.kernelAddress;
 	vaddr_t kvirt = (vaddr_t) &LOAD_ADDRESS;
 
 	// Now load our page table
-	// Note: g_pml4 is not in the HHDM region, so we cannot use VMM_hhdm_virtualToPhysical
+	// Note: m_root is not in the HHDM region, so we cannot use VMM_hhdm_virtualToPhysical
 	// It is in the kernel data section, so we use the kernel code offset
-	paddr_t pml4_phys = kphys + ((uint64_t)m_pml4 - kvirt);
-	bool res = setPML4(pml4_phys);
-	if (!res){
+	paddr_t root_phys = kphys + ((uint64_t)m_root - kvirt);
+	if (root_phys % PAGE_SIZE != 0){
 		log(PANIC, MODULE, "Could not set page table !!");
 		panic();
 	}
 
-	m_enabled = true;
+	g_kernelAddressSpace.root = root_phys;
+	Paging_switchAddressSpace(&g_kernelAddressSpace);
+	// The bootloader's global pages survived the CR3 load
+	flushTLBGlobal();
 
 	log(SUCCESS, MODULE, "Kernel page table set successfully ! Kernel starts at %#lx", kvirt);
+	log(INFO, MODULE, "Using %d-level paging (%d bits virtual addresses)",
+		m_levels, (m_levels == 5) ? 57 : 48);
 }
@@ -0,0 +1,254 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include "Logging.h"
+#include "Panic.h"
+#include "IRQ/IRQ.h"
+#include "HAL/SMP/PerCPU.h"
+#include "HAL/Halt.h"
+#include "CPU/CPU.h"
+#include "CPU/Registers.h"
+#include "Drivers/IrqChip/APIC.h"
+
+#include "HAL/Memory/TLB.h"
+#define MODULE "TLB"
+
+// Each CPU has one request slot, for the shootdown it initiated. Its targets are told about it
+// by setting the initiator's bit in their pending requests mask, and sending them an IPI
+
+struct ShootdownRequest {
+	const struct TLBBatch* batch; // Owned by the initiator, valid until all targets acknowledged
+	atomic_int pending; // Number of targets that didn't acknowledge yet
+};
+
+struct PCIDCache {
+	struct AddressSpace* current;
+	uint64_t ids[TLB_N_PCIDS]; // ID of the address space using PCID i+1, 0 if none
+	int next; // Slot to evict next (round-robin)
+};
+
+// invpcid instruction types
+#define INVPCID_ADDRESS			0 // One address, in one PCID
+#define INVPCID_CONTEXT			1 // All the (non-global) entries of one PCID
+#define INVPCID_ALL_GLOBAL		2 // All the entries, global ones included
+
+static struct ShootdownRequest m_requests[MAX_CPUS]; // Indexed by initiator
+static _Atomic cpumask_t m_pendingRequests[MAX_CPUS]; // Indexed by target, bit i: request of CPU#i
+static _Atomic cpumask_t m_activeCPUs = 0;
+static uint32_t m_apicIDs[MAX_CPUS];
+
+static bool m_hasPCID = false;
+static bool m_hasINVPCID = false;
+static struct PCIDCache m_pcidCaches[MAX_CPUS];
+
+// Paging.asm
+void flushTLB(void* addr);
+void flushTLBAll();
+void flushTLBGlobal();
+void invalidatePCID(int type, uint64_t pcid, vaddr_t addr);
+
+// ================ PCIDs ================
+
+static inline bool isKernelSpace(const struct AddressSpace* space){
+	return space == &g_kernelAddressSpace;
+}
+
+// Get the slot of the address space `id` in the cache, -1 if it isn't cached
+static int findPCIDSlot(struct PCIDCache* cache, uint64_t id){
+	for (int i=0 ; i<TLB_N_PCIDS ; i++){
+		if (cache->ids[i] == id)
+			return i;
+	}
+
+	return -1;
+}
+
+// Invalidate all the entries of the batch with invlpg, i.e. in the current PCID (and global ones)
+static void invalidateRanges(const struct TLBBatch* batch){
+	for (int i=0 ; i<batch->n_ranges ; i++){
+		const struct TLBRange* range = &batch->ranges[i];
+		for (uint64_t j=0 ; j<range->n_entries ; j++)
+			flushTLB((void*) (range->start + j*range->entrySize));
+	}
+}
+
+// Invalidate all the entries of the batch in the PCID `pcid`
+static void invalidateRangesInPCID(const struct TLBBatch* batch, uint64_t pcid){
+	if (batch->flushAll){
+		invalidatePCID(INVPCID_CONTEXT, pcid, 0);
+		return;
+	}
+
+	for (int i=0 ; i<batch->n_ranges ; i++){
+		const struct TLBRange* range = &batch->ranges[i];
+		for (uint64_t j=0 ; j<range->n_entries ; j++)
+			invalidatePCID(INVPCID_ADDRESS, pcid, range->start + j*range->entrySize);
+	}
+}
+
+// Flush everything, global entries included
+static void flushGlobal(){
+	if (m_hasINVPCID)
+		invalidatePCID(INVPCID_ALL_GLOBAL, 0, 0);
+	else
+		flushTLBGlobal();
+}
+
+// Handle all the requests sent to this CPU
+static void handleRequests(){
+	int cpu = PerCPU_getCpuId();
+	cpumask_t requests = atomic_exchange_explicit(&m_pendingRequests[cpu], 0, memory_order_acquire);
+
+	while (requests != 0){
+		int initiator = __builtin_ctzll(requests);
+		requests &= requests - 1;
+
+		TLB_invalidateLocal(m_requests[initiator].batch);
+		atomic_fetch_sub_explicit(&m_requests[initiator].pending, 1, memory_order_release);
+	}
+}
+
+static void shootdownIrq(void*){
+	handleRequests();
+}
+
+// ================ Public API ================
+
+void TLB_initFeatures(){
+	union CR4 cr4;
+	cr4.value = Registers_readCR4();
+
+	// Kernel mappings are global pages, so that they survive address space switches
+	if (g_CPU.features.bits.PGE)
+		cr4.bits.PGE = true;
+
+	// Note: PCIDs can only be enabled while the current PCID is 0, which it is at boot
+	if (g_CPU.features.bits.PCID && (Registers_readCR3() & CR3_PCID_MASK) == 0){
+		cr4.bits.PCIDE = true;
+		m_hasPCID = true;
+		m_hasINVPCID = g_CPU.features.bits.INVPCID;
+	}
+
+	Registers_writeCR4(cr4.value);
+
+	log(INFO, MODULE, "Global pages %s, PCIDs %s, INVPCID %s",
+		cr4.bits.PGE ? "enabled" : "unsupported", m_hasPCID ? "enabled" : "unsupported",
+		m_hasINVPCID ? "enabled" : "unsupported");
+}
+
+void TLB_init(){
+	IRQ_installHandler(IRQ_TLB_SHOOTDOWN, shootdownIrq);
+	// Note: no need to call IRQ_enableSpecific, IPIs do not go through the I/O APIC
+
+	TLB_initCPU();
+}
+
+void TLB_initCPU(){
+	int cpu = PerCPU_getCpuId();
+	if (cpu >= MAX_CPUS){
+		log(PANIC, MODULE, "CPU#%d cannot receive TLB shootdowns (max %d CPUs)", cpu, MAX_CPUS);
+		panic();
+	}
+
+	// The APs start with the BSP's CR4, but PCIDs can only be enabled in long mode
+	union CR4 cr4;
+	cr4.value = Registers_readCR4();
+	if (m_hasPCID && !cr4.bits.PCIDE){
+		cr4.bits.PCIDE = true;
+		Registers_writeCR4(cr4.value);
+	}
+
+	m_apicIDs[cpu] = PerCPU_getCPUInfoMember(apicID);
+	atomic_fetch_or_explicit(&m_activeCPUs, 1ul << cpu, memory_order_release);
+}
+
+cpumask_t TLB_getActiveCPUs(){
+	return atomic_load_explicit(&m_activeCPUs, memory_order_acquire);
+}
+
+uint64_t TLB_activate(struct AddressSpace* space){
+	int cpu = PerCPU_getCpuId();
+	struct PCIDCache* cache = &m_pcidCaches[cpu];
+
+	// Register first, so that we get the shootdowns of the entries we are going to cache
+	// Note: we never unregister, the CPUs that don't cache the address space anymore ignore them
+	atomic_fetch_or(&space->cpus, 1ul << cpu);
+	cache->current = space;
+
+	// The kernel address space uses PCID 0, flushed at each load: it holds global pages anyway
+	if (!m_hasPCID || isKernelSpace(space))
+		return space->root;
+
+	// Cached: its TLB entries are still valid, keep them
+	int slot = findPCIDSlot(cache, space->id);
+	if (slot >= 0)
+		return space->root | (slot+1) | CR3_NOFLUSH;
+
+	// Not cached: take the oldest slot, and flush its PCID while loading
+	slot = cache->next;
+	cache->next = (cache->next + 1) % TLB_N_PCIDS;
+	cache->ids[slot] = space->id;
+	return space->root | (slot+1);
+}
+
+struct AddressSpace* TLB_getCurrentAddressSpace(){
+	return m_pcidCaches[PerCPU_getCpuId()].current;
+}
+
+void TLB_invalidateLocal(const struct TLBBatch* batch){
+	struct PCIDCache* cache = &m_pcidCaches[PerCPU_getCpuId()];
+	const struct AddressSpace* space = batch->space;
+
+	// Kernel entries are global, which invlpg invalidates too
+	if (isKernelSpace(space)){
+		batch->flushAll ? flushGlobal() : invalidateRanges(batch);
+		return;
+	}
+
+	if (space == cache->current){
+		batch->flushAll ? flushTLBAll() : invalidateRanges(batch);
+		return;
+	}
+
+	// Another address space: its entries are only in its PCID, if we still cache it
+	int slot = findPCIDSlot(cache, space->id);
+	if (slot < 0)
+		return;
+
+	if (m_hasINVPCID)
+		invalidateRangesInPCID(batch, slot+1);
+	else
+		cache->ids[slot] = 0; // Forget it: its PCID will be flushed when it is loaded again
+}
+
+void TLB_startShootdown(const struct TLBBatch* batch, cpumask_t cpus){
+	int self = PerCPU_getCpuId();
+	struct ShootdownRequest* request = &m_requests[self];
+
+	cpus &= ~(1ul << self);
+	if (batch->n_entries == 0)
+		cpus = 0;
+
+	// The page tables changes must be visible before we read who uses them (see TLB_activate)
+	atomic_thread_fence(memory_order_seq_cst);
+
+	request->batch = batch;
+	atomic_store_explicit(&request->pending, __builtin_popcountll(cpus), memory_order_relaxed);
+
+	while (cpus != 0){
+		int cpu = __builtin_ctzll(cpus);
+		cpus &= cpus - 1;
+
+		atomic_fetch_or_explicit(&m_pendingRequests[cpu], 1ul << self, memory_order_release);
+		APIC_sendIPI(m_apicIDs[cpu], IRQ_TLB_SHOOTDOWN);
+	}
+}
+
+void TLB_waitShootdown(){
+	struct ShootdownRequest* request = &m_requests[PerCPU_getCpuId()];
+
+	// Our targets may be waiting for us too, with IRQs disabled: handle their requests meanwhile
+	while (atomic_load_explicit(&request->pending, memory_order_acquire) > 0){
+		handleRequests();
+		pause();
+	}
+}
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include "string.h"
+#include "Memory/VMalloc.h"
 #include "CPU/CPU.h"
 
 #include "Platform/GDT.h"
@@ -165,9 +166,10 @@ static struct TSS m_TSS = {
 // (GDT.asm)
 void setTSS(uint16_t TSS_descriptor);
 
-void GDT_setTSS(){
-	struct SystemSegmentDescriptor* entry = (struct SystemSegmentDescriptor*) &m_GDT[5];
-	const uint64_t base = (uint64_t) &m_TSS;
+// Each CPU's GDT has its own TSS at the same entry
+static void setTSSDescriptor(struct SegmentDescriptor* gdt, struct TSS* tss){
+	struct SystemSegmentDescriptor* entry = (struct SystemSegmentDescriptor*) &gdt[5];
+	const uint64_t base = (uint64_t) tss;
 	const uint16_t limit = sizeof(struct TSS)-1;
 	const uint8_t access = TSS_CPU0_ACCESS;
 	const uint8_t flags = TSS_CPU0_FLAGS;
@@ -179,6 +181,40 @@ void GDT_setTSS(){
 	entry->common.limit_16to19_and_flags = GDT_getLimit16to19AndFlags(limit, flags);
 	entry->common.base_24to31 = getBase24to31(base);
 	entry->base_32to63 = getBase32to63(base);
+}
+
+void GDT_setTSS(){
+	setTSSDescriptor(m_GDT, &m_TSS);
+	setTSS(GDT_SEGMENT_TSS_CPU0);
+}
+
+// ================ APs tables ================
+
+// GDT and TSS of an AP: a TSS can only be loaded on one CPU, so each needs a GDT referencing its own
+struct APTables {
+	struct SegmentDescriptor GDT[sizeof(m_GDT) / sizeof(struct SegmentDescriptor)];
+	struct GDTDescriptor descriptor;
+	struct TSS TSS;
+	aligned(0x1000) uint8_t stack[4 * 0x1000]; // TSS ring 0 stack
+};
+
+struct APTables* GDT_allocateAPTables(){
+	struct APTables* tables = vmalloc(sizeof(struct APTables));
+	if (tables == NULL)
+		return NULL;
+
+	memcpy(tables->GDT, m_GDT, sizeof(m_GDT));
+	tables->descriptor.size = sizeof(tables->GDT) - 1;
+	tables->descriptor.offset = (uint64_t) tables->GDT;
+
+	memset(&tables->TSS, 0, sizeof(struct TSS));
+	tables->TSS.rsp0 = (uint64_t) tables->stack + sizeof(tables->stack);
+	setTSSDescriptor(tables->GDT, &tables->TSS);
+
+	return tables;
+}
 
+void GDT_initAP(struct APTables* tables){
+	setGDT(&tables->descriptor, GDT_SEGMENT_KTEXT, GDT_SEGMENT_KDATA);
 	setTSS(GDT_SEGMENT_TSS_CPU0);
 }
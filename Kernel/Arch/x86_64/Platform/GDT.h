@@ -13,4 +13,13 @@ void GDT_init();
 // Initialize the TSS for CPU0
 void GDT_setTSS();
 
+struct APTables;
+
+// Allocate the GDT and TSS of an AP, returns NULL if we are out of memory
+struct APTables* GDT_allocateAPTables();
+
+// Load the GDT and TSS allocated by GDT_allocateAPTables, on the current CPU (an AP)
+// Note: this resets the gs base, so call it before setting the per-CPU data
+void GDT_initAP(struct APTables* tables);
+
 #endif
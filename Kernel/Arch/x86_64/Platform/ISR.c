@@ -3,6 +3,8 @@
 #include "assert.h"
 #include "Panic.h"
 #include "Logging.h"
+#include "Memory/VMM.h"
+#include "Memory/VMA.h"
 #include "IDT.h"
 
 #include "Platform/ISR.h"
@@ -13,6 +15,12 @@
 #define ISR_SEGMENT_NOT_PRESENT		0x0b
 #define ISR_PAGE_FAULT				0x0e
 
+// Page fault error code bits
+#define PF_PRESENT					0x01
+#define PF_WRITE					0x02
+#define PF_USER						0x04
+#define PF_INSTRUCTION_FETCH		0x10
+
 // Global array of [un]registered exception/trap handlers
 // It is handled (edited) in ISR.c, and handlers are called in ISR.asm
 isr_t m_handlers[256];
@@ -126,6 +134,25 @@ void ISR_pageFault(struct ISR_Params* params){
 	uint64_t cr2;
 	__asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
 
+	// Non-present page: it may belong to a VMA, and be populated on demand
+	if (!(params->err & PF_PRESENT)){
+		int access = 0;
+		if (params->err & PF_WRITE) access |= PAGE_WRITE;
+		if (params->err & PF_USER) access |= PAGE_USER;
+		if (params->err & PF_INSTRUCTION_FETCH) access |= PAGE_EXEC;
+
+		if (VMA_handleFault(cr2, access))
+			return;
+	}
+
+	// Write to a present page: it may be copy-on-write, or being collapsed into a huge page
+	if ((params->err & PF_PRESENT) && (params->err & PF_WRITE)){
+		struct AddressSpace* space = VMM_isKernelAddress(cr2) ?
+			&g_kernelAddressSpace : Paging_getCurrentAddressSpace();
+		if (Paging_handleWriteFault(space, cr2))
+			return;
+	}
+
 	const char* cause = params->err & 0b00000001 ? "page-protection violation" : "non-present page";
 	const char* type = params->err & 0b00000010 ? "write access" : "read access";
 	const char* cpu_mode = params->err & 0b00000100 ? "user" : "kernel";
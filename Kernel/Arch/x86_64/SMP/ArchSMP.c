@@ -1,40 +1,127 @@
+#include <stdatomic.h>
 #include "string.h"
 #include "stdlib.h"
 #include "assert.h"
+#include "mugOS/Preprocessor.h"
 #include "Logging.h"
 #include "Panic.h"
 #include "Memory/PMM.h"
 #include "Memory/VMM.h"
+#include "Memory/VMalloc.h"
 #include "Drivers/ACPI/ACPI.h"
 #include "HAL/SMP/PerCPU.h"
+#include "CPU/CPU.h"
 #include "Drivers/IrqChip/APIC.h"
+#include "CPU/Registers.h"
+#include "Platform/GDT.h"
+#include "Platform/IDT.h"
+#include "Time/Time.h"
+#include "SMP/SMP.h"
+#include "HAL/Memory/TLB.h"
+#include "HAL/Memory/Paging.h"
+#include "HAL/Halt.h"
 
 #include "HAL/SMP/ArchSMP.h"
 #define MODULE "Arch SMP"
 
 int g_nCPUs;
 
+#define AP_STACK_SIZE			(4*PAGE_SIZE) // Initial stack, then the AP's idle thread's
+#define AP_START_TIMEOUT		1000000000 // ns
+
 // EntryAP.asm
 extern void entryAP();
+extern uint8_t entryAPParams; // label in EntryAP.asm
 extern uint8_t endEntryAP; // label in EntryAP.asm
 
+// Parameters of the trampoline, see entryAPParams in EntryAP.asm
+struct TrampolineParams {
+	uint64_t cr0;
+	uint64_t cr4;
+	uint64_t efer;
+	uint64_t tempRoot; // Copy of the root table, below 4 GiB (CR3 is 32 bits in protected mode)
+	uint64_t root;
+	uint64_t stacks; // Array of the APs stack tops, indexed by ticket
+	uint64_t entry;
+	uint32_t ticket;
+} packed;
+
+static struct APTables** m_apTables;
+static atomic_int m_nStartedAPs = 0;
+static atomic_int m_nAPIDs = 0; // CPU IDs given to the APs so far ; -1 once we stopped waiting
+
+// Whether the CPU of a MADT entry is valid (enabled or online-capable)
+static inline bool isValidCPU(const struct MADTEntry_LAPIC* lapic){
+	return lapic->flags.bits.onlineCapable || lapic->flags.bits.enabled;
+}
+
 static int parseNumberOfValidCPUs(){
 	int n_cpus = 0;
 
-	// Count number of valid (enabled or online-capable) CPUs
 	for (int i=0 ; i<g_MADT.nLAPIC ; i++){
-		if (!g_MADT.LAPICs[i].flags.bits.onlineCapable && !g_MADT.LAPICs[i].flags.bits.enabled)
-			continue;
-
-		n_cpus++;
+		if (isValidCPU(&g_MADT.LAPICs[i]))
+			n_cpus++;
 	}
 
 	return n_cpus;
 }
 
+// Kernel entry of the APs, called by the trampoline with their ticket
+[[noreturn]]
+static void startAP(int index){
+	GDT_initAP(m_apTables[index]);
+	IDT_init();
+
+	// CPU IDs are given in arrival order, so that the started CPUs are always the first ones.
+	// Those that arrive after the BSP stopped waiting get none, and stop here
+	int n_ids = atomic_load(&m_nAPIDs);
+	do {
+		if (n_ids < 0)
+			haltAndCatchFire();
+	} while (!atomic_compare_exchange_weak(&m_nAPIDs, &n_ids, n_ids + 1));
+	int cpu = n_ids + 1; // CPU#0 is the BSP
+
+	PerCPU_wakeAP(cpu);
+	APIC_initLAPIC();
+	TLB_initCPU();
+	Paging_initCPU();
+	APIC_initTimerAP();
+
+	atomic_fetch_add(&m_nStartedAPs, 1);
+	SMP_runAP();
+}
+
+/// @brief Allocate the stacks and tables of the `n_aps` APs
+/// @return The array of their stack tops, or NULL if we are out of memory
+static uint64_t* allocateAPs(int n_aps){
+	uint64_t* stacks = kmalloc(n_aps * sizeof(uint64_t));
+	m_apTables = kmalloc(n_aps * sizeof(struct APTables*));
+	if (stacks == NULL || m_apTables == NULL)
+		return NULL;
+
+	for (int i=0 ; i<n_aps ; i++){
+		void* stack = vmalloc(AP_STACK_SIZE);
+		m_apTables[i] = GDT_allocateAPTables();
+		if (stack == NULL || m_apTables[i] == NULL)
+			return NULL;
+
+		stacks[i] = (uint64_t) stack + AP_STACK_SIZE;
+	}
+
+	return stacks;
+}
+
 void ArchSMP_init(){
 	g_nCPUs = parseNumberOfValidCPUs();
+
+	// The per-CPU structures (CPU masks, PCID caches...) are sized for MAX_CPUS
+	if (g_nCPUs > MAX_CPUS){
+		log(WARNING, MODULE, "Found %d CPUs, only the first %d are used", g_nCPUs, MAX_CPUS);
+		g_nCPUs = MAX_CPUS;
+	}
+
 	PerCPU_init(g_nCPUs);
+	TLB_init();
 }
 
 void ArchSMP_startCPUs(){
@@ -42,36 +129,117 @@ void ArchSMP_startCPUs(){
 	if (g_nCPUs == 1)
 		return;
 
-	// Prepare CPU's startup code
+	int n_aps = g_nCPUs - 1;
+	uint64_t* stacks = allocateAPs(n_aps);
+	if (stacks == NULL){
+		log(PANIC, MODULE, "Could not allocate the APs stacks and tables !");
+		panic();
+	}
+
+	// Prepare CPU's startup code, followed by the temporary root table
 	int size = (void*) &endEntryAP - (void*) entryAP;
 	int n_pages = roundToPage(size);
-	paddr_t ap_entry_phys = PMM_allocatePages(n_pages);
-	if ((ap_entry_phys & ~0xff000) != 0){
+	// The startup IPI vector is the page number of the entry point, so it must be below 1 MiB
+	paddr_t ap_entry_phys = PMM_allocateLowPages(n_pages + 1, 0x100000);
+	if (ap_entry_phys == (paddr_t) NULL){
 		log(ERROR, MODULE, "Could not allocate low memory needed for starting CPUs. SMP disabled");
+		g_nCPUs = 1;
 		return;
 	}
+	paddr_t temp_root = ap_entry_phys + n_pages*PAGE_SIZE;
+
+	// Identity map the trampoline: the APs still run it right after enabling paging
+	// The mapping is in the kernel root table, so it must be made before copying it
+	VMM_map(ap_entry_phys, ap_entry_phys, n_pages, PAGE_KERNEL|PAGE_READ|PAGE_WRITE|PAGE_EXEC);
+	memcpy((void*) VMM_toHHDM(ap_entry_phys), entryAP, size);
+	Paging_copyKernelRoot((void*) VMM_toHHDM(temp_root));
+
+	// The APs enter long mode with the BSP's control registers ; except for the bits that can
+	// only be set once in long mode (PCIDs, enabled by TLB_initCPU), or that are read-only
+	union CR4 cr4 = { .value = Registers_readCR4() };
+	cr4.bits.PCIDE = 0;
+	union MSR_IA32_EFER efer = { .value = Registers_readMSR(MSR_ADDR_IA32_EFER) };
+	efer.bits.LMA = 0;
 
-	// Copy the entryAP code to low memory. This CPU is in long mode, so we need to map the region
-	// We use a temporary userspace page: it is guaranteed to be free (userspace isn't up yet)
-	vaddr_t ap_entry_virt = 0x1000;
-	VMM_map(ap_entry_phys, ap_entry_virt, n_pages, PAGE_KERNEL|PAGE_READ|PAGE_WRITE);
-	memcpy((void*) ap_entry_virt, entryAP, size);
+	uint64_t params_offset = (void*) &entryAPParams - (void*) entryAP;
+	struct TrampolineParams* params = (void*) VMM_toHHDM(ap_entry_phys + params_offset);
+	params->cr0 = Registers_readCR0();
+	params->cr4 = cr4.value;
+	params->efer = efer.value;
+	params->tempRoot = temp_root;
+	params->root = g_kernelAddressSpace.root;
+	params->stacks = (uint64_t) stacks;
+	params->entry = (uint64_t) startAP;
+	params->ticket = 0;
 
+	// Start all the CPUs at once: INIT, wait 10 ms, then two startup IPIs
+	// Only the first n_aps ones: each AP that runs the trampoline takes a stack
+	ktime_t start = Time_get();
 	uint32_t this_lapic = PerCPU_getCPUInfoMember(apicID);
 	struct MADTEntry_LAPIC* cur;
-	for (int i=0 ; i<g_MADT.nLAPIC ; i++){
-		cur = g_MADT.LAPICs + i;
-		if (!cur->flags.bits.onlineCapable && !cur->flags.bits.enabled)
-			continue;
-		if (cur->lapicID == this_lapic)
-			continue;
-
-		// Wake each CPU, which will start executing the entryAP
-		APIC_wakeCPU(cur->lapicID, ap_entry_phys);
+	for (int sipi=0 ; sipi<=2 ; sipi++){
+		int n_sent = 0;
+		for (int i=0 ; i<g_MADT.nLAPIC && n_sent<n_aps ; i++){
+			cur = g_MADT.LAPICs + i;
+			if (!isValidCPU(cur) || cur->lapicID == this_lapic)
+				continue;
+
+			n_sent++;
+			if (sipi == 0)
+				APIC_sendInit(cur->lapicID);
+			else
+				APIC_sendStartup(cur->lapicID, ap_entry_phys);
+		}
+
+		// Busy waits: sleeping would need the event timer, the APs may share it
+		if (sipi == 0)
+			mdelay(10);
+		else
+			udelay(200);
 	}
 
-	VMM_unmap(ap_entry_virt, n_pages);
-	PMM_freePages(ap_entry_phys, n_pages);
+	// Wait for all the APs to reach the kernel
+	ktime_t deadline = Time_get() + AP_START_TIMEOUT;
+	while (atomic_load(&m_nStartedAPs) < n_aps && Time_get() < deadline)
+		pause();
+
+	int n_started = atomic_load(&m_nStartedAPs);
+	ktime_t elapsed = Time_get() - start;
+	if (n_started < n_aps){
+		// Keep the late APs out, and wait for the ones that got an ID: they are already in the
+		// kernel. Only those are online from now on
+		int n_ids = atomic_exchange(&m_nAPIDs, -1);
+		while (atomic_load(&m_nStartedAPs) < n_ids)
+			pause();
+		g_nCPUs = 1 + n_ids;
+
+		// The missing CPUs may still be running the trampoline: leave it in place
+		log(ERROR, MODULE, "Only %d out of %d APs started", n_ids, n_aps);
+		return;
+	}
+
+	VMM_unmap(ap_entry_phys, n_pages);
+	PMM_freePages(ap_entry_phys, n_pages + 1);
+	kfree(stacks);
+
+	// The APs start in parallel: this shouldn't grow with their number
+	log(SUCCESS, MODULE, "Successfully started %d threads in %ld us", g_nCPUs, elapsed / 1000);
+}
+
+enum CPUDistance ArchSMP_getDistance(int a, int b){
+	const struct CPUInfo* info_a = PerCPU_getCPUInfoOf(a);
+	const struct CPUInfo* info_b = PerCPU_getCPUInfoOf(b);
+
+	if ((info_a->apicID >> g_CPU.smtShift) == (info_b->apicID >> g_CPU.smtShift))
+		return CPU_DISTANCE_SAME_CORE;
+	if ((info_a->apicID >> g_CPU.packageShift) == (info_b->apicID >> g_CPU.packageShift))
+		return CPU_DISTANCE_SAME_PACKAGE;
+	if (info_a->node == info_b->node)
+		return CPU_DISTANCE_SAME_NODE;
+
+	return CPU_DISTANCE_REMOTE;
+}
 
-	log(SUCCESS, MODULE, "Successfully started %d threads", g_nCPUs);
+void ArchSMP_sendIPI(int cpu, int vector){
+	APIC_sendIPI(PerCPU_getCPUInfoOf(cpu)->apicID, vector);
 }
@@ -1,21 +1,148 @@
 section .note.GNU-stack noalloc noexec nowrite progbits
 
 ; EntryAP.asm: Entry point for the APs (Auxiliary Processors, aka non-BSP processors)
+; The BSP copies this trampoline below 1 MiB, identity maps it, and fills its parameters (see
+; struct TrampolineParams in ArchSMP.c). Each AP goes from real mode to protected mode, then to
+; long mode with the BSP's control registers, takes a ticket for its stack, and calls the kernel
+; Note: the code runs from the copy, so it only uses offsets from entryAP, and the physical
+; address of the copy (in ebx)
 
 ; The entry point for APs gets its own section, as it needs special alignment
 ; The 'exec' is a flag for the linker, to get proper debugging
 section .ap_entry exec
 
-; The CPUs start in 16 bits real mode
-bits 16
+%define offset(label) ((label) - entryAP)
+
+; Temporary GDT selectors
+%define CODE32_SELECTOR		0x08
+%define DATA_SELECTOR		0x10
+%define CODE64_SELECTOR		0x18
+
+%define MSR_IA32_EFER		0xc0000080
 
 global entryAP:function
+global entryAPParams
 global endEntryAP
 
+; The CPUs start in 16 bits real mode, at cs:0 with cs = (address of the copy) >> 4
+bits 16
+
 entryAP:
+	cli
+	cld
+
+	mov ax, cs
+	mov ds, ax
+	xor ebx, ebx
+	mov bx, ax
+	shl ebx, 4			; ebx = physical address of the copy
+
+	; Load the temporary GDT: lgdt needs its linear address
+	lea eax, [ebx + offset(tempGDT)]
+	mov [offset(tempGDTDescriptor) + 2], eax
+	lgdt [offset(tempGDTDescriptor)]
+
+	; Enter protected mode
+	mov eax, cr0
+	or eax, 1			; CR0.PE
+	mov cr0, eax
+
+	; Far jump to the 32 bits code, at its linear address too
+	; Note: the APs all write the same values, so they can race here
+	lea eax, [ebx + offset(entry32)]
+	mov [offset(farPointer32)], eax
+	o32 jmp far [offset(farPointer32)]
+;
+
+bits 32
+
+entry32:
+	mov ax, DATA_SELECTOR
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	; PAE (and LA57 with 5-level paging) must be set before enabling paging
+	mov eax, [ebx + offset(entryAPParams.cr4)]
+	mov cr4, eax
+	; CR3 is 32 bits wide for now: use the copy of the root table, below 4 GiB
+	mov eax, [ebx + offset(entryAPParams.tempRoot)]
+	mov cr3, eax
+
+	; Long mode enable (and NX)
+	mov ecx, MSR_IA32_EFER
+	mov eax, [ebx + offset(entryAPParams.efer)]
+	xor edx, edx
+	wrmsr
+
+	; Enable paging: this activates long mode (in compatibility mode until we load a 64 bits cs)
+	mov eax, [ebx + offset(entryAPParams.cr0)]
+	mov cr0, eax
+
+	lea eax, [ebx + offset(entry64)]
+	mov [ebx + offset(farPointer64)], eax
+	jmp far [ebx + offset(farPointer64)]
+;
+
+bits 64
+
+entry64:
+	mov ax, DATA_SELECTOR
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+	mov ebx, ebx		; the upper halves of the registers are undefined after the mode switch
+
+	; Load the actual root table, which may be above 4 GiB
+	mov rax, [rbx + offset(entryAPParams.root)]
+	mov cr3, rax
+
+	; Take a ticket: it is our index in the stacks array
+	mov eax, 1
+	lock xadd [rbx + offset(entryAPParams.ticket)], eax
+	mov rsi, [rbx + offset(entryAPParams.stacks)]
+	mov rsp, [rsi + 8*rax]
+
+	; Call the kernel entry, which doesn't return: entry(index)
+	mov edi, eax
+	mov rax, [rbx + offset(entryAPParams.entry)]
+	call rax
+
+	.halt:
 	cli
 	hlt
-	jmp entryAP
+	jmp .halt
+;
+
+; Temporary GDT: flat segments
+align 16
+tempGDT:
+	dq 0						; Null descriptor
+	dq 0x00cf9a000000ffff		; 32 bits code segment
+	dq 0x00cf92000000ffff		; Data segment
+	dq 0x00af9a000000ffff		; 64 bits code segment
+tempGDTDescriptor:
+	dw 4*8 - 1
+	dd 0						; linear address of tempGDT, set at runtime
+
+farPointer32:
+	dd 0						; linear address of entry32, set at runtime
+	dw CODE32_SELECTOR
+farPointer64:
+	dd 0						; linear address of entry64, set at runtime
+	dw CODE64_SELECTOR
+
+; Parameters, filled by the BSP (see struct TrampolineParams in ArchSMP.c)
+align 8
+entryAPParams:
+	.cr0:		dq 0
+	.cr4:		dq 0
+	.efer:		dq 0
+	.tempRoot:	dq 0
+	.root:		dq 0
+	.stacks:	dq 0
+	.entry:		dq 0
+	.ticket:	dd 0
 
 	endEntryAP:
 	; this label is used for computing the size of the function
@@ -4,6 +4,7 @@
 #include "Panic.h"
 #include "Logging.h"
 #include "CPU/Registers.h"
+#include "HAL/IRQ/IrqFlags.h"
 
 #include "HAL/SMP/PerCPU.h"
 #define MODULE "Per-CPU data"
@@ -11,7 +12,8 @@
 // Initial BSP info, used during early boot
 static struct CPUInfo m_bspInfo = {
 	.ID = 0,
-	.apicID = -1
+	.apicID = -1,
+	.self = &m_bspInfo
 };
 
 // Final, malloc-ed CPU infos array
@@ -25,10 +27,18 @@ static void setInfo(struct CPUInfo* info){
 	Registers_writeMSR(MSR_ADDR_IA32_GS_BASE, (uintptr_t) info);
 }
 
+struct CPUInfo* PerCPU_getCPUInfoOf(int cpu){
+	return &m_CPUInfos[cpu];
+}
+
 void PerCPU_wake(){
 	setInfo(&m_bspInfo);
 }
 
+void PerCPU_wakeAP(int cpu){
+	setInfo(&m_CPUInfos[cpu]);
+}
+
 void PerCPU_init(int nCpus){
 	assert(nCpus > 0);
 
@@ -38,6 +48,18 @@ void PerCPU_init(int nCpus){
 		panic();
 	}
 
+	memset(m_CPUInfos, 0, nCpus * sizeof(struct CPUInfo));
+	for (int i=0 ; i<nCpus ; i++){
+		m_CPUInfos[i].ID = i;
+		m_CPUInfos[i].self = &m_CPUInfos[i];
+	}
+
+	// Move the BSP to its final info. IRQs are disabled so that nothing (e.g. the page
+	// cache) changes in the early info between the copy and the switch
+	unsigned long flags;
+	IRQ_disableSave(flags);
 	memcpy(m_CPUInfos, &m_bspInfo, sizeof(struct CPUInfo));
+	m_CPUInfos[0].self = &m_CPUInfos[0];
 	setInfo(m_CPUInfos);
+	IRQ_restore(flags);
 }
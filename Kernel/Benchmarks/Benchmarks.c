@@ -0,0 +1,653 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include "mugOS/Preprocessor.h"
+#include "mugOS/SlabAllocator.h"
+#include "Logging.h"
+#include "Memory/PMM.h"
+#include "Memory/VMM.h"
+#include "Memory/VMalloc.h"
+#include "Time/Time.h"
+#include "Time/Timer.h"
+#include "SMP/SMP.h"
+#include "Scheduler/Scheduler.h"
+#include "Sync/Mutex.h"
+#include "Sync/Semaphore.h"
+#include "Sync/LockStats.h"
+#include "Drivers/Graphics/Graphics.h"
+#include "HAL/Halt.h"
+
+#include "Benchmarks.h"
+#define MODULE "Benchmarks"
+
+#ifdef BENCHMARKS_YES
+
+#define BENCHMARK_HANDOFFS			10000 // Round trips of the context switch benchmarks
+#define BENCHMARK_MUTEX_LOCKS		10000 // Locks of the shared mutex per thread
+#define BENCHMARK_TASKS				4096 // Short tasks of the load balancing benchmark
+#define BENCHMARK_TASK_LENGTH		50000 // Busy time of each task, in ns
+#define BENCHMARK_TASKS_IN_FLIGHT	128 // Tasks not done yet at most (below the run queue size)
+#define BENCHMARK_PAGES_BATCH		64 // Pages allocated before being freed, by the PMM benchmark
+#define BENCHMARK_PAGES_ROUNDS		1000
+#define BENCHMARK_FRAGMENT_BLOCKS	16384 // 2-page blocks of the biggest fragmented range
+#define BENCHMARK_ALLOCATIONS		100 // Multi-page allocations timed per size
+#define BENCHMARK_OBJECTS_SIZE		64 // Size of the slab benchmark objects
+#define BENCHMARK_OBJECTS_BATCH		64 // Objects allocated before being freed, by the slab benchmark
+#define BENCHMARK_OBJECTS_ROUNDS	1000
+#define BENCHMARK_UNMAPS			1000 // Unmaps per CPU count of the shootdown benchmark
+#define BENCHMARK_USER_ADDRESS		0x400000 // Where the benchmarks map user pages
+#define BENCHMARK_MAP_PAGES			256 // Pages mapped at once by the map benchmark (no huge page)
+#define BENCHMARK_MAP_ROUNDS		100
+#define BENCHMARK_FORK_MAX_PAGES	4096 // Resident pages of the biggest address space forked
+#define BENCHMARK_FORKS				10 // Forks per address space size
+#define BENCHMARK_MAX_TIMERS		10000 // Timers pending at once, at most
+#define BENCHMARK_TIMERS_SPREAD		10000000000 // Range of the pending timers deadlines (ns)
+#define BENCHMARK_EXPIRY_SPREAD		100000000 // Range of the expiring timers deadlines (ns)
+#define BENCHMARK_CLEARS			20 // Framebuffer clears
+#define BENCHMARK_SCROLLS			200 // Framebuffer scrolls (of a line)
+
+#ifdef PMM_BACKEND_BUDDY
+#define BENCHMARK_PMM_BACKEND		"buddy"
+#else
+#define BENCHMARK_PMM_BACKEND		"bitmap"
+#endif
+
+// Number of operations per second, for `n` of them in `elapsed` nanoseconds
+static inline long perSecond(long n, ktime_t elapsed){
+	return (elapsed > 0) ? n * 1000000000 / elapsed : 0;
+}
+
+// ================ Threads ================
+
+static void (*m_entry)(int index);
+static semaphore_t m_start;
+static semaphore_t m_done;
+static atomic_bool m_abort;
+
+static void runThread(void* arg){
+	Semaphore_down(&m_start);
+	if (!atomic_load(&m_abort))
+		m_entry((intptr_t) arg);
+	Semaphore_up(&m_done);
+}
+
+/// @brief Run `entry(i)` for each i in [0, n), each in its own thread, all started at once, and
+/// wait for them to return
+/// @return The time between their start and the last return, or -1 if we are out of memory
+static ktime_t runThreads(int n, void (*entry)(int index)){
+	int n_created = 0;
+
+	m_entry = entry;
+	Semaphore_init(&m_start, 0, NULL);
+	Semaphore_init(&m_done, 0, NULL);
+	atomic_store(&m_abort, false);
+
+	while (n_created < n){
+		if (Scheduler_createThread("benchmark", runThread, (void*) (intptr_t) n_created) == NULL)
+			break;
+		n_created++;
+	}
+	if (n_created < n)
+		atomic_store(&m_abort, true);
+
+	ktime_t start = Time_get();
+	for (int i=0 ; i<n_created ; i++)
+		Semaphore_up(&m_start);
+	for (int i=0 ; i<n_created ; i++)
+		Semaphore_down(&m_done);
+	ktime_t elapsed = Time_get() - start;
+
+	if (n_created < n){
+		log(ERROR, MODULE, "Could not create %d threads", n);
+		return -1;
+	}
+
+	return elapsed;
+}
+
+// ================ Scheduler and locks ================
+
+static atomic_int m_turn;
+static int m_pingPongCPUs[2];
+static semaphore_t m_pingPong[2];
+
+// Pass the turn back and forth, yielding while it is the other thread's
+static void yieldPingPong(int self){
+	for (int i=0 ; i<BENCHMARK_HANDOFFS ; i++){
+		while (atomic_load(&m_turn) != self)
+			Scheduler_yield();
+		atomic_store(&m_turn, !self);
+	}
+
+	m_pingPongCPUs[self] = SMP_getCpuId();
+}
+
+// Pass a token back and forth, blocking until it is woken with it
+static void semaphorePingPong(int self){
+	for (int i=0 ; i<BENCHMARK_HANDOFFS ; i++){
+		Semaphore_down(&m_pingPong[self]);
+		Semaphore_up(&m_pingPong[!self]);
+	}
+}
+
+// Context switch latency, with two threads that yield to each other. The threads may be stolen by
+// different CPUs: they then hand off without switching, which is logged
+static void benchmarkContextSwitch(){
+	atomic_store(&m_turn, 0);
+	ktime_t elapsed = runThreads(2, yieldPingPong);
+	if (elapsed >= 0){
+		bool same_cpu = (m_pingPongCPUs[0] == m_pingPongCPUs[1]);
+		log(INFO, MODULE, "Yield handoff: %ld ns (%s)", elapsed / (2 * BENCHMARK_HANDOFFS),
+			same_cpu ? "context switches" : "threads on different CPUs, no switch");
+	}
+
+	// Blocking and waking: a switch on each side, and an IPI when the threads are on different CPUs
+	Semaphore_init(&m_pingPong[0], 1, NULL);
+	Semaphore_init(&m_pingPong[1], 0, NULL);
+	elapsed = runThreads(2, semaphorePingPong);
+	if (elapsed >= 0)
+		log(INFO, MODULE, "Semaphore handoff (block and wake): %ld ns",
+			elapsed / (2 * BENCHMARK_HANDOFFS));
+}
+
+static mutex_t m_benchmarkMutex = MUTEX_INIT(m_benchmarkMutex, "Benchmark mutex");
+static volatile long m_mutexCounter; // Protected by m_benchmarkMutex
+
+static void lockMutex(int){
+	for (int i=0 ; i<BENCHMARK_MUTEX_LOCKS ; i++){
+		Mutex_lock(&m_benchmarkMutex);
+		m_mutexCounter++;
+		Mutex_unlock(&m_benchmarkMutex);
+	}
+}
+
+// Mutex throughput, uncontended then with a thread per CPU: contended lockers mostly spin, while
+// the holder runs, instead of paying for a switch
+static void benchmarkMutex(){
+	for (int n_threads=1 ; ; n_threads=g_nCPUs){
+		m_mutexCounter = 0;
+		ktime_t elapsed = runThreads(n_threads, lockMutex);
+		if (elapsed < 0)
+			return;
+
+		if (m_mutexCounter != (long) n_threads * BENCHMARK_MUTEX_LOCKS)
+			log(ERROR, MODULE, "Mutex: lost increments, %ld instead of %ld", m_mutexCounter,
+				(long) n_threads * BENCHMARK_MUTEX_LOCKS);
+		log(INFO, MODULE, "Mutex with %d threads: %ld ns per lock and unlock", n_threads,
+			elapsed / ((long) n_threads * BENCHMARK_MUTEX_LOCKS));
+		if (n_threads == g_nCPUs)
+			break;
+	}
+}
+
+static semaphore_t m_taskSlots;
+
+static void shortTask(void*){
+	ktime_t end = Time_get() + BENCHMARK_TASK_LENGTH;
+	while (Time_get() < end)
+		pause();
+
+	Semaphore_up(&m_taskSlots);
+}
+
+// Load balancing: many short tasks, all created on the current CPU. Idle CPUs steal them, so the
+// speedup over running them one after the other should get close to the number of CPUs
+static void benchmarkShortTasks(){
+	int n_created = 0;
+
+	Semaphore_init(&m_taskSlots, BENCHMARK_TASKS_IN_FLIGHT, NULL);
+	ktime_t start = Time_get();
+	for ( ; n_created<BENCHMARK_TASKS ; n_created++){
+		Semaphore_down(&m_taskSlots);
+		if (Scheduler_createThread("short task", shortTask, NULL) == NULL){
+			Semaphore_up(&m_taskSlots);
+			break;
+		}
+	}
+
+	// Wait for the last ones
+	for (int i=0 ; i<BENCHMARK_TASKS_IN_FLIGHT ; i++)
+		Semaphore_down(&m_taskSlots);
+	ktime_t elapsed = Time_get() - start;
+
+	if (n_created < BENCHMARK_TASKS){
+		log(ERROR, MODULE, "Could not create %d short tasks", BENCHMARK_TASKS);
+		return;
+	}
+
+	long speedup = (long) BENCHMARK_TASKS * BENCHMARK_TASK_LENGTH * 100 / elapsed;
+	log(INFO, MODULE, "%d tasks of %d us: %ld ms, %ld tasks/s, %ld.%02ldx speedup on %d CPUs",
+		BENCHMARK_TASKS, BENCHMARK_TASK_LENGTH / 1000, elapsed / 1000000,
+		perSecond(BENCHMARK_TASKS, elapsed), speedup / 100, speedup % 100, g_nCPUs);
+}
+
+// ================ TLB shootdowns ================
+
+// The first `n` CPUs of `cpus`
+static cpumask_t firstCPUs(cpumask_t cpus, int n){
+	cpumask_t res = 0;
+
+	for (int i=0 ; i<n && cpus!=0 ; i++){
+		cpumask_t cpu = cpus & -cpus;
+		res |= cpu;
+		cpus &= ~cpu;
+	}
+
+	return res;
+}
+
+// Latency of the unmap of a page of a user address space, against the number of other CPUs that
+// may cache it: they all get a shootdown IPI, and must acknowledge it
+static void benchmarkUnmap(){
+	struct AddressSpace space;
+	struct TLBBatch batch;
+	int n_others = g_nCPUs - 1;
+
+	paddr_t page = PMM_allocatePages(1);
+	if (page == (paddr_t) NULL || !VMM_createAddressSpace(&space)){
+		log(ERROR, MODULE, "Out of memory for the unmap benchmark");
+		if (page != (paddr_t) NULL)
+			PMM_freePages(page, 1);
+		return;
+	}
+
+	// 0, 1, 2, 4... other CPUs, and all of them
+	for (int n=0 ; ; n=min(max(2*n, 1), n_others)){
+		ktime_t elapsed = 0;
+
+		// Stay on this CPU: `n` other CPUs pretend to use the address space
+		Scheduler_disablePreemption();
+		atomic_store(&space.cpus, firstCPUs(~(1ul << SMP_getCpuId()), n));
+		for (int i=0 ; i<BENCHMARK_UNMAPS ; i++){
+			Paging_mapPage(&space, page, BENCHMARK_USER_ADDRESS, PAGE_USER|PAGE_READ|PAGE_WRITE);
+
+			ktime_t start = Time_get();
+			Paging_initTLBBatch(&batch, &space);
+			Paging_unmapBatched(BENCHMARK_USER_ADDRESS, 1, &batch);
+			Paging_flushTLBBatch(&batch);
+			elapsed += Time_get() - start;
+		}
+		atomic_store(&space.cpus, 0);
+		Scheduler_enablePreemption();
+
+		log(INFO, MODULE, "Unmap of a page cached by %d other CPUs: %ld ns", n,
+			elapsed / BENCHMARK_UNMAPS);
+		if (n == n_others)
+			break;
+	}
+
+	VMM_destroyAddressSpace(&space);
+	PMM_freePages(page, 1);
+}
+
+// ================ PMM ================
+
+// Allocate and free single pages, by batches
+static void allocatePages(int){
+	paddr_t pages[BENCHMARK_PAGES_BATCH];
+
+	for (int round=0 ; round<BENCHMARK_PAGES_ROUNDS ; round++){
+		int n_allocated = 0;
+		while (n_allocated < BENCHMARK_PAGES_BATCH){
+			pages[n_allocated] = PMM_allocatePages(1);
+			if (pages[n_allocated] == (paddr_t) NULL)
+				break;
+			n_allocated++;
+		}
+
+		for (int i=0 ; i<n_allocated ; i++)
+			PMM_freePages(pages[i], 1);
+	}
+}
+
+// Single page allocations throughput, on one CPU then on all of them: with the per-CPU page
+// caches, the throughput per CPU should mostly hold
+static void benchmarkPageAllocations(){
+	for (int n_threads=1 ; ; n_threads=g_nCPUs){
+		ktime_t elapsed = runThreads(n_threads, allocatePages);
+		if (elapsed < 0)
+			return;
+
+		long n_pages = (long) BENCHMARK_PAGES_BATCH * BENCHMARK_PAGES_ROUNDS;
+		log(INFO, MODULE, "Page allocations and frees with %d threads: %ld pages/s per thread",
+			n_threads, perSecond(n_pages, elapsed));
+		if (n_threads == g_nCPUs)
+			break;
+	}
+}
+
+// Sizes of the multi-page allocations timed, in pages: they bypass the per-CPU page caches
+static const uint64_t m_allocationSizes[] = { 2, 8, 64 };
+
+// Average latency of the allocation of `n_pages` pages
+// @return -1 if we are out of memory
+static ktime_t timeAllocations(uint64_t n_pages){
+	paddr_t blocks[BENCHMARK_ALLOCATIONS];
+	ktime_t elapsed = 0;
+	int n_allocated = 0;
+
+	while (n_allocated < BENCHMARK_ALLOCATIONS){
+		ktime_t start = Time_get();
+		blocks[n_allocated] = PMM_allocatePages(n_pages);
+		elapsed += Time_get() - start;
+		if (blocks[n_allocated] == (paddr_t) NULL)
+			break;
+		n_allocated++;
+	}
+
+	for (int i=0 ; i<n_allocated ; i++)
+		PMM_freePages(blocks[i], n_pages);
+
+	return (n_allocated > 0) ? elapsed / n_allocated : -1;
+}
+
+static void logAllocations(uint64_t fragmented_pages){
+	for (size_t i=0 ; i<sizeof(m_allocationSizes)/sizeof(m_allocationSizes[0]) ; i++){
+		log(INFO, MODULE, "PMM (%s allocator, %lu MB fragmented): %lu pages in %ld ns",
+			BENCHMARK_PMM_BACKEND, fragmented_pages * PAGE_SIZE >> 20, m_allocationSizes[i],
+			timeAllocations(m_allocationSizes[i]));
+	}
+}
+
+// Multi-page allocations latency, against the size of a fragmented range: 2-page blocks, every
+// other one free. The allocations that don't fit in these holes must skip them: with the bitmap
+// backend, the search grows with the range, while the buddy backend finds a block in its free
+// lists at once
+// Note: build with PMM_BACKEND=BITMAP and PMM_BACKEND=BUDDY to compare them
+static void benchmarkMultiPageAllocations(){
+	paddr_t* blocks = vmalloc(BENCHMARK_FRAGMENT_BLOCKS * sizeof(paddr_t));
+	if (blocks == NULL){
+		log(ERROR, MODULE, "Out of memory for the multi-page allocations benchmark");
+		return;
+	}
+
+	logAllocations(0);
+
+	// Keep most of the memory free, for the other allocations
+	for (int n_blocks=1024 ; n_blocks<=BENCHMARK_FRAGMENT_BLOCKS ; n_blocks*=4){
+		if (2 * (uint64_t) n_blocks > PMM_getFreePages() / 4)
+			break;
+
+		int n_allocated = 0;
+		while (n_allocated < n_blocks){
+			blocks[n_allocated] = PMM_allocatePages(2);
+			if (blocks[n_allocated] == (paddr_t) NULL)
+				break;
+			n_allocated++;
+		}
+
+		for (int i=1 ; i<n_allocated ; i+=2)
+			PMM_freePages(blocks[i], 2);
+		logAllocations(2 * n_allocated);
+		for (int i=0 ; i<n_allocated ; i+=2)
+			PMM_freePages(blocks[i], 2);
+	}
+
+	vfree(blocks);
+}
+
+// ================ Slab allocator ================
+
+static cache_t* m_objectsCache;
+
+// Allocate and free objects, by batches
+static void allocateObjects(int){
+	void* objects[BENCHMARK_OBJECTS_BATCH];
+
+	for (int round=0 ; round<BENCHMARK_OBJECTS_ROUNDS ; round++){
+		int n_allocated = 0;
+		while (n_allocated < BENCHMARK_OBJECTS_BATCH){
+			objects[n_allocated] = Cache_malloc(m_objectsCache);
+			if (objects[n_allocated] == NULL)
+				break;
+			n_allocated++;
+		}
+
+		for (int i=0 ; i<n_allocated ; i++)
+			Cache_free(m_objectsCache, objects[i]);
+	}
+}
+
+// Objects allocations throughput, on one CPU then on all of them: the per-CPU magazines should
+// serve most of them, without the cache's lock
+static void benchmarkObjectAllocations(){
+	m_objectsCache = Cache_create("benchmark objects", BENCHMARK_OBJECTS_SIZE, NULL);
+	if (m_objectsCache == NULL){
+		log(ERROR, MODULE, "Out of memory for the slab benchmark");
+		return;
+	}
+
+	for (int n_threads=1 ; ; n_threads=g_nCPUs){
+		ktime_t elapsed = runThreads(n_threads, allocateObjects);
+		if (elapsed < 0)
+			break;
+
+		long n_objects = (long) BENCHMARK_OBJECTS_BATCH * BENCHMARK_OBJECTS_ROUNDS;
+		log(INFO, MODULE, "Cache_malloc and Cache_free with %d threads: %ld objects/s per thread",
+			n_threads, perSecond(n_objects, elapsed));
+		if (n_threads == g_nCPUs)
+			break;
+	}
+
+	Cache_destroy(m_objectsCache);
+}
+
+// ================ Paging ================
+
+// Throughput of the kernel page tables updates: map and unmap a range of 4KB pages, in a virtual
+// range reserved for it
+static void benchmarkMap(){
+	ktime_t map_time = 0;
+	ktime_t unmap_time = 0;
+
+	void* range = vreserve(BENCHMARK_MAP_PAGES * PAGE_SIZE);
+	paddr_t pages = PMM_allocatePages(BENCHMARK_MAP_PAGES);
+	if (range == NULL || pages == (paddr_t) NULL){
+		log(ERROR, MODULE, "Out of memory for the map benchmark");
+		vfree(range);
+		if (pages != (paddr_t) NULL)
+			PMM_freePages(pages, BENCHMARK_MAP_PAGES);
+		return;
+	}
+
+	for (int i=0 ; i<BENCHMARK_MAP_ROUNDS ; i++){
+		ktime_t start = Time_get();
+		VMM_map(pages, (vaddr_t) range, BENCHMARK_MAP_PAGES, PAGE_KERNEL|PAGE_READ|PAGE_WRITE);
+		ktime_t mapped = Time_get();
+		VMM_unmap((vaddr_t) range, BENCHMARK_MAP_PAGES);
+		unmap_time += Time_get() - mapped;
+		map_time += mapped - start;
+	}
+
+	long n_pages = BENCHMARK_MAP_PAGES * BENCHMARK_MAP_ROUNDS;
+	log(INFO, MODULE, "Map: %ld pages/s, unmap (and shootdown): %ld pages/s",
+		perSecond(n_pages, map_time), perSecond(n_pages, unmap_time));
+
+	vfree(range);
+	PMM_freePages(pages, BENCHMARK_MAP_PAGES);
+}
+
+// Map `n_pages` pages in `space` at BENCHMARK_USER_ADDRESS, after the `n_mapped` first ones
+// @return The number of pages mapped in total
+static int populate(struct AddressSpace* space, int n_mapped, int n_pages){
+	for ( ; n_mapped<n_pages ; n_mapped++){
+		paddr_t page = PMM_allocatePages(1);
+		if (page == (paddr_t) NULL)
+			break;
+
+		vaddr_t virt = BENCHMARK_USER_ADDRESS + n_mapped*PAGE_SIZE;
+		if (!Paging_mapPage(space, page, virt, PAGE_USER|PAGE_READ|PAGE_WRITE)){
+			PMM_freePages(page, 1);
+			break;
+		}
+	}
+
+	return n_mapped;
+}
+
+// Latency of the copy-on-write clone of an address space (fork), against its resident size: the
+// pages aren't copied, but they are all write-protected and shared
+static void benchmarkFork(){
+	struct AddressSpace parent;
+	struct AddressSpace child;
+	int n_mapped = 0;
+
+	if (!VMM_createAddressSpace(&parent)){
+		log(ERROR, MODULE, "Out of memory for the fork benchmark");
+		return;
+	}
+
+	for (int n_pages=1 ; n_pages<=BENCHMARK_FORK_MAX_PAGES ; n_pages*=4){
+		ktime_t elapsed = 0;
+
+		n_mapped = populate(&parent, n_mapped, n_pages);
+		if (n_mapped < n_pages){
+			log(ERROR, MODULE, "Out of memory for the fork benchmark");
+			break;
+		}
+
+		for (int i=0 ; i<BENCHMARK_FORKS ; i++){
+			ktime_t start = Time_get();
+			bool cloned = VMM_cloneAddressSpace(&child, &parent);
+			elapsed += Time_get() - start;
+			if (!cloned){
+				log(ERROR, MODULE, "Out of memory for the fork benchmark");
+				VMM_destroyAddressSpace(&parent);
+				return;
+			}
+
+			VMM_destroyAddressSpace(&child);
+		}
+
+		log(INFO, MODULE, "Fork of %d resident pages: %ld us", n_pages,
+			elapsed / BENCHMARK_FORKS / 1000);
+	}
+
+	VMM_destroyAddressSpace(&parent);
+}
+
+// ================ Framebuffer ================
+
+// Throughput of the framebuffer writes (write-combining): clears, and scrolls, which also read it
+// Note: this wipes the screen, so it runs before the other benchmarks log their results
+static void benchmarkFramebuffer(){
+	ktime_t start = Time_get();
+	for (int i=0 ; i<BENCHMARK_CLEARS ; i++)
+		Graphics_clearScreen();
+	ktime_t clear_time = Time_get() - start;
+
+	start = Time_get();
+	for (int i=0 ; i<BENCHMARK_SCROLLS ; i++)
+		Graphics_scrollDown();
+	ktime_t scroll_time = Time_get() - start;
+
+	log(INFO, MODULE, "Framebuffer: %ld clears/s, %ld scrolls/s",
+		perSecond(BENCHMARK_CLEARS, clear_time), perSecond(BENCHMARK_SCROLLS, scroll_time));
+}
+
+// ================ Timers ================
+
+struct BenchmarkTimer {
+	struct Timer timer;
+	ktime_t deadline;
+};
+
+static atomic_long m_nExpired;
+static atomic_long m_totalLateness; // Of the expired timers, in ns
+static atomic_long m_maxLateness;
+
+static void timerExpired(void* arg){
+	struct BenchmarkTimer* timer = arg;
+	long lateness = Time_get() - timer->deadline;
+
+	atomic_fetch_add(&m_totalLateness, lateness);
+	long max = atomic_load(&m_maxLateness);
+	while (lateness > max && !atomic_compare_exchange_weak(&m_maxLateness, &max, lateness))
+		pause();
+	atomic_fetch_add(&m_nExpired, 1);
+}
+
+// Start `n` timers, with deadlines spread over `spread` ns after `start`
+// @return The time it took
+static ktime_t startTimers(struct BenchmarkTimer* timers, int n, ktime_t start, ktime_t spread){
+	ktime_t begin = Time_get();
+	for (int i=0 ; i<n ; i++){
+		timers[i].deadline = start + spread / n * i;
+		Timer_start(&timers[i].timer, timers[i].deadline);
+	}
+
+	return Time_get() - begin;
+}
+
+// Timeouts: the cost of starting and cancelling timers shouldn't grow with the number of pending
+// ones (timer wheels), and many expiring at once should only cost an IRQ per wheel slot
+static void benchmarkTimers(){
+	struct BenchmarkTimer* timers = vmalloc(BENCHMARK_MAX_TIMERS * sizeof(struct BenchmarkTimer));
+	if (timers == NULL){
+		log(ERROR, MODULE, "Out of memory for the timers benchmark");
+		return;
+	}
+
+	for (int i=0 ; i<BENCHMARK_MAX_TIMERS ; i++)
+		Timer_init(&timers[i].timer, timerExpired, &timers[i]);
+
+	// Far deadlines: none expires before it is cancelled
+	for (int n=100 ; n<=BENCHMARK_MAX_TIMERS ; n*=10){
+		ktime_t start_time = startTimers(timers, n, Time_get() + 1000000000, BENCHMARK_TIMERS_SPREAD);
+
+		ktime_t begin = Time_get();
+		for (int i=0 ; i<n ; i++)
+			Timer_cancel(&timers[i].timer);
+		ktime_t cancel_time = Time_get() - begin;
+
+		log(INFO, MODULE, "%d pending timers: %ld ns per start, %ld ns per cancel", n,
+			start_time / n, cancel_time / n);
+	}
+
+	// Close deadlines: they all expire
+	atomic_store(&m_nExpired, 0);
+	atomic_store(&m_totalLateness, 0);
+	atomic_store(&m_maxLateness, 0);
+	startTimers(timers, BENCHMARK_MAX_TIMERS, Time_get(), BENCHMARK_EXPIRY_SPREAD);
+	while (atomic_load(&m_nExpired) < BENCHMARK_MAX_TIMERS)
+		msleep(10);
+
+	log(INFO, MODULE, "%d timers expired over %d ms: %ld us late on average, %ld us at most",
+		BENCHMARK_MAX_TIMERS, BENCHMARK_EXPIRY_SPREAD / 1000000,
+		atomic_load(&m_totalLateness) / BENCHMARK_MAX_TIMERS / 1000,
+		atomic_load(&m_maxLateness) / 1000);
+
+	vfree(timers);
+}
+
+// ================ Public API ================
+
+static void benchmarksThread(void*){
+	log(INFO, MODULE, "Running the benchmarks...");
+	benchmarkFramebuffer();
+	benchmarkContextSwitch();
+	benchmarkMutex();
+	benchmarkShortTasks();
+	benchmarkTimers();
+	benchmarkPageAllocations();
+	benchmarkMultiPageAllocations();
+	benchmarkObjectAllocations();
+	benchmarkUnmap();
+	benchmarkMap();
+	benchmarkFork();
+	log(SUCCESS, MODULE, "Done");
+
+	// The locks the benchmarks contended the most (with LOCK_STATS=YES)
+	LockStats_log();
+}
+
+void Benchmarks_start(){
+	if (Scheduler_createThread("benchmarks", benchmarksThread, NULL) == NULL)
+		log(ERROR, MODULE, "Could not start the benchmarks thread");
+}
+
+#else
+
+void Benchmarks_start(){
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef __BENCHMARKS_H__
+#define __BENCHMARKS_H__
+
+// Benchmarks.h: boot-time micro-benchmarks of the kernel subsystems, timed with `Time_get`
+// They run in a kernel thread once boot is done, and log their results. They are only built with
+// BENCHMARKS=YES: they take a few seconds, and use some memory
+
+/// @brief Start the thread that runs the benchmarks, if they are enabled
+/// @note Call it at the end of the boot: all the subsystems must have been initialized
+void Benchmarks_start();
+
+#endif
@@ -36,4 +36,14 @@ volatile struct limine_rsdp_request g_rsdpReq = {
 	.response = NULL
 };
 
+// Ask for 5-level paging (57 bits virtual addresses) when the CPU supports it, 4-level otherwise
+volatile struct limine_paging_mode_request g_pagingModeReq = {
+	.id = LIMINE_PAGING_MODE_REQUEST,
+	.revision = 1,
+	.response = NULL,
+	.mode = LIMINE_PAGING_MODE_X86_64_5LVL,
+	.max_mode = LIMINE_PAGING_MODE_X86_64_5LVL,
+	.min_mode = LIMINE_PAGING_MODE_X86_64_4LVL,
+};
+
 volatile LIMINE_REQUESTS_END_MARKER;
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include "stdlib.h"
+#include "string.h"
+#include "mugOS/SlabAllocator.h"
+#include "Logging.h"
+#include "Memory/PMM.h"
+#include "Memory/VMA.h"
+#include "Scheduler/Scheduler.h"
+#include "Sync/LockStats.h"
+#include "Drivers/Output/Serial.h"
+
+#include "DebugConsole.h"
+#define MODULE "Debug console"
+
+struct Command {
+	char key;
+	const char* description;
+	void (*run)();
+};
+
+// Log the slabinfo-like dump of the caches, line by line
+static void printCaches(){
+	size_t size = SlabAllocator_dumpInfo(NULL, 0) + 1;
+	char* dump = kmalloc(size);
+	if (dump == NULL){
+		log(ERROR, MODULE, "Out of memory to dump the caches");
+		return;
+	}
+
+	SlabAllocator_dumpInfo(dump, size);
+	for (char* line=dump ; *line!='\0' ; ){
+		char* end = strchr(line, '\n');
+		int length = (end == NULL) ? (int) strlen(line) : end - line;
+		log(INFO, MODULE, "%.*s", length, line);
+		line += length + (end != NULL);
+	}
+
+	kfree(dump);
+}
+
+static void collapseKernelVMAs(){
+	VMA_collapse(&g_kernelAddressSpace);
+	log(INFO, MODULE, "Collapsed the kernel VMAs");
+}
+
+static const struct Command m_commands[] = {
+	{ 'm', "Log the memory usage", PMM_printMemoryUsage },
+	{ 's', "Log the slab caches statistics", printCaches },
+	{ 'c', "Collapse the kernel VMAs into huge pages now", collapseKernelVMAs },
+	{ 'l', "Log the contended locks statistics", LockStats_log },
+};
+
+static void printHelp(){
+	log(INFO, MODULE, "Commands:");
+	for (size_t i=0 ; i<sizeof(m_commands)/sizeof(m_commands[0]) ; i++)
+		log(INFO, MODULE, "%c: %s", m_commands[i].key, m_commands[i].description);
+}
+
+static void consoleThread(void*){
+	while (true){
+		uint8_t key = Serial_waitByteDefault();
+		if (key == '\r' || key == '\n')
+			continue;
+
+		const struct Command* command = NULL;
+		for (size_t i=0 ; i<sizeof(m_commands)/sizeof(m_commands[0]) ; i++){
+			if (m_commands[i].key == key)
+				command = &m_commands[i];
+		}
+
+		if (command == NULL)
+			printHelp();
+		else
+			command->run();
+	}
+}
+
+void DebugConsole_start(){
+	// Without any port, waiting for a byte returns at once
+	if (!Serial_isEnabled())
+		return;
+
+	if (Scheduler_createThread("debug console", consoleThread, NULL) == NULL){
+		log(ERROR, MODULE, "Could not start the debug console thread");
+		return;
+	}
+
+	log(INFO, MODULE, "Started, press any key on the serial port to list the commands");
+}
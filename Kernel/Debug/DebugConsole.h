@@ -0,0 +1,12 @@
+#ifndef __DEBUG_CONSOLE_H__
+#define __DEBUG_CONSOLE_H__
+
+// DebugConsole.h: debugging commands over the default serial port
+// A kernel thread waits for keys on the serial port, and runs the command bound to each one (e.g.
+// 'm' logs the memory usage). Any other key lists the commands
+
+/// @brief Start the debug console's thread, if there is a serial port
+/// @note The serial driver and the scheduler must have been initialized
+void DebugConsole_start();
+
+#endif
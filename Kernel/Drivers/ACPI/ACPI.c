@@ -12,10 +12,14 @@
 struct MADT g_MADT;
 struct FADT g_FADT;
 struct HPETT g_HPETT;
+struct SRAT g_SRAT;
+struct SLIT g_SLIT;
 
 bool g_MADTPresent = false;
 bool g_FADTPresent = false;
 bool g_HPETTPresent = false;
+bool g_SRATPresent = false;
+bool g_SLITPresent = false;
 
 static int m_nTables; // Number of tables in the XSDT
 
@@ -26,6 +30,20 @@ struct rawMADT {
 	uint32_t localApicFlags;
 } packed;
 
+// ACPI table: System Resource Affinity Table (raw, as in provided ACPI table)
+struct rawSRAT {
+	struct SDTHeader header;
+	uint32_t reserved_0; // Must be 1
+	uint64_t reserved_1;
+} packed;
+
+// ACPI table: System Locality Information Table (raw, as in provided ACPI table)
+struct rawSLIT {
+	struct SDTHeader header;
+	uint64_t nLocalities;
+	uint8_t distances[];
+} packed;
+
 static inline bool isChecksumValid(uint8_t* table, uint32_t size){
 	uint8_t sum = 0; // we voluntarily use overflow to only keep the last byte
 
@@ -215,6 +233,110 @@ static void parseHPETT(void* hpett){
 	g_HPETTPresent = true;
 }
 
+static void parseSRAT(struct rawSRAT* srat_ptr){
+	struct SRATEntryHeader* curHdr;
+
+	if (!isChecksumValid((uint8_t*) srat_ptr, srat_ptr->header.length)){
+		log(WARNING, MODULE, "Invalid SRAT checksum, table will be ignored");
+		g_SRATPresent = false;
+		return;
+	}
+
+	memcpy(&g_SRAT.header, &srat_ptr->header, sizeof(struct SDTHeader));
+
+	// Same as the MADT: count the entries, malloc arrays, and copy them
+	uint32_t cur_offset = sizeof(struct rawSRAT);
+	while (cur_offset < srat_ptr->header.length){
+		curHdr = (void*)srat_ptr + cur_offset;
+
+		switch (curHdr->entryType){
+		case SRAT_ENTRYTYPE_LAPIC_AFFINITY:
+			g_SRAT.nLAPICAffinity++;
+			break;
+		case SRAT_ENTRYTYPE_MEMORY_AFFINITY:
+			g_SRAT.nMemoryAffinity++;
+			break;
+		case SRAT_ENTRYTYPE_X2APIC_AFFINITY:
+			g_SRAT.nX2APICAffinity++;
+			break;
+		default:
+			break;
+		}
+
+		cur_offset += curHdr->entryLength;
+	}
+
+	g_SRAT.LAPICAffinities = kmalloc(g_SRAT.nLAPICAffinity * sizeof(struct SRATEntry_LAPICAffinity));
+	g_SRAT.memoryAffinities = kmalloc(g_SRAT.nMemoryAffinity * sizeof(struct SRATEntry_MemoryAffinity));
+	g_SRAT.X2APICAffinities = kmalloc(g_SRAT.nX2APICAffinity * sizeof(struct SRATEntry_X2APICAffinity));
+
+	// Assert that we got memory where needed
+	assert(g_SRAT.LAPICAffinities!=NULL || g_SRAT.nLAPICAffinity==0);
+	assert(g_SRAT.memoryAffinities!=NULL || g_SRAT.nMemoryAffinity==0);
+	assert(g_SRAT.X2APICAffinities!=NULL || g_SRAT.nX2APICAffinity==0);
+
+	// Now reloop and copy the structures
+	// We use g_SRAT.n* as temporary indexes
+	g_SRAT.nLAPICAffinity = 0;
+	g_SRAT.nMemoryAffinity = 0;
+	g_SRAT.nX2APICAffinity = 0;
+
+	cur_offset = sizeof(struct rawSRAT);
+	while (cur_offset < srat_ptr->header.length){
+		curHdr = (void*)srat_ptr + cur_offset;
+
+		switch (curHdr->entryType){
+		case SRAT_ENTRYTYPE_LAPIC_AFFINITY:
+			assert(curHdr->entryLength == sizeof(struct SRATEntry_LAPICAffinity));
+			memcpy(g_SRAT.LAPICAffinities + g_SRAT.nLAPICAffinity, curHdr,
+				sizeof(struct SRATEntry_LAPICAffinity));
+			g_SRAT.nLAPICAffinity++;
+			break;
+		case SRAT_ENTRYTYPE_MEMORY_AFFINITY:
+			assert(curHdr->entryLength == sizeof(struct SRATEntry_MemoryAffinity));
+			memcpy(g_SRAT.memoryAffinities + g_SRAT.nMemoryAffinity, curHdr,
+				sizeof(struct SRATEntry_MemoryAffinity));
+			g_SRAT.nMemoryAffinity++;
+			break;
+		case SRAT_ENTRYTYPE_X2APIC_AFFINITY:
+			assert(curHdr->entryLength == sizeof(struct SRATEntry_X2APICAffinity));
+			memcpy(g_SRAT.X2APICAffinities + g_SRAT.nX2APICAffinity, curHdr,
+				sizeof(struct SRATEntry_X2APICAffinity));
+			g_SRAT.nX2APICAffinity++;
+			break;
+		default:
+			break;
+		}
+
+		cur_offset += curHdr->entryLength;
+	}
+
+	g_SRATPresent = true;
+}
+
+static void parseSLIT(struct rawSLIT* slit_ptr){
+	if (!isChecksumValid((uint8_t*) slit_ptr, slit_ptr->header.length)){
+		log(WARNING, MODULE, "Invalid SLIT checksum, table will be ignored");
+		g_SLITPresent = false;
+		return;
+	}
+
+	uint64_t n_distances = slit_ptr->nLocalities * slit_ptr->nLocalities;
+	if (sizeof(struct rawSLIT) + n_distances > slit_ptr->header.length){
+		log(WARNING, MODULE, "Invalid SLIT size, table will be ignored");
+		g_SLITPresent = false;
+		return;
+	}
+
+	memcpy(&g_SLIT.header, &slit_ptr->header, sizeof(struct SDTHeader));
+	g_SLIT.nLocalities = slit_ptr->nLocalities;
+	g_SLIT.distances = kmalloc(n_distances);
+	assert(g_SLIT.distances != NULL || n_distances == 0);
+	memcpy(g_SLIT.distances, slit_ptr->distances, n_distances);
+
+	g_SLITPresent = true;
+}
+
 static void parseXSDT(struct XSDT* xsdt){
 	// Note: we don't keep this table's data, as it only contains reference to other tables
 	if (!isChecksumValid((uint8_t*)xsdt, xsdt->header.length)){
@@ -231,6 +353,13 @@ static void parseXSDT(struct XSDT* xsdt){
 
 		struct SDTHeader* hdr = (struct SDTHeader*) table_virt;
 
+		// Tables with many entries (e.g. SRAT) can span several pages
+		uint64_t n_pages = roundToPage(getOffset(table_phys) + hdr->length);
+		if (n_pages > 1){
+			VMM_unmap(table_virt, 1);
+			VMM_map(table_phys, table_virt, n_pages, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
+		}
+
 		// FADT: Fixed ACPI Description Table
 		if (strncmp(hdr->signature, "FACP", 4) == 0){
 			parseFADT(hdr);
@@ -243,14 +372,24 @@ static void parseXSDT(struct XSDT* xsdt){
 		else if (strncmp(hdr->signature, "HPET", 4) == 0){
 			parseHPETT(hdr);
 		}
+		// SRAT: System Resource Affinity Table
+		else if (strncmp(hdr->signature, "SRAT", 4) == 0){
+			parseSRAT((struct rawSRAT*) hdr);
+		}
+		// SLIT: System Locality Information Table
+		else if (strncmp(hdr->signature, "SLIT", 4) == 0){
+			parseSLIT((struct rawSLIT*) hdr);
+		}
 
-		VMM_unmap(table_virt, 1);
+		VMM_unmap(table_virt, n_pages);
 	}
 
-	log(INFO, MODULE, "Parsed tables: RSDP XSDT%s%s%s",
+	log(INFO, MODULE, "Parsed tables: RSDP XSDT%s%s%s%s%s",
 		g_FADTPresent ? " FADT" : "",
 		g_MADTPresent ? " MADT" : "",
-		g_HPETTPresent ? " HPETT" : ""
+		g_HPETTPresent ? " HPETT" : "",
+		g_SRATPresent ? " SRAT" : "",
+		g_SLITPresent ? " SLIT" : ""
 	);
 }
 
@@ -6,10 +6,14 @@
 extern struct MADT g_MADT;
 extern struct FADT g_FADT;
 extern struct HPETT g_HPETT;
+extern struct SRAT g_SRAT;
+extern struct SLIT g_SLIT;
 
 extern bool g_MADTPresent;
 extern bool g_FADTPresent;
 extern bool g_HPETTPresent;
+extern bool g_SRATPresent;
+extern bool g_SLITPresent;
 
 void ACPI_init();
 
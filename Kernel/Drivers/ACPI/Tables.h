@@ -334,4 +334,99 @@ struct MADT {
 	struct MADTEntry_LX2APIC_NMI* X2APIC_NMIs;
 };
 
+// ================ SRAT: System Resource Affinity Table ================
+
+enum SRATEntryType {
+	SRAT_ENTRYTYPE_LAPIC_AFFINITY =		0x00, // Processor Local APIC/SAPIC Affinity
+	SRAT_ENTRYTYPE_MEMORY_AFFINITY =	0x01, // Memory Affinity
+	SRAT_ENTRYTYPE_X2APIC_AFFINITY =	0x02, // Processor Local x2APIC Affinity
+	// More stuff (GICC, ITS...), unused in the OS
+};
+
+struct SRATEntryHeader {
+	uint8_t entryType;		// enum SRATEntryType
+	uint8_t entryLength;
+} packed;
+
+// 0x00 SRAT_ENTRYTYPE_LAPIC_AFFINITY
+struct SRATEntry_LAPICAffinity {
+	struct SRATEntryHeader header;
+	uint8_t proximityDomain_low; // Bits [7:0] of the proximity domain
+	uint8_t lapicID;
+	union {
+		uint32_t value;
+		struct {
+			uint32_t enabled : 1;
+		} bits;
+	} flags;
+	uint8_t localSAPICEID;
+	uint8_t proximityDomain_high[3]; // Bits [31:8] of the proximity domain
+	uint32_t clockDomain;
+} packed;
+
+// 0x01 SRAT_ENTRYTYPE_MEMORY_AFFINITY
+struct SRATEntry_MemoryAffinity {
+	struct SRATEntryHeader header;
+	uint32_t proximityDomain;
+	uint16_t reserved_0;
+	uint32_t baseAddress[2]; // low, high
+	uint32_t length[2]; // low, high
+	uint32_t reserved_1;
+	union {
+		uint32_t value;
+		struct {
+			uint32_t enabled : 1;
+			uint32_t hotPluggable : 1;
+			uint32_t nonVolatile : 1;
+		} bits;
+	} flags;
+	uint64_t reserved_2;
+} packed;
+
+// 0x02 SRAT_ENTRYTYPE_X2APIC_AFFINITY
+struct SRATEntry_X2APICAffinity {
+	struct SRATEntryHeader header;
+	uint16_t reserved_0;
+	uint32_t proximityDomain;
+	uint32_t x2apicID;
+	union {
+		uint32_t value;
+		struct {
+			uint32_t enabled : 1;
+		} bits;
+	} flags;
+	uint32_t clockDomain;
+	uint32_t reserved_1;
+} packed;
+
+compile_assert(sizeof(struct SRATEntry_LAPICAffinity) == 16);
+compile_assert(sizeof(struct SRATEntry_MemoryAffinity) == 40);
+compile_assert(sizeof(struct SRATEntry_X2APICAffinity) == 24);
+
+// ACPI table: System Resource Affinity Table (parsed)
+struct SRAT {
+	// Begins the same way as the raw ACPI SRAT table
+	struct SDTHeader header;
+
+	// For the entries, they are parsed and organized in a nice way
+	int nLAPICAffinity;
+	int nMemoryAffinity;
+	int nX2APICAffinity;
+	struct SRATEntry_LAPICAffinity* LAPICAffinities;
+	struct SRATEntry_MemoryAffinity* memoryAffinities;
+	struct SRATEntry_X2APICAffinity* X2APICAffinities;
+};
+
+// ================ SLIT: System Locality Information Table ================
+
+// ACPI table: System Locality Information Table (parsed)
+struct SLIT {
+	// Begins the same way as the raw ACPI SLIT table
+	struct SDTHeader header;
+	uint64_t nLocalities;
+	// Relative distance from locality i to locality j is distances[i*nLocalities + j]
+	// The distance of a locality to itself is 10
+	uint8_t* distances;
+};
+
 #endif
@@ -4,7 +4,6 @@
 #include "assert.h"
 #include "IO.h"
 #include "Logging.h"
-#include "IRQ/IRQ.h"
 #include "Drivers/Graphics/Font.h"
 
 #include "Drivers/Graphics/Framebuffer.h"
@@ -17,6 +16,8 @@
 // Note: we assume that pitch is a multiple of the pixel byte size (aka 4 bytes for 32 bpp)
 #define getLineOffset() 8*(this->pitch/this->bpp)
 
+static struct LockStats m_lockStats = { .name = "Framebuffer" };
+
 void Framebuffer_clearTerminal(Framebuffer* this){
 	assert(this);
 	memset(this->text, '\0', TERMINAL_SIZE);
@@ -111,11 +112,8 @@ void Framebuffer_drawChar(Framebuffer* this, char c, uint32_t color, int x, int
 	writeMemoryBarrier();
 }
 
-void Framebuffer_scrollDown(Framebuffer* this){
-	assert(this);
-	unsigned long flags;
-	IRQ_disableSave(flags);
-
+// Note: the lock must be held
+static void scrollDownLocked(Framebuffer* this){
 	// Move every line up
 	// This method has been optimized to only redraw characters that changed
 
@@ -172,26 +170,20 @@ void Framebuffer_scrollDown(Framebuffer* this){
 		const int y = j*this->charHeight + this->drawOffsetY;
 		Framebuffer_drawChar(this, ' ', this->fontColor, x, y);
 	}
-
-	IRQ_restore(flags);
 }
 
-void Framebuffer_putchar(Framebuffer* this, const char c){
-	assert(this);
-
+// Note: the lock must be held
+static void putcharLocked(Framebuffer* this, const char c){
 	// Track where the last character in the line is (for proper '\r' support)
 	static uint32_t endline_pos = 0;
 
 	if (c == '\0')
 		return;
 
-	unsigned long flags;
-	IRQ_disableSave(flags);
-
 	switch (c){
 	case '\t':
 		do {
-			Framebuffer_putchar(this, ' ');
+			putcharLocked(this, ' ');
 		} while (this->cursorX % TAB_SIZE != 0);
 		break;
 
@@ -224,24 +216,48 @@ void Framebuffer_putchar(Framebuffer* this, const char c){
 	}
 
 	if (this->cursorY >= this->textHeight)
-		Framebuffer_scrollDown(this);
+		scrollDownLocked(this);
+}
 
-	IRQ_restore(flags);
+void Framebuffer_scrollDown(Framebuffer* this){
+	assert(this);
+	unsigned long flags;
+
+	Spinlock_lockIrqSave(&this->lock, flags);
+	scrollDownLocked(this);
+	Spinlock_unlockIrqRestore(&this->lock, flags);
 }
 
-void Framebuffer_puts_noLF(Framebuffer* this, const char* str){
+void Framebuffer_putchar(Framebuffer* this, const char c){
 	assert(this);
-	if (str==NULL) return;
+	unsigned long flags;
+
+	Spinlock_lockIrqSave(&this->lock, flags);
+	putcharLocked(this, c);
+	Spinlock_unlockIrqRestore(&this->lock, flags);
+}
 
-	while (*str){
-		Framebuffer_putchar(this, *str);
+// Print `str`, and a line feed if `line_feed` is set. Other CPUs can't print in the middle of it
+static void putString(Framebuffer* this, const char* str, bool line_feed){
+	assert(this);
+	unsigned long flags;
+
+	Spinlock_lockIrqSave(&this->lock, flags);
+	while (str != NULL && *str){
+		putcharLocked(this, *str);
 		str++;
 	}
+	if (line_feed)
+		putcharLocked(this, '\n');
+	Spinlock_unlockIrqRestore(&this->lock, flags);
+}
+
+void Framebuffer_puts_noLF(Framebuffer* this, const char* str){
+	putString(this, str, false);
 }
 
 void Framebuffer_puts(Framebuffer* this, const char* str){
-	Framebuffer_puts_noLF(this, str);
-	Framebuffer_putchar(this, '\n');
+	putString(this, str, true);
 }
 
 void Framebuffer_putPixel(Framebuffer* this, int x, int y, color_t pixel){
@@ -322,6 +338,7 @@ bool Framebuffer_init(Framebuffer* this){
 		return false;
 	}
 
+	Spinlock_init(&this->lock, &m_lockStats);
 	this->drawOffsetX = 4;
 	this->drawOffsetY = 4;
 	Framebuffer_setClearColor(this, COLOR_32BPP(31, 31, 31));
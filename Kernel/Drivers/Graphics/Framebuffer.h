@@ -2,6 +2,7 @@
 #define __FRAMEBUFFER_H__
 
 #include <stdint.h>
+#include "Sync/Spinlock.h"
 
 typedef uint32_t color_t;
 
@@ -50,6 +51,7 @@ typedef struct s_Framebuffer {
 	uint32_t textWidth;			// Terminal width (number of characters in a line)
 	uint32_t textHeight;		// Terminal height (number of lines)
 	char text[TERMINAL_SIZE];	// Contains the printed letters
+	spinlock_t lock;			// Protects the cursor and the terminal, taken with IRQs disabled
 } Framebuffer;
 
 void Framebuffer_clearTerminal(Framebuffer* this);
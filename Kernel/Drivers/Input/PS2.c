@@ -5,6 +5,7 @@
 #include "Logging.h"
 #include "IRQ/IRQ.h"
 #include "Time/Time.h"
+#include "Sync/WaitQueue.h"
 #include "Drivers/Input/Keycodes.h"
 #include "Drivers/Input/Keyboard.h"
 #include "HAL/Drivers/Input/PS2Controller.h"
@@ -875,40 +876,46 @@ static void mouseIRQ(void*){
 #define RESPONSE_BUFFER_SIZE 5
 static uint8_t m_responseBuffer[RESPONSE_BUFFER_SIZE];
 static int m_inBuffer = 0;
+static waitqueue_t m_responseWaiters = WAITQUEUE_INIT(m_responseWaiters, "PS/2 responses"); // Protects the buffer
+
+#define RESPONSE_TIMEOUT 5000000000 // In nanoseconds
 
 static bool receiveByte(uint8_t* byte_out){
 	// receiveByte is simply popResponseBuffer, with a wait timeout:
-	// we try to wait a certain time for the buffer to be filled
-
-	unsigned int counter = 0;
-	while ((m_inBuffer<1) && (counter++<100000))
-		udelay(50);
-
-	if (m_inBuffer < 1) return false;
+	// we wait (blocked) a certain time for the buffer to be filled
+	ktime_t deadline = Time_get() + RESPONSE_TIMEOUT;
+	bool waiting = true;
 
 	unsigned long flags;
-	IRQ_disableSave(flags); // lock the buffer (TODO: change for a lock)
+	WaitQueue_lock(&m_responseWaiters, flags);
 
-	*byte_out = m_responseBuffer[0];
-	memmove(m_responseBuffer, m_responseBuffer+1, RESPONSE_BUFFER_SIZE-1);
-	m_inBuffer--;
+	while (m_inBuffer < 1 && waiting)
+		waiting = WaitQueue_wait(&m_responseWaiters, flags, deadline);
 
-	IRQ_restore(flags);
-	return true;
+	bool received = (m_inBuffer > 0);
+	if (received){
+		*byte_out = m_responseBuffer[0];
+		memmove(m_responseBuffer, m_responseBuffer+1, RESPONSE_BUFFER_SIZE-1);
+		m_inBuffer--;
+	}
+
+	WaitQueue_unlock(&m_responseWaiters, flags);
+	return received;
 }
 
 static void pushResponseBuffer(uint8_t value){
 	unsigned long flags;
-	IRQ_disableSave(flags); // lock the buffer (TODO: change for a lock here too)
+	WaitQueue_lock(&m_responseWaiters, flags);
 
 	if (m_inBuffer == RESPONSE_BUFFER_SIZE){
-		IRQ_restore(flags);
+		WaitQueue_unlock(&m_responseWaiters, flags);
 		return;
 	}
 
 	m_responseBuffer[m_inBuffer] = value;
 	m_inBuffer++;
-	IRQ_restore(flags);
+	WaitQueue_wakeAll(&m_responseWaiters);
+	WaitQueue_unlock(&m_responseWaiters, flags);
 }
 
 static void initIRQ(void*){
@@ -4,6 +4,8 @@
 #include "assert.h"
 #include "Logging.h"
 #include "IRQ/IRQ.h"
+#include "Sync/Spinlock.h"
+#include "Sync/WaitQueue.h"
 
 #include "Serial.h"
 #define MODULE "Serial Port"
@@ -40,9 +42,13 @@ struct UARTDevice {
 	int buffer1[UARTDEVICE_EXT_BUFF_SIZE]; // Actual Ringbuffer buffers, since we don't have kmalloc yet
 	int buffer2[UARTDEVICE_EXT_BUFF_SIZE];
 	Ringbuffer externalWriteBuff, externalReadBuff;
+	spinlock_t lock; // Protects the buffers, and the IER
+	waitqueue_t readers; // Threads waiting for data (see Serial_waitByte)
 };
 
 static struct UARTDevice m_devices[N_PORTS];
+static struct LockStats m_lockStats = { .name = "Serial" }; // Shared by the devices
+static struct LockStats m_readersLockStats = { .name = "Serial: readers" };
 static int m_defaultDevice = -1;
 static bool m_enabled = false;
 
@@ -115,7 +121,7 @@ static void processTHRE(struct UARTDevice* dev);
 
 /// @brief Add (push back) the null-terminated string str to be written the device write buffer
 /// @return `true` on success, `false` on error
-/// @note IRQ-safe
+/// @note IRQ-safe ; the device lock must NOT be held
 static bool pushBackWriteBuffer(struct UARTDevice* dev, const uint8_t* str){
 	if (dev==NULL) return false;
 	if (str==NULL) return true;
@@ -123,17 +129,17 @@ static bool pushBackWriteBuffer(struct UARTDevice* dev, const uint8_t* str){
 	size_t n = strlen((const char*) str);
 	if (n==0) return true;
 
+	unsigned long flags;
+	Spinlock_lockIrqSave(&dev->lock, flags);
+
 	// If we were not already writing (buffer empty), after filling the buffer,
 	// we need to trigger the THRE again so that we actually send what we put in the buffer
 	bool shouldTriggerTHRE = (Ringbuffer_getDataSize(&dev->externalWriteBuff) == 0);
 
-	unsigned long flags;
-	IRQ_disableSave(flags);
-
 	size_t i = 0;
 	while (str[i]){
 		if (!Ringbuffer_pushBack(&dev->externalWriteBuff, str[i])){
-			IRQ_restore(flags);
+			Spinlock_unlockIrqRestore(&dev->lock, flags);
 			return false;
 		}
 		i++;
@@ -154,12 +160,12 @@ static bool pushBackWriteBuffer(struct UARTDevice* dev, const uint8_t* str){
 		processTHRE(dev);
 	}
 
-	IRQ_restore(flags);
+	Spinlock_unlockIrqRestore(&dev->lock, flags);
 	return true;
 }
 
 /// @brief Remove (pop front) `n` bytes from the buffer into `out` (out size must be >= n !)
-/// @note IRQs MUST BE DISABLED when calling this method
+/// @note The device lock must be held, with IRQs disabled
 static uint8_t popFrontWriteBuffer(struct UARTDevice* dev){
 	int temp;
 
@@ -176,7 +182,7 @@ static uint8_t popFrontWriteBuffer(struct UARTDevice* dev){
 }
 
 /// @brief Add (push back) the null-terminated string str to be written the device read buffer
-/// @note IRQs MUST BE DISABLED when calling this method
+/// @note The device lock must be held, with IRQs disabled
 static bool pushBackReadBuffer(struct UARTDevice* dev, const uint8_t* str){
 	assert(str);
 	if (dev==NULL) return false;
@@ -198,17 +204,15 @@ static bool pushBackReadBuffer(struct UARTDevice* dev, const uint8_t* str){
 /// @brief Pop first byte from the device's read buffer
 /// @note IRQ-safe
 static uint8_t popFrontReadBuffer(struct UARTDevice* dev){
-	int temp;
-
-	if (Ringbuffer_getDataSize(&dev->externalReadBuff) == 0)
-		return 0x00;
+	int temp = 0x00;
 
 	unsigned long flags;
-	IRQ_disableSave(flags);
+	Spinlock_lockIrqSave(&dev->lock, flags);
 
-	Ringbuffer_pop(&dev->externalReadBuff, &temp);
+	if (Ringbuffer_getDataSize(&dev->externalReadBuff) > 0)
+		Ringbuffer_pop(&dev->externalReadBuff, &temp);
 
-	IRQ_restore(flags);
+	Spinlock_unlockIrqRestore(&dev->lock, flags);
 	return (uint8_t) temp;
 }
 
@@ -237,7 +241,15 @@ static void processAvailableData(struct UARTDevice* dev){
 	}
 
 	// Put it in the buffer for public access
-	if (!pushBackReadBuffer(dev, temp)){
+	Spinlock_lock(&dev->lock);
+	bool pushed = pushBackReadBuffer(dev, temp);
+	Spinlock_unlock(&dev->lock);
+
+	unsigned long flags;
+	WaitQueue_lock(&dev->readers, flags);
+	WaitQueue_wakeAll(&dev->readers);
+	WaitQueue_unlock(&dev->readers, flags);
+	if (!pushed){
 		static unsigned int counter = 0, times = 0; // times the pushBackReadBuffer was called with already full buffer
 		counter++;
 		times = counter % 256;
@@ -250,6 +262,7 @@ static void processAvailableData(struct UARTDevice* dev){
 }
 
 // Process THRE: Transmitter Holding Register Empty interrupt
+// Note: the device lock must be held
 static void processTHRE(struct UARTDevice* dev){
 	// Served "by reading IIR or writing to THR"
 	//
@@ -326,7 +339,9 @@ static void handleDeviceInterrupt(struct UARTDevice* dev){
 			break;
 		case SERIAL_IIR_INT_TRANSMITTER:
 			// THRE: Transmitter Holding Register Empty (priority: third)
+			Spinlock_lock(&dev->lock);
 			processTHRE(dev);
+			Spinlock_unlock(&dev->lock);
 			break;
 		case SERIAL_IIR_INT_DATA:
 			// DR or trigger level reached (priority: second)
@@ -453,6 +468,8 @@ void Serial_init(){
 		curDev->internalBufferSize = (curDev->controller == UART_16550A) ? 14 : 1;
 		Ringbuffer_initWithBuffer(&curDev->externalWriteBuff, UARTDEVICE_EXT_BUFF_SIZE, curDev->buffer1);
 		Ringbuffer_initWithBuffer(&curDev->externalReadBuff, UARTDEVICE_EXT_BUFF_SIZE, curDev->buffer2);
+		Spinlock_init(&curDev->lock, &m_lockStats);
+		WaitQueue_init(&curDev->readers, &m_readersLockStats);
 
 		curDev->present = initializeUARTController(curDev->port);
 		if (!curDev->present){
@@ -543,3 +560,29 @@ uint8_t Serial_receiveByteDefault(){
 
 	return receiveByteInternal(m_devices[m_defaultDevice].identifier);
 }
+
+static uint8_t waitByteInternal(int device){
+	struct UARTDevice* dev = &m_devices[device-1];
+	unsigned long flags;
+
+	// The readers pop with the wait queue lock held: the data can't be taken by another one
+	WaitQueue_lock(&dev->readers, flags);
+	while (Ringbuffer_getDataSize(&dev->externalReadBuff) == 0)
+		WaitQueue_wait(&dev->readers, flags, WAITQUEUE_NO_DEADLINE);
+	uint8_t byte = popFrontReadBuffer(dev);
+	WaitQueue_unlock(&dev->readers, flags);
+
+	return byte;
+}
+
+uint8_t Serial_waitByte(int device){
+	if (!m_enabled || device<=0 || device>N_PORTS || !m_devices[device-1].present) return 0;
+
+	return waitByteInternal(device);
+}
+
+uint8_t Serial_waitByteDefault(){
+	if (!m_enabled) return 0;
+
+	return waitByteInternal(m_devices[m_defaultDevice].identifier);
+}
@@ -9,9 +9,12 @@ bool Serial_isEnabled();
 bool Serial_sendByte(int device, uint8_t byte);
 bool Serial_sendString(int device, const char* str);
 uint8_t Serial_receiveByte(int device);
+/// @brief Receive a byte, waiting for one if there is none: the calling thread blocks meanwhile
+uint8_t Serial_waitByte(int device);
 
 bool Serial_sendByteDefault(uint8_t byte);
 bool Serial_sendStringDefault(const char* str);
 uint8_t Serial_receiveByteDefault();
+uint8_t Serial_waitByteDefault();
 
 #endif
@@ -1,6 +1,8 @@
 #include <stddef.h>
 #include "assert.h"
 #include "Logging.h"
+#include "Scheduler/Scheduler.h"
+#include "Sync/RWLock.h"
 #include "HAL/Drivers/IrqChip/IrqChip.h"
 
 #include "IRQ/IRQ.h"
@@ -11,6 +13,8 @@
 
 static struct IRQChip* m_chip;
 static irqhandler_t m_handlers[N_IRQ]; // note: the first 32 are reserved
+// Protects the handlers. The IRQs only read them: they don't wait on each other
+static rwlock_t m_handlersLock = RWLOCK_INIT("IRQ handlers");
 
 void IRQ_init(){
 	for (int i=0 ; i<N_IRQ ; i++)
@@ -36,22 +40,39 @@ void IRQ_disableSpecific(int irq){
 
 void IRQ_installHandler(int irq, irqhandler_t handler){
 	assert(isValidIRQ(irq));
+	unsigned long flags;
+
+	RWLock_writeLockIrqSave(&m_handlersLock, flags);
 	m_handlers[irq] = handler;
+	RWLock_writeUnlockIrqRestore(&m_handlersLock, flags);
 }
 
 void IRQ_removeHandler(int irq){
 	assert(isValidIRQ(irq));
+	unsigned long flags;
+
+	// Once this returns, no CPU starts the removed handler anymore
+	RWLock_writeLockIrqSave(&m_handlersLock, flags);
 	m_handlers[irq] = NULL;
+	RWLock_writeUnlockIrqRestore(&m_handlersLock, flags);
 }
 
 void IRQ_prehandler(void* params){
 	int irq = IRQChip_getIRQ(params);
 
-	if (m_handlers[irq] != NULL)
-		m_handlers[irq](params);
+	// The handler is called without the lock: it may install handlers itself
+	RWLock_readLock(&m_handlersLock);
+	irqhandler_t handler = m_handlers[irq];
+	RWLock_readUnlock(&m_handlersLock);
+
+	if (handler != NULL)
+		handler(params);
 	else
 		log(WARNING, MODULE, "Unhandled IRQ %d", irq);
 
-	// Finally, signal the chip that we handled the interrupt
+	// Signal the chip that we handled the interrupt
 	m_chip->sendEOI(irq);
+
+	// Finally, switch threads if the IRQ ended the current one's time slice
+	Scheduler_preempt();
 }
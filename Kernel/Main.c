@@ -5,14 +5,20 @@
 #include "Memory/MemoryMap.h"
 #include "Memory/PMM.h"
 #include "Memory/VMM.h"
+#include "Memory/VMA.h"
+#include "Memory/VMalloc.h"
 #include "IRQ/IRQ.h"
 #include "Time/Time.h"
+#include "Time/Timer.h"
 #include "SMP/SMP.h"
+#include "Scheduler/Scheduler.h"
 #include "Drivers/Graphics/Graphics.h"
 #include "Drivers/ACPI/ACPI.h"
 #include "Drivers/Output/Serial.h"
 #include "Drivers/Input/PS2.h"
 #include "Drivers/Input/Keyboard.h"
+#include "Debug/DebugConsole.h"
+#include "Benchmarks/Benchmarks.h"
 #include "HAL/HAL.h"
 #include "HAL/Halt.h"
 
@@ -39,8 +45,11 @@ void kmain(){
 	PMM_init();
 	VMM_init();
 	SlabAllocator_init(); // Kernel heap (kmalloc, caches...)
+	VMA_init(); // Demand paging
+	VMalloc_init(); // Big kernel allocations
 
 	ACPI_init();
+	PMM_initNUMA(); // Needs the ACPI SRAT
 
 	// IRQ subsystem initialization, and enable IRQs for the boostrap CPU
 	IRQ_init();
@@ -49,16 +58,27 @@ void kmain(){
 	// Time subsystem initialization
 	Time_init();
 
-	// CPUs initializations
+	// CPUs initializations. The scheduler is initialized before the APs start, as they enter it
+	// From now on, this context is the BSP's idle thread
 	SMP_init();
+	Timer_initWheels();
+	Time_startClockUpdates();
+	Scheduler_init();
 	SMP_startCPUs();
+	VMA_startCollapseThread();
 
 	// Misc drivers initializations
 	Serial_init();
 	PS2_init();
 	Keyboard_init();
+	DebugConsole_start();
 
-	// Infinite loop: whenever an interrupts fire, handle it ; then stop again.
-	while (true)
+	Benchmarks_start();
+
+	// Idle loop: whenever an interrupts fire, handle it (possibly switching to another thread) ;
+	// then stop again. Memory reclaim is done in the background from here, when the CPU is idle
+	while (true){
+		PMM_reclaim();
 		halt();
+	}
 }
@@ -0,0 +1,348 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "mugOS/Preprocessor.h"
+#include "string.h"
+#include "Memory/PMM.h"
+
+#include "Memory/BitmapAllocator.h"
+#define MODULE "Bitmap allocator"
+
+struct BitmapAllocator {
+	uint64_t nBlocks; // (= #bits)
+	paddr_t start;
+
+	uint64_t* bitmap;
+	uint64_t bitmapLength; // bitmap[bitmapLength]
+
+	struct BitmapZone {
+		uint64_t startBit;
+		uint64_t endBit;
+		uint64_t nextFreeHint; // every block of the zone before this one is allocated
+	} zones[PMM_MAX_ZONES];
+	int nZones;
+};
+
+static struct BitmapAllocator m_bitmapAllocator;
+
+// ================ Bitmap ================
+
+static void clearBits(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
+	uint64_t start_index, end_index;
+	uint64_t start_mask, end_mask;
+
+	// These check shouldn't be necessary, but better safe than sorry
+	if (start_bit >= end_bit) return;
+	if (start_bit >= allocator->nBlocks) return;
+	if (end_bit > allocator->nBlocks)
+		end_bit = allocator->nBlocks;
+
+	for (int i=0 ; i<allocator->nZones ; i++){
+		struct BitmapZone* zone = &allocator->zones[i];
+		if (start_bit < zone->endBit && end_bit > zone->startBit)
+			zone->nextFreeHint = min(zone->nextFreeHint, max(start_bit, zone->startBit));
+	}
+
+	// Example on uint8, clearing from start_bit=2 to end_bit=19
+	// 11000000 00000000 00011111
+	// First and last are what start_mask and end_mask are for
+	// The middle is handled faster by a for loop
+
+	// Compute masks
+	uint64_t index_in_first_uint64 = start_bit % 64;
+	uint64_t index_in_last_uint64 = end_bit % 64;
+	start_mask = (index_in_first_uint64 == 0) ? 0x0000000000000000 :
+		~((1llu << (64 - index_in_first_uint64)) - 1); // e.g. 3 => 0b11100000
+	end_mask = (index_in_last_uint64 == 0) ? 0xffffffffffffffff :
+		~(((1llu << index_in_last_uint64) - 1) << (64 - index_in_last_uint64)); // e.g. 3 => 0b00000111
+
+	// Apply masks
+
+	// Indexes in the uint64_t* bitmap
+	start_index = start_bit / 64;
+	end_index = end_bit / 64;
+
+	// Special case: we need to apply both masks in the same uint64
+	if (start_index == end_index){
+		allocator->bitmap[start_index] &= start_mask | end_mask;
+		return;
+	}
+
+	allocator->bitmap[start_index] &= start_mask;
+	for (uint64_t i=start_index+1 ; i<end_index ; i++)
+		allocator->bitmap[i] = 0x0000000000000000;
+	if (index_in_last_uint64 != 0)
+		allocator->bitmap[end_index] &= end_mask;
+}
+
+static void setBits(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
+	uint64_t start_index, end_index;
+	uint64_t start_mask, end_mask;
+
+	// These check shouldn't be necessary, but better safe than sorry
+	if (start_bit >= end_bit) return;
+	if (start_bit >= allocator->nBlocks) return;
+	if (end_bit > allocator->nBlocks)
+		end_bit = allocator->nBlocks;
+
+	// Example on uint8, setting from start_bit=2 to end_bit=19
+	// 00111111 11111111 11100000
+	// First and last are what start_mask and end_mask are for
+	// The middle is handled faster by a for loop
+
+	// Compute masks
+	uint64_t index_in_first_uint64 = start_bit % 64;
+	uint64_t index_in_last_uint64 = end_bit % 64;
+	start_mask = (index_in_first_uint64 == 0) ? 0xffffffffffffffff :
+		(1llu << (64 - index_in_first_uint64)) - 1; // e.g. 3 => 0b00011111
+	end_mask = (index_in_last_uint64 == 0) ? 0x0000000000000000 :
+		((1llu << index_in_last_uint64) - 1) << (64 - index_in_last_uint64); // e.g. 3 => 0b11111000
+
+	// Apply masks
+
+	// Indexes in the uint64_t* bitmap
+	start_index = start_bit / 64;
+	end_index = end_bit / 64;
+
+	// Special case: we need to apply both masks in the same uint64
+	if (start_index == end_index){
+		allocator->bitmap[start_index] |= start_mask & end_mask;
+		return;
+	}
+
+	allocator->bitmap[start_index] |= start_mask;
+	for (uint64_t i=start_index+1 ; i<end_index ; i++)
+		allocator->bitmap[i] = 0xffffffffffffffff;
+	if (index_in_last_uint64 != 0)
+		allocator->bitmap[end_index] |= end_mask;
+}
+
+// Mask selecting the bits [start, end[ of a bitmap word (bit 0 being the most significant one)
+static inline uint64_t getWordMask(int start, int end){
+	uint64_t from_start = 0xffffffffffffffff >> start;
+	uint64_t before_end = (end == 64) ? 0xffffffffffffffff : ~(0xffffffffffffffff >> end);
+	return from_start & before_end;
+}
+
+static uint64_t countFreeBlocks(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
+	uint64_t n_bits = 0;
+
+	if (end_bit > allocator->nBlocks)
+		end_bit = allocator->nBlocks;
+	if (start_bit >= end_bit)
+		return 0;
+
+	uint64_t start_index = start_bit / 64;
+	uint64_t last_index = (end_bit - 1) / 64;
+
+	for (uint64_t i=start_index ; i<=last_index ; i++){
+		// First and last words may be partial
+		int first = (i == start_index) ? start_bit % 64 : 0;
+		int end = (i == last_index) ? (end_bit - 1) % 64 + 1 : 64;
+		uint64_t mask = getWordMask(first, end);
+
+		// Note: __builtin_popcountll counts the number of bits to 1 in the argument
+		n_bits += __builtin_popcountll(~allocator->bitmap[i] & mask);
+	}
+
+	return n_bits;
+}
+
+static bool isFullyAllocated(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
+	if (start_bit >= end_bit) return false;
+	if (start_bit >= allocator->nBlocks) return false;
+	if (end_bit > allocator->nBlocks) return false;
+
+	uint64_t start_index = start_bit / 64;
+	uint64_t last_index = (end_bit - 1) / 64;
+
+	for (uint64_t i=start_index ; i<=last_index ; i++){
+		int first = (i == start_index) ? start_bit % 64 : 0;
+		int end = (i == last_index) ? (end_bit - 1) % 64 + 1 : 64;
+		uint64_t mask = getWordMask(first, end);
+
+		if ((allocator->bitmap[i] & mask) != mask)
+			return false;
+	}
+
+	return true;
+}
+
+/// @brief Find the first free (cleared) bit in [start_bit, end_bit[
+/// @return The index of the bit, or `end_bit` if there is none
+static uint64_t findFirstFreeBit(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
+	if (start_bit >= end_bit)
+		return end_bit;
+
+	uint64_t index = start_bit / 64;
+	uint64_t last_index = (end_bit - 1) / 64;
+
+	// Consider the bits before start_bit as allocated
+	uint64_t cur = allocator->bitmap[index] | ~getWordMask(start_bit % 64, 64);
+
+	// Skip fully allocated words
+	while (cur == 0xffffffffffffffff){
+		if (++index > last_index)
+			return end_bit;
+		cur = allocator->bitmap[index];
+	}
+
+	// Note: __builtin_clzll counts the leading zeros, i.e. the bits before the first one
+	uint64_t res = index*64 + __builtin_clzll(~cur);
+	return min(res, end_bit);
+}
+
+/// @brief Find the first allocated (set) bit in [start_bit, end_bit[
+/// @return The index of the bit, or `end_bit` if there is none
+static uint64_t findFirstUsedBit(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
+	if (start_bit >= end_bit)
+		return end_bit;
+
+	uint64_t index = start_bit / 64;
+	uint64_t last_index = (end_bit - 1) / 64;
+
+	// Consider the bits before start_bit as free
+	uint64_t cur = allocator->bitmap[index] & getWordMask(start_bit % 64, 64);
+
+	// Skip fully free words
+	while (cur == 0x0000000000000000){
+		if (++index > last_index)
+			return end_bit;
+		cur = allocator->bitmap[index];
+	}
+
+	uint64_t res = index*64 + __builtin_clzll(cur);
+	return min(res, end_bit);
+}
+
+// Round a bit index up, so that the page it describes is aligned on `alignment` pages
+static inline uint64_t alignBit(struct BitmapAllocator* allocator, uint64_t bit, uint64_t alignment){
+	uint64_t first_page = allocator->start / PAGE_SIZE;
+	uint64_t aligned_page = (first_page + bit + alignment-1) & ~(alignment-1);
+	return aligned_page - first_page;
+}
+
+/// @brief Search for `n_bits` consecutive free bits in [start_bit, end_bit[,
+/// the first one describing a page aligned on `alignment` pages
+/// @param first_free Set to the first free bit encountered during the search (`end_bit` if none)
+/// @return The index of the first bit of the run, or `end_bit` if there is none
+static uint64_t findFreeRun(struct BitmapAllocator* allocator, uint64_t n_bits, uint64_t alignment,
+							uint64_t start_bit, uint64_t end_bit, uint64_t* first_free){
+	uint64_t cur = start_bit;
+	*first_free = end_bit;
+
+	while (cur < end_bit){
+		uint64_t run_start = findFirstFreeBit(allocator, cur, end_bit);
+		if (*first_free == end_bit)
+			*first_free = run_start;
+
+		run_start = alignBit(allocator, run_start, alignment);
+		if (run_start >= end_bit || end_bit - run_start < n_bits)
+			return end_bit;
+
+		// Only look as far as we need: the run may span any number of words
+		uint64_t run_end = findFirstUsedBit(allocator, run_start, run_start + n_bits);
+		if (run_end == run_start + n_bits)
+			return run_start;
+
+		cur = run_end;
+	}
+
+	return end_bit;
+}
+
+static paddr_t allocate_firstFit(struct BitmapAllocator* allocator, struct BitmapZone* zone,
+								 uint64_t n_pages, uint64_t alignment, uint64_t end_bit){
+	uint64_t first_free;
+
+	if (n_pages == 0 || zone->nextFreeHint >= end_bit)
+		return (paddr_t) NULL;
+
+	// Search for n_pages consecutive free bits in the zone
+	// Note: every bit before nextFreeHint is allocated, so we can start there
+	uint64_t start_idx = findFreeRun(allocator, n_pages, alignment, zone->nextFreeHint,
+									 end_bit, &first_free);
+
+	if (start_idx == end_bit){
+		// If we searched the whole zone, we know where its first free bit is
+		if (end_bit == zone->endBit)
+			zone->nextFreeHint = first_free;
+		return (paddr_t) NULL;
+	}
+
+	uint64_t end_idx = start_idx + n_pages;
+	setBits(allocator, start_idx, end_idx);
+
+	// If the run we took was the first free bits, the next free one is at least after it
+	zone->nextFreeHint = (first_free == start_idx) ? end_idx : first_free;
+
+	return allocator->start + start_idx * PAGE_SIZE;
+}
+
+// Bit describing the page at `addr`, clamped to [0, nBlocks]
+static uint64_t getBit(struct BitmapAllocator* allocator, paddr_t addr){
+	if (addr < allocator->start)
+		return 0;
+	return min((addr - allocator->start) / PAGE_SIZE, allocator->nBlocks);
+}
+
+// ================ Backend interface ================
+
+size_t BitmapAllocator_getMetadataSize(uint64_t n_pages){
+	return ((n_pages + 63) / 64) * sizeof(uint64_t);
+}
+
+void BitmapAllocator_init(void* metadata, paddr_t start, uint64_t n_pages){
+	struct BitmapAllocator* allocator = &m_bitmapAllocator;
+
+	allocator->start = start;
+	allocator->nBlocks = n_pages;
+	allocator->bitmap = metadata;
+	allocator->bitmapLength = (n_pages + 63) / 64;
+	allocator->nZones = 0;
+
+	// Initialize the bitmap with all regions used/reserved
+	memset(allocator->bitmap, 0xff, allocator->bitmapLength*sizeof(uint64_t));
+}
+
+void BitmapAllocator_setZones(const struct PMMZone* zones, int n_zones){
+	struct BitmapAllocator* allocator = &m_bitmapAllocator;
+
+	// Free pages are in the bitmap, we only need to cut it
+	allocator->nZones = n_zones;
+	for (int i=0 ; i<n_zones ; i++){
+		struct BitmapZone* zone = &allocator->zones[i];
+		zone->startBit = getBit(allocator, zones[i].start);
+		zone->endBit = getBit(allocator, zones[i].end);
+		zone->nextFreeHint = findFirstFreeBit(allocator, zone->startBit, zone->endBit);
+	}
+}
+
+void BitmapAllocator_addFreePages(paddr_t addr, uint64_t n_pages){
+	uint64_t start_bit = (addr - m_bitmapAllocator.start) / PAGE_SIZE;
+	clearBits(&m_bitmapAllocator, start_bit, start_bit + n_pages);
+}
+
+paddr_t BitmapAllocator_allocatePages(int zone, uint64_t n_pages, uint64_t alignment, paddr_t limit){
+	struct BitmapZone* bitmap_zone = &m_bitmapAllocator.zones[zone];
+	uint64_t end_bit = min(bitmap_zone->endBit, getBit(&m_bitmapAllocator, limit));
+	return allocate_firstFit(&m_bitmapAllocator, bitmap_zone, n_pages, alignment, end_bit);
+}
+
+void BitmapAllocator_freePages(paddr_t addr, uint64_t n_pages){
+	// Note: Bounds are checked by clearBits
+	uint64_t start_bit = (addr - m_bitmapAllocator.start) / PAGE_SIZE;
+	clearBits(&m_bitmapAllocator, start_bit, start_bit + n_pages);
+}
+
+bool BitmapAllocator_isAllocated(paddr_t addr, uint64_t n_pages){
+	if (addr < m_bitmapAllocator.start)
+		return false;
+
+	uint64_t start_bit = (addr - m_bitmapAllocator.start) / PAGE_SIZE;
+	return isFullyAllocated(&m_bitmapAllocator, start_bit, start_bit + n_pages);
+}
+
+uint64_t BitmapAllocator_countFreePages(int zone){
+	struct BitmapZone* bitmap_zone = &m_bitmapAllocator.zones[zone];
+	return countFreeBlocks(&m_bitmapAllocator, bitmap_zone->startBit, bitmap_zone->endBit);
+}
@@ -0,0 +1,30 @@
+#ifndef __BITMAP_ALLOCATOR_H__
+#define __BITMAP_ALLOCATOR_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "Memory/Memory.h"
+#include "Memory/PMM.h"
+
+// BitmapAllocator.h: First-fit bitmap physical page allocator (PMM backend)
+
+size_t BitmapAllocator_getMetadataSize(uint64_t n_pages);
+
+/// @brief Initialize the allocator, with all pages allocated and no zones
+/// @param metadata Storage for the bitmap, of `BitmapAllocator_getMetadataSize` bytes
+void BitmapAllocator_init(void* metadata, paddr_t start, uint64_t n_pages);
+
+/// @brief Set the zones to allocate from (free pages stay free)
+void BitmapAllocator_setZones(const struct PMMZone* zones, int n_zones);
+
+/// @brief Hand free pages to the allocator (no double-free check is done)
+void BitmapAllocator_addFreePages(paddr_t addr, uint64_t n_pages);
+
+/// @param alignment In pages, power of two
+/// @param limit The allocated pages must all be below this address
+paddr_t BitmapAllocator_allocatePages(int zone, uint64_t n_pages, uint64_t alignment, paddr_t limit);
+void BitmapAllocator_freePages(paddr_t addr, uint64_t n_pages);
+bool BitmapAllocator_isAllocated(paddr_t addr, uint64_t n_pages);
+uint64_t BitmapAllocator_countFreePages(int zone);
+
+#endif
@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <stddef.h>
+#include "mugOS/Preprocessor.h"
+#include "mugOS/List.h"
+#include "Memory/Page.h"
+#include "Memory/PMM.h"
+
+#include "Memory/BuddyAllocator.h"
+#define MODULE "Buddy allocator"
+
+// A block of order n is 2^n pages long, and its first page frame number is a multiple of 2^n.
+// Its buddy is the block of the same order it was split from ; when both are free, they are
+// merged back into a block of order n+1.
+// Free blocks are kept in per-zone, per-order lists, using their first page's `struct Page` node
+
+struct FreeArea {
+	list_t blocks;
+	uint64_t nBlocks;
+};
+
+// Blocks never cross zones boundaries: each zone is a separate buddy system
+struct BuddyZone {
+	// Page frame numbers (physical address / PAGE_SIZE) of the zone are in [startFrame, endFrame[
+	uint64_t startFrame;
+	uint64_t endFrame;
+	struct FreeArea freeAreas[BUDDY_MAX_ORDER+1];
+};
+
+static struct BuddyZone m_zones[PMM_MAX_ZONES];
+static int m_nZones = 0;
+
+// ================ Blocks ================
+
+static inline struct Page* frameToPage(uint64_t frame){
+	return Page_fromAddress(frame * PAGE_SIZE);
+}
+
+static inline uint64_t pageToFrame(struct Page* page){
+	return Page_toAddress(page) / PAGE_SIZE;
+}
+
+static inline bool isInZone(struct BuddyZone* zone, uint64_t frame){
+	return frame >= zone->startFrame && frame < zone->endFrame;
+}
+
+static struct BuddyZone* getZone(uint64_t frame){
+	for (int i=0 ; i<m_nZones ; i++){
+		if (isInZone(&m_zones[i], frame))
+			return &m_zones[i];
+	}
+
+	return NULL;
+}
+
+// Smallest order so that 2^order >= n_pages
+static inline int getOrder(uint64_t n_pages){
+	return (n_pages <= 1) ? 0 : 64 - __builtin_clzll(n_pages - 1);
+}
+
+// Biggest order of a block starting at `frame` that fits in `n_pages`
+static inline int getFittingOrder(uint64_t frame, uint64_t n_pages){
+	int order = 63 - __builtin_clzll(n_pages);
+	if (frame != 0)
+		order = min(order, __builtin_ctzll(frame));
+	return min(order, BUDDY_MAX_ORDER);
+}
+
+static void pushBlock(struct BuddyZone* zone, uint64_t frame, int order){
+	struct Page* page = frameToPage(frame);
+
+	page->flags |= PAGE_FLAG_BUDDY;
+	page->order = order;
+	List_pushFront(&zone->freeAreas[order].blocks, &page->node);
+	zone->freeAreas[order].nBlocks++;
+}
+
+static void popBlock(struct BuddyZone* zone, struct Page* page){
+	List_pop(&zone->freeAreas[page->order].blocks, &page->node);
+	zone->freeAreas[page->order].nBlocks--;
+	page->flags &= ~PAGE_FLAG_BUDDY;
+}
+
+// Free a block, and merge it with its buddies as long as they are free too
+static void freeBlock(struct BuddyZone* zone, uint64_t frame, int order){
+	while (order < BUDDY_MAX_ORDER){
+		uint64_t buddy_frame = frame ^ (1ul << order);
+		if (!isInZone(zone, buddy_frame))
+			break;
+
+		struct Page* buddy = frameToPage(buddy_frame);
+		if (!(buddy->flags & PAGE_FLAG_BUDDY) || buddy->order != order)
+			break;
+
+		popBlock(zone, buddy);
+		frame &= ~(1ul << order);
+		order++;
+	}
+
+	pushBlock(zone, frame, order);
+}
+
+// Free any range of pages, by cutting it into the biggest naturally aligned blocks possible
+static void freeRange(uint64_t frame, uint64_t n_pages){
+	while (n_pages > 0){
+		struct BuddyZone* zone = getZone(frame);
+		if (zone == NULL){
+			// Not in any zone, ignore it (zones cover all managed memory)
+			frame++;
+			n_pages--;
+			continue;
+		}
+
+		uint64_t end_frame = min(frame + n_pages, zone->endFrame);
+		while (frame < end_frame){
+			int order = getFittingOrder(frame, end_frame - frame);
+			freeBlock(zone, frame, order);
+			frame += 1ul << order;
+			n_pages -= 1ul << order;
+		}
+	}
+}
+
+// Whether the page `frame` is part of a free block
+static bool isInFreeBlock(uint64_t frame){
+	struct BuddyZone* zone = getZone(frame);
+	if (zone == NULL)
+		return false;
+
+	for (int order=0 ; order<=BUDDY_MAX_ORDER ; order++){
+		uint64_t head = frame & ~((1ul << order) - 1);
+		if (!isInZone(zone, head))
+			break;
+
+		struct Page* page = frameToPage(head);
+		if ((page->flags & PAGE_FLAG_BUDDY) && page->order >= order)
+			return true;
+	}
+
+	return false;
+}
+
+// Find the first free block of order `order` or more, whose first 2^order pages are below `limit_frame`
+static struct Page* findLowBlock(struct BuddyZone* zone, int order, uint64_t limit_frame){
+	lnode_t* node;
+
+	for (int cur=order ; cur<=BUDDY_MAX_ORDER ; cur++){
+		List_foreach(&zone->freeAreas[cur].blocks, node){
+			struct Page* page = List_getObject(node, struct Page, node);
+			if (pageToFrame(page) + (1ul << order) <= limit_frame)
+				return page;
+		}
+	}
+
+	return NULL;
+}
+
+// ================ Backend interface ================
+
+size_t BuddyAllocator_getMetadataSize(unused uint64_t n_pages){
+	// Everything is stored in the memmap
+	return 0;
+}
+
+void BuddyAllocator_init(unused void* metadata, unused paddr_t start, unused uint64_t n_pages){
+	m_nZones = 0;
+}
+
+void BuddyAllocator_setZones(const struct PMMZone* zones, int n_zones){
+	list_t free_blocks;
+	List_init(&free_blocks);
+
+	// Take all free blocks out of the current zones
+	for (int i=0 ; i<m_nZones ; i++){
+		for (int order=0 ; order<=BUDDY_MAX_ORDER ; order++){
+			list_t* blocks = &m_zones[i].freeAreas[order].blocks;
+			while (!List_isEmpty(blocks)){
+				struct Page* page = List_getObject(blocks->head, struct Page, node);
+				popBlock(&m_zones[i], page);
+				List_pushBack(&free_blocks, &page->node);
+			}
+		}
+	}
+
+	// Setup the new zones
+	m_nZones = n_zones;
+	for (int i=0 ; i<n_zones ; i++){
+		m_zones[i].startFrame = zones[i].start / PAGE_SIZE;
+		m_zones[i].endFrame = zones[i].end / PAGE_SIZE;
+		for (int order=0 ; order<=BUDDY_MAX_ORDER ; order++){
+			List_init(&m_zones[i].freeAreas[order].blocks);
+			m_zones[i].freeAreas[order].nBlocks = 0;
+		}
+	}
+
+	// And give them back the free blocks. Note: page->order was kept by popBlock
+	while (!List_isEmpty(&free_blocks)){
+		struct Page* page = List_getObject(free_blocks.head, struct Page, node);
+		List_popFront(&free_blocks);
+		freeRange(pageToFrame(page), 1ul << page->order);
+	}
+}
+
+void BuddyAllocator_addFreePages(paddr_t addr, uint64_t n_pages){
+	freeRange(addr / PAGE_SIZE, n_pages);
+}
+
+paddr_t BuddyAllocator_allocatePages(int zone_index, uint64_t n_pages, uint64_t alignment, paddr_t limit){
+	struct BuddyZone* zone = &m_zones[zone_index];
+	struct Page* page;
+	int cur;
+
+	if (n_pages == 0)
+		return (paddr_t) NULL;
+
+	// Blocks are naturally aligned, so a block big enough is aligned enough
+	int order = getOrder(max(n_pages, alignment));
+	if (order > BUDDY_MAX_ORDER)
+		return (paddr_t) NULL;
+
+	if (limit / PAGE_SIZE >= zone->endFrame){
+		// Find the smallest free block that fits
+		cur = order;
+		while (cur <= BUDDY_MAX_ORDER && List_isEmpty(&zone->freeAreas[cur].blocks))
+			cur++;
+		if (cur > BUDDY_MAX_ORDER)
+			return (paddr_t) NULL;
+
+		page = List_getObject(zone->freeAreas[cur].blocks.head, struct Page, node);
+	}
+	else {
+		// Slow path: search for a block low enough
+		page = findLowBlock(zone, order, limit / PAGE_SIZE);
+		if (page == NULL)
+			return (paddr_t) NULL;
+
+		cur = page->order;
+	}
+
+	popBlock(zone, page);
+	uint64_t frame = pageToFrame(page);
+
+	// Split it until it has the requested order, freeing the upper halves
+	while (cur > order){
+		cur--;
+		pushBlock(zone, frame + (1ul << cur), cur);
+	}
+
+	// Give back the pages of the block we don't need
+	uint64_t block_size = 1ul << order;
+	if (n_pages < block_size)
+		freeRange(frame + n_pages, block_size - n_pages);
+
+	return frame * PAGE_SIZE;
+}
+
+void BuddyAllocator_freePages(paddr_t addr, uint64_t n_pages){
+	freeRange(addr / PAGE_SIZE, n_pages);
+}
+
+bool BuddyAllocator_isAllocated(paddr_t addr, uint64_t n_pages){
+	uint64_t frame = addr / PAGE_SIZE;
+
+	if (n_pages == 0 || !Page_isManaged(addr) || !Page_isManaged(addr + (n_pages-1)*PAGE_SIZE))
+		return false;
+
+	// Note: only the first page of each block that would be freed is checked
+	while (n_pages > 0){
+		int order = getFittingOrder(frame, n_pages);
+		if (isInFreeBlock(frame))
+			return false;
+		frame += 1ul << order;
+		n_pages -= 1ul << order;
+	}
+
+	return true;
+}
+
+uint64_t BuddyAllocator_countFreePages(int zone_index){
+	struct BuddyZone* zone = &m_zones[zone_index];
+	uint64_t n_pages = 0;
+
+	for (int i=0 ; i<=BUDDY_MAX_ORDER ; i++)
+		n_pages += zone->freeAreas[i].nBlocks << i;
+
+	return n_pages;
+}
@@ -0,0 +1,33 @@
+#ifndef __BUDDY_ALLOCATOR_H__
+#define __BUDDY_ALLOCATOR_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "Memory/Memory.h"
+#include "Memory/PMM.h"
+
+// BuddyAllocator.h: Binary buddy physical page allocator (PMM backend)
+// Free blocks are naturally aligned power-of-two runs of pages, tracked in the memmap (Page.h)
+
+#define BUDDY_MAX_ORDER 18 // Biggest block is 2^18 pages (1 GiB)
+
+size_t BuddyAllocator_getMetadataSize(uint64_t n_pages);
+
+/// @brief Initialize the allocator, with all pages allocated and no zones
+/// @note The memmap (g_pages) must have been zero-initialized beforehand
+void BuddyAllocator_init(void* metadata, paddr_t start, uint64_t n_pages);
+
+/// @brief Set the zones to allocate from. The free pages are moved to the new zones
+void BuddyAllocator_setZones(const struct PMMZone* zones, int n_zones);
+
+/// @brief Hand free pages to the allocator (no double-free check is done)
+void BuddyAllocator_addFreePages(paddr_t addr, uint64_t n_pages);
+
+/// @param alignment In pages, power of two
+/// @param limit The allocated pages must all be below this address
+paddr_t BuddyAllocator_allocatePages(int zone, uint64_t n_pages, uint64_t alignment, paddr_t limit);
+void BuddyAllocator_freePages(paddr_t addr, uint64_t n_pages);
+bool BuddyAllocator_isAllocated(paddr_t addr, uint64_t n_pages);
+uint64_t BuddyAllocator_countFreePages(int zone);
+
+#endif
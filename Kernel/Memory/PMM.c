@@ -1,6 +1,8 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include <limine.h>
+#include "mugOS/Preprocessor.h"
 #include "string.h"
 #include "assert.h"
 #include "Logging.h"
@@ -8,273 +10,403 @@
 #include "Boot/LimineRequests.h"
 #include "Memory/MemoryMap.h"
 #include "Memory/VMM.h"
+#include "Memory/Page.h"
+#include "Memory/BitmapAllocator.h"
+#include "Memory/BuddyAllocator.h"
+#include "Drivers/ACPI/ACPI.h"
+#include "Sync/MCSLock.h"
+#include "Scheduler/Scheduler.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "HAL/SMP/PerCPU.h"
 
 #include "PMM.h"
 #define MODULE "Physical Memory Manager"
 
-struct BitmapAllocator {
-	uint64_t nBlocks; // (= #bits)
-	paddr_t start;
-	uint64_t allocatableBlocks; // #blocks that can be allocated (<= nBlocks)
-	uint64_t allocatedBlocks; // #allocated blocks at a given time
-
-	uint64_t* bitmap;
-	uint64_t bitmapLength; // bitmap[bitmapLength]
+// Physical memory allocator backend. Select it with PMM_BACKEND_* at compile time
+struct PageAllocator {
+	const char* name;
+	// Size (in bytes) of the metadata needed to manage n_pages pages
+	size_t (*getMetadataSize)(uint64_t n_pages);
+	// Initialize the backend, with all the pages allocated
+	void (*init)(void* metadata, paddr_t start, uint64_t n_pages);
+	// Set the zones to allocate from. Pages outside of any zone are never allocated
+	void (*setZones)(const struct PMMZone* zones, int n_zones);
+	void (*addFreePages)(paddr_t addr, uint64_t n_pages);
+	// Allocate n_pages pages in the zone `zone`, the first one aligned on `alignment` pages,
+	// and all of them below `limit`
+	paddr_t (*allocatePages)(int zone, uint64_t n_pages, uint64_t alignment, paddr_t limit);
+	void (*freePages)(paddr_t addr, uint64_t n_pages);
+	bool (*isAllocated)(paddr_t addr, uint64_t n_pages);
+	uint64_t (*countFreePages)(int zone);
 };
 
-static struct BitmapAllocator m_bitmapAllocator;
+#define NO_LIMIT ((paddr_t) -1)
 
-// ================ Memory allocator ================
+static const char* const ZONE_TYPE_NAMES[] = {"DMA", "DMA32", "Normal"};
 
-static void clearBits(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
-	uint64_t start_index, end_index;
-	uint64_t start_mask, end_mask;
-
-	// These check shouldn't be necessary, but better safe than sorry
-	if (start_bit >= end_bit) return;
-	if (start_bit >= allocator->nBlocks) return;
-	if (end_bit > allocator->nBlocks)
-		end_bit = allocator->nBlocks;
-
-	// From now on we can update free blocks
-	allocator->allocatedBlocks -= end_bit - start_bit;
-
-	// Example on uint8, clearing from start_bit=2 to end_bit=19
-	// 11000000 00000000 00011111
-	// First and last are what start_mask and end_mask are for
-	// The middle is handled faster by a for loop
-
-	// Compute masks
-	uint64_t index_in_first_uint64 = start_bit % 64;
-	uint64_t index_in_last_uint64 = end_bit % 64;
-	start_mask = (index_in_first_uint64 == 0) ? 0x0000000000000000 :
-		~((1llu << (64 - index_in_first_uint64)) - 1); // e.g. 3 => 0b11100000
-	end_mask = (index_in_last_uint64 == 0) ? 0xffffffffffffffff :
-		~(((1llu << index_in_last_uint64) - 1) << (64 - index_in_last_uint64)); // e.g. 3 => 0b00000111
-
-	// Apply masks
-
-	// Indexes in the uint64_t* bitmap
-	start_index = start_bit / 64;
-	end_index = end_bit / 64;
-
-	// Special case: we need to apply both masks in the same uint64
-	if (start_index == end_index){
-		allocator->bitmap[start_index] &= start_mask | end_mask;
-		return;
-	}
+static struct PageAllocator m_allocator;
+static uint64_t m_allocatablePages; // #pages that can be allocated (<= g_nPages)
+static uint64_t m_allocatedPages; // #allocated pages at a given time (including per-CPU caches)
+// Protects the allocator, the zones and the counters. Shared by all the CPUs when their page caches
+// run dry: an MCS lock keeps it fair, and its waiters off each other's cache lines
+static mcslock_t m_lock = MCSLOCK_INIT("PMM");
+
+static struct PMMZone m_zones[PMM_MAX_ZONES];
+static int m_nZones;
+static int m_nNodes = 1;
+static uint32_t m_nodeDomains[PMM_MAX_NODES]; // ACPI proximity domain of each node
+// Zones to allocate from for each node, by order of preference (indexes in m_zones)
+static uint8_t m_zoneLists[PMM_MAX_NODES][PMM_MAX_ZONES];
+
+static struct PMMWatermarks m_watermarks;
+static shrinker_t m_shrinkers[PMM_MAX_SHRINKERS];
+static int m_nShrinkers = 0;
+static atomic_bool m_reclaimRequested = false; // Free memory went below the low watermark
+
+struct Page* g_pages;
+paddr_t g_pagesStart;
+uint64_t g_nPages;
 
-	allocator->bitmap[start_index] &= start_mask;
-	for (uint64_t i=start_index+1 ; i<end_index ; i++)
-		allocator->bitmap[i] = 0x0000000000000000;
-	if (index_in_last_uint64 != 0)
-		allocator->bitmap[end_index] &= end_mask;
+// ================ Global allocator ================
+
+// Get the number of pages needed to store `size` bytes
+static inline uint64_t getSizeAsPages(size_t n_bytes){
+	// Note: Adding PAGE_SIZE-1 rounds the integer division up
+	return (n_bytes + PAGE_SIZE-1) / PAGE_SIZE;
 }
 
-static void setBits(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
-	uint64_t start_index, end_index;
-	uint64_t start_mask, end_mask;
+static inline void lockAllocator(struct MCSNode* node){
+	MCSLock_lock(&m_lock, node);
+}
 
-	// These check shouldn't be necessary, but better safe than sorry
-	if (start_bit >= end_bit) return;
-	if (start_bit >= allocator->nBlocks) return;
-	if (end_bit > allocator->nBlocks)
-		end_bit = allocator->nBlocks;
+static inline void unlockAllocator(struct MCSNode* node){
+	MCSLock_unlock(&m_lock, node);
+}
 
-	// From now on we can update free blocks
-	allocator->allocatedBlocks += end_bit - start_bit;
+// Note: m_lock must be held
+static paddr_t allocateLocked(uint64_t n_pages, uint64_t alignment, enum PMMZoneType max_type,
+							  paddr_t limit, int node){
+	if (node < 0 || node >= m_nNodes)
+		node = 0;
 
-	// Example on uint8, setting from start_bit=2 to end_bit=19
-	// 00111111 11111111 11100000
-	// First and last are what start_mask and end_mask are for
-	// The middle is handled faster by a for loop
+	// Try the zones by order of preference: closest node first, then highest zone type
+	for (int i=0 ; i<m_nZones ; i++){
+		int zone = m_zoneLists[node][i];
+		if (m_zones[zone].type > max_type || m_zones[zone].start >= limit)
+			continue;
 
-	// Compute masks
-	uint64_t index_in_first_uint64 = start_bit % 64;
-	uint64_t index_in_last_uint64 = end_bit % 64;
-	start_mask = (index_in_first_uint64 == 0) ? 0xffffffffffffffff :
-		(1llu << (64 - index_in_first_uint64)) - 1; // e.g. 3 => 0b00011111
-	end_mask = (index_in_last_uint64 == 0) ? 0x0000000000000000 :
-		((1llu << index_in_last_uint64) - 1) << (64 - index_in_last_uint64); // e.g. 3 => 0b11111000
+		paddr_t res = m_allocator.allocatePages(zone, n_pages, alignment, limit);
+		if (res != (paddr_t) NULL){
+			m_allocatedPages += n_pages;
+			return res;
+		}
+	}
 
-	// Apply masks
+	return (paddr_t) NULL;
+}
 
-	// Indexes in the uint64_t* bitmap
-	start_index = start_bit / 64;
-	end_index = end_bit / 64;
+// Note: m_lock must be held
+static void freeLocked(paddr_t addr, uint64_t n_pages){
+	// Note 1: we don't check that the freed address is invalid ; We assume that
+	// the kernel code that called this doesn't mess up its addresses and sizes
+	// Note 2: Bounds are checked by isAllocated
 
-	// Special case: we need to apply both masks in the same uint64
-	if (start_index == end_index){
-		allocator->bitmap[start_index] |= start_mask & end_mask;
+	// Check that we don't free stuff that's already free
+	if (!m_allocator.isAllocated(addr, n_pages)){
+		log(ERROR, MODULE, "PMM_freePages: double free or bogus pointer detected");
 		return;
 	}
 
-	allocator->bitmap[start_index] |= start_mask;
-	for (uint64_t i=start_index+1 ; i<end_index ; i++)
-		allocator->bitmap[i] = 0xffffffffffffffff;
-	if (index_in_last_uint64 != 0)
-		allocator->bitmap[end_index] |= end_mask;
+	m_allocator.freePages(addr, n_pages);
+	m_allocatedPages -= n_pages;
 }
 
-// Get the number of pages needed to store `size` bytes
-static inline uint64_t getSizeAsPages(size_t n_bytes){
-	// Note: Adding PAGE_SIZE-1 rounds the integer division up
-	return (n_bytes + PAGE_SIZE-1) / PAGE_SIZE;
+// Note: read without the lock, this is only an estimate
+static inline uint64_t getFreePages(){
+	return m_allocatablePages - m_allocatedPages;
+}
+
+// Request background reclaim if free memory is low
+static inline void checkWatermarks(){
+	if (getFreePages() < m_watermarks.low)
+		atomic_store_explicit(&m_reclaimRequested, true, memory_order_relaxed);
 }
 
-static uint64_t countFreeBlocks(struct BitmapAllocator* allocator){
-	uint64_t n_bits = 0;
-	uint64_t cur;
+// ================ Per-CPU page caches ================
+
+// Note: IRQs must be disabled
+static void refillPageCache(struct PMMPageCache* cache){
+	int node = PerCPU_getCPUInfoMember(node);
+	struct MCSNode lock_node;
 
-	for (uint64_t i=0 ; i<allocator->bitmapLength-1 ; i++){
-		cur = allocator->bitmap[i];
-		// Note: __builtin_popcountll counts the number of bits to 1 in the argument
-		n_bits += 64 - __builtin_popcountll(cur);
+	lockAllocator(&lock_node);
+	while (cache->count < PMM_PAGE_CACHE_BATCH){
+		paddr_t page = allocateLocked(1, 1, PMM_ZONE_NORMAL, NO_LIMIT, node);
+		if (page == (paddr_t) NULL)
+			break;
+
+		Page_fromAddress(page)->flags |= PAGE_FLAG_CACHED;
+		cache->pages[cache->count++] = page;
 	}
+	unlockAllocator(&lock_node);
 
-	// Last uint64 is special to parse: we need to ignore the last bits
-	cur = allocator->bitmap[allocator->bitmapLength-1];
-	int n_bits_remaining = allocator->nBlocks % 64;
-	if (n_bits_remaining == 0)
-		n_bits_remaining = 64;
+	checkWatermarks();
+}
 
-	for (int j=0 ; j<n_bits_remaining ; j++){
-		if ((cur & 0x8000000000000000) == 0)
-			n_bits++;
-		cur <<= 1;
+// Give back the `n_pages` oldest (i.e. coldest) pages of the cache to the allocator
+// Note: IRQs must be disabled
+static void drainPageCache(struct PMMPageCache* cache, int n_pages){
+	struct MCSNode lock_node;
+
+	lockAllocator(&lock_node);
+	// freeLocked rejects the pages that were double freed, while they were free in the allocator
+	for (int i=0 ; i<n_pages ; i++){
+		Page_fromAddress(cache->pages[i])->flags &= ~PAGE_FLAG_CACHED;
+		freeLocked(cache->pages[i], 1);
 	}
+	unlockAllocator(&lock_node);
 
-	return n_bits;
+	cache->count -= n_pages;
+	memmove(cache->pages, cache->pages + n_pages, cache->count * sizeof(paddr_t));
 }
 
-static bool isFullyAllocated(struct BitmapAllocator* allocator, uint64_t start_bit, uint64_t end_bit){
-	uint64_t cur;
+static paddr_t allocateCachedPage(){
+	unsigned long flags;
+	paddr_t page = (paddr_t) NULL;
 
-	if (start_bit >= end_bit) return false;
-	if (start_bit >= allocator->nBlocks) return false;
-	if (end_bit > allocator->nBlocks) return false;
+	IRQ_disableSave(flags);
+	struct PMMPageCache* cache = &PerCPU_getCPUInfo()->pageCache;
 
-	uint64_t start_index = start_bit / 64;
-	uint64_t end_index = end_bit / 64;
-	int index_in_first_uint64 = start_bit % 64;
-	int index_in_last_uint64 = end_bit % 64;
+	if (cache->count == 0)
+		refillPageCache(cache);
 
-	// Edge case: only one uint64 to check
-	if (start_index == end_index){
-		cur = allocator->bitmap[start_index] >> (64 - index_in_last_uint64);
-		for (uint64_t i=start_bit ; i<end_bit ; i++){
-			if ((cur & 1) == 0)
-				return false;
-			cur >>= 1;
-		}
-		return true;
+	if (cache->count > 0){
+		page = cache->pages[--cache->count];
+		Page_fromAddress(page)->flags &= ~PAGE_FLAG_CACHED;
 	}
 
-	// First uint64
-	if (index_in_first_uint64 != 0){
-		cur = allocator->bitmap[start_index];
-		start_index++;
-		for (int j=index_in_first_uint64 ; j<64 ; j++){
-			if ((cur & 1) == 0)
-				return false;
-			cur >>= 1;
-		}
-	}
-	// Middle
-	for (uint64_t i=start_index ; i<end_index-1 ; i++){
-		cur = allocator->bitmap[i];
-		if (cur != 0xffffffffffffffff)
-			return false;
+	IRQ_restore(flags);
+	return page;
+}
+
+static void freeCachedPage(paddr_t addr){
+	unsigned long flags;
+
+	if (!Page_isManaged(addr)){
+		log(ERROR, MODULE, "PMM_freePages: bogus pointer %#lx detected", addr);
+		return;
 	}
-	// Last uint64
-	cur = allocator->bitmap[end_index];
-	for (int j=0 ; j<index_in_last_uint64 ; j++){
-		if ((cur & 0x8000000000000000) == 0)
-			return false;
-		cur <<= 1;
+
+	// Note: a page freed again after it went back to the allocator is detected when the cache is
+	// drained (see freeLocked), if it wasn't allocated from it meanwhile. The backends can't tell
+	// whether a page is free without the lock, and taking it here would defeat the cache
+	IRQ_disableSave(flags);
+
+	struct Page* page = Page_fromAddress(addr);
+	if (page->flags & PAGE_FLAG_CACHED){
+		IRQ_restore(flags);
+		log(ERROR, MODULE, "PMM_freePages: double free detected (page %#lx)", addr);
+		return;
 	}
 
-	return true;
+	struct PMMPageCache* cache = &PerCPU_getCPUInfo()->pageCache;
+
+	if (cache->count == PMM_PAGE_CACHE_SIZE)
+		drainPageCache(cache, PMM_PAGE_CACHE_BATCH);
+
+	page->flags |= PAGE_FLAG_CACHED;
+	cache->pages[cache->count++] = addr;
+
+	IRQ_restore(flags);
 }
 
-static inline paddr_t allocate_firstFit(struct BitmapAllocator* allocator, uint64_t n_pages){
-	// Search for n_blocks consecutive free bits in the bitmap
-	uint64_t n_bits = 0; // consecutive free bits in the current sequence
-	uint64_t cur;
-
-	if (n_pages == 0)
-		return (paddr_t) NULL;
-
-	uint64_t i;
-	int j;
-	for (i=0 ; i<allocator->bitmapLength-1 ; i++){
-		cur = allocator->bitmap[i];
-		for (j=0 ; j<64 ; j++){
-			if ((cur & 0x8000000000000000) == 0)
-				n_bits++;
-			else
-				n_bits = 0;
-
-			if (n_bits == n_pages){
-				uint64_t end_idx = i*64 + j + 1;
-				uint64_t start_idx = end_idx - n_pages;
-				setBits(allocator, start_idx, end_idx);
-				return allocator->start + start_idx * PAGE_SIZE;
-			}
+// ================ Reclaim ================
 
-			cur <<= 1;
-		}
-	}
+// Give back all the pages of this CPU's cache to the allocator
+// Note: pages freed by the shrinkers land there, and would not count as free (nor merge into bigger blocks)
+static int drainLocalPageCache(){
+	unsigned long flags;
 
-	// Last uint64 is special to parse: we need to ignore the last bits
-	cur = allocator->bitmap[allocator->bitmapLength-1];
-	int n_bits_remaining = allocator->nBlocks % 64;
-	for (j=0 ; j<n_bits_remaining ; j++){
-		if ((cur & 0x8000000000000000) == 0)
-			n_bits++;
-		else
-			n_bits = 0;
-
-		if (n_bits == n_pages){
-			uint64_t end_idx = i*64 + j + 1;
-			uint64_t start_idx = end_idx - n_pages;
-			setBits(allocator, start_idx, end_idx);
-			return allocator->start + start_idx * PAGE_SIZE;
-		}
+	IRQ_disableSave(flags);
+	struct PMMPageCache* cache = &PerCPU_getCPUInfo()->pageCache;
+	int n_pages = cache->count;
+	drainPageCache(cache, n_pages);
+	IRQ_restore(flags);
+
+	return n_pages;
+}
+
+static inline bool canReclaim(){
+	return PerCPU_getCPUInfoMember(noReclaim) == 0;
+}
+
+// Call the shrinkers, until `n_pages` pages are freed or they have nothing left to free
+static uint64_t shrink(uint64_t n_pages){
+	uint64_t freed = 0;
+
+	// The shrinkers' own allocations must not reclaim (and re-enter them)
+	PMM_disableReclaim();
+	for (int i=0 ; i<m_nShrinkers && freed<n_pages ; i++)
+		freed += m_shrinkers[i](n_pages - freed);
+	PMM_enableReclaim();
+
+	return freed;
+}
+
+/// @brief Direct reclaim, for an allocation of `n_pages` that failed or is below the min watermark
+/// @return Whether some memory was given back to the allocator (i.e. the allocation is worth retrying)
+/// @note The allocator must not be locked
+static bool reclaimDirect(uint64_t n_pages){
+	if (!canReclaim())
+		return false;
+
+	uint64_t freed = shrink(max(n_pages, (uint64_t) PMM_PAGE_CACHE_BATCH));
+	int drained = drainLocalPageCache();
 
-		cur <<= 1;
+	return freed > 0 || drained > 0;
+}
+
+// Compute the watermarks from the amount of allocatable memory
+static void setWatermarks(){
+	// min is 1/256 of the memory (within [128 KiB, 64 MiB]), low and high are 5/4 and 3/2 of it
+	m_watermarks.min = min(max(m_allocatablePages / 256, 32ul), 16384ul);
+	m_watermarks.low = m_watermarks.min + m_watermarks.min/4;
+	m_watermarks.high = m_watermarks.min + m_watermarks.min/2;
+}
+
+void PMM_registerShrinker(shrinker_t shrinker){
+	if (m_nShrinkers == PMM_MAX_SHRINKERS){
+		log(ERROR, MODULE, "Cannot register more than %d shrinkers", PMM_MAX_SHRINKERS);
+		return;
 	}
 
-	return (paddr_t) NULL;
+	m_shrinkers[m_nShrinkers++] = shrinker;
+}
+
+void PMM_disableReclaim(){
+	// The count is per-CPU: the thread must stay on this CPU until it enables reclaim back
+	Scheduler_disablePreemption();
+	PerCPU_addCPUInfoMember(noReclaim, 1);
+}
+
+void PMM_enableReclaim(){
+	PerCPU_addCPUInfoMember(noReclaim, -1);
+	Scheduler_enablePreemption();
+}
+
+void PMM_reclaim(){
+	if (!canReclaim())
+		return;
+	if (!atomic_exchange_explicit(&m_reclaimRequested, false, memory_order_relaxed))
+		return;
+
+	uint64_t free_pages = getFreePages();
+	if (free_pages >= m_watermarks.high)
+		return;
+
+	uint64_t freed = shrink(m_watermarks.high - free_pages);
+	drainLocalPageCache();
+
+	log(DEBUG, MODULE, "Reclaimed %lu pages (%lu free, watermarks %lu/%lu/%lu)", freed,
+		getFreePages(), m_watermarks.min, m_watermarks.low, m_watermarks.high);
 }
 
+uint64_t PMM_getFreePages(){
+	return getFreePages();
+}
+
+const struct PMMWatermarks* PMM_getWatermarks(){
+	return &m_watermarks;
+}
+
+// ================ Memory allocator ================
+
 paddr_t PMM_allocatePages(uint64_t n_pages){
-	return allocate_firstFit(&m_bitmapAllocator, n_pages);
+	if (n_pages != 1)
+		return PMM_allocateAlignedPages(n_pages, PAGE_SIZE);
+
+	if (getFreePages() < m_watermarks.min)
+		reclaimDirect(1);
+
+	paddr_t res = allocateCachedPage();
+	if (res == (paddr_t) NULL && reclaimDirect(1))
+		res = allocateCachedPage();
+
+	return res;
 }
 
-void PMM_freePages(paddr_t addr, uint64_t n_pages){
-	// Note 1: we don't check that the freed address is invalid ; We assume that
-	// the kernel code that called this doesn't mess up its addresses and sizes
-	// Note 2: Bounds are checked by both isFullyAllocated and clearBits
+// Allocate with IRQs disabled and the allocator locked
+static paddr_t tryAllocate(uint64_t n_pages, uint64_t alignment, enum PMMZoneType max_type,
+						   paddr_t limit, int node){
+	struct MCSNode lock_node;
+	unsigned long flags;
 
-	uint64_t start_bit = (addr - m_bitmapAllocator.start) / PAGE_SIZE;
-	uint64_t end_bit = start_bit + n_pages;
+	IRQ_disableSave(flags);
+	if (node < 0)
+		node = PerCPU_getCPUInfoMember(node);
 
-	// Check that we don't free stuff that's already free
-	if (!isFullyAllocated(&m_bitmapAllocator, start_bit, end_bit)){
-		log(ERROR, MODULE, "PMM_freePages: double free or bogus pointer detected");
+	lockAllocator(&lock_node);
+	paddr_t res = allocateLocked(n_pages, alignment, max_type, limit, node);
+	unlockAllocator(&lock_node);
+	IRQ_restore(flags);
+
+	return res;
+}
+
+// Allocate, reclaiming memory first if it is critically low, or if the allocation fails
+static paddr_t allocate(uint64_t n_pages, uint64_t alignment, enum PMMZoneType max_type,
+						paddr_t limit, int node){
+	if (getFreePages() < m_watermarks.min)
+		reclaimDirect(n_pages);
+
+	paddr_t res = tryAllocate(n_pages, alignment, max_type, limit, node);
+	if (res == (paddr_t) NULL && reclaimDirect(n_pages))
+		res = tryAllocate(n_pages, alignment, max_type, limit, node);
+
+	checkWatermarks();
+	return res;
+}
+
+paddr_t PMM_allocateAlignedPages(uint64_t n_pages, size_t alignment){
+	// Alignment must be a power of two, and a multiple of PAGE_SIZE
+	assert(alignment >= PAGE_SIZE && (alignment & (alignment-1)) == 0);
+
+	return allocate(n_pages, alignment / PAGE_SIZE, PMM_ZONE_NORMAL, NO_LIMIT, -1);
+}
+
+paddr_t PMM_allocateZonePages(uint64_t n_pages, enum PMMZoneType zone){
+	return allocate(n_pages, 1, zone, NO_LIMIT, -1);
+}
+
+paddr_t PMM_allocateLowPages(uint64_t n_pages, paddr_t limit){
+	return allocate(n_pages, 1, PMM_ZONE_NORMAL, limit, -1);
+}
+
+paddr_t PMM_allocateNodePages(uint64_t n_pages, int node){
+	return allocate(n_pages, 1, PMM_ZONE_NORMAL, NO_LIMIT, max(node, 0));
+}
+
+void PMM_freePages(paddr_t addr, uint64_t n_pages){
+	struct MCSNode lock_node;
+	unsigned long flags;
+
+	if (n_pages == 1){
+		freeCachedPage(addr);
 		return;
 	}
 
-	// Free the memory in the bitmap
-	clearBits(&m_bitmapAllocator, start_bit, end_bit);
+	IRQ_disableSave(flags);
+	lockAllocator(&lock_node);
+	freeLocked(addr, n_pages);
+	unlockAllocator(&lock_node);
+	IRQ_restore(flags);
 }
 
 // ================ Functions ================
 
 void PMM_printMemoryUsage(){
-	const uint64_t total = m_bitmapAllocator.allocatableBlocks * PAGE_SIZE;
-	const uint64_t used = m_bitmapAllocator.allocatedBlocks * PAGE_SIZE;
+	const uint64_t total = m_allocatablePages * PAGE_SIZE;
+	const uint64_t used = m_allocatedPages * PAGE_SIZE;
 	uint64_t per_ten_thousand = 10000 * used / total;
 
 	int magnitude_totalMem = getMagnitude(total);
@@ -295,17 +427,279 @@ void PMM_printMemoryUsage(){
 }
 
 void PMM_printPagesUsage(){
-	const uint64_t total = m_bitmapAllocator.allocatableBlocks;
-	const uint64_t used = m_bitmapAllocator.allocatedBlocks;
+	const uint64_t total = m_allocatablePages;
+	const uint64_t used = m_allocatedPages;
 
 	log(DEBUG, MODULE, "Pages usage: %lu / %lu", used, total);
 }
 
+// ================ Zones ================
+
+static inline enum PMMZoneType getZoneType(paddr_t addr){
+	if (addr < PMM_ZONE_DMA_END)
+		return PMM_ZONE_DMA;
+	if (addr < PMM_ZONE_DMA32_END)
+		return PMM_ZONE_DMA32;
+	return PMM_ZONE_NORMAL;
+}
+
+static inline paddr_t getZoneTypeEnd(enum PMMZoneType type){
+	switch (type){
+	case PMM_ZONE_DMA:		return PMM_ZONE_DMA_END;
+	case PMM_ZONE_DMA32:	return PMM_ZONE_DMA32_END;
+	default:				return NO_LIMIT;
+	}
+}
+
+static inline paddr_t getManagedEnd(){
+	return g_pagesStart + g_nPages*PAGE_SIZE;
+}
+
+/// @brief Append the range [start, end[ of node `node` to `zones`, cut at the zone types boundaries.
+/// Contiguous ranges of the same node and type are merged
+/// @return false if there is not enough room in `zones`
+static bool addZones(struct PMMZone* zones, int* n_zones, int node, paddr_t start, paddr_t end){
+	// Only keep the managed memory
+	start = max(start, g_pagesStart);
+	end = min(end, getManagedEnd());
+
+	while (start < end){
+		enum PMMZoneType type = getZoneType(start);
+		paddr_t cut = min(end, getZoneTypeEnd(type));
+		struct PMMZone* last = (*n_zones > 0) ? &zones[*n_zones - 1] : NULL;
+
+		if (last != NULL && last->node == node && last->type == type && last->end == start){
+			last->end = cut;
+		}
+		else {
+			if (*n_zones == PMM_MAX_ZONES)
+				return false;
+			zones[(*n_zones)++] = (struct PMMZone) {.type = type, .node = node, .start = start, .end = cut};
+		}
+
+		start = cut;
+	}
+
+	return true;
+}
+
+// Relative distance between two nodes (10 for the same node), from the ACPI SLIT if there is one
+static int getNodeDistance(int from, int to){
+	uint32_t from_domain = m_nodeDomains[from];
+	uint32_t to_domain = m_nodeDomains[to];
+
+	if (g_SLITPresent && from_domain < g_SLIT.nLocalities && to_domain < g_SLIT.nLocalities)
+		return g_SLIT.distances[from_domain*g_SLIT.nLocalities + to_domain];
+
+	return (from == to) ? 10 : 20;
+}
+
+// Order the zones of each node: zones of the node itself first, then of the other nodes by
+// distance. For each node, use the highest zone types first, to spare the DMA zones
+static void buildZoneLists(){
+	for (int node=0 ; node<m_nNodes ; node++){
+		int nodes[PMM_MAX_NODES];
+		int n_zones = 0;
+
+		// Insertion sort of the nodes by distance (the node itself always first)
+		for (int i=0 ; i<m_nNodes ; i++){
+			int distance = (i == node) ? 0 : getNodeDistance(node, i);
+			int j = i;
+			while (j > 0 && ((nodes[j-1] == node) ? 0 : getNodeDistance(node, nodes[j-1])) > distance){
+				nodes[j] = nodes[j-1];
+				j--;
+			}
+			nodes[j] = i;
+		}
+
+		for (int i=0 ; i<m_nNodes ; i++){
+			for (int type=PMM_ZONE_NORMAL ; type>=PMM_ZONE_DMA ; type--){
+				for (int zone=0 ; zone<m_nZones ; zone++){
+					if (m_zones[zone].node == nodes[i] && (int) m_zones[zone].type == type)
+						m_zoneLists[node][n_zones++] = zone;
+				}
+			}
+		}
+	}
+}
+
+static uint64_t countFreePages(){
+	uint64_t n_pages = 0;
+
+	for (int i=0 ; i<m_nZones ; i++)
+		n_pages += m_allocator.countFreePages(i);
+
+	return n_pages;
+}
+
+// Note: m_lock must be held, or the allocator not used yet
+static void setZones(const struct PMMZone* zones, int n_zones, int n_nodes){
+	m_allocator.setZones(zones, n_zones);
+
+	memcpy(m_zones, zones, n_zones * sizeof(struct PMMZone));
+	m_nZones = n_zones;
+	m_nNodes = n_nodes;
+	buildZoneLists();
+}
+
+// Get the node of an ACPI proximity domain, or -1 if it is unknown
+static int getNodeOfDomain(uint32_t domain){
+	for (int i=0 ; i<m_nNodes ; i++){
+		if (m_nodeDomains[i] == domain)
+			return i;
+	}
+
+	return -1;
+}
+
+/// @brief Build the zones from the ACPI SRAT memory ranges. Memory not described by the SRAT goes to node 0
+/// @return The number of zones, or -1 on failure
+static int getNUMAZones(struct PMMZone* zones){
+	const struct SRATEntry_MemoryAffinity* ranges = g_SRAT.memoryAffinities;
+	paddr_t cur = g_pagesStart;
+	int n_zones = 0;
+
+	// Give node IDs to the proximity domains, in the order they appear
+	m_nNodes = 0;
+	for (int i=0 ; i<g_SRAT.nMemoryAffinity ; i++){
+		if (!ranges[i].flags.bits.enabled || getNodeOfDomain(ranges[i].proximityDomain) >= 0)
+			continue;
+		if (m_nNodes == PMM_MAX_NODES){
+			log(WARNING, MODULE, "Too many NUMA nodes, only using the first %d", PMM_MAX_NODES);
+			break;
+		}
+		m_nodeDomains[m_nNodes++] = ranges[i].proximityDomain;
+	}
+
+	if (m_nNodes == 0)
+		return -1;
+
+	// Add the ranges in address order (the SRAT is not guaranteed to be sorted)
+	while (true){
+		int next = -1;
+		paddr_t next_start = NO_LIMIT;
+
+		for (int i=0 ; i<g_SRAT.nMemoryAffinity ; i++){
+			paddr_t start = ranges[i].baseAddress[0] | ((paddr_t) ranges[i].baseAddress[1] << 32);
+			paddr_t length = ranges[i].length[0] | ((paddr_t) ranges[i].length[1] << 32);
+			if (!ranges[i].flags.bits.enabled || start + length <= cur || start >= next_start)
+				continue;
+			next = i;
+			next_start = start;
+		}
+
+		if (next < 0)
+			break;
+
+		paddr_t length = ranges[next].length[0] | ((paddr_t) ranges[next].length[1] << 32);
+		paddr_t end = next_start + length;
+		int node = max(getNodeOfDomain(ranges[next].proximityDomain), 0);
+
+		// Fill the hole before the range, if any
+		if (!addZones(zones, &n_zones, 0, cur, next_start))
+			return -1;
+		if (!addZones(zones, &n_zones, node, max(cur, next_start), end))
+			return -1;
+		cur = end;
+	}
+
+	if (!addZones(zones, &n_zones, 0, cur, getManagedEnd()))
+		return -1;
+
+	return n_zones;
+}
+
+int PMM_getNodeOfAPIC(uint32_t apicID){
+	if (!g_SRATPresent || m_nNodes == 1)
+		return 0;
+
+	for (int i=0 ; i<g_SRAT.nLAPICAffinity ; i++){
+		const struct SRATEntry_LAPICAffinity* cur = &g_SRAT.LAPICAffinities[i];
+		if (!cur->flags.bits.enabled || cur->lapicID != apicID)
+			continue;
+
+		uint32_t domain = cur->proximityDomain_low | ((uint32_t) cur->proximityDomain_high[0] << 8)
+			| ((uint32_t) cur->proximityDomain_high[1] << 16)
+			| ((uint32_t) cur->proximityDomain_high[2] << 24);
+		return max(getNodeOfDomain(domain), 0);
+	}
+
+	for (int i=0 ; i<g_SRAT.nX2APICAffinity ; i++){
+		const struct SRATEntry_X2APICAffinity* cur = &g_SRAT.X2APICAffinities[i];
+		if (cur->flags.bits.enabled && cur->x2apicID == apicID)
+			return max(getNodeOfDomain(cur->proximityDomain), 0);
+	}
+
+	return 0;
+}
+
+void PMM_initNUMA(){
+	struct PMMZone zones[PMM_MAX_ZONES];
+	struct MCSNode lock_node;
+	unsigned long flags;
+
+	if (!g_SRATPresent){
+		log(INFO, MODULE, "No ACPI SRAT, not using NUMA");
+		return;
+	}
+
+	IRQ_disableSave(flags);
+	lockAllocator(&lock_node);
+
+	uint64_t free_pages = countFreePages();
+	int n_zones = getNUMAZones(zones);
+	if (n_zones < 0){
+		// Keep the current zones
+		m_nNodes = 1;
+		m_nodeDomains[0] = 0;
+		unlockAllocator(&lock_node);
+		IRQ_restore(flags);
+		log(WARNING, MODULE, "Could not build the NUMA zones from the ACPI SRAT, not using NUMA");
+		return;
+	}
+
+	setZones(zones, n_zones, m_nNodes);
+	assert(free_pages == countFreePages());
+
+	unlockAllocator(&lock_node);
+	IRQ_restore(flags);
+
+	for (int i=0 ; i<m_nZones ; i++){
+		log(DEBUG, MODULE, "Zone %d: node %d, %s, %#016lx-%#016lx", i, m_zones[i].node,
+			ZONE_TYPE_NAMES[m_zones[i].type], m_zones[i].start, m_zones[i].end);
+	}
+	log(SUCCESS, MODULE, "NUMA initialized (%d nodes, %d zones)", m_nNodes, m_nZones);
+}
+
 // ================ Initialization ================
 
-/// @brief Get the bitmap start address.
+static void getAllocator(struct PageAllocator* allocator){
+#if defined(PMM_BACKEND_BITMAP)
+	allocator->name = "bitmap";
+	allocator->getMetadataSize = BitmapAllocator_getMetadataSize;
+	allocator->init = BitmapAllocator_init;
+	allocator->setZones = BitmapAllocator_setZones;
+	allocator->addFreePages = BitmapAllocator_addFreePages;
+	allocator->allocatePages = BitmapAllocator_allocatePages;
+	allocator->freePages = BitmapAllocator_freePages;
+	allocator->isAllocated = BitmapAllocator_isAllocated;
+	allocator->countFreePages = BitmapAllocator_countFreePages;
+#else
+	allocator->name = "buddy";
+	allocator->getMetadataSize = BuddyAllocator_getMetadataSize;
+	allocator->init = BuddyAllocator_init;
+	allocator->setZones = BuddyAllocator_setZones;
+	allocator->addFreePages = BuddyAllocator_addFreePages;
+	allocator->allocatePages = BuddyAllocator_allocatePages;
+	allocator->freePages = BuddyAllocator_freePages;
+	allocator->isAllocated = BuddyAllocator_isAllocated;
+	allocator->countFreePages = BuddyAllocator_countFreePages;
+#endif
+}
+
+/// @brief Get the address of the first managed page.
 /// In the case where it would be 0, returns the next free page
-static paddr_t getBitmapStart(){
+static paddr_t getManagedStart(){
 	for (int i=0 ; i<g_memoryMap.size ; i++){
 		struct MemoryMapEntry* cur = g_memoryMap.entries + i;
 
@@ -376,43 +770,35 @@ static paddr_t earlyAllocate(struct limine_memmap_response* memmap, uint64_t n_p
 	panic();
 }
 
-static void initBitmap(struct BitmapAllocator* allocator, struct MemoryMap* memmap,
-					   paddr_t bitmap_addr_phys, uint64_t nPages){
-	// Note: Before calling initBitmap, start, nBlocks and allocatableBlocks needs to be set
-
-	allocator->bitmapLength = (allocator->nBlocks + 63) / 64;
+/// @brief Hand the usable memory regions to the allocator
+/// @param reserved_addr Start of a region that is already in use, to skip
+/// @return The number of free pages
+static uint64_t addFreeMemory(struct MemoryMap* memmap, paddr_t reserved_addr, uint64_t reserved_pages){
+	const paddr_t reserved_end = reserved_addr + reserved_pages*PAGE_SIZE;
+	uint64_t freePages = 0;
 
-	// Initialized bitmap with all regions used/reserved
-	memset(allocator->bitmap, 0xff, allocator->bitmapLength*sizeof(uint64_t));
-	allocator->allocatedBlocks = allocator->allocatableBlocks;
-
-	// Set the usable memory as free
-	int start_bit, end_bit;
-	uint64_t freeMemory = 0; // count free memory for verification
 	for (int i=0 ; i<memmap->size ; i++){
 		struct MemoryMapEntry* cur = &memmap->entries[i];
 		if (cur->type != MEMORY_USABLE)
 			continue;
 
-		freeMemory += cur->length;
+		paddr_t start = cur->address;
+		paddr_t end = cur->address + cur->length;
 
-		start_bit = (cur->address - allocator->start) / PAGE_SIZE;
-		end_bit = (cur->address - allocator->start + cur->length) / PAGE_SIZE;
-		clearBits(allocator, start_bit, end_bit);
+		// Add the parts of the region before and after the reserved one
+		paddr_t before_end = min(end, reserved_addr);
+		paddr_t after_start = max(start, reserved_end);
+		if (start < before_end){
+			m_allocator.addFreePages(start, (before_end - start) / PAGE_SIZE);
+			freePages += (before_end - start) / PAGE_SIZE;
+		}
+		if (after_start < end){
+			m_allocator.addFreePages(after_start, (end - after_start) / PAGE_SIZE);
+			freePages += (end - after_start) / PAGE_SIZE;
+		}
 	}
 
-	// Assert that we didn't mess up anything
-	uint64_t freeBlocks = countFreeBlocks(allocator);
-	assert(allocator->allocatedBlocks == allocator->allocatableBlocks - freeBlocks);
-	assert(freeMemory == PAGE_SIZE * freeBlocks);
-
-	// From now, we can mark as used the memory that we earlyAllocated
-	start_bit = (bitmap_addr_phys - allocator->start) / PAGE_SIZE;
-	end_bit = start_bit + nPages;
-	setBits(allocator, start_bit, end_bit);
-
-	// Verify that we removed 'nPages' bits
-	assert(freeBlocks - nPages == countFreeBlocks(allocator));
+	return freePages;
 }
 
 void PMM_init(){
@@ -421,24 +807,41 @@ void PMM_init(){
 		panic();
 	}
 
+	getAllocator(&m_allocator);
+
 	// Compute allocator sizes
 	// Note: we add 1 because from @start to the n-th page, there is n-1 pages
-	m_bitmapAllocator.start = getBitmapStart();
-	m_bitmapAllocator.allocatableBlocks = getAllocatableBlocks();
-	m_bitmapAllocator.nBlocks =
-		((g_memoryMap.lastUsablePage - m_bitmapAllocator.start) / PAGE_SIZE) + 1;
-
-	// Allocate memory for the bitmap
-	size_t bitmapSize = (m_bitmapAllocator.nBlocks + 7) / 8; // Note: +7 rounds the division up
-	uint64_t n_pages = getSizeAsPages(bitmapSize);
+	g_pagesStart = getManagedStart();
+	g_nPages = ((g_memoryMap.lastUsablePage - g_pagesStart) / PAGE_SIZE) + 1;
+	m_allocatablePages = getAllocatableBlocks();
+
+	// Allocate memory for the memmap and the allocator's metadata
+	uint64_t memmap_pages = getSizeAsPages(g_nPages * sizeof(struct Page));
+	uint64_t metadata_pages = getSizeAsPages(m_allocator.getMetadataSize(g_nPages));
+	uint64_t n_pages = memmap_pages + metadata_pages;
 	paddr_t allocated = earlyAllocate(g_memmapReq.response, n_pages);
+	// Note: usable memory is direct-mapped in the HHDM, by the bootloader and then by the VMM
 	vaddr_t allocated_virt = VMM_toHHDM(allocated);
-	VMM_premap(allocated, allocated_virt, n_pages, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
-	m_bitmapAllocator.bitmap = (uint64_t*) allocated_virt;
 
-	initBitmap(&m_bitmapAllocator, &g_memoryMap, allocated, n_pages);
+	g_pages = (struct Page*) allocated_virt;
+	memset(g_pages, 0, g_nPages * sizeof(struct Page));
+
+	// Initialize the allocator with all regions used/reserved, then set the usable memory
+	// as free (except what we just earlyAllocated)
+	// Until PMM_initNUMA, everything is on node 0
+	struct PMMZone zones[3];
+	int n_zones = 0;
+	addZones(zones, &n_zones, 0, g_pagesStart, getManagedEnd());
+	m_allocator.init((void*) (allocated_virt + memmap_pages*PAGE_SIZE), g_pagesStart, g_nPages);
+	setZones(zones, n_zones, 1);
+	uint64_t freePages = addFreeMemory(&g_memoryMap, allocated, n_pages);
+	m_allocatedPages = m_allocatablePages - freePages;
+	setWatermarks();
+
+	// Assert that we didn't mess up anything
+	assert(freePages == countFreePages());
 
 	PMM_printMemoryUsage();
-	log(SUCCESS, MODULE, "Initialization success (managing %lu pages, %lu allocatable)",
-		m_bitmapAllocator.nBlocks, m_bitmapAllocator.allocatableBlocks);
+	log(SUCCESS, MODULE, "Initialization success (%s allocator, managing %lu pages, %lu allocatable)",
+		m_allocator.name, g_nPages, m_allocatablePages);
 }
@@ -1,21 +1,123 @@
 #ifndef __PMM_H__
 #define __PMM_H__
 
+#include <stddef.h>
 #include "Memory/Memory.h"
 
 // PMM.h: Physical Memory Manager
+// The allocator backend is selected at compile time: buddy allocator by default,
+// or first-fit bitmap allocator if PMM_BACKEND_BITMAP is defined
+
+// Physical memory is split in zones: contiguous ranges of memory of a given type, on a given
+// NUMA node. Allocations prefer the current CPU's node, and the highest zone type allowed
+enum PMMZoneType {
+	PMM_ZONE_DMA,		// Below 16 MiB (ISA DMA)
+	PMM_ZONE_DMA32,		// Below 4 GiB (32-bit DMA)
+	PMM_ZONE_NORMAL,
+};
+
+#define PMM_ZONE_DMA_END		0x0000000001000000
+#define PMM_ZONE_DMA32_END		0x0000000100000000
+
+#define PMM_MAX_NODES			8
+#define PMM_MAX_ZONES			32
+
+struct PMMZone {
+	enum PMMZoneType type;
+	int node;
+	paddr_t start;
+	paddr_t end;
+};
+
+// Per-CPU cache of free pages (see struct CPUInfo), serving single-page allocations without
+// touching the global allocator. It is refilled from, and drained to it, by batches
+#define PMM_PAGE_CACHE_SIZE		64
+#define PMM_PAGE_CACHE_BATCH	16
+
+struct PMMPageCache {
+	int count;
+	paddr_t pages[PMM_PAGE_CACHE_SIZE];
+};
+
+// Free memory watermarks, in pages. Below `low`, background reclaim is requested (see
+// PMM_reclaim), and it frees memory until there is `high` free pages again. Below `min`,
+// allocations reclaim memory themselves before being served
+struct PMMWatermarks {
+	uint64_t min;
+	uint64_t low;
+	uint64_t high;
+};
+
+#define PMM_MAX_SHRINKERS		4
+
+/// @brief Function that frees some memory under memory pressure (e.g. emptying caches)
+/// @param n_pages The number of pages it should try to free
+/// @return The number of pages actually freed
+/// @note It may be called from within any allocation that allows reclaim (see
+/// `PMM_disableReclaim`): it must not allocate memory from the PMM, and may only wait on locks
+/// that are never held across such an allocation
+typedef uint64_t (*shrinker_t)(uint64_t n_pages);
 
 void PMM_init();
 
+/// @brief Split the zones per NUMA node, using the ACPI SRAT and SLIT tables
+/// @note ACPI must have been initialized beforehand
+void PMM_initNUMA();
+
+/// @brief Get the NUMA node of a CPU
+/// @param apicID The local APIC ID of the CPU
+int PMM_getNodeOfAPIC(uint32_t apicID);
+
 /// @brief Allocate `n_pages` contiguous physical pages
 /// @return The start address of the allocated block
 paddr_t PMM_allocatePages(uint64_t n_pages);
 
+/// @brief Allocate `n_pages` contiguous physical pages, the first one being aligned on `alignment`
+/// bytes. Use it to get blocks that can be mapped with huge pages (e.g. with `SIZE_2MB`, `SIZE_1GB`)
+/// @param alignment Power of two, multiple of `PAGE_SIZE`
+/// @return The start address of the allocated block
+paddr_t PMM_allocateAlignedPages(uint64_t n_pages, size_t alignment);
+
+/// @brief Allocate `n_pages` contiguous physical pages, in a zone of type `zone` or lower.
+/// Use it for devices with DMA addressing limitations (e.g. `PMM_ZONE_DMA32`)
+/// @return The start address of the allocated block
+paddr_t PMM_allocateZonePages(uint64_t n_pages, enum PMMZoneType zone);
+
+/// @brief Allocate `n_pages` contiguous physical pages, that all are below the `limit` address.
+/// Use it for memory with strict addressing constraints (e.g. real-mode code below 1 MiB)
+/// @return The start address of the allocated block
+paddr_t PMM_allocateLowPages(uint64_t n_pages, paddr_t limit);
+
+/// @brief Allocate `n_pages` contiguous physical pages, preferably on the NUMA node `node`
+/// @return The start address of the allocated block
+paddr_t PMM_allocateNodePages(uint64_t n_pages, int node);
+
 /// @brief Free pages allocated by `PMM_allocatePages`
 /// @param addr Address returned by `PMM_allocatePages`
 /// @param n_pages Number of pages that were allocated (passed to `PMM_allocatePages`)
 void PMM_freePages(paddr_t addr, uint64_t n_pages);
 
+/// @brief Register a shrinker, that will be called to reclaim memory when it gets low
+void PMM_registerShrinker(shrinker_t shrinker);
+
+/// @brief Forbid direct reclaim in this CPU's allocations, until PMM_enableReclaim is called.
+/// Use it around allocations made by code the shrinkers could re-enter (e.g. the slab allocator).
+/// Calls can be nested. Preemption is disabled until then (see `Scheduler_disablePreemption`)
+void PMM_disableReclaim();
+
+/// @brief Allow back direct reclaim, after PMM_disableReclaim
+void PMM_enableReclaim();
+
+/// @brief Background reclaim: if free memory went below the low watermark since the last call,
+/// call the shrinkers to get back to the high watermark. Call it when the CPU is idle
+void PMM_reclaim();
+
+/// @brief Get the number of free pages (the ones in the per-CPU caches excluded)
+uint64_t PMM_getFreePages();
+
+/// @brief Get the free memory watermarks
+const struct PMMWatermarks* PMM_getWatermarks();
+
 /// @brief Pretty-print the physical memory usage.
 void PMM_printMemoryUsage();
 
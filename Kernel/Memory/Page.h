@@ -0,0 +1,69 @@
+#ifndef __PAGE_H__
+#define __PAGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "mugOS/List.h"
+#include "Memory/Memory.h"
+
+// Page.h: Physical page descriptors
+// The PMM keeps one `struct Page` per physical page it manages, in the `g_pages` array (memmap)
+
+struct Page {
+	union {
+		// Used by the current owner of the page (e.g. the buddy allocator's free lists)
+		lnode_t node;
+		// Slab allocator (PAGE_FLAG_SLAB): slab the page belongs to, and its cache
+		struct {
+			void* slab;
+			void* cache;
+		};
+	};
+	uint16_t flags;
+	// Buddy allocator: order of the free block this page is the head of
+	uint8_t order;
+	// Copy-on-write: number of address spaces mapping the page, besides the first one
+	atomic_uint shares;
+};
+
+#define PAGE_FLAG_BUDDY			0x0001 // Page is the head of a free buddy block
+#define PAGE_FLAG_CACHED		0x0002 // Page is free, in a per-CPU page cache
+#define PAGE_FLAG_SLAB			0x0004 // Page holds slab objects
+
+extern struct Page* g_pages;
+extern paddr_t g_pagesStart; // Physical address of the page described by g_pages[0]
+extern uint64_t g_nPages; // Number of entries in g_pages
+
+static inline bool Page_isManaged(paddr_t addr){
+	return addr >= g_pagesStart && (addr - g_pagesStart) / PAGE_SIZE < g_nPages;
+}
+
+static inline struct Page* Page_fromAddress(paddr_t addr){
+	return g_pages + (addr - g_pagesStart) / PAGE_SIZE;
+}
+
+static inline paddr_t Page_toAddress(struct Page* page){
+	return g_pagesStart + (paddr_t)(page - g_pages) * PAGE_SIZE;
+}
+
+/// @brief Add a reference to a page mapped by one more address space
+static inline void Page_share(struct Page* page){
+	atomic_fetch_add_explicit(&page->shares, 1, memory_order_relaxed);
+}
+
+/// @brief Drop a reference to a page, from an address space that doesn't map it anymore
+/// @return false if it wasn't shared: the caller was its last user, and should free it
+static inline bool Page_unshare(struct Page* page){
+	unsigned int shares = atomic_load_explicit(&page->shares, memory_order_relaxed);
+
+	while (shares > 0){
+		if (atomic_compare_exchange_weak_explicit(&page->shares, &shares, shares - 1,
+				memory_order_acq_rel, memory_order_relaxed))
+			return true;
+	}
+
+	return false;
+}
+
+#endif
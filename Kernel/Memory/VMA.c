@@ -0,0 +1,355 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include "string.h"
+#include "mugOS/Preprocessor.h"
+#include "mugOS/List.h"
+#include "mugOS/SlabAllocator.h"
+#include "Logging.h"
+#include "Panic.h"
+#include "Memory/PMM.h"
+#include "Memory/VMM.h"
+#include "Memory/Page.h"
+#include "Time/Time.h"
+#include "Scheduler/Scheduler.h"
+#include "Sync/Mutex.h"
+#include "HAL/IRQ/IrqFlags.h"
+
+#include "VMA.h"
+#define MODULE "VMA"
+
+#define VMA_DESTROY_CHUNK		64 // Pages unmapped per TLB flush when destroying a VMA
+
+static cache_t* m_vmasCache;
+// Serializes the collapse passes: concurrent ones would copy the same ranges, only for all but one
+// copy to be thrown away
+static mutex_t m_collapseMutex = MUTEX_INIT(m_collapseMutex, "VMA collapse");
+
+// ================ VMAs list ================
+
+static inline void lock(struct AddressSpace* space){
+	Spinlock_lock(&space->vmaLock);
+}
+
+static inline void unlock(struct AddressSpace* space){
+	Spinlock_unlock(&space->vmaLock);
+}
+
+// Note: the space's lock must be held
+static struct VMA* findVMA(struct AddressSpace* space, vaddr_t addr){
+	lnode_t* node;
+
+	List_foreach(&space->vmas, node){
+		struct VMA* vma = List_getObject(node, struct VMA, lnode);
+		if (addr >= vma->start && addr < vma->end)
+			return vma;
+	}
+
+	return NULL;
+}
+
+// Note: the space's lock must be held
+static bool overlaps(struct AddressSpace* space, vaddr_t start, vaddr_t end){
+	lnode_t* node;
+
+	List_foreach(&space->vmas, node){
+		struct VMA* vma = List_getObject(node, struct VMA, lnode);
+		if (start < vma->end && vma->start < end)
+			return true;
+	}
+
+	return false;
+}
+
+// ================ Demand paging ================
+
+/// @brief Allocate a zeroed page, and map it at `virt` (unless another CPU did it first)
+/// @return false if we are out of memory
+static bool populatePage(struct AddressSpace* space, vaddr_t virt, int page_flags){
+	paddr_t page = PMM_allocatePages(1);
+	if (page == (paddr_t) NULL)
+		return false;
+
+	memset((void*) VMM_toHHDM(page), 0, PAGE_SIZE);
+	if (!Paging_mapPage(space, page, virt, page_flags))
+		PMM_freePages(page, 1);
+
+	return true;
+}
+
+/// @brief Allocate a zeroed 2MB page, and map it at `virt` (2MB aligned)
+/// @return false if there is no free aligned block, or if part of the range is already mapped
+static bool populateHugePage(struct AddressSpace* space, vaddr_t virt, int page_flags){
+	if (!Paging_canMapHugePage(space, virt))
+		return false;
+
+	// Only take readily available blocks: reclaiming memory for them isn't worth it
+	PMM_disableReclaim();
+	paddr_t page = PMM_allocateAlignedPages(SIZE_2MB / PAGE_SIZE, SIZE_2MB);
+	PMM_enableReclaim();
+	if (page == (paddr_t) NULL)
+		return false;
+
+	memset((void*) VMM_toHHDM(page), 0, SIZE_2MB);
+	if (!Paging_mapHugePage(space, page, virt, page_flags)){
+		PMM_freePages(page, SIZE_2MB / PAGE_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+// Populate the non-present pages of the aligned window around `addr` (best effort)
+static void faultAround(struct AddressSpace* space, struct VMA* vma, vaddr_t addr){
+	constexpr uint64_t window_size = VMA_FAULT_AROUND_PAGES * PAGE_SIZE;
+	vaddr_t start = max(vma->start, addr & ~(window_size - 1));
+	vaddr_t end = min(vma->end, (addr & ~(window_size - 1)) + window_size);
+	paddr_t phys;
+
+	for (vaddr_t virt=start ; virt<end ; virt+=PAGE_SIZE){
+		if (virt == addr || Paging_toPhysical(space, virt, &phys))
+			continue;
+		if (!populatePage(space, virt, vma->pageFlags))
+			return;
+	}
+}
+
+// Note: the space's lock must be held
+static bool handleFault(struct AddressSpace* space, vaddr_t addr, int access){
+	struct VMA* vma = findVMA(space, addr);
+	if (vma == NULL)
+		return false;
+
+	// Check the access rights
+	if ((access & PAGE_WRITE) && !(vma->pageFlags & PAGE_WRITE))
+		return false;
+	if ((access & PAGE_EXEC) && !(vma->pageFlags & PAGE_EXEC))
+		return false;
+	if ((access & PAGE_USER) && !(vma->pageFlags & PAGE_USER))
+		return false;
+
+	// Use a huge page if its whole range is in the VMA
+	vaddr_t huge = addr & ~(SIZE_2MB - 1);
+	bool fits = (huge >= vma->start && huge + SIZE_2MB <= vma->end);
+	if (fits && !(vma->flags & VMA_NO_HUGE_PAGES) && populateHugePage(space, huge, vma->pageFlags))
+		return true;
+
+	if (!populatePage(space, addr, vma->pageFlags)){
+		log(ERROR, MODULE, "Out of memory while populating page %#lx", addr);
+		return false;
+	}
+
+	if (vma->flags & VMA_FAULT_AROUND)
+		faultAround(space, vma, addr);
+
+	return true;
+}
+
+// ================ Huge pages collapse ================
+
+// Find the first 2MB range at or after `cursor` that is entirely in a VMA of `space`
+// @return false if there is none
+static bool findHugeRange(struct AddressSpace* space, vaddr_t cursor, vaddr_t* huge){
+	unsigned long irq_flags;
+	lnode_t* node;
+	bool found = false;
+
+	IRQ_disableSave(irq_flags);
+	lock(space);
+	List_foreach(&space->vmas, node){
+		struct VMA* vma = List_getObject(node, struct VMA, lnode);
+		if (vma->flags & VMA_NO_HUGE_PAGES)
+			continue;
+
+		vaddr_t base = max(cursor, vma->start);
+		vaddr_t start = (base + SIZE_2MB - 1) & ~(SIZE_2MB - 1);
+		if (start >= base && start + SIZE_2MB <= vma->end && (!found || start < *huge)){
+			*huge = start;
+			found = true;
+		}
+	}
+	unlock(space);
+	IRQ_restore(irq_flags);
+
+	return found;
+}
+
+// Replace the 4KB pages of the 2MB range `virt` by a huge page, if they are all populated
+static void collapseRange(struct AddressSpace* space, vaddr_t virt){
+	struct TLBBatch batch;
+	unsigned long irq_flags;
+
+	// The pages must not be modified while they are copied
+	if (!Paging_prepareCollapse(space, virt))
+		return;
+
+	paddr_t huge = PMM_allocateAlignedPages(SIZE_2MB / PAGE_SIZE, SIZE_2MB);
+	if (huge == (paddr_t) NULL)
+		return;
+
+	// The VMA must still be there: otherwise, its pages may have been reused by now
+	Paging_initTLBBatch(&batch, space);
+	IRQ_disableSave(irq_flags);
+	lock(space);
+	struct VMA* vma = findVMA(space, virt);
+	bool collapsed = (vma != NULL && virt + SIZE_2MB <= vma->end &&
+		Paging_collapse(space, virt, huge, &batch));
+	unlock(space);
+	IRQ_restore(irq_flags);
+
+	Paging_flushTLBBatch(&batch);
+	if (!collapsed)
+		PMM_freePages(huge, SIZE_2MB / PAGE_SIZE);
+}
+
+// ================ Public API ================
+
+void VMA_init(){
+	m_vmasCache = Cache_create("vmas", sizeof(struct VMA), NULL);
+	if (m_vmasCache == NULL){
+		log(PANIC, MODULE, "Could not allocate the VMAs cache !");
+		panic();
+	}
+}
+
+struct VMA* VMA_create(struct AddressSpace* space, vaddr_t start, uint64_t n_pages, int page_flags,
+		int flags){
+	unsigned long irq_flags;
+
+	if (n_pages == 0 || getOffset(start) != 0)
+		return NULL;
+
+	struct VMA* vma = Cache_malloc(m_vmasCache);
+	if (vma == NULL)
+		return NULL;
+
+	vma->start = start;
+	vma->end = start + n_pages*PAGE_SIZE;
+	vma->pageFlags = page_flags;
+	vma->flags = flags;
+
+	IRQ_disableSave(irq_flags);
+	lock(space);
+	bool overlapping = overlaps(space, vma->start, vma->end);
+	if (!overlapping)
+		List_pushBack(&space->vmas, &vma->lnode);
+	unlock(space);
+	IRQ_restore(irq_flags);
+
+	if (overlapping){
+		Cache_free(m_vmasCache, vma);
+		return NULL;
+	}
+
+	return vma;
+}
+
+void VMA_destroy(struct AddressSpace* space, struct VMA* vma){
+	struct TLBBatch batch;
+	struct PhysicalRange pages[VMA_DESTROY_CHUNK];
+	unsigned long irq_flags;
+
+	// Once removed, no fault can populate it anymore
+	IRQ_disableSave(irq_flags);
+	lock(space);
+	List_pop(&space->vmas, &vma->lnode);
+	unlock(space);
+	IRQ_restore(irq_flags);
+
+	// Unmap the populated pages by chunks, and release them once they are invalidated
+	// Note: they may be shared copy-on-write with other address spaces
+	Paging_initTLBBatch(&batch, space);
+	vaddr_t virt = vma->start;
+	while (virt < vma->end){
+		int n_pages = 0;
+		for ( ; virt<vma->end && n_pages<VMA_DESTROY_CHUNK ; virt+=PAGE_SIZE){
+			if (!Paging_unmapPage(virt, &batch, &pages[n_pages]))
+				continue;
+			// Skip the rest of a huge page
+			virt = (virt & ~(pages[n_pages].length - 1)) + pages[n_pages].length - PAGE_SIZE;
+			n_pages++;
+		}
+		Paging_flushTLBBatch(&batch);
+
+		for (int i=0 ; i<n_pages ; i++){
+			if (!Page_unshare(Page_fromAddress(pages[i].address)))
+				PMM_freePages(pages[i].address, pages[i].length / PAGE_SIZE);
+		}
+	}
+
+	Cache_free(m_vmasCache, vma);
+}
+
+bool VMA_cloneAll(struct AddressSpace* dst, struct AddressSpace* src){
+	unsigned long irq_flags;
+	lnode_t* node;
+	bool success = true;
+
+	IRQ_disableSave(irq_flags);
+	lock(src);
+	List_foreach(&src->vmas, node){
+		struct VMA* vma = List_getObject(node, struct VMA, lnode);
+		struct VMA* copy = Cache_malloc(m_vmasCache);
+		if (copy == NULL){
+			success = false;
+			break;
+		}
+
+		*copy = *vma;
+		List_pushBack(&dst->vmas, &copy->lnode);
+	}
+	unlock(src);
+	IRQ_restore(irq_flags);
+
+	return success;
+}
+
+void VMA_freeAll(struct AddressSpace* space){
+	while (!List_isEmpty(&space->vmas)){
+		struct VMA* vma = List_getObject(space->vmas.head, struct VMA, lnode);
+		List_popFront(&space->vmas);
+		Cache_free(m_vmasCache, vma);
+	}
+}
+
+void VMA_collapse(struct AddressSpace* space){
+	vaddr_t huge;
+	vaddr_t cursor = 0;
+
+	Mutex_lock(&m_collapseMutex);
+	while (findHugeRange(space, cursor, &huge)){
+		collapseRange(space, huge);
+		cursor = huge + SIZE_2MB;
+	}
+	Mutex_unlock(&m_collapseMutex);
+}
+
+static void collapseThread(void*){
+	while (true){
+		sleep(VMA_COLLAPSE_PERIOD);
+		VMA_collapse(&g_kernelAddressSpace);
+	}
+}
+
+void VMA_startCollapseThread(){
+	if (Scheduler_createThread("vma collapse", collapseThread, NULL) == NULL)
+		log(ERROR, MODULE, "Could not start the collapse thread, huge pages won't be collapsed");
+}
+
+bool VMA_handleFault(vaddr_t addr, int access){
+	struct AddressSpace* space;
+	unsigned long irq_flags;
+
+	if (VMM_isKernelAddress(addr))
+		space = &g_kernelAddressSpace;
+	else
+		space = Paging_getCurrentAddressSpace();
+
+	// The lock keeps the VMA from being destroyed meanwhile
+	IRQ_disableSave(irq_flags);
+	lock(space);
+	bool handled = handleFault(space, getPage(addr), access);
+	unlock(space);
+	IRQ_restore(irq_flags);
+
+	return handled;
+}
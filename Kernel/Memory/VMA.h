@@ -0,0 +1,63 @@
+#ifndef __VMA_H__
+#define __VMA_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mugOS/List.h"
+#include "Memory/Memory.h"
+#include "HAL/Memory/Paging.h"
+
+// VMA.h: Virtual Memory Areas, and demand paging
+// A VMA is a reserved range of an address space. Its pages are only allocated (and zeroed) when
+// they are first accessed, by the page fault handler: big reservations cost nothing until used.
+// Transparent huge pages: the aligned 2MB ranges of a VMA are populated with a huge page when the
+// PMM has a free aligned block, and `VMA_collapse` merges the fully populated ones afterwards
+
+#define VMA_FAULT_AROUND			0x00000001 // Also populate the neighbouring pages on faults
+#define VMA_NO_HUGE_PAGES			0x00000002 // Only use 4KB pages
+#define VMA_FAULT_AROUND_PAGES		16 // Size of the (aligned) window populated around a fault
+#define VMA_COLLAPSE_PERIOD			10 // Seconds between two passes of the collapse thread
+
+struct VMA {
+	vaddr_t start;
+	vaddr_t end;
+	int pageFlags; // Flags of its pages ; see the `PAGE_`-prefixed macros
+	int flags; // See the `VMA_`-prefixed macros
+	lnode_t lnode;
+};
+
+void VMA_init();
+
+/// @brief Reserve `n_pages` pages of `space` starting at `start`, populated on demand
+/// @param page_flags Flags to map the pages with ; see the `PAGE_`-prefixed macros
+/// @param flags See the `VMA_`-prefixed macros
+/// @return The VMA, or NULL if it overlaps another one, or on allocation failure
+struct VMA* VMA_create(struct AddressSpace* space, vaddr_t start, uint64_t n_pages, int page_flags,
+	int flags);
+
+/// @brief Remove a VMA from `space`, and unmap and free its populated pages
+void VMA_destroy(struct AddressSpace* space, struct VMA* vma);
+
+/// @brief Copy the VMAs of `src` into the (empty) `dst`, e.g. when cloning an address space
+/// @return false if we are out of memory ; the VMAs copied so far are left in `dst`
+bool VMA_cloneAll(struct AddressSpace* dst, struct AddressSpace* src);
+
+/// @brief Free all the VMAs of `space`, but not their pages (see `Paging_destroyAddressSpace`)
+void VMA_freeAll(struct AddressSpace* space);
+
+/// @brief Collapse the fully populated 2MB ranges of the VMAs of `space` into huge pages
+/// @note Slow (it copies the pages): call it in the background, from a thread. The passes are
+/// serialized
+void VMA_collapse(struct AddressSpace* space);
+
+/// @brief Start the kernel thread that collapses the kernel VMAs (see `VMA_collapse`) every
+/// `VMA_COLLAPSE_PERIOD` seconds. It sleeps in between: it doesn't compete with the other threads
+/// @note The scheduler must have been initialized
+void VMA_startCollapseThread();
+
+/// @brief Handle a page fault on a non-present page, by populating it if it is in a VMA
+/// @param access Type of the faulting access: PAGE_WRITE, PAGE_EXEC and PAGE_USER flags
+/// @return Whether the fault was handled ; false means the access is invalid
+bool VMA_handleFault(vaddr_t addr, int access);
+
+#endif
@@ -3,12 +3,13 @@
 #include "Panic.h"
 #include "Logging.h"
 #include "HAL/Memory/Paging.h"
+#include "Memory/VMA.h"
 
 #include "Memory/VMM.h"
 #define MODULE "Virtual memory manager"
 
-// HHDM: Higher Half Direct mapping. Used only before initialization.
-// Maps kernel code/data, framebuffers too
+// HHDM: Higher Half Direct mapping. Maps all the usable memory (page tables are accessed
+// through it), framebuffers too
 #define HHDM_BULLSHIT_VALUE 0xabcdeff00ffedcba
 static uint64_t m_hhdmOffset = HHDM_BULLSHIT_VALUE;
 
@@ -84,22 +85,64 @@ vaddr_t VMM_mapInHeap(paddr_t addr, uint64_t n_pages, int flags){
 
 // ================ Unmap memory ================
 
-void VMM_unmap(vaddr_t addr, uint64_t n_pages){
+bool VMM_unmap(vaddr_t addr, uint64_t n_pages){
 	return Paging_unmap(addr, n_pages);
 }
 
+// ================ Address spaces ================
+
+bool VMM_createAddressSpace(struct AddressSpace* space){
+	return Paging_createAddressSpace(space);
+}
+
+bool VMM_cloneAddressSpace(struct AddressSpace* dst, struct AddressSpace* src){
+	if (!Paging_cloneAddressSpace(dst, src))
+		return false;
+
+	if (!VMA_cloneAll(dst, src)){
+		VMM_destroyAddressSpace(dst);
+		return false;
+	}
+
+	return true;
+}
+
+void VMM_destroyAddressSpace(struct AddressSpace* space){
+	VMA_freeAll(space);
+	Paging_destroyAddressSpace(space);
+}
+
 // ================ Physical -> Virtual ================
 
 paddr_t VMM_toPhysical(vaddr_t addr){
-	// Special regions: direct mappings, easy
-	if (addr & (0xfffff00000000000)){
-		return addr & ~0xfffff00000000000;
+	paddr_t res;
+
+	// Heap structures: direct mapping, easy
+	if (addr >= m_hsdmOffset && addr < m_hsdmOffset + m_hsdmSize)
+		return addr - m_hsdmOffset;
+
+	// Other regions: walk the page tables
+	if (!Paging_toPhysical(&g_kernelAddressSpace, addr, &res)){
+		log(PANIC, MODULE, "VMM_toPhysical: address %#lx is not mapped", addr);
+		panic();
+	}
+
+	return res;
+}
+
+int VMM_toPhysicalRanges(vaddr_t addr, size_t length, struct PhysicalRange* ranges, int max_ranges){
+	if (length == 0)
+		return 0;
+
+	// Heap structures: physically contiguous
+	if (addr >= m_hsdmOffset && addr + length <= m_hsdmOffset + m_hsdmSize){
+		if (max_ranges < 1)
+			return -1;
+		ranges[0] = (struct PhysicalRange) { .address = addr - m_hsdmOffset, .length = length };
+		return 1;
 	}
 
-	// Not special regions (mapped with VMM_map)
-	// We need to find address in paging mappings
-	log(PANIC, MODULE, "Calling VMM_toPhysical on VMM_map-ed region is unimplemented");
-	panic();
+	return Paging_toPhysicalRanges(&g_kernelAddressSpace, addr, length, ranges, max_ranges);
 }
 
 // ================ Virtual -> Physical ================
@@ -1,6 +1,7 @@
 #ifndef __VMM_H__
 #define __VMM_H__
 
+#include <stddef.h>
 #include "Memory/Memory.h"
 #include "HAL/Memory/Paging.h"
 
@@ -10,6 +11,10 @@
 // They can be used safely with VMM_map
 #define VMM_KERNEL_MEMORY		toCanonical(1ul << (ADDRESS_SIZE-1))
 
+// Whether `addr` is in the kernel half of the address spaces (the canonical higher half, with
+// 4-level as well as 5-level paging)
+#define VMM_isKernelAddress(addr)	(((vaddr_t) (addr) & (1ul << 63)) != 0)
+
 void VMM_init();
 
 // ================ Map memory ================
@@ -31,13 +36,35 @@ vaddr_t VMM_mapInHeap(paddr_t addr, uint64_t n_pages, int flags);
 
 // ================ Unmap memory ================
 
-void VMM_unmap(vaddr_t addr, uint64_t n_pages);
+/// @brief Unmap `n_pages` pages starting at `addr` from the kernel tables
+/// @return false if we are out of memory to split a huge page (see `Paging_unmap`)
+bool VMM_unmap(vaddr_t addr, uint64_t n_pages);
+
+// ================ Address spaces ================
+
+/// @brief Create an empty user address space
+/// @return false if we are out of memory
+bool VMM_createAddressSpace(struct AddressSpace* space);
+
+/// @brief Create `dst` as a copy of `src` (e.g. for fork). The pages are shared copy-on-write:
+/// they are only copied when either address space writes to them
+/// @return false if we are out of memory
+bool VMM_cloneAddressSpace(struct AddressSpace* dst, struct AddressSpace* src);
+
+/// @brief Free an address space, its VMAs and its pages
+/// @note It must not be loaded on any CPU anymore
+void VMM_destroyAddressSpace(struct AddressSpace* space);
 
 // ================ Physical -> Virtual ================
 
-/// @brief Get the physical address from any virtual address
+/// @brief Get the physical address from any (mapped) virtual address
 paddr_t VMM_toPhysical(vaddr_t addr);
 
+/// @brief Translate a virtual buffer into a list of physically contiguous ranges (e.g. for DMA)
+/// @return The number of ranges written to `ranges`, or -1 if part of the buffer isn't mapped,
+/// or if it needs more than `max_ranges` ranges
+int VMM_toPhysicalRanges(vaddr_t addr, size_t length, struct PhysicalRange* ranges, int max_ranges);
+
 // ================ Virtual -> Physical ================
 
 /// @brief Get virtual address from HHDM-mapped physical address
@@ -0,0 +1,312 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include "string.h"
+#include "mugOS/Preprocessor.h"
+#include "mugOS/List.h"
+#include "mugOS/SlabAllocator.h"
+#include "Logging.h"
+#include "Panic.h"
+#include "Memory/PMM.h"
+#include "Memory/VMM.h"
+#include "Memory/Page.h"
+#include "Memory/VMA.h"
+#include "Sync/Spinlock.h"
+#include "HAL/IRQ/IrqFlags.h"
+
+#include "VMalloc.h"
+#define MODULE "vmalloc"
+
+// The virtual range is managed with a bitmap, one bit per page (set = in use).
+// Each allocation is followed by an unmapped guard page, to catch overflows
+
+#define N_BITS			(VMALLOC_SIZE / PAGE_SIZE)
+#define BITMAP_LENGTH	(N_BITS / 64)
+
+// An allocation. Its physical pages are chained through their `struct Page` node,
+// or populated on demand by its VMA (vreserve)
+struct VMArea {
+	vaddr_t start;
+	uint64_t n_pages; // Excluding the guard page
+	list_t pages;
+	struct VMA* vma; // NULL if not demand-paged
+	lnode_t area_lnode;
+};
+
+static uint64_t* m_bitmap; // bit i of the range is bit i%64 of m_bitmap[i/64]
+static uint64_t m_nextFreeHint; // every page before this one is in use
+static list_t m_areas = LIST_STATIC_INIT(m_areas);
+static cache_t* m_areasCache;
+static spinlock_t m_lock = SPINLOCK_INIT("VMalloc"); // Protects the bitmap and the areas list
+
+// ================ Virtual range ================
+
+static inline void lock(){
+	Spinlock_lock(&m_lock);
+}
+
+static inline void unlock(){
+	Spinlock_unlock(&m_lock);
+}
+
+/// @brief Find the first bit with value `value` in [start, end[
+/// @return Its index, or `end` if there is none
+static uint64_t findBit(uint64_t start, uint64_t end, bool value){
+	if (start >= end)
+		return end;
+
+	uint64_t index = start / 64;
+	// Make the bits we search for ones, and ignore the ones before start
+	uint64_t cur = (value ? m_bitmap[index] : ~m_bitmap[index]) & (~0ul << (start % 64));
+
+	while (cur == 0){
+		if (++index >= BITMAP_LENGTH)
+			return end;
+		cur = value ? m_bitmap[index] : ~m_bitmap[index];
+	}
+
+	return min(index*64 + __builtin_ctzll(cur), end);
+}
+
+static void setBits(uint64_t start, uint64_t end, bool value){
+	for (uint64_t i=start ; i<end ; i++){
+		if (value)
+			m_bitmap[i / 64] |= 1ul << (i % 64);
+		else
+			m_bitmap[i / 64] &= ~(1ul << (i % 64));
+	}
+}
+
+/// @brief Reserve `n_pages` consecutive pages of the range (first fit)
+/// @return The index of the first page, or N_BITS on failure
+/// @note m_lock must be held
+static uint64_t allocateRange(uint64_t n_pages){
+	uint64_t cur = m_nextFreeHint;
+
+	while (cur < N_BITS){
+		uint64_t start = findBit(cur, N_BITS, false);
+		if (N_BITS - start < n_pages)
+			return N_BITS;
+
+		uint64_t end = findBit(start, start + n_pages, true);
+		if (end == start + n_pages){
+			setBits(start, end, true);
+			if (start == m_nextFreeHint)
+				m_nextFreeHint = end;
+			return start;
+		}
+
+		cur = end;
+	}
+
+	return N_BITS;
+}
+
+// Note: m_lock must be held
+static void freeRange(uint64_t start, uint64_t n_pages){
+	setBits(start, start + n_pages, false);
+	m_nextFreeHint = min(m_nextFreeHint, start);
+}
+
+// Note: m_lock must be held
+static struct VMArea* findArea(vaddr_t addr){
+	lnode_t* node;
+
+	List_foreach(&m_areas, node){
+		struct VMArea* area = List_getObject(node, struct VMArea, area_lnode);
+		if (area->start == addr)
+			return area;
+	}
+
+	return NULL;
+}
+
+// ================ Physical pages ================
+
+// Unmap and free the pages of an area (that may be partially populated)
+static void releasePages(struct VMArea* area){
+	uint64_t n_mapped = 0;
+	lnode_t* node;
+
+	// The populated pages are the first ones: unmap them all at once, so that
+	// the TLB invalidations are batched
+	List_foreach(&area->pages, node)
+		n_mapped++;
+	if (n_mapped > 0)
+		VMM_unmap(area->start, n_mapped);
+
+	while (!List_isEmpty(&area->pages)){
+		struct Page* page = List_getObject(area->pages.head, struct Page, node);
+		List_popFront(&area->pages);
+		PMM_freePages(Page_toAddress(page), 1);
+	}
+}
+
+static bool populatePages(struct VMArea* area){
+	for (uint64_t i=0 ; i<area->n_pages ; i++){
+		paddr_t addr = PMM_allocatePages(1);
+		if (addr == (paddr_t) NULL)
+			return false;
+
+		VMM_map(addr, area->start + i*PAGE_SIZE, 1, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
+		List_pushBack(&area->pages, &Page_fromAddress(addr)->node);
+	}
+
+	return true;
+}
+
+// ================ Areas ================
+
+// Reserve a virtual range for `area` (and its guard page)
+static bool reserveArea(struct VMArea* area){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	lock();
+	uint64_t start = allocateRange(area->n_pages + 1);
+	unlock();
+	IRQ_restore(flags);
+
+	if (start == N_BITS)
+		return false;
+
+	area->start = VMALLOC_START + start*PAGE_SIZE;
+	return true;
+}
+
+static void releaseArea(struct VMArea* area){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	lock();
+	freeRange((area->start - VMALLOC_START) / PAGE_SIZE, area->n_pages + 1);
+	unlock();
+	IRQ_restore(flags);
+}
+
+static void addArea(struct VMArea* area){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	lock();
+	List_pushFront(&m_areas, &area->area_lnode);
+	unlock();
+	IRQ_restore(flags);
+}
+
+// ================ Public API ================
+
+void VMalloc_init(){
+	uint64_t n_pages = roundToPage(BITMAP_LENGTH * sizeof(uint64_t));
+
+	paddr_t bitmap = PMM_allocatePages(n_pages);
+	m_areasCache = Cache_create("vmalloc-areas", sizeof(struct VMArea), NULL);
+	if (bitmap == (paddr_t) NULL || m_areasCache == NULL){
+		log(PANIC, MODULE, "Could not allocate the vmalloc structures !");
+		panic();
+	}
+
+	m_bitmap = (uint64_t*) VMM_mapInHeap(bitmap, n_pages, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
+	memset(m_bitmap, 0, BITMAP_LENGTH * sizeof(uint64_t));
+	m_nextFreeHint = 0;
+
+	log(SUCCESS, MODULE, "Initialized, range %#lx-%#lx", VMALLOC_START, VMALLOC_END);
+}
+
+void* vmalloc(size_t size){
+	if (size == 0)
+		return NULL;
+
+	struct VMArea* area = Cache_malloc(m_areasCache);
+	if (area == NULL)
+		return NULL;
+
+	area->n_pages = roundToPage(size);
+	area->vma = NULL;
+	List_init(&area->pages);
+
+	if (!reserveArea(area)){
+		Cache_free(m_areasCache, area);
+		return NULL;
+	}
+
+	if (!populatePages(area)){
+		releasePages(area);
+		releaseArea(area);
+		Cache_free(m_areasCache, area);
+		return NULL;
+	}
+
+	addArea(area);
+	return (void*) area->start;
+}
+
+void* vreserve(size_t size){
+	if (size == 0)
+		return NULL;
+
+	struct VMArea* area = Cache_malloc(m_areasCache);
+	if (area == NULL)
+		return NULL;
+
+	area->n_pages = roundToPage(size);
+	List_init(&area->pages);
+
+	if (!reserveArea(area)){
+		Cache_free(m_areasCache, area);
+		return NULL;
+	}
+
+	area->vma = VMA_create(&g_kernelAddressSpace, area->start, area->n_pages,
+		PAGE_READ|PAGE_WRITE|PAGE_KERNEL, 0);
+	if (area->vma == NULL){
+		releaseArea(area);
+		Cache_free(m_areasCache, area);
+		return NULL;
+	}
+
+	addArea(area);
+	return (void*) area->start;
+}
+
+void vfree(void* ptr){
+	unsigned long flags;
+
+	if (ptr == NULL)
+		return;
+
+	IRQ_disableSave(flags);
+	lock();
+	struct VMArea* area = findArea((vaddr_t) ptr);
+	if (area != NULL)
+		List_pop(&m_areas, &area->area_lnode);
+	unlock();
+	IRQ_restore(flags);
+
+	if (area == NULL){
+		log(ERROR, MODULE, "vfree: double free or bogus pointer %p detected", ptr);
+		return;
+	}
+
+	if (area->vma != NULL)
+		VMA_destroy(&g_kernelAddressSpace, area->vma);
+	else
+		releasePages(area);
+
+	releaseArea(area);
+	Cache_free(m_areasCache, area);
+}
+
+size_t VMalloc_getSize(void* ptr){
+	unsigned long flags;
+	size_t size = 0;
+
+	IRQ_disableSave(flags);
+	lock();
+	struct VMArea* area = findArea((vaddr_t) ptr);
+	if (area != NULL)
+		size = area->n_pages * PAGE_SIZE;
+	unlock();
+	IRQ_restore(flags);
+
+	return size;
+}
@@ -0,0 +1,38 @@
+#ifndef __VMALLOC_H__
+#define __VMALLOC_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "Memory/Memory.h"
+
+// VMalloc.h: Virtually contiguous kernel memory allocator
+// Allocations are made of physically discontiguous pages, mapped in a dedicated virtual range.
+// Use it for big buffers, that don't need to be physically contiguous
+
+#define VMALLOC_START			0xffffe00000000000
+#define VMALLOC_SIZE			0x0000000100000000 // 4 GiB
+#define VMALLOC_END				(VMALLOC_START + VMALLOC_SIZE)
+
+#define VMalloc_isVMallocAddress(addr) \
+	((vaddr_t)(addr) >= VMALLOC_START && (vaddr_t)(addr) < VMALLOC_END)
+
+void VMalloc_init();
+
+/// @brief Allocate `size` bytes of virtually contiguous memory (rounded up to pages)
+/// @return A pointer to the allocated memory, or `NULL` on error
+void* vmalloc(size_t size);
+
+/// @brief Reserve `size` bytes of virtually contiguous memory, whose pages are only allocated (and
+/// zeroed) when first accessed
+/// @return A pointer to the reserved memory, or `NULL` on error
+/// @note The first access to each page faults: don't touch it with the PMM or paging locks held
+void* vreserve(size_t size);
+
+/// @brief Free memory allocated by `vmalloc` or `vreserve`
+void vfree(void* ptr);
+
+/// @brief Get the usable size of a `vmalloc` allocation
+/// @return The size in bytes, 0 if `ptr` wasn't returned by `vmalloc`
+size_t VMalloc_getSize(void* ptr);
+
+#endif
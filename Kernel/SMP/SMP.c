@@ -1,10 +1,15 @@
 #include "Logging.h"
+#include "mugOS/SlabAllocator.h"
+#include "Scheduler/Scheduler.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "HAL/Halt.h"
 
 #include "SMP.h"
 #define MODULE "SMP"
 
 void SMP_init(){
 	ArchSMP_init();
+	SlabAllocator_initCPUCaches(g_nCPUs);
 
 	log(INFO, MODULE, "Boostrap Processor is CPU#%d", SMP_getCpuId());
 	log(SUCCESS, MODULE, "Initialization success, found %d CPUs/threads", g_nCPUs);
@@ -13,3 +18,12 @@ void SMP_init(){
 void SMP_startCPUs(){
 	ArchSMP_startCPUs();
 }
+
+void SMP_runAP(){
+	// This context becomes the AP's idle thread
+	Scheduler_initCPU();
+	IRQ_enable();
+
+	while (true)
+		halt();
+}
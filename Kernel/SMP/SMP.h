@@ -7,6 +7,10 @@
 void SMP_init();
 void SMP_startCPUs();
 
+/// @brief Run the current AP, once its architecture specific initialization is done
+[[noreturn]]
+void SMP_runAP();
+
 #define SMP_getCpuId() PerCPU_getCpuId()
 
 #endif
@@ -0,0 +1,543 @@
+#include <stddef.h>
+#include <stdatomic.h>
+#include "string.h"
+#include "stdlib.h"
+#include "mugOS/SlabAllocator.h"
+#include "Logging.h"
+#include "Panic.h"
+#include "Memory/VMalloc.h"
+#include "Time/Time.h"
+#include "Time/Timer.h"
+#include "IRQ/IRQ.h"
+#include "SMP/SMP.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "HAL/Halt.h"
+#include "HAL/Scheduler/ArchContext.h"
+#include "HAL/SMP/PerCPU.h"
+
+#include "Scheduler.h"
+#define MODULE "Scheduler"
+
+// Ready threads deque, a bounded work-stealing deque. Only its CPU pushes threads, at the bottom,
+// without atomic read-modify-write. Threads are taken from the top with a compare-and-swap: by its
+// CPU, which keeps the round-robin order, and by the idle CPUs that steal them
+struct Deque {
+	atomic_int_fast64_t top;
+	atomic_int_fast64_t bottom;
+	struct Thread* _Atomic threads[SCHEDULER_DEQUE_SIZE];
+};
+
+struct RunQueue {
+	struct Deque ready;
+	list_t overflow; // Threads woken while `ready` was full, moved to it as it empties
+	struct Thread* current;
+	struct Thread* idle;
+	struct Thread* prev; // Thread switched out, requeued (or freed) once its context is saved
+	bool requeuePrev; // Whether `prev` was preempted ; blocked threads are requeued when woken
+	bool needResched; // Switch to the next thread when the current IRQ returns
+	struct Timer tick; // Only runs while a thread does: idle CPUs are tickless
+};
+
+static cache_t* m_threadsCache;
+static struct RunQueue* m_runQueues = NULL; // Indexed by CPU ID. NULL until Scheduler_init
+static atomic_uint_fast64_t m_nextThreadID = 0;
+static _Atomic cpumask_t m_idleCPUs = 0; // CPUs running their idle thread, without a tick
+
+static void wakeTimeout(void* arg);
+
+// ================ Deques ================
+
+static void initDeque(struct Deque* deque){
+	atomic_init(&deque->top, 0);
+	atomic_init(&deque->bottom, 0);
+}
+
+static inline int64_t getDequeSize(struct Deque* deque){
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	return bottom - top;
+}
+
+// Note: only the deque's CPU may push, with IRQs disabled
+// @return false if the deque is full
+static bool push(struct Deque* deque, struct Thread* thread){
+	int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+	if (bottom - top >= SCHEDULER_DEQUE_SIZE)
+		return false;
+
+	atomic_store_explicit(&deque->threads[bottom % SCHEDULER_DEQUE_SIZE], thread, memory_order_relaxed);
+	atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+	return true;
+}
+
+// Take the oldest thread of `deque`, from any CPU
+// @return NULL if the deque is empty
+static struct Thread* take(struct Deque* deque){
+	while (true){
+		int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+		int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+		if (top >= bottom)
+			return NULL;
+
+		// The slot can't be reused by a push before `top` moves, which would fail the CAS
+		struct Thread* thread = atomic_load_explicit(&deque->threads[top % SCHEDULER_DEQUE_SIZE],
+			memory_order_relaxed);
+		if (atomic_compare_exchange_weak(&deque->top, &top, top + 1))
+			return thread;
+
+		pause();
+	}
+}
+
+// ================ Run queues ================
+
+// Note: IRQs must be disabled
+static inline struct RunQueue* getRunQueue(){
+	return &m_runQueues[SMP_getCpuId()];
+}
+
+// Move the threads of the overflow list to the deque, while it has room
+// Note: IRQs must be disabled
+static void refill(struct RunQueue* rq){
+	// Keep room for the running thread, as Scheduler_createThread does
+	while (!List_isEmpty(&rq->overflow) && getDequeSize(&rq->ready) < SCHEDULER_DEQUE_SIZE - 1){
+		struct Thread* thread = List_getObject(rq->overflow.head, struct Thread, lnode);
+		List_popFront(&rq->overflow);
+		push(&rq->ready, thread);
+	}
+}
+
+// Steal a thread from the nearest CPU that has some ready
+// @return NULL if there is none
+static struct Thread* steal(){
+	int self = SMP_getCpuId();
+
+	for (int distance=0 ; distance<CPU_N_DISTANCES ; distance++){
+		// Start after ourselves, so that the idle CPUs spread over their victims
+		for (int i=1 ; i<g_nCPUs ; i++){
+			int victim = (self + i) % g_nCPUs;
+			if (getDequeSize(&m_runQueues[victim].ready) <= 0)
+				continue;
+			if ((int) ArchSMP_getDistance(self, victim) != distance)
+				continue;
+
+			struct Thread* thread = take(&m_runQueues[victim].ready);
+			if (thread != NULL)
+				return thread;
+		}
+	}
+
+	return NULL;
+}
+
+// Whether the idle CPU could steal a thread
+static bool canSteal(){
+	for (int i=0 ; i<g_nCPUs ; i++){
+		if (getDequeSize(&m_runQueues[i].ready) > 0)
+			return true;
+	}
+
+	return false;
+}
+
+// ================ Idle CPUs ================
+
+// Steal a thread, or mark the current CPU idle: the CPUs that queue a thread then kick it
+// @return NULL if there is none to steal
+static struct Thread* stealOrGoIdle(){
+	cpumask_t self = 1ul << SMP_getCpuId();
+
+	struct Thread* thread = steal();
+	if (thread != NULL)
+		return thread;
+
+	// Check again once marked: a thread queued before is seen here, and one queued after kicks us
+	atomic_fetch_or(&m_idleCPUs, self);
+	thread = steal();
+	if (thread != NULL)
+		atomic_fetch_and(&m_idleCPUs, ~self);
+
+	return thread;
+}
+
+// The current CPU switches to a thread: unmark it idle, and restart its tick
+static void leaveIdle(struct RunQueue* rq){
+	cpumask_t self = 1ul << SMP_getCpuId();
+
+	if (atomic_load_explicit(&m_idleCPUs, memory_order_relaxed) & self)
+		atomic_fetch_and(&m_idleCPUs, ~self);
+	if (!Timer_isPending(&rq->tick))
+		Timer_start(&rq->tick, Time_get() + SCHEDULER_TICK_PERIOD);
+}
+
+// Kick an idle CPU (if any), so that it steals the thread just queued on the current one
+static void kickIdleCPU(){
+	// Pairs with stealOrGoIdle: either the idle CPU sees the thread, or we see it idle
+	atomic_thread_fence(memory_order_seq_cst);
+	cpumask_t idle = atomic_load_explicit(&m_idleCPUs, memory_order_relaxed);
+
+	while (idle != 0){
+		int cpu = __builtin_ctzll(idle);
+		cpumask_t mask = 1ul << cpu;
+		idle &= ~mask;
+
+		// Whoever unmarks it kicks it ; it marks itself again if there is nothing left to steal
+		if (atomic_fetch_and(&m_idleCPUs, ~mask) & mask){
+			ArchSMP_sendIPI(cpu, IRQ_RESCHEDULE);
+			return;
+		}
+	}
+}
+
+// A thread was queued on the current CPU: switch to it if we are idle, or kick an idle CPU
+// Note: IRQs must be disabled
+static void notifyQueued(struct RunQueue* rq){
+	if (rq->current != rq->idle){
+		kickIdleCPU();
+		return;
+	}
+
+	// We have no tick: the IRQ of an immediate one will switch to it
+	rq->needResched = true;
+	if (!Timer_isPending(&rq->tick))
+		Timer_start(&rq->tick, Time_get());
+}
+
+// Inter-processor interrupt, from kickIdleCPU
+static void kickIrq(void*){
+	getRunQueue()->needResched = true;
+}
+
+// ================ Threads ================
+
+static struct Thread* allocateThread(const char* name){
+	struct Thread* thread = Cache_malloc(m_threadsCache);
+	if (thread == NULL)
+		return NULL;
+
+	thread->id = atomic_fetch_add(&m_nextThreadID, 1);
+	thread->name = name;
+	thread->timeslice = SCHEDULER_TIMESLICE;
+	thread->stack = NULL;
+	atomic_init(&thread->onCPU, false);
+	Timer_init(&thread->wakeTimer, wakeTimeout, thread);
+	return thread;
+}
+
+static void destroyThread(struct Thread* thread){
+	vfree(thread->stack);
+	Cache_free(m_threadsCache, thread);
+}
+
+// Finish a switch, on the thread switched to: the previous thread's context is saved by now, so
+// it can be made available to the other CPUs
+// Note: the thread may run on another CPU than the one it was switched out on
+static void finishSwitch(){
+	struct RunQueue* rq = getRunQueue();
+	struct Thread* prev = rq->prev;
+	rq->prev = NULL;
+	if (prev == NULL || prev == rq->idle)
+		return;
+
+	if (prev->state == THREAD_DEAD){
+		destroyThread(prev);
+		return;
+	}
+
+	// From now on, a blocked thread can be woken (see `wake`)
+	atomic_store_explicit(&prev->onCPU, false, memory_order_release);
+	if (rq->requeuePrev && !push(&rq->ready, prev)){
+		// Can't happen, Scheduler_createThread keeps room for it
+		log(PANIC, MODULE, "Run queue of CPU#%d overflowed !", SMP_getCpuId());
+		panic();
+	}
+}
+
+// Switch to the next ready thread of `rq`. When it has none, the running thread continues ;
+// idle CPUs (and exiting or blocking threads) steal one from the other CPUs, or switch to the
+// idle thread
+// Note: IRQs must be disabled
+static void schedule(struct RunQueue* rq){
+	struct Thread* prev = rq->current;
+	rq->needResched = false;
+	refill(rq);
+
+	// Note: a blocking thread may already be woken (READY) by another CPU, it still has to go
+	bool running = (prev->state == THREAD_RUNNING);
+	struct Thread* next = take(&rq->ready);
+	if (next == NULL && (prev == rq->idle || !running))
+		next = stealOrGoIdle();
+	if (next == NULL)
+		next = running ? prev : rq->idle;
+
+	next->timeslice = SCHEDULER_TIMESLICE;
+	if (next != rq->idle)
+		leaveIdle(rq);
+	if (next == prev)
+		return;
+
+	if (running)
+		prev->state = THREAD_READY;
+	rq->requeuePrev = running;
+	next->state = THREAD_RUNNING;
+	atomic_store_explicit(&next->onCPU, true, memory_order_relaxed);
+	rq->current = next;
+	rq->prev = prev;
+
+	ArchContext_switch(&prev->context, next->context);
+	finishSwitch();
+}
+
+// Make a blocked thread ready, in the current CPU's run queue
+// @return false if it wasn't blocked (already woken, or not blocked yet)
+// Note: IRQs must be disabled
+static bool wake(struct Thread* thread){
+	enum ThreadState blocked = THREAD_BLOCKED;
+	if (!atomic_compare_exchange_strong(&thread->state, &blocked, THREAD_READY))
+		return false;
+
+	// It may still be switching out, on another CPU: wait until its context is saved
+	while (atomic_load_explicit(&thread->onCPU, memory_order_acquire))
+		pause();
+
+	// Keep room for the running thread, as Scheduler_createThread does. Past it (e.g. many threads
+	// woken at once), the thread waits in the overflow list, in order
+	struct RunQueue* rq = getRunQueue();
+	if (!List_isEmpty(&rq->overflow) || getDequeSize(&rq->ready) >= SCHEDULER_DEQUE_SIZE - 1)
+		List_pushBack(&rq->overflow, &thread->lnode);
+	else
+		push(&rq->ready, thread);
+
+	notifyQueued(rq);
+	return true;
+}
+
+// Deadline of a blocked thread (see Scheduler_block)
+static void wakeTimeout(void* arg){
+	wake(arg);
+}
+
+// ================ Ticks ================
+
+// Called on each CPU's tick, from the event timer IRQ
+static void tick(void*){
+	struct RunQueue* rq = getRunQueue();
+	struct Thread* current = rq->current;
+
+	// Tickless idle: the tick restarts when the CPU switches to a thread (see leaveIdle)
+	if (current == rq->idle){
+		if (canSteal())
+			rq->needResched = true;
+		return;
+	}
+
+	if (--current->timeslice <= 0)
+		rq->needResched = (getDequeSize(&rq->ready) > 0);
+	Timer_start(&rq->tick, Time_get() + SCHEDULER_TICK_PERIOD);
+}
+
+// Entry point of the threads (see ArchContext_init)
+[[noreturn]]
+static void startThread(void* arg){
+	struct Thread* thread = arg;
+
+	// We come from `schedule`, with IRQs disabled
+	finishSwitch();
+	IRQ_enable();
+
+	thread->entry(thread->arg);
+	Scheduler_exit();
+}
+
+// ================ Public API ================
+
+void Scheduler_init(){
+	m_threadsCache = Cache_create("threads", sizeof(struct Thread), NULL);
+	m_runQueues = kmalloc(g_nCPUs * sizeof(struct RunQueue));
+	if (m_threadsCache == NULL || m_runQueues == NULL){
+		log(PANIC, MODULE, "Could not allocate the run queues !");
+		panic();
+	}
+
+	for (int i=0 ; i<g_nCPUs ; i++){
+		initDeque(&m_runQueues[i].ready);
+		List_init(&m_runQueues[i].overflow);
+		m_runQueues[i].current = NULL;
+		m_runQueues[i].idle = NULL;
+		m_runQueues[i].prev = NULL;
+		m_runQueues[i].requeuePrev = false;
+		m_runQueues[i].needResched = false;
+		Timer_init(&m_runQueues[i].tick, tick, NULL);
+	}
+
+	IRQ_installHandler(IRQ_RESCHEDULE, kickIrq);
+	Scheduler_initCPU();
+
+	log(SUCCESS, MODULE, "Initialized, with a %d ms time slice",
+		SCHEDULER_TIMESLICE * SCHEDULER_TICK_PERIOD / 1000000);
+}
+
+void Scheduler_initCPU(){
+	struct Thread* idle = allocateThread("idle");
+	if (idle == NULL){
+		log(PANIC, MODULE, "Could not allocate the idle thread of CPU#%d !", SMP_getCpuId());
+		panic();
+	}
+
+	idle->state = THREAD_RUNNING;
+	atomic_init(&idle->onCPU, true);
+	idle->entry = NULL;
+	idle->arg = NULL;
+
+	unsigned long flags;
+	IRQ_disableSave(flags);
+	struct RunQueue* rq = getRunQueue();
+	rq->idle = idle;
+	rq->current = idle;
+	atomic_fetch_or(&m_idleCPUs, 1ul << SMP_getCpuId());
+	IRQ_restore(flags);
+}
+
+struct Thread* Scheduler_createThread(const char* name, void (*entry)(void* arg), void* arg){
+	unsigned long flags;
+
+	struct Thread* thread = allocateThread(name);
+	if (thread == NULL)
+		return NULL;
+
+	thread->stack = vmalloc(SCHEDULER_STACK_SIZE);
+	if (thread->stack == NULL){
+		Cache_free(m_threadsCache, thread);
+		return NULL;
+	}
+
+	thread->entry = entry;
+	thread->arg = arg;
+	thread->context = ArchContext_init(thread->stack + SCHEDULER_STACK_SIZE, startThread, thread);
+	thread->state = THREAD_READY;
+
+	// Keep room for the running thread in the deque, to requeue it when it is preempted
+	IRQ_disableSave(flags);
+	struct RunQueue* rq = getRunQueue();
+	bool added = (getDequeSize(&rq->ready) < SCHEDULER_DEQUE_SIZE - 1 && push(&rq->ready, thread));
+	if (added)
+		notifyQueued(rq);
+	IRQ_restore(flags);
+
+	if (!added){
+		destroyThread(thread);
+		return NULL;
+	}
+
+	return thread;
+}
+
+void Scheduler_exit(){
+	IRQ_disable();
+	struct RunQueue* rq = getRunQueue();
+	rq->current->state = THREAD_DEAD;
+	schedule(rq);
+
+	// Dead threads are never switched back to
+	unreachable();
+}
+
+void Scheduler_disablePreemption(){
+	PerCPU_addCPUInfoMember(preemptCount, 1);
+}
+
+void Scheduler_enablePreemption(){
+	unsigned long flags;
+
+	PerCPU_addCPUInfoMember(preemptCount, -1);
+	if (m_runQueues == NULL)
+		return;
+
+	// Preempted meanwhile: switch now. In an IRQ handler, or with IRQs disabled, the switch waits
+	// for the next IRQ return instead
+	IRQ_disableSave(flags);
+	struct RunQueue* rq = getRunQueue();
+	if (IRQ_areIRQSet(flags) && rq->needResched && PerCPU_getCPUInfoMember(preemptCount) == 0)
+		schedule(rq);
+	IRQ_restore(flags);
+}
+
+void Scheduler_yield(){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	schedule(getRunQueue());
+	IRQ_restore(flags);
+}
+
+bool Scheduler_canBlock(){
+	unsigned long flags;
+
+	if (m_runQueues == NULL)
+		return false;
+
+	IRQ_disableSave(flags);
+	struct RunQueue* rq = getRunQueue();
+	bool can_block = (rq->current != NULL && rq->current != rq->idle);
+	IRQ_restore(flags);
+
+	return can_block;
+}
+
+void Scheduler_block(spinlock_t* lock, ktime_t deadline){
+	struct RunQueue* rq = getRunQueue();
+	struct Thread* current = rq->current;
+
+	current->state = THREAD_BLOCKED;
+	if (deadline != SCHEDULER_NO_DEADLINE)
+		Timer_start(&current->wakeTimer, deadline);
+	if (lock != NULL)
+		Spinlock_unlock(lock);
+
+	schedule(rq);
+
+	// Woken, or timed out ; possibly on another CPU
+	if (deadline != SCHEDULER_NO_DEADLINE)
+		Timer_cancel(&current->wakeTimer);
+}
+
+bool Scheduler_wake(struct Thread* thread){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	bool woken = wake(thread);
+	IRQ_restore(flags);
+
+	return woken;
+}
+
+void Scheduler_sleepUntil(ktime_t deadline){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	Scheduler_block(NULL, deadline);
+	IRQ_restore(flags);
+}
+
+struct Thread* Scheduler_getCurrentThread(){
+	unsigned long flags;
+
+	if (m_runQueues == NULL)
+		return NULL;
+
+	IRQ_disableSave(flags);
+	struct Thread* current = getRunQueue()->current;
+	IRQ_restore(flags);
+
+	return current;
+}
+
+void Scheduler_preempt(){
+	if (m_runQueues == NULL)
+		return;
+
+	struct RunQueue* rq = getRunQueue();
+	if (rq->needResched && PerCPU_getCPUInfoMember(preemptCount) == 0)
+		schedule(rq);
+}
@@ -0,0 +1,86 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "Memory/Memory.h"
+#include "Time/Time.h"
+#include "Sync/Spinlock.h"
+#include "Scheduler/Thread.h"
+
+// Scheduler.h: preemptive, round-robin kernel threads scheduler
+// Each CPU has its own run queue, and an idle thread that runs when the queue is empty: the CPU's
+// boot context. The event timer's tick preempts the running thread at the end of its time slice:
+// the switch itself happens when the IRQ returns.
+// Load balancing is done by work stealing: the idle CPUs take ready threads from the run queues
+// of the others, the nearest ones first (see ArchSMP_getDistance). Idle CPUs have no tick: the
+// CPUs that queue a thread kick one of them with an IPI.
+// Threads block until another thread (or an IRQ) wakes them, or until a deadline (a timer, see
+// Time/Timer.h). See Sync/WaitQueue.h, which builds on it
+
+#define SCHEDULER_TICK_PERIOD		4000000 // In nanoseconds
+#define SCHEDULER_TIMESLICE			5 // In ticks
+#define SCHEDULER_STACK_SIZE		(4 * PAGE_SIZE) // Kernel threads stack size
+#define SCHEDULER_DEQUE_SIZE		256 // Ready threads per CPU that can be stolen (power of two)
+#define SCHEDULER_NO_DEADLINE		KTIME_MAX // Block until woken
+
+/// @brief Initialize the scheduler, and make the current context the BSP's idle thread
+/// @note SMP and the Time subsystem (and the timer wheels) must have been initialized beforehand
+void Scheduler_init();
+
+/// @brief Make the current context the current CPU's idle thread. Call it on each AP, once its
+/// event timer is initialized
+/// @note It is NOT necessary to call it for the BSP, this is done by `Scheduler_init`
+void Scheduler_initCPU();
+
+/// @brief Create a kernel thread running `entry(arg)`, and add it to the current CPU's run queue
+/// @param name Name of the thread (not copied)
+/// @return The thread, or NULL if we are out of memory, or if the run queue is full
+struct Thread* Scheduler_createThread(const char* name, void (*entry)(void* arg), void* arg);
+
+/// @brief Terminate the current thread. Returning from its entry function does the same
+[[noreturn]]
+void Scheduler_exit();
+
+/// @brief Give the CPU to the next ready thread, if any
+void Scheduler_yield();
+
+/// @brief Keep the current thread from being preempted (and moved to another CPU), until
+/// `Scheduler_enablePreemption` is called. Calls can be nested
+/// @note The thread must not block meanwhile
+void Scheduler_disablePreemption();
+
+/// @brief Allow back preemption, after `Scheduler_disablePreemption` ; switches to the next thread
+/// if the current one was to be preempted meanwhile
+void Scheduler_enablePreemption();
+
+/// @brief Whether the current context is a thread that can block: not an idle thread (e.g. the
+/// boot code), which must always be able to run
+/// @note The caller must also not be in an IRQ handler, nor hold a spinlock
+bool Scheduler_canBlock();
+
+/// @brief Block the current thread until it is woken (see `Scheduler_wake`), or until `deadline`
+/// @param lock Released once the thread is blocked (nullable): a waker that takes it can't miss
+/// the thread. It isn't taken again on return
+/// @param deadline Time (see `Time_get`) to wake the thread at, or `SCHEDULER_NO_DEADLINE`
+/// @note IRQs must be disabled, and the current thread must be able to block (see
+/// `Scheduler_canBlock`). They are still disabled on return
+void Scheduler_block(spinlock_t* lock, ktime_t deadline);
+
+/// @brief Make `thread` ready again, in the current CPU's run queue. Callable from IRQ handlers
+/// @return false if it wasn't blocked
+bool Scheduler_wake(struct Thread* thread);
+
+/// @brief Block the current thread until `deadline` (see `Scheduler_block`)
+void Scheduler_sleepUntil(ktime_t deadline);
+
+/// @brief Get the thread running on the current CPU
+/// @return NULL before `Scheduler_init`
+struct Thread* Scheduler_getCurrentThread();
+
+/// @brief Switch to the next thread if the current one must be preempted, and preemption isn't
+/// disabled (see `Scheduler_disablePreemption`)
+/// @note Called when returning from IRQs, after the EOI
+void Scheduler_preempt();
+
+#endif
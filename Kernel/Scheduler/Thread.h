@@ -0,0 +1,32 @@
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "mugOS/List.h"
+#include "Time/Timer.h"
+
+// Thread.h: kernel threads
+
+enum ThreadState {
+	THREAD_READY,		// In a run queue (or being switched out), waiting for a CPU
+	THREAD_RUNNING,
+	THREAD_BLOCKED,		// Waiting to be woken (see Scheduler_block)
+	THREAD_DEAD,		// Exited, freed once switched out
+};
+
+struct Thread {
+	uintptr_t context; // Saved context, while it is switched out (see HAL/Scheduler/ArchContext.h)
+	uint64_t id;
+	const char* name;
+	_Atomic enum ThreadState state;
+	atomic_bool onCPU; // Its context is in use: it runs, or is being switched out
+	int timeslice; // Ticks left before it is preempted
+	void (*entry)(void* arg);
+	void* arg;
+	void* stack; // Base of its stack ; NULL for the idle threads, which run on the CPUs boot stacks
+	struct Timer wakeTimer; // Deadline of a timed block (see Scheduler_block)
+	lnode_t lnode; // In its CPU's overflow list, when woken while the run queue is full
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include <stddef.h>
+#include "Logging.h"
+
+#include "LockStats.h"
+#define MODULE "Lock stats"
+
+static struct LockStats* _Atomic m_contended = NULL; // Statistics of the contended locks
+
+void LockStats_add(struct LockStats* stats, unsigned long spins){
+	if (stats == NULL)
+		return;
+
+	atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+	if (spins == 0)
+		return;
+
+	atomic_fetch_add_explicit(&stats->contentions, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->spins, spins, memory_order_relaxed);
+
+	// First contention: chain the statistics, for LockStats_log
+	if (atomic_exchange_explicit(&stats->registered, true, memory_order_relaxed))
+		return;
+
+	struct LockStats* head = atomic_load_explicit(&m_contended, memory_order_relaxed);
+	do {
+		stats->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&m_contended, &head, stats,
+		memory_order_release, memory_order_relaxed));
+}
+
+void LockStats_log(){
+#ifndef LOCK_STATS_YES
+	log(INFO, MODULE, "Disabled, build with LOCK_STATS=YES to enable them");
+#else
+	struct LockStats* stats = atomic_load_explicit(&m_contended, memory_order_acquire);
+	if (stats == NULL){
+		log(INFO, MODULE, "No lock was contended");
+		return;
+	}
+
+	for ( ; stats!=NULL ; stats=stats->next){
+		unsigned long acquisitions = atomic_load_explicit(&stats->acquisitions, memory_order_relaxed);
+		unsigned long contentions = atomic_load_explicit(&stats->contentions, memory_order_relaxed);
+		unsigned long spins = atomic_load_explicit(&stats->spins, memory_order_relaxed);
+
+		log(INFO, MODULE, "%s: %lu acquisitions, %lu contended (%lu%%), %lu spins per contention",
+			stats->name, acquisitions, contentions, contentions * 100 / acquisitions,
+			spins / contentions);
+	}
+#endif
+}
@@ -0,0 +1,38 @@
+#ifndef __LOCK_STATS_H__
+#define __LOCK_STATS_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// LockStats.h: lock contention statistics
+// Each lock points to the statistics of its class: a single lock, or a set of similar locks (e.g.
+// all the slab caches' ones). They count the acquisitions, how many of them had to wait, and how
+// long. They are only recorded when built with LOCK_STATS=YES, and cost nothing otherwise.
+// Statistics must live forever: the contended ones are chained for `LockStats_log`
+
+struct LockStats {
+	const char* name;
+	atomic_ulong acquisitions;
+	atomic_ulong contentions; // Acquisitions that had to wait
+	atomic_ulong spins; // Wait loop iterations, over all the contentions
+	atomic_bool registered; // In the contended list
+	struct LockStats* next;
+};
+
+/// @brief New (static storage) statistics named `lock_name`, for a lock initializer
+#define LOCK_STATS_NEW(lock_name) (&(struct LockStats){ .name = (lock_name) })
+
+#ifdef LOCK_STATS_YES
+/// @brief Record an acquisition of a lock, that waited for `spins` loop iterations (0: uncontended)
+#define LockStats_record(stats, spins) LockStats_add(stats, spins)
+#else
+#define LockStats_record(stats, spins) ((void) (stats), (void) (spins))
+#endif
+
+/// @brief Do not call directly, see `LockStats_record`
+void LockStats_add(struct LockStats* stats, unsigned long spins);
+
+/// @brief Log the statistics of the locks that were contended, since boot
+void LockStats_log();
+
+#endif
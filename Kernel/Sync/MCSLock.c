@@ -0,0 +1,60 @@
+#include <stddef.h>
+#include "HAL/Halt.h"
+
+#include "MCSLock.h"
+
+void MCSLock_init(mcslock_t* lock, struct LockStats* stats){
+	atomic_init(&lock->tail, NULL);
+	lock->stats = stats;
+}
+
+void MCSLock_lock(mcslock_t* lock, struct MCSNode* node){
+	unsigned long spins = 0;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+
+	// Queue up ; if there was nobody, we hold the lock
+	struct MCSNode* prev = atomic_exchange_explicit(&lock->tail, node, memory_order_acq_rel);
+	if (prev != NULL){
+		// Link behind the previous waiter, and wait for it to hand us the lock
+		atomic_store_explicit(&prev->next, node, memory_order_release);
+		while (atomic_load_explicit(&node->locked, memory_order_acquire)){
+			pause();
+			spins++;
+		}
+	}
+
+	LockStats_record(lock->stats, spins);
+}
+
+void MCSLock_unlock(mcslock_t* lock, struct MCSNode* node){
+	struct MCSNode* next = atomic_load_explicit(&node->next, memory_order_acquire);
+
+	if (next == NULL){
+		// No known waiter: release the lock, unless one is queuing up right now
+		struct MCSNode* expected = node;
+		if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL,
+			memory_order_release, memory_order_relaxed))
+			return;
+
+		// Wait for it to link behind us
+		while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL)
+			pause();
+	}
+
+	atomic_store_explicit(&next->locked, false, memory_order_release);
+}
+
+bool MCSLock_tryLock(mcslock_t* lock, struct MCSNode* node){
+	struct MCSNode* expected = NULL;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&lock->tail, &expected, node,
+		memory_order_acquire, memory_order_relaxed))
+		return false;
+
+	LockStats_record(lock->stats, 0);
+	return true;
+}
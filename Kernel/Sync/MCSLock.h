@@ -0,0 +1,55 @@
+#ifndef __MCS_LOCK_H__
+#define __MCS_LOCK_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "mugOS/Preprocessor.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "Sync/LockStats.h"
+
+// MCSLock.h: MCS queue lock (Mellor-Crummey & Scott), for heavily contended locks
+// The waiters form a queue, each one spinning on its own node: a release only touches the cache
+// line of the next waiter, instead of every waiting CPU's. It is fair (FIFO), like the ticket lock.
+// Each acquisition needs a node, usually on the stack, that must be kept until the release
+
+#define MCS_NODE_ALIGNMENT		64 // A cache line: a waiter only touches its own
+
+struct MCSNode {
+	struct MCSNode* _Atomic next;
+	atomic_bool locked;
+} aligned(MCS_NODE_ALIGNMENT);
+
+typedef struct MCSLock {
+	struct MCSNode* _Atomic tail; // Last waiter (or holder), NULL if free
+	struct LockStats* stats; // Nullable
+} mcslock_t;
+
+/// @brief Static initializer for an MCS lock, whose statistics are named `lock_name`
+#define MCSLOCK_INIT(lock_name) { .tail = NULL, .stats = LOCK_STATS_NEW(lock_name) }
+
+/// @param stats Statistics to record the acquisitions in (nullable), e.g. shared by similar locks
+void MCSLock_init(mcslock_t* lock, struct LockStats* stats);
+
+/// @param node Node of this acquisition, kept until `MCSLock_unlock`
+void MCSLock_lock(mcslock_t* lock, struct MCSNode* node);
+
+/// @param node Node given to `MCSLock_lock`
+void MCSLock_unlock(mcslock_t* lock, struct MCSNode* node);
+
+/// @return Whether the lock was taken (with `node`)
+bool MCSLock_tryLock(mcslock_t* lock, struct MCSNode* node);
+
+/// @brief Save and disable the IRQs (see `IRQ_disableSave`), then take the lock
+#define MCSLock_lockIrqSave(lock, node, flags) \
+	do { \
+		IRQ_disableSave(flags); \
+		MCSLock_lock(lock, node); \
+	} while (0)
+
+#define MCSLock_unlockIrqRestore(lock, node, flags) \
+	do { \
+		MCSLock_unlock(lock, node); \
+		IRQ_restore(flags); \
+	} while (0)
+
+#endif
@@ -0,0 +1,98 @@
+#include <stddef.h>
+#include "Logging.h"
+#include "Panic.h"
+#include "Scheduler/Scheduler.h"
+#include "HAL/Halt.h"
+
+#include "Mutex.h"
+#define MODULE "Mutex"
+
+static inline bool acquire(mutex_t* mutex, struct Thread* self){
+	struct Thread* expected = NULL;
+	return atomic_compare_exchange_strong(&mutex->owner, &expected, self);
+}
+
+// Whether `owner` runs on a CPU: it will likely release the mutex soon
+// Note: it may release it (and exit) meanwhile ; the threads cache keeps its memory readable
+static inline bool isRunning(struct Thread* owner){
+	return (atomic_load_explicit(&owner->onCPU, memory_order_relaxed) &&
+		owner->state == THREAD_RUNNING);
+}
+
+// Get the current thread, to own the mutex
+static inline struct Thread* getOwner(){
+	struct Thread* self = Scheduler_getCurrentThread();
+	if (self == NULL){
+		// No thread yet: it would be taken by no one
+		log(PANIC, MODULE, "Mutex taken before the scheduler was initialized !");
+		panic();
+	}
+
+	return self;
+}
+
+// ================ Public API ================
+
+void Mutex_init(mutex_t* mutex, struct LockStats* stats){
+	atomic_init(&mutex->owner, NULL);
+	atomic_init(&mutex->n_waiters, 0);
+	WaitQueue_init(&mutex->waiters, NULL);
+	mutex->stats = stats;
+}
+
+void Mutex_lock(mutex_t* mutex){
+	struct Thread* self = getOwner();
+	unsigned long spins = 0;
+	unsigned long flags;
+
+	if (acquire(mutex, self)){
+		LockStats_record(mutex->stats, 0);
+		return;
+	}
+
+	// Spin while the owner runs
+	while (spins < MUTEX_SPIN_LIMIT){
+		struct Thread* owner = atomic_load_explicit(&mutex->owner, memory_order_relaxed);
+		if (owner == NULL && acquire(mutex, self)){
+			LockStats_record(mutex->stats, spins + 1);
+			return;
+		}
+		if (owner != NULL && !isRunning(owner))
+			break;
+
+		pause();
+		spins++;
+	}
+
+	// Block. Being counted before trying again guarantees that the owner sees us when releasing
+	WaitQueue_lock(&mutex->waiters, flags);
+	atomic_fetch_add(&mutex->n_waiters, 1);
+	while (!acquire(mutex, self)){
+		WaitQueue_wait(&mutex->waiters, flags, WAITQUEUE_NO_DEADLINE);
+		spins++;
+	}
+	atomic_fetch_sub(&mutex->n_waiters, 1);
+	WaitQueue_unlock(&mutex->waiters, flags);
+
+	LockStats_record(mutex->stats, spins + 1);
+}
+
+void Mutex_unlock(mutex_t* mutex){
+	unsigned long flags;
+
+	atomic_store(&mutex->owner, NULL);
+	if (atomic_load(&mutex->n_waiters) == 0)
+		return;
+
+	WaitQueue_lock(&mutex->waiters, flags);
+	WaitQueue_wakeOne(&mutex->waiters);
+	WaitQueue_unlock(&mutex->waiters, flags);
+}
+
+bool Mutex_tryLock(mutex_t* mutex){
+	bool acquired = acquire(mutex, getOwner());
+	if (acquired)
+		LockStats_record(mutex->stats, 0);
+
+	return acquired;
+}
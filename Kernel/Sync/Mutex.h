@@ -0,0 +1,41 @@
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "Sync/LockStats.h"
+#include "Sync/WaitQueue.h"
+#include "Scheduler/Thread.h"
+
+// Mutex.h: sleeping locks, for critical sections that are long, or that may block themselves
+// Adaptive: a thread that finds the mutex held by a running thread spins for a while, as it will
+// likely be released soon, without the cost of a switch. Otherwise, it blocks until the holder
+// releases it. Not fair: a spinning thread may take it before the woken one.
+// Mutexes can't be taken in IRQ handlers, nor before `Scheduler_init` (this panics)
+
+#define MUTEX_SPIN_LIMIT		1000 // Spin loop iterations before blocking
+
+typedef struct Mutex {
+	struct Thread* _Atomic owner; // NULL if free
+	atomic_int n_waiters; // Threads blocked on it, or about to
+	waitqueue_t waiters;
+	struct LockStats* stats; // Nullable
+} mutex_t;
+
+/// @brief Static initializer for the mutex `var`, whose statistics are named `lock_name`
+#define MUTEX_INIT(var, lock_name) { \
+	.owner = NULL, \
+	.n_waiters = 0, \
+	.waiters = WAITQUEUE_INIT((var).waiters, lock_name " (waiters)"), \
+	.stats = LOCK_STATS_NEW(lock_name), \
+}
+
+/// @param stats Statistics to record the acquisitions in (nullable), e.g. shared by similar locks
+void Mutex_init(mutex_t* mutex, struct LockStats* stats);
+void Mutex_lock(mutex_t* mutex);
+void Mutex_unlock(mutex_t* mutex);
+
+/// @return Whether the mutex was taken
+bool Mutex_tryLock(mutex_t* mutex);
+
+#endif
@@ -0,0 +1,59 @@
+#include "HAL/Halt.h"
+
+#include "RWLock.h"
+
+void RWLock_init(rwlock_t* lock, struct LockStats* stats){
+	atomic_init(&lock->value, 0);
+	lock->stats = stats;
+}
+
+void RWLock_readLock(rwlock_t* lock){
+	unsigned long spins = 0;
+	unsigned int value = atomic_load_explicit(&lock->value, memory_order_relaxed);
+
+	while (true){
+		if (!(value & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+			atomic_compare_exchange_weak_explicit(&lock->value, &value, value + 1,
+			memory_order_acquire, memory_order_relaxed))
+			break;
+
+		pause();
+		spins++;
+		value = atomic_load_explicit(&lock->value, memory_order_relaxed);
+	}
+
+	LockStats_record(lock->stats, spins);
+}
+
+void RWLock_readUnlock(rwlock_t* lock){
+	atomic_fetch_sub_explicit(&lock->value, 1, memory_order_release);
+}
+
+void RWLock_writeLock(rwlock_t* lock){
+	unsigned long spins = 0;
+	unsigned int value = atomic_load_explicit(&lock->value, memory_order_relaxed);
+
+	while (true){
+		// Free (maybe with writers waiting, us included): take it, clearing the waiting flag
+		// The other waiting writers set it again
+		if ((value & ~RWLOCK_WAITING) == 0 &&
+			atomic_compare_exchange_weak_explicit(&lock->value, &value, RWLOCK_WRITER,
+			memory_order_acquire, memory_order_relaxed))
+			break;
+
+		// Keep new readers out
+		if (!(value & RWLOCK_WAITING))
+			atomic_fetch_or_explicit(&lock->value, RWLOCK_WAITING, memory_order_relaxed);
+
+		pause();
+		spins++;
+		value = atomic_load_explicit(&lock->value, memory_order_relaxed);
+	}
+
+	LockStats_record(lock->stats, spins);
+}
+
+void RWLock_writeUnlock(rwlock_t* lock){
+	// Keep the waiting flag, that other writers may have set meanwhile
+	atomic_fetch_and_explicit(&lock->value, ~RWLOCK_WRITER, memory_order_release);
+}
@@ -0,0 +1,58 @@
+#ifndef __RW_LOCK_H__
+#define __RW_LOCK_H__
+
+#include <stdatomic.h>
+#include "HAL/IRQ/IrqFlags.h"
+#include "Sync/LockStats.h"
+
+// RWLock.h: reader-writer spinlock, for data that is read much more often than it is modified
+// Readers share the lock, writers hold it alone. A waiting writer keeps new readers out, so that
+// writers don't starve. Consequently, a CPU must not take the read lock recursively (e.g. in an
+// IRQ handler, while the code it interrupted holds it): it would deadlock if a writer is waiting
+
+#define RWLOCK_WRITER			0x80000000 // Held by a writer
+#define RWLOCK_WAITING			0x40000000 // A writer is waiting
+#define RWLOCK_READERS			0x3fffffff // Number of readers
+
+typedef struct RWLock {
+	atomic_uint value; // See the `RWLOCK_` macros
+	struct LockStats* stats; // Nullable
+} rwlock_t;
+
+/// @brief Static initializer for a reader-writer lock, whose statistics are named `lock_name`
+#define RWLOCK_INIT(lock_name) { .value = 0, .stats = LOCK_STATS_NEW(lock_name) }
+
+/// @param stats Statistics to record the acquisitions in (nullable), e.g. shared by similar locks
+void RWLock_init(rwlock_t* lock, struct LockStats* stats);
+void RWLock_readLock(rwlock_t* lock);
+void RWLock_readUnlock(rwlock_t* lock);
+void RWLock_writeLock(rwlock_t* lock);
+void RWLock_writeUnlock(rwlock_t* lock);
+
+/// @brief Save and disable the IRQs (see `IRQ_disableSave`), then take the read lock
+#define RWLock_readLockIrqSave(lock, flags) \
+	do { \
+		IRQ_disableSave(flags); \
+		RWLock_readLock(lock); \
+	} while (0)
+
+#define RWLock_readUnlockIrqRestore(lock, flags) \
+	do { \
+		RWLock_readUnlock(lock); \
+		IRQ_restore(flags); \
+	} while (0)
+
+/// @brief Save and disable the IRQs (see `IRQ_disableSave`), then take the write lock
+#define RWLock_writeLockIrqSave(lock, flags) \
+	do { \
+		IRQ_disableSave(flags); \
+		RWLock_writeLock(lock); \
+	} while (0)
+
+#define RWLock_writeUnlockIrqRestore(lock, flags) \
+	do { \
+		RWLock_writeUnlock(lock); \
+		IRQ_restore(flags); \
+	} while (0)
+
+#endif
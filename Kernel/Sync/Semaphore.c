@@ -0,0 +1,47 @@
+#include "Semaphore.h"
+
+void Semaphore_init(semaphore_t* sem, unsigned int value, struct LockStats* stats){
+	sem->count = value;
+	WaitQueue_init(&sem->waiters, stats);
+}
+
+void Semaphore_down(semaphore_t* sem){
+	Semaphore_downUntil(sem, WAITQUEUE_NO_DEADLINE);
+}
+
+bool Semaphore_downUntil(semaphore_t* sem, ktime_t deadline){
+	unsigned long flags;
+	bool waiting = true;
+
+	WaitQueue_lock(&sem->waiters, flags);
+	while (sem->count == 0 && waiting)
+		waiting = WaitQueue_wait(&sem->waiters, flags, deadline);
+
+	bool acquired = (sem->count > 0);
+	if (acquired)
+		sem->count--;
+	WaitQueue_unlock(&sem->waiters, flags);
+
+	return acquired;
+}
+
+bool Semaphore_tryDown(semaphore_t* sem){
+	unsigned long flags;
+
+	WaitQueue_lock(&sem->waiters, flags);
+	bool acquired = (sem->count > 0);
+	if (acquired)
+		sem->count--;
+	WaitQueue_unlock(&sem->waiters, flags);
+
+	return acquired;
+}
+
+void Semaphore_up(semaphore_t* sem){
+	unsigned long flags;
+
+	WaitQueue_lock(&sem->waiters, flags);
+	sem->count++;
+	WaitQueue_wakeOne(&sem->waiters);
+	WaitQueue_unlock(&sem->waiters, flags);
+}
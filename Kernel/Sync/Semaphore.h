@@ -0,0 +1,37 @@
+#ifndef __SEMAPHORE_H__
+#define __SEMAPHORE_H__
+
+#include <stdbool.h>
+#include "Time/Time.h"
+#include "Sync/WaitQueue.h"
+
+// Semaphore.h: counting semaphores, whose waiters block (see WaitQueue.h)
+// `Semaphore_up` may be called from IRQ handlers, e.g. to signal a completed I/O
+
+typedef struct Semaphore {
+	unsigned int count; // Protected by the wait queue's lock
+	waitqueue_t waiters;
+} semaphore_t;
+
+/// @brief Static initializer for the semaphore `var`, whose lock statistics are named `lock_name`
+#define SEMAPHORE_INIT(var, lock_name, value) \
+	{ .count = (value), .waiters = WAITQUEUE_INIT((var).waiters, lock_name) }
+
+/// @param stats Statistics to record the lock acquisitions in (nullable)
+void Semaphore_init(semaphore_t* sem, unsigned int value, struct LockStats* stats);
+
+/// @brief Decrement the count, waiting for it to be positive
+void Semaphore_down(semaphore_t* sem);
+
+/// @brief Decrement the count, waiting for it to be positive until `deadline` (see `Time_get`)
+/// @return false if the deadline passed first
+bool Semaphore_downUntil(semaphore_t* sem, ktime_t deadline);
+
+/// @brief Decrement the count if it is positive
+/// @return Whether it was decremented
+bool Semaphore_tryDown(semaphore_t* sem);
+
+/// @brief Increment the count, and wake a waiter
+void Semaphore_up(semaphore_t* sem);
+
+#endif
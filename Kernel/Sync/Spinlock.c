@@ -0,0 +1,80 @@
+#include <stddef.h>
+#include "HAL/Halt.h"
+
+#include "Spinlock.h"
+
+// ================ Spinlock ================
+
+void Spinlock_init(spinlock_t* lock, struct LockStats* stats){
+	atomic_init(&lock->locked, false);
+	lock->stats = stats;
+}
+
+void Spinlock_lock(spinlock_t* lock){
+	unsigned long spins = 0;
+
+	while (atomic_exchange_explicit(&lock->locked, true, memory_order_acquire)){
+		// Only try again once it looks free: reading doesn't take the cache line away from the holder
+		do {
+			pause();
+			spins++;
+		} while (atomic_load_explicit(&lock->locked, memory_order_relaxed));
+	}
+
+	LockStats_record(lock->stats, spins);
+}
+
+void Spinlock_unlock(spinlock_t* lock){
+	atomic_store_explicit(&lock->locked, false, memory_order_release);
+}
+
+bool Spinlock_tryLock(spinlock_t* lock){
+	if (atomic_load_explicit(&lock->locked, memory_order_relaxed))
+		return false;
+	if (atomic_exchange_explicit(&lock->locked, true, memory_order_acquire))
+		return false;
+
+	LockStats_record(lock->stats, 0);
+	return true;
+}
+
+// ================ Ticket lock ================
+
+void TicketLock_init(ticketlock_t* lock, struct LockStats* stats){
+	atomic_init(&lock->next, 0);
+	atomic_init(&lock->owner, 0);
+	lock->stats = stats;
+}
+
+void TicketLock_lock(ticketlock_t* lock){
+	unsigned int ticket = atomic_fetch_add_explicit(&lock->next, 1, memory_order_relaxed);
+	unsigned int owner;
+	unsigned long spins = 0;
+
+	while ((owner = atomic_load_explicit(&lock->owner, memory_order_acquire)) != ticket){
+		// Proportional backoff: the more holders before us, the longer we wait before reading again
+		for (unsigned int i=0 ; i<ticket-owner ; i++)
+			pause();
+		spins++;
+	}
+
+	LockStats_record(lock->stats, spins);
+}
+
+void TicketLock_unlock(ticketlock_t* lock){
+	// Only the holder writes the owner
+	unsigned int owner = atomic_load_explicit(&lock->owner, memory_order_relaxed);
+	atomic_store_explicit(&lock->owner, owner + 1, memory_order_release);
+}
+
+bool TicketLock_tryLock(ticketlock_t* lock){
+	// Take the next ticket only if it is served right away
+	unsigned int owner = atomic_load_explicit(&lock->owner, memory_order_acquire);
+	unsigned int expected = owner;
+	if (!atomic_compare_exchange_strong_explicit(&lock->next, &expected, owner + 1,
+		memory_order_acquire, memory_order_relaxed))
+		return false;
+
+	LockStats_record(lock->stats, 0);
+	return true;
+}
@@ -0,0 +1,80 @@
+#ifndef __SPINLOCK_H__
+#define __SPINLOCK_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "HAL/IRQ/IrqFlags.h"
+#include "Sync/LockStats.h"
+
+// Spinlock.h: busy-waiting locks, for short critical sections
+// - spinlock_t: test-and-test-and-set lock. The waiters spin on a read, which keeps the cache line
+//   shared until the lock is released. Cheapest, but unfair: a CPU may starve under contention
+// - ticketlock_t: fair lock, the CPUs get it in the order they asked for it
+// See also RWLock.h (reader-writer lock) and MCSLock.h (queue lock, for heavily contended locks).
+// A lock that is also taken in IRQ handlers must be taken with IRQs disabled everywhere else (the
+// `IrqSave` variants), or an IRQ could spin forever on the lock held by the code it interrupted
+
+typedef struct Spinlock {
+	atomic_bool locked;
+	struct LockStats* stats; // Nullable
+} spinlock_t;
+
+typedef struct TicketLock {
+	atomic_uint next; // Next ticket to hand out
+	atomic_uint owner; // Ticket of the holder
+	struct LockStats* stats; // Nullable
+} ticketlock_t;
+
+/// @brief Static initializer for a spinlock, whose statistics are named `lock_name`
+#define SPINLOCK_INIT(lock_name) { .locked = false, .stats = LOCK_STATS_NEW(lock_name) }
+
+/// @brief Static initializer for a ticket lock, whose statistics are named `lock_name`
+#define TICKETLOCK_INIT(lock_name) { .next = 0, .owner = 0, .stats = LOCK_STATS_NEW(lock_name) }
+
+// ================ Spinlock ================
+
+/// @param stats Statistics to record the acquisitions in (nullable), e.g. shared by similar locks
+void Spinlock_init(spinlock_t* lock, struct LockStats* stats);
+void Spinlock_lock(spinlock_t* lock);
+void Spinlock_unlock(spinlock_t* lock);
+
+/// @return Whether the lock was taken
+bool Spinlock_tryLock(spinlock_t* lock);
+
+/// @brief Save and disable the IRQs (see `IRQ_disableSave`), then take the lock
+#define Spinlock_lockIrqSave(lock, flags) \
+	do { \
+		IRQ_disableSave(flags); \
+		Spinlock_lock(lock); \
+	} while (0)
+
+#define Spinlock_unlockIrqRestore(lock, flags) \
+	do { \
+		Spinlock_unlock(lock); \
+		IRQ_restore(flags); \
+	} while (0)
+
+// ================ Ticket lock ================
+
+/// @param stats Statistics to record the acquisitions in (nullable), e.g. shared by similar locks
+void TicketLock_init(ticketlock_t* lock, struct LockStats* stats);
+void TicketLock_lock(ticketlock_t* lock);
+void TicketLock_unlock(ticketlock_t* lock);
+
+/// @return Whether the lock was taken
+bool TicketLock_tryLock(ticketlock_t* lock);
+
+/// @brief Save and disable the IRQs (see `IRQ_disableSave`), then take the lock
+#define TicketLock_lockIrqSave(lock, flags) \
+	do { \
+		IRQ_disableSave(flags); \
+		TicketLock_lock(lock); \
+	} while (0)
+
+#define TicketLock_unlockIrqRestore(lock, flags) \
+	do { \
+		TicketLock_unlock(lock); \
+		IRQ_restore(flags); \
+	} while (0)
+
+#endif
@@ -0,0 +1,91 @@
+#include <stddef.h>
+#include "HAL/Halt.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "Time/Timer.h"
+
+#include "WaitQueue.h"
+
+// A waiting thread, on its stack
+struct WaitQueueEntry {
+	struct Thread* thread;
+	bool woken; // Removed from the queue by a waker
+	lnode_t lnode;
+};
+
+// The timer's IRQ itself ends the halt
+static void timeout(void*){
+}
+
+// Wait for the next IRQ (at the latest, the one of `deadline`), with the lock released
+// Note: IRQs are disabled, and `flags` are the caller's
+static void haltUntilIRQ(waitqueue_t* wq, unsigned long flags, ktime_t deadline){
+	struct Timer timer;
+
+	Spinlock_unlock(&wq->lock);
+
+	if (IRQ_areIRQSet(flags)){
+		// There may be no other IRQ at all: the CPUs are tickless
+		Timer_init(&timer, timeout, NULL);
+		if (deadline != WAITQUEUE_NO_DEADLINE)
+			Timer_start(&timer, deadline);
+
+		enableAndHalt();
+		IRQ_disable();
+		Timer_cancel(&timer);
+	}
+	else{
+		// IRQs can't be enabled here: poll
+		pause();
+	}
+
+	Spinlock_lock(&wq->lock);
+}
+
+static void wake(struct WaitQueueEntry* entry){
+	entry->woken = true;
+	Scheduler_wake(entry->thread);
+}
+
+// ================ Public API ================
+
+void WaitQueue_init(waitqueue_t* wq, struct LockStats* stats){
+	Spinlock_init(&wq->lock, stats);
+	List_init(&wq->waiters);
+}
+
+bool WaitQueue_wait(waitqueue_t* wq, unsigned long flags, ktime_t deadline){
+	if (!IRQ_areIRQSet(flags) || !Scheduler_canBlock()){
+		haltUntilIRQ(wq, flags, deadline);
+		return (Time_get() < deadline);
+	}
+
+	struct WaitQueueEntry entry = {
+		.thread = Scheduler_getCurrentThread(),
+		.woken = false,
+	};
+	List_pushBack(&wq->waiters, &entry.lnode);
+
+	Scheduler_block(&wq->lock, deadline);
+	Spinlock_lock(&wq->lock);
+
+	// Timed out: we are still queued (unless a waker came meanwhile)
+	if (!entry.woken)
+		List_pop(&wq->waiters, &entry.lnode);
+
+	return (entry.woken || Time_get() < deadline);
+}
+
+bool WaitQueue_wakeOne(waitqueue_t* wq){
+	if (List_isEmpty(&wq->waiters))
+		return false;
+
+	struct WaitQueueEntry* entry = List_getObject(wq->waiters.head, struct WaitQueueEntry, lnode);
+	List_popFront(&wq->waiters);
+	wake(entry);
+	return true;
+}
+
+void WaitQueue_wakeAll(waitqueue_t* wq){
+	while (!List_isEmpty(&wq->waiters))
+		WaitQueue_wakeOne(wq);
+}
@@ -0,0 +1,56 @@
+#ifndef __WAIT_QUEUE_H__
+#define __WAIT_QUEUE_H__
+
+#include <stdbool.h>
+#include "mugOS/List.h"
+#include "Time/Time.h"
+#include "Sync/Spinlock.h"
+#include "Scheduler/Scheduler.h"
+
+// WaitQueue.h: wait queues, to block threads until an event (a condition variable with its lock)
+// The waiter checks its condition with the queue's lock held, and waits while it is false: the
+// lock is released once the thread is blocked. The waker makes the condition true and wakes the
+// waiters with the lock held, so that no wakeup can be lost in between. Wakers may be IRQ handlers.
+// Contexts that can't block (see `Scheduler_canBlock`) halt until the next IRQ instead, and check
+// their condition again
+
+#define WAITQUEUE_NO_DEADLINE		SCHEDULER_NO_DEADLINE
+
+typedef struct WaitQueue {
+	spinlock_t lock; // Protects the waiters, and the condition they wait for
+	list_t waiters;
+} waitqueue_t;
+
+/// @brief Static initializer for the wait queue `var`, whose lock statistics are named `lock_name`
+#define WAITQUEUE_INIT(var, lock_name) \
+	{ .lock = SPINLOCK_INIT(lock_name), .waiters = LIST_STATIC_INIT((var).waiters) }
+
+/// @param stats Statistics to record the lock acquisitions in (nullable)
+void WaitQueue_init(waitqueue_t* wq, struct LockStats* stats);
+
+/// @brief Take the lock of `wq`, with IRQs disabled (wakers may be IRQ handlers)
+#define WaitQueue_lock(wq, flags) Spinlock_lockIrqSave(&(wq)->lock, flags)
+#define WaitQueue_unlock(wq, flags) Spinlock_unlockIrqRestore(&(wq)->lock, flags)
+
+/// @brief Wait on `wq` until woken, or until `deadline` (see `Time_get`). Usage:
+/// ```c
+/// WaitQueue_lock(wq, flags);
+/// while (!condition)
+/// 	WaitQueue_wait(wq, flags, WAITQUEUE_NO_DEADLINE);
+/// WaitQueue_unlock(wq, flags);
+/// ```
+/// @param flags The flags saved by `WaitQueue_lock`: a caller with IRQs already disabled can't block
+/// @return false if the deadline passed. The condition must be checked again either way
+/// @note The lock must be held: it is released while waiting, and held again on return
+bool WaitQueue_wait(waitqueue_t* wq, unsigned long flags, ktime_t deadline);
+
+/// @brief Wake the oldest waiter of `wq`
+/// @return Whether there was one
+/// @note The lock must be held
+bool WaitQueue_wakeOne(waitqueue_t* wq);
+
+/// @brief Wake all the waiters of `wq`
+/// @note The lock must be held
+void WaitQueue_wakeAll(waitqueue_t* wq);
+
+#endif
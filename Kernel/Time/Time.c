@@ -3,7 +3,11 @@
 #include "Logging.h"
 #include "Panic.h"
 #include "Time/Timers.h"
+#include "Time/Timer.h"
+#include "Sync/Spinlock.h"
+#include "Scheduler/Scheduler.h"
 #include "HAL/Halt.h"
+#include "HAL/IRQ/IrqFlags.h"
 #include "HAL/Drivers/Timers/ArchTimers.h"
 
 #include "Time.h"
@@ -15,7 +19,21 @@ static list_t m_eventTimers = LIST_STATIC_INIT(m_eventTimers);
 static struct SteadyTimer* m_steadyTimer = NULL;
 static struct EventTimer* m_eventTimer = NULL;
 
-static atomic_bool m_eventAcked = false;
+// Range of the conversions, in seconds
+#define CONVERSION_MAX_SECONDS	3600
+
+// The clock: the time of its last update, plus the steady timer's (masked) counter delta since
+// then. The counters wrap (every ~4.7s for a 24 bits PM timer), and the conversions overflow past
+// CONVERSION_MAX_SECONDS: only deltas are converted, and they are folded into `lastNs` once they
+// exceed half of that range. Readers retry if an update ran meanwhile: `seq` is odd during updates
+static struct {
+	atomic_uint seq;
+	uint64_t lastTicks; // Counter at the last update
+	ktime_t lastNs; // Time at the last update
+	uint64_t foldDelta; // Deltas above it are folded on read
+} m_clock;
+static spinlock_t m_clockLock = SPINLOCK_INIT("Clock");
+static struct Timer m_clockTimer; // Updates the clock, even if no one reads it (tickless CPUs)
 
 static inline void delayTicks(unsigned long ticks){
 	uint64_t t0 = m_steadyTimer->read();
@@ -25,32 +43,42 @@ static inline void delayTicks(unsigned long ticks){
 	}
 }
 
-static void eventHandlerSimpleAck(){
-	atomic_store(&m_eventAcked, true);
+static void setExpired(void* arg){
+	atomic_bool* expired = arg;
+	atomic_store(expired, true);
 }
 
-static inline void sleepNanoseconds(unsigned long ns){
-	m_eventTimer->eventHandler = eventHandlerSimpleAck;
-	unsigned long n_ticks = (ns * m_eventTimer->mult) >> m_eventTimer->shift;
+// Halt the CPU until `deadline`: no other thread runs meanwhile
+// Note: IRQs must be enabled
+static void haltUntil(ktime_t deadline){
+	atomic_bool expired = false;
+	struct Timer timer;
 
-	long n_full = n_ticks / m_eventTimer->maxTick;
-	long n_rem = max(n_ticks % m_eventTimer->maxTick, m_eventTimer->minTick);
+	Timer_init(&timer, setExpired, &expired);
+	Timer_start(&timer, deadline);
 
-	// Bulk wait for when the number of ticks exeeds the maxTick supported by the timer
-	for (long i=0 ; i<n_full ; i++){
-		m_eventAcked = false;
-		m_eventTimer->scheduleEvent(m_eventTimer->maxTick);
-		while (!atomic_load(&m_eventAcked)){
-			halt(); // wait for the IRQ
-		}
+	// Check with IRQs disabled, and halt atomically enabling them: the IRQ can't be missed
+	IRQ_disable();
+	while (!atomic_load(&expired)){
+		enableAndHalt();
+		IRQ_disable();
 	}
+	IRQ_enable();
+}
 
-	// Schedule and wait the remaining ticks
-	m_eventAcked = false;
-	m_eventTimer->scheduleEvent(n_rem);
-	while (!atomic_load(&m_eventAcked)){
-		halt();
+static void sleepNanoseconds(unsigned long ns){
+	// Sleeps shorter than the timers resolution busy-wait, as do the ones with IRQs disabled.
+	// Threads give the CPU away ; the others (boot code) halt it
+	if (ns < TIMER_RESOLUTION || !IRQ_areIRQSet(IRQ_getFlags())){
+		ndelay(ns);
+		return;
 	}
+
+	ktime_t deadline = Time_get() + ns;
+	if (Scheduler_canBlock())
+		Scheduler_sleepUntil(deadline);
+	else
+		haltUntil(deadline);
 }
 
 /// @brief Compute mult/shift operators for converting frequencies, such that
@@ -95,6 +123,41 @@ static ktime_t ticksToNs(const struct SteadyTimer* timer, uint64_t ticks){
 	return (timer->mult * ticks) >> timer->shift;
 }
 
+// ================ Clock ================
+
+// Fold the counter delta into the clock's base, and switch to `timer` (nullable) if given
+static void updateClock(struct SteadyTimer* timer){
+	unsigned long flags;
+
+	// IRQs are disabled: a reader interrupting the update would retry forever
+	Spinlock_lockIrqSave(&m_clockLock, flags);
+	atomic_fetch_add_explicit(&m_clock.seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	if (m_steadyTimer != NULL){
+		uint64_t ticks = m_steadyTimer->read();
+		uint64_t delta = (ticks - m_clock.lastTicks) & m_steadyTimer->mask;
+		m_clock.lastNs += ticksToNs(m_steadyTimer, delta);
+		m_clock.lastTicks = ticks;
+	}
+	if (timer != NULL){
+		uint64_t range = min(timer->mask, timer->frequency * CONVERSION_MAX_SECONDS);
+		m_clock.foldDelta = range / 2;
+		m_clock.lastTicks = timer->read();
+		m_steadyTimer = timer;
+	}
+
+	atomic_fetch_add_explicit(&m_clock.seq, 1, memory_order_release);
+	Spinlock_unlockIrqRestore(&m_clockLock, flags);
+}
+
+// Update the clock every quarter of its folding range: even if the timer is late, the counter
+// doesn't wrap in between
+static void clockTimerCallback(void*){
+	updateClock(NULL);
+	Timer_start(&m_clockTimer, Time_get() + ticksToNs(m_steadyTimer, m_clock.foldDelta / 2));
+}
+
 // ================ Public API ================
 
 void Time_init(){
@@ -110,32 +173,67 @@ void Time_init(){
 		panic();
 	}
 
+	m_eventTimer->eventHandler = Timer_expire;
+
 	log(SUCCESS, MODULE, "Initialized with %s steady timer & %s event timer",
 		m_steadyTimer->name, m_eventTimer->name);
 }
 
+void Time_startClockUpdates(){
+	Timer_init(&m_clockTimer, clockTimerCallback, NULL);
+	clockTimerCallback(NULL);
+}
+
 void Time_registerSteadyTimer(struct SteadyTimer* timer){
 	List_pushBack(&m_steadyTimers, &timer->node);
 
-	computeConversion(&timer->mult, &timer->shift, timer->frequency, 1000000000, 3600);
+	computeConversion(&timer->mult, &timer->shift, timer->frequency, 1000000000, CONVERSION_MAX_SECONDS);
 
 	if (m_steadyTimer == NULL || m_steadyTimer->score < timer->score)
-		m_steadyTimer = timer;
+		updateClock(timer);
 }
 
 void Time_registerEventTimer(struct EventTimer* timer){
 	List_pushBack(&m_eventTimers, &timer->node);
 
 	// EventTimer conversion is from nanoseconds to n_ticks
-	computeConversion(&timer->mult, &timer->shift, 1000000000, timer->frequency, 3600);
+	computeConversion(&timer->mult, &timer->shift, 1000000000, timer->frequency, CONVERSION_MAX_SECONDS);
 
 	if (m_eventTimer == NULL || m_eventTimer->score < timer->score)
 		m_eventTimer = timer;
 }
 
+void Time_scheduleEvent(ktime_t delay){
+	// Longer delays would overflow the conversion: the event fires earlier, and is scheduled again
+	delay = min(max(delay, (ktime_t) 0), (ktime_t) CONVERSION_MAX_SECONDS * 1000000000);
+
+	unsigned long n_ticks = ((uint64_t) delay * m_eventTimer->mult) >> m_eventTimer->shift;
+	m_eventTimer->scheduleEvent(min(max(n_ticks, m_eventTimer->minTick), m_eventTimer->maxTick));
+}
+
 ktime_t Time_get(){
-	uint64_t ticks = m_steadyTimer->read();
-	return ticksToNs(m_steadyTimer, ticks);
+	struct SteadyTimer* timer;
+	uint64_t last_ticks, ticks, fold_delta;
+	ktime_t last_ns;
+	unsigned int seq;
+
+	// The counter is read after the snapshot: it can't be behind `last_ticks`
+	do {
+		seq = atomic_load_explicit(&m_clock.seq, memory_order_acquire);
+		timer = m_steadyTimer;
+		last_ticks = m_clock.lastTicks;
+		last_ns = m_clock.lastNs;
+		fold_delta = m_clock.foldDelta;
+		ticks = timer->read();
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) || seq != atomic_load_explicit(&m_clock.seq, memory_order_relaxed));
+
+	uint64_t delta = (ticks - last_ticks) & timer->mask;
+	// Not updated for long: fold it now, before the counter wraps
+	if (delta > fold_delta)
+		updateClock(NULL);
+
+	return last_ns + ticksToNs(timer, delta);
 }
 
 void sleep(unsigned long sec){
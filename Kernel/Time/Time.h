@@ -7,18 +7,33 @@
 /// @brief Kernel time type: a signed number of nanoseconds
 typedef int64_t ktime_t;
 
+#define KTIME_MAX INT64_MAX
+
 /// @brief Initialize the Time subsystem
 void Time_init();
 
+/// @brief Start updating the clock periodically, so that it doesn't miss a counter wrap while
+/// no one reads it. Call it once the timer wheels are initialized (see Time/Timer.h)
+void Time_startClockUpdates();
+
 /// @brief Register an SteadyTimer to the Time subsystem
 void Time_registerSteadyTimer(struct SteadyTimer* timer);
 
 /// @brief Register an EventTimer to the Time subsystem
 void Time_registerEventTimer(struct EventTimer* timer);
 
-/// @brief Return a read of the current time
+/// @brief Program the current CPU's event timer to fire in `delay` nanoseconds (or earlier, if it
+/// can't wait that long). Replaces the event previously programmed
+/// @note Used by the timer wheels (see Time/Timer.h): use timers instead
+void Time_scheduleEvent(ktime_t delay);
+
+/// @brief Return a read of the current time: nanoseconds since the first steady timer was
+/// registered. It is monotonic, and doesn't wrap with the steady timer's counter
 ktime_t Time_get();
 
+// Sleeps: a thread gives the CPU away, and other contexts (the boot code) halt it, until a timer
+// expires (see Time/Timer.h). Sleeps shorter than the timers resolution busy-wait instead
+
 /// @brief Sleep for `sec` seconds (IRQ unsafe)
 void sleep(unsigned long sec);
 
@@ -0,0 +1,299 @@
+#include <stddef.h>
+#include "stdlib.h"
+#include "mugOS/Preprocessor.h"
+#include "mugOS/List.h"
+#include "mugOS/SlabAllocator.h"
+#include "Logging.h"
+#include "Panic.h"
+#include "Sync/Spinlock.h"
+#include "SMP/SMP.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "HAL/Halt.h"
+
+#include "Timer.h"
+#define MODULE "Timer"
+
+#define LEVEL_MASK					(TIMER_LEVEL_SIZE - 1)
+#define LEVEL_SHIFT(level)			((level) * TIMER_LEVEL_SHIFT)
+#define LEVEL_GRANULARITY(level)	(1ull << LEVEL_SHIFT(level))
+// Distance (in wheel ticks) from which timers go to `level`
+#define LEVEL_START(level)			((uint64_t) (TIMER_LEVEL_SIZE - 1) << LEVEL_SHIFT((level) - 1))
+#define WHEEL_MAX_DELTA				(LEVEL_START(TIMER_LEVELS) - LEVEL_GRANULARITY(TIMER_LEVELS - 1))
+#define EXPIRED_SLOT				-1 // Slot of the timers collected, whose callbacks are to run
+#define NO_EXPIRY					UINT64_MAX
+
+compile_assert(TIMER_LEVEL_SIZE == 64); // The pending bitmaps are uint64_t
+
+// A slot of level l holds the timers that expire at `index << LEVEL_SHIFT(l)` (rounded up), for
+// the next TIMER_LEVEL_SIZE indices of the level. It is processed when the wheel's clock reaches
+// it: level 0 slots at each wheel tick, level 1 slots every 8 ticks, and so on. The clock skips
+// the ticks without timers, instead of processing them one by one
+struct TimerWheel {
+	spinlock_t lock;
+	uint64_t clk; // Next wheel tick to process
+	ktime_t programmed; // Time the event timer is programmed for, KTIME_MAX if none
+	struct Timer* running; // Timer whose callback runs (see Timer_cancel)
+	uint64_t pending[TIMER_LEVELS]; // Bit i: slot i of the level has timers
+	list_t slots[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+	list_t expired; // Collected timers, whose callbacks are to run
+};
+
+static struct TimerWheel* m_wheels = NULL; // Indexed by CPU ID. NULL until Timer_initWheels
+static struct LockStats m_wheelsLockStats = { .name = "Timer wheels" };
+
+// Note: IRQs must be disabled
+static inline struct TimerWheel* getWheel(){
+	return &m_wheels[SMP_getCpuId()];
+}
+
+// Wheel tick of `deadline`, rounded up: a timer never expires early
+static inline uint64_t toWheelTicks(ktime_t deadline){
+	if (deadline <= 0)
+		return 0;
+
+	uint64_t ticks = deadline >> TIMER_RESOLUTION_SHIFT;
+	if (deadline & (TIMER_RESOLUTION - 1))
+		ticks++;
+
+	return ticks;
+}
+
+// ================ Wheel ================
+
+// Add `timer` to the slot of its expiry
+// @return The wheel tick at which the slot expires
+static uint64_t enqueue(struct TimerWheel* wheel, struct Timer* timer){
+	uint64_t clk = wheel->clk;
+	uint64_t expiry = timer->expiry;
+	uint64_t index;
+	int level = 0;
+
+	if (expiry < clk){
+		// Already expired: on the next processed tick
+		index = clk;
+	}
+	else{
+		if (expiry - clk > WHEEL_MAX_DELTA)
+			expiry = clk + WHEEL_MAX_DELTA;
+		while (level < TIMER_LEVELS - 1 && expiry - clk >= LEVEL_START(level + 1))
+			level++;
+
+		index = (expiry + LEVEL_GRANULARITY(level) - 1) >> LEVEL_SHIFT(level);
+	}
+
+	int slot = index & LEVEL_MASK;
+	List_pushBack(&wheel->slots[level][slot], &timer->lnode);
+	wheel->pending[level] |= 1ull << slot;
+	timer->slot = level * TIMER_LEVEL_SIZE + slot;
+	timer->pending = true;
+
+	return index << LEVEL_SHIFT(level);
+}
+
+static void detach(struct TimerWheel* wheel, struct Timer* timer){
+	timer->pending = false;
+
+	if (timer->slot == EXPIRED_SLOT){
+		List_pop(&wheel->expired, &timer->lnode);
+		return;
+	}
+
+	int level = timer->slot / TIMER_LEVEL_SIZE;
+	int slot = timer->slot % TIMER_LEVEL_SIZE;
+	List_pop(&wheel->slots[level][slot], &timer->lnode);
+	if (List_isEmpty(&wheel->slots[level][slot]))
+		wheel->pending[level] &= ~(1ull << slot);
+}
+
+// Find the wheel tick at which the first pending slot expires
+// @return NO_EXPIRY if there is none
+static uint64_t getNextExpiry(struct TimerWheel* wheel){
+	uint64_t next = NO_EXPIRY;
+
+	for (int level=0 ; level<TIMER_LEVELS ; level++){
+		uint64_t pending = wheel->pending[level];
+		if (pending == 0)
+			continue;
+
+		// First index of the level still to process, and the first pending slot from there
+		uint64_t first = (wheel->clk + LEVEL_GRANULARITY(level) - 1) >> LEVEL_SHIFT(level);
+		int start = first & LEVEL_MASK;
+		uint64_t rotated = (pending >> start) | (pending << ((TIMER_LEVEL_SIZE - start) & LEVEL_MASK));
+		next = min(next, (first + __builtin_ctzll(rotated)) << LEVEL_SHIFT(level));
+	}
+
+	return next;
+}
+
+// Move the timers of the slots that expire at the current tick to the expired list
+static void collect(struct TimerWheel* wheel){
+	uint64_t index = wheel->clk;
+
+	for (int level=0 ; level<TIMER_LEVELS ; level++){
+		int slot = index & LEVEL_MASK;
+		list_t* list = &wheel->slots[level][slot];
+
+		while (!List_isEmpty(list)){
+			struct Timer* timer = List_getObject(list->head, struct Timer, lnode);
+			List_popFront(list);
+			List_pushBack(&wheel->expired, &timer->lnode);
+			timer->slot = EXPIRED_SLOT;
+		}
+		wheel->pending[level] &= ~(1ull << slot);
+
+		// The next level's slots only expire at its granularity
+		if (index & (LEVEL_GRANULARITY(1) - 1))
+			break;
+		index >>= TIMER_LEVEL_SHIFT;
+	}
+}
+
+// Run the callbacks of the expired timers. They run without the lock: they may start timers
+static void runExpired(struct TimerWheel* wheel){
+	while (!List_isEmpty(&wheel->expired)){
+		struct Timer* timer = List_getObject(wheel->expired.head, struct Timer, lnode);
+		List_popFront(&wheel->expired);
+		timer->pending = false;
+		wheel->running = timer;
+
+		Spinlock_unlock(&wheel->lock);
+		timer->callback(timer->arg);
+		Spinlock_lock(&wheel->lock);
+
+		wheel->running = NULL;
+	}
+}
+
+// Advance the clock of a wheel left idle up to now, so that new timers get their precise level
+// Note: the ticks skipped have no timers
+static void forward(struct TimerWheel* wheel){
+	uint64_t now = Time_get() >> TIMER_RESOLUTION_SHIFT;
+	if (now <= wheel->clk)
+		return;
+
+	wheel->clk = min(now, getNextExpiry(wheel));
+}
+
+// Program the event timer for the wheel tick `next`, unless it fires before already
+static void program(struct TimerWheel* wheel, uint64_t next){
+	if (next == NO_EXPIRY)
+		return;
+
+	ktime_t deadline = next << TIMER_RESOLUTION_SHIFT;
+	if (deadline >= wheel->programmed)
+		return;
+
+	wheel->programmed = deadline;
+	Time_scheduleEvent(deadline - Time_get());
+}
+
+// ================ Public API ================
+
+void Timer_initWheels(){
+	m_wheels = kmalloc(g_nCPUs * sizeof(struct TimerWheel));
+	if (m_wheels == NULL){
+		log(PANIC, MODULE, "Could not allocate the timer wheels !");
+		panic();
+	}
+
+	uint64_t now = Time_get() >> TIMER_RESOLUTION_SHIFT;
+	for (int i=0 ; i<g_nCPUs ; i++){
+		struct TimerWheel* wheel = &m_wheels[i];
+
+		Spinlock_init(&wheel->lock, &m_wheelsLockStats);
+		wheel->clk = now;
+		wheel->programmed = KTIME_MAX;
+		wheel->running = NULL;
+		for (int level=0 ; level<TIMER_LEVELS ; level++){
+			wheel->pending[level] = 0;
+			for (int slot=0 ; slot<TIMER_LEVEL_SIZE ; slot++)
+				List_init(&wheel->slots[level][slot]);
+		}
+		List_init(&wheel->expired);
+	}
+
+	log(SUCCESS, MODULE, "Initialized, with a %ld us resolution", TIMER_RESOLUTION / 1000);
+}
+
+void Timer_init(struct Timer* timer, void (*callback)(void* arg), void* arg){
+	timer->callback = callback;
+	timer->arg = arg;
+	timer->cpu = -1;
+	timer->pending = false;
+}
+
+void Timer_start(struct Timer* timer, ktime_t deadline){
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+
+	// It may be pending on another CPU
+	if (timer->cpu >= 0){
+		struct TimerWheel* previous = &m_wheels[timer->cpu];
+		Spinlock_lock(&previous->lock);
+		if (timer->pending)
+			detach(previous, timer);
+		Spinlock_unlock(&previous->lock);
+	}
+
+	struct TimerWheel* wheel = getWheel();
+	Spinlock_lock(&wheel->lock);
+	forward(wheel);
+	timer->expiry = toWheelTicks(deadline);
+	timer->cpu = SMP_getCpuId();
+	program(wheel, enqueue(wheel, timer));
+	Spinlock_unlock(&wheel->lock);
+
+	IRQ_restore(flags);
+}
+
+bool Timer_cancel(struct Timer* timer){
+	unsigned long flags;
+
+	if (timer->cpu < 0)
+		return false;
+
+	// Note: the event timer stays programmed, a spurious event is cheaper than reprogramming it
+	struct TimerWheel* wheel = &m_wheels[timer->cpu];
+	Spinlock_lockIrqSave(&wheel->lock, flags);
+	bool pending = timer->pending;
+	if (pending)
+		detach(wheel, timer);
+
+	while (wheel->running == timer){
+		Spinlock_unlock(&wheel->lock);
+		pause();
+		Spinlock_lock(&wheel->lock);
+	}
+	Spinlock_unlockIrqRestore(&wheel->lock, flags);
+
+	return pending;
+}
+
+void Timer_expire(){
+	if (m_wheels == NULL)
+		return;
+
+	struct TimerWheel* wheel = getWheel();
+	uint64_t now = Time_get() >> TIMER_RESOLUTION_SHIFT;
+
+	Spinlock_lock(&wheel->lock);
+	wheel->programmed = KTIME_MAX;
+
+	while (wheel->clk <= now){
+		// Skip to the next tick that has timers
+		uint64_t next = getNextExpiry(wheel);
+		if (next > now){
+			wheel->clk = now + 1;
+			break;
+		}
+
+		wheel->clk = next;
+		collect(wheel);
+		wheel->clk++;
+		runExpired(wheel);
+	}
+
+	program(wheel, getNextExpiry(wheel));
+	Spinlock_unlock(&wheel->lock);
+}
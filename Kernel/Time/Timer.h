@@ -0,0 +1,62 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mugOS/List.h"
+#include "Time/Time.h"
+
+// Timer.h: kernel timers, callbacks that run at a deadline (see Timers.h for the hardware timers)
+// Each CPU has a hierarchical timer wheel: levels of slots (lists of timers), each level being
+// TIMER_LEVEL_SHIFT times coarser than the previous one. A timer goes in the slot of the first
+// level whose range covers its deadline, so starting and cancelling it is O(1), whatever the
+// number of timers. Deadlines are rounded up to the granularity of their level (an eighth of their
+// distance at most): nearby ones are coalesced, and expire together. They never expire early.
+// The event timer isn't periodic: it is only programmed for the next expiry of the CPU's wheel
+// (tickless), and a CPU without timers gets no timer IRQ at all
+
+#define TIMER_RESOLUTION_SHIFT	18 // Level 0 granularity: 2^18 ns (~262 us)
+#define TIMER_RESOLUTION		(1l << TIMER_RESOLUTION_SHIFT) // In nanoseconds
+#define TIMER_LEVEL_SIZE		64 // Slots per level: one bit each in the pending bitmaps
+#define TIMER_LEVEL_SHIFT		3 // Each level is 8 times coarser than the previous one
+#define TIMER_LEVELS			9 // Range: ~77 hours ; later deadlines are clamped to it
+
+struct Timer {
+	lnode_t lnode;
+	uint64_t expiry; // In wheel ticks (TIMER_RESOLUTION)
+	void (*callback)(void* arg);
+	void* arg;
+	int cpu; // CPU whose wheel it is (or was last) in ; -1 if it was never started
+	int slot; // Slot it is in: level * TIMER_LEVEL_SIZE + index
+	bool pending;
+};
+
+/// @brief Allocate the CPUs timer wheels
+/// @note The number of CPUs must be known (see `SMP_init`)
+void Timer_initWheels();
+
+/// @brief Initialize `timer`, whose `callback(arg)` will be called when it expires. Callbacks run
+/// from the event timer IRQ, on the CPU that started the timer, with IRQs disabled
+void Timer_init(struct Timer* timer, void (*callback)(void* arg), void* arg);
+
+/// @brief Start `timer` on the current CPU, to expire at `deadline` (see `Time_get`). Restarts it
+/// if it is already pending
+/// @note Starting and cancelling the same timer concurrently must be serialized by the caller
+void Timer_start(struct Timer* timer, ktime_t deadline);
+
+/// @brief Cancel `timer`. If its callback is running (on another CPU), wait for it to return:
+/// the timer can be freed afterwards
+/// @return Whether it was pending
+/// @note Do NOT call it from the timer's own callback
+bool Timer_cancel(struct Timer* timer);
+
+/// @brief Whether `timer` is pending (a hint, unless the caller serializes it with its starts)
+static inline bool Timer_isPending(struct Timer* timer){
+	return timer->pending;
+}
+
+/// @brief Run the current CPU's expired timers, and program the next event
+/// @note Called from the event timer IRQ
+void Timer_expire();
+
+#endif
@@ -46,6 +46,22 @@ void List_pushBack(list_t* list, lnode_t* node){
 	list->tail = node;
 }
 
+void List_insertBefore(list_t* list, lnode_t* next, lnode_t* node){
+	assert(list != NULL);
+	assert(next != NULL);
+	assert(node != NULL);
+
+	if (next == (lnode_t*) list)
+		return List_pushBack(list, node);
+	if (next == list->head)
+		return List_pushFront(list, node);
+
+	node->next = next;
+	node->prev = next->prev;
+	next->prev->next = node;
+	next->prev = node;
+}
+
 void List_empty(list_t* list){
 	assert(list != NULL);
 
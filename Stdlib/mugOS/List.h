@@ -59,6 +59,8 @@ typedef struct List {
 void List_init(list_t* list);
 void List_pushFront(list_t* list, lnode_t* node);
 void List_pushBack(list_t* list, lnode_t* node);
+/// @brief Insert `node` before `next`, which may be the list head itself (inserts at the end)
+void List_insertBefore(list_t* list, lnode_t* next, lnode_t* node);
 void List_empty(list_t* list);
 void List_popFront(list_t* list);
 void List_popBack(list_t* list);
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdatomic.h>
 #include "string.h"
 #include "stdio.h"
 #include "assert.h"
@@ -11,6 +12,11 @@
 #include "Panic.h"
 #include "Memory/PMM.h"
 #include "Memory/VMM.h"
+#include "Memory/Page.h"
+#include "Memory/VMalloc.h"
+#include "Sync/Spinlock.h"
+#include "HAL/IRQ/IrqFlags.h"
+#include "HAL/SMP/PerCPU.h"
 #else
 #error "Implement a mmap-like system call"
 #endif
@@ -23,8 +29,8 @@
 #define align(ptr)						((void*) roundMultiple((uintptr_t)(ptr), OBJ_ROUND))
 
 #define KMALLOC_MIN_CACHE_SIZE			32
-#define KMALLOC_MAX_CACHE_SIZE			65536
-#define KMALLOC_N_CACHES				12 // log2(KMALLOC_MAX_CACHE_SIZE) - log2(KMALLOC_MIN_CACHE_SIZE) + 1
+#define KMALLOC_MAX_CACHE_SIZE			16384 // Above, kmalloc uses vmalloc
+#define KMALLOC_N_CACHES				10 // log2(KMALLOC_MAX_CACHE_SIZE) - log2(KMALLOC_MIN_CACHE_SIZE) + 1
 #define KMALLOC_CACHES_OFFSET			5 // = log2(KMALLOC_MIN_CACHE_SIZE)
 
 #define SLAB_OFFSLAB_THRESHOLD			512 // Above, struct Slab is allocated in kmalloc caches
@@ -34,6 +40,12 @@
 
 #define REAP_TARGET						16 // Perfect target for reaping memory, in #pages
 
+#define MAGAZINE_SIZE					15 // Objects per magazine
+
+#define SLABINFO_HEADER \
+	"# active    total objsize obj/slab pages | slabs empty" \
+	" |     allocs      frees   misses  grows shrinks | name\n"
+
 // Slab management structures
 struct Slab {
 	struct Cache* owner;
@@ -49,6 +61,25 @@ struct Slab {
 	uint32_t* freeObjects;
 };
 
+// Magazine: a stack of free objects, loaded in a CPU or stored in its cache's depot
+struct Magazine {
+	lnode_t magazine_lnode;
+	int n_rounds; // #objects in the magazine
+	void* rounds[MAGAZINE_SIZE];
+};
+
+// Per-CPU layer of a cache. Allocations and frees are served by the loaded magazine ;
+// the previous one avoids going to the depot when they alternate at a magazine boundary
+struct CPUCache {
+	struct Magazine* loaded;
+	struct Magazine* previous;
+
+	// Statistics
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t misses; // Allocations and frees that needed the depot (or the slabs)
+};
+
 // Object cache, with an optional constructor
 typedef struct Cache {
 	char name[24];
@@ -62,35 +93,54 @@ typedef struct Cache {
 	list_t partial_slabs;
 	list_t empty_slabs;
 
+	// Per-CPU layer, indexed by CPU ID. NULL until SlabAllocator_initCPUCaches
+	struct CPUCache* cpuCaches;
+	// Depot: magazines that are not loaded in any CPU
+	list_t full_magazines;
+	list_t empty_magazines;
+
+	// Statistics of the slab layer. Per-CPU ones are in struct CPUCache
+	struct {
+		uint64_t allocs; // Allocations and frees done without the per-CPU layer
+		uint64_t frees;
+		uint64_t grows;
+		uint64_t shrinks;
+		uint64_t n_slabs;
+		uint64_t n_empty_slabs;
+	} stats;
+
+	spinlock_t lock; // Protects the slabs, the depot and the stats
 	lnode_t cache_lnode;
 } cache_t;
 
-typedef void* key_t;
-typedef struct Slab* value_t;
-
-typedef struct HashmapEntry {
-	key_t key;
-	value_t value;
-} entry_t;
-
-typedef struct Hashmap {
-	entry_t* entries;
-	long totalEntries;
-	long freeEntries;
-} hashmap_t;
-
 // Cache for allocating caches structs
 static struct Cache m_cacheCache = {
 	.name = "caches",
 	.offslab = false,
 	.objSize = sizeof(struct Cache),
 	.n_pages = 1,
-	.n_objects = (1*PAGE_SIZE - sizeof(struct Slab)) / (128 + getSlabFreelistSize(1)), // 30
+	.n_objects = (1*PAGE_SIZE - sizeof(struct Slab)) / (sizeof(struct Cache) + getSlabFreelistSize(1)),
 	.constructor = NULL,
 
 	.full_slabs = LIST_STATIC_INIT(m_cacheCache.full_slabs),
 	.partial_slabs = LIST_STATIC_INIT(m_cacheCache.partial_slabs),
 	.empty_slabs = LIST_STATIC_INIT(m_cacheCache.empty_slabs),
+	.lock = SPINLOCK_INIT("Slab: caches cache"),
+};
+
+// Cache for allocating magazines (it has no per-CPU layer itself)
+static struct Cache m_magazineCache = {
+	.name = "magazines",
+	.offslab = false,
+	.objSize = sizeof(struct Magazine),
+	.n_pages = 1,
+	.n_objects = (1*PAGE_SIZE - sizeof(struct Slab)) / (sizeof(struct Magazine) + getSlabFreelistSize(1)),
+	.constructor = NULL,
+
+	.full_slabs = LIST_STATIC_INIT(m_magazineCache.full_slabs),
+	.partial_slabs = LIST_STATIC_INIT(m_magazineCache.partial_slabs),
+	.empty_slabs = LIST_STATIC_INIT(m_magazineCache.empty_slabs),
+	.lock = SPINLOCK_INIT("Slab: magazines cache"),
 };
 
 static struct Cache m_kmallocCaches[KMALLOC_N_CACHES] = {
@@ -104,167 +154,28 @@ static struct Cache m_kmallocCaches[KMALLOC_N_CACHES] = {
 	{ .objSize =  4096 },
 	{ .objSize =  8192 },
 	{ .objSize = 16384 },
-	{ .objSize = 32768 },
-	{ .objSize = 65536 },
 };
 
-static hashmap_t m_hashmap;
 static list_t m_caches = LIST_STATIC_INIT(m_caches);
+static spinlock_t m_cachesLock = SPINLOCK_INIT("Slab: caches list");
+static struct LockStats m_cacheLockStats = { .name = "Slab: caches" }; // Shared by the other caches
+static int m_nCPUs = 0; // Size of the caches' cpuCaches arrays, 0 while they are disabled
 
 static void* allocatePages(long n, bool clear);
 static void freePages(void* pages, long n);
 
-// ================ Hashmap ================
+// ================ Locking ================
 
-#define HASHMAP_DEFAULT_SIZE		(long) (PAGE_SIZE/sizeof(entry_t))
-// Max size of hashmap, in bytes
-#define HASHMAP_MAX_SIZE			(long) (SIZE_MAX / (2*sizeof(entry_t)))
-// Grow hashmap if we're below 25% of free space (75% full)
-// Do NOT EVER set it to 0%, algorithms rely on assumption that map is partially empty
-#define hashmapTooFull(map)			(map->freeEntries*4 < map->totalEntries)
+// Note: the locks are taken with IRQs disabled, and in this order: caches list, cache. The PMM
+// shrinker (shrinkCaches) takes them from within allocations: no allocation that may reclaim is
+// made while holding them (see allocatePages)
 
-static inline uint64_t hash(void* key){
-	// Hashing pointers, maybe test later
-	uint64_t sum;
-	uintptr_t actual_ptr_value;
-
-	actual_ptr_value = (uintptr_t)key >> PAGE_SHIFT;
-	sum = actual_ptr_value;
-	sum = (sum << 7) - sum + (actual_ptr_value >> 16);
-
-	// Use these two lines only on 64 bits (we only support 64 bits CPU anyway)
-	sum = (sum << 7) - sum + (actual_ptr_value >> 32);
-	sum = (sum << 7) - sum + (actual_ptr_value >> 48);
-
-	return sum;
+static inline void spinLock(spinlock_t* lock){
+	Spinlock_lock(lock);
 }
 
-static bool Hashmap_grow(hashmap_t* map){
-	assert(map);
-	void* p;
-	entry_t* new_values;
-
-	if (map->totalEntries > HASHMAP_MAX_SIZE)
-		return false;
-
-	// Double the capacity
-	long new_total = (map->totalEntries == 0) ? HASHMAP_DEFAULT_SIZE : 2*map->totalEntries;
-	long n_pages = roundToPage(new_total * sizeof(entry_t));
-	uint64_t mask = new_total - 1;
-
-	new_values = allocatePages(n_pages, true);
-	if (!new_values) return false;
-
-	// Copy the entries from old to new array
-	for (long i=0 ; i<map->totalEntries ; i++){
-		p = map->entries[i].key;
-		if (p == NULL)
-			continue;
-		uint64_t j = hash(p) & mask;
-		// Insert
-		while (new_values[j].key != NULL){
-			j = (j-1) & mask; // j--;
-		}
-		new_values[j] = map->entries[i]; // memcpy the value_t
-	}
-
-	// Free the previous mmap-ed 'values' array region
-	if (map->totalEntries > 0){
-		size_t old_size = roundToPage(map->totalEntries*sizeof(entry_t));
-		freePages(map->entries, roundToPage(old_size));
-	}
-	map->entries = new_values;
-	map->freeEntries += new_total - map->totalEntries;
-	map->totalEntries = new_total;
-	return true;
-}
-
-static bool Hashmap_insert(hashmap_t* map, key_t ptr, value_t value){
-	assert(map);
-	if (ptr == NULL) return false; // never insert NULL
-
-	// Lazily check for growth need
-	if (hashmapTooFull(map) || map->totalEntries == 0){
-		if (!Hashmap_grow(map))
-			return false;
-	}
-
-	const uint64_t mask = map->totalEntries - 1;
-
-	ptr = (void*) getPage(ptr);
-	uint64_t i = hash(ptr) & mask;
-
-	while (map->entries[i].key != NULL){
-		i = (i-1) & mask; // i--;
-	}
-
-	map->entries[i].key = ptr;
-	map->entries[i].value = value;
-	map->freeEntries--;
-	return true;
-}
-
-static entry_t* Hashmap_find(hashmap_t* map, key_t ptr){
-	assert(map);
-	if (map->entries == NULL) return NULL;
-	const uint64_t mask = map->totalEntries - 1;
-	uint64_t i;
-
-	ptr = (void*) getPage(ptr);
-	i = hash(ptr) & mask;
-
-	// Iterate over 'collisions' bucket
-	while (map->entries[i].key != NULL){
-		if (map->entries[i].key == ptr)
-			return map->entries + i;
-
-		i = (i-1) & mask; // i--;
-	}
-
-	return NULL;
-}
-
-/// @brief Delete the `entry` from the hashmap.
-/// @warning The address MUST be taken from the hashmap values (returned by Hashmap_find) !
-static void Hashmap_delete(hashmap_t* map, entry_t* entry){
-	assert(map);
-	assert(!(map->totalEntries & (map->totalEntries-1))); // assert that total is a power of two
-	if (entry == NULL) return;
-	if (map->totalEntries == 0) return;
-
-	const uint64_t mask = map->totalEntries - 1;
-	uint64_t cur_index, prev_index, target_index;
-
-	cur_index = entry - map->entries; // pointer arithmetic to get index of value
-	assert(cur_index < (uint64_t)map->totalEntries);
-
-	// Remove first element
-	map->entries[cur_index].key = NULL;
-	map->entries[cur_index].value = 0;
-	prev_index = cur_index;
-
-	// Handle collision bucket (move back elements that needs it)
-	do {
-		cur_index = (cur_index-1) & mask;
-
-		// The index at which cur element should be (if we exclude collisions)
-		target_index = hash(map->entries[cur_index].key) & mask;
-		if (cur_index <= target_index && target_index < prev_index) // cur <= target < prev
-			continue;
-		if (target_index < prev_index && prev_index < cur_index) // target < prev < cur
-			continue;
-		if (prev_index < cur_index && cur_index <= target_index) // prev < cur <= target
-			continue;
-
-		// Move cur to prev
-		map->entries[prev_index] = map->entries[cur_index];
-		map->entries[cur_index].key = NULL;
-		map->entries[cur_index].value = 0; // or memset if it's a struct
-		prev_index = cur_index;
-
-	} while (map->entries[cur_index].key != NULL);
-
-	map->freeEntries++;
+static inline void spinUnlock(spinlock_t* lock){
+	Spinlock_unlock(lock);
 }
 
 // ================ Slabs ================
@@ -370,28 +281,50 @@ static void initCache(struct Cache* cache, const char* name, size_t objsize, cto
 	List_init(&cache->full_slabs);
 	List_init(&cache->partial_slabs);
 	List_init(&cache->empty_slabs);
+
+	cache->cpuCaches = NULL;
+	List_init(&cache->full_magazines);
+	List_init(&cache->empty_magazines);
+	memset(&cache->stats, 0, sizeof(cache->stats));
+	Spinlock_init(&cache->lock, &m_cacheLockStats);
+}
+
+// Record (or forget) the slab and cache in the descriptors of the slab's payload pages
+static void setSlabPages(struct Slab* slab, long n_pages, cache_t* cache){
+	paddr_t addr = VMM_toPhysical(getPage(slab->payload));
+
+	for (long i=0 ; i<n_pages ; i++){
+		struct Page* page = Page_fromAddress(addr + i*PAGE_SIZE);
+		if (cache != NULL){
+			page->flags |= PAGE_FLAG_SLAB;
+			page->slab = slab;
+			page->cache = cache;
+		}
+		else {
+			page->flags &= ~PAGE_FLAG_SLAB;
+			page->slab = NULL;
+			page->cache = NULL;
+		}
+	}
+}
+
+// Get the descriptor of the page an object is in, NULL if it isn't a slab object
+static struct Page* getSlabPage(void* ptr){
+	paddr_t addr = VMM_toPhysical((vaddr_t) ptr);
+	if (!Page_isManaged(addr))
+		return NULL;
+
+	struct Page* page = Page_fromAddress(addr);
+	return (page->flags & PAGE_FLAG_SLAB) ? page : NULL;
 }
 
 static bool growCache(cache_t* cache){
 	assert(cache);
-	bool success;
 
 	struct Slab* new_slab = allocateSlab(cache->n_pages, cache->n_objects, cache->offslab);
 	if (new_slab == NULL) return false;
 
-	// Add entry for all pages to the hashmap
-	void* obj_base = new_slab->payload;
-	for (int i=0 ; i<cache->n_pages ; i++){
-		success = Hashmap_insert(&m_hashmap, obj_base + i*PAGE_SIZE, new_slab);
-		// On failure, undo all hashmap insertions
-		if (!success){
-			for (int j=0 ; j<i ; j++){
-				entry_t* entry = Hashmap_find(&m_hashmap, obj_base + j*PAGE_SIZE);
-				Hashmap_delete(&m_hashmap, entry);
-			}
-			return false;
-		}
-	}
+	setSlabPages(new_slab, cache->n_pages, cache);
 
 	// Initializes all new objects
 	if (cache->constructor != NULL){
@@ -403,6 +336,9 @@ static bool growCache(cache_t* cache){
 
 	new_slab->owner = cache;
 	List_pushFront(&cache->empty_slabs, &new_slab->slab_lnode);
+	cache->stats.grows++;
+	cache->stats.n_slabs++;
+	cache->stats.n_empty_slabs++;
 	return true;
 }
 
@@ -419,21 +355,20 @@ static void freeCacheInSlab(struct Cache* cache, struct Slab* slab, void* ptr){
 	else if (isSlabEmpty(slab)){
 		List_pop(&cache->partial_slabs, &slab->slab_lnode);
 		List_pushFront(&cache->empty_slabs, &slab->slab_lnode);
+		cache->stats.n_empty_slabs++;
 	}
 }
 
 static void removeCacheSlab(cache_t* cache, list_t* list, struct Slab* to_remove){
-	entry_t* entry;
 	long n_pages = cache->n_pages;
 	bool offslab = cache->offslab;
 
 	// Remove the slab from our structures
 	List_pop(list, &to_remove->slab_lnode);
-	for (int i=0 ; i<cache->n_pages ; i++){
-		entry = Hashmap_find(&m_hashmap, to_remove->payload + i*PAGE_SIZE);
-		if (entry != NULL) // Shouldn't happen
-			Hashmap_delete(&m_hashmap, entry);
-	}
+	setSlabPages(to_remove, n_pages, NULL);
+	cache->stats.n_slabs--;
+	if (list == &cache->empty_slabs)
+		cache->stats.n_empty_slabs--;
 
 	// Finally, we can free the pages
 	freeSlab(to_remove, n_pages, offslab);
@@ -443,23 +378,211 @@ static void shrinkCache(cache_t* cache, int n_slabs){
 	for (int i=0 ; i<n_slabs ; i++){
 		struct Slab* to_remove = List_getObject(cache->empty_slabs.head, struct Slab, slab_lnode);
 		removeCacheSlab(cache, &cache->empty_slabs, to_remove);
+		cache->stats.shrinks++;
 	}
 }
 
-static int getReapablePages(struct Cache* cache){
-	int n_pages = 0;
+// Note: IRQs must be disabled, and the cache locked
+static void* allocateFromSlabs(cache_t* cache){
+	struct Slab* slab;
+	bool was_empty = false;
 
-	lnode_t* node;
-	List_foreach(&cache->empty_slabs, node){
-		n_pages += cache->n_pages;
+	// Allocate from partial slabs
+	if (!List_isEmpty(&cache->partial_slabs)){
+		slab = List_getObject(cache->partial_slabs.head, struct Slab, slab_lnode);
+	}
+	// Allocate from free slabs. Grow if necessary
+	else {
+		if (List_isEmpty(&cache->empty_slabs) && !growCache(cache))
+			return NULL;
+		was_empty = true;
+		slab = List_getObject(cache->empty_slabs.head, struct Slab, slab_lnode);
+	}
+
+	void* res = allocateObject(slab);
+
+	if (was_empty){
+		List_pop(&cache->empty_slabs, &slab->slab_lnode);
+		List_pushFront(&cache->partial_slabs, &slab->slab_lnode);
+		cache->stats.n_empty_slabs--;
+	}
+	else if (isSlabFull(slab)){
+		List_pop(&cache->partial_slabs, &slab->slab_lnode);
+		List_pushFront(&cache->full_slabs, &slab->slab_lnode);
 	}
 
+	return res;
+}
+
+// Note: IRQs must be disabled, and the cache locked
+static void freeToSlabs(cache_t* cache, void* ptr){
+	struct Page* page = getSlabPage(ptr);
+	if (page == NULL) return;
+
+	struct Slab* slab = page->slab;
+	assert(slab->owner == cache);
+	freeCacheInSlab(cache, slab, ptr);
+}
+
+static int getReapablePages(struct Cache* cache){
+	int n_pages = cache->stats.n_empty_slabs * cache->n_pages;
+
 	if (cache->constructor != NULL)
 		n_pages /= 2;
 
 	return n_pages;
 }
 
+// ================ Magazines ================
+
+static inline bool isMagazineEmpty(struct Magazine* magazine){
+	return magazine == NULL || magazine->n_rounds == 0;
+}
+
+static inline bool isMagazineFull(struct Magazine* magazine){
+	return magazine == NULL || magazine->n_rounds == MAGAZINE_SIZE;
+}
+
+static inline void swapMagazines(struct CPUCache* cpu_cache){
+	struct Magazine* tmp = cpu_cache->loaded;
+	cpu_cache->loaded = cpu_cache->previous;
+	cpu_cache->previous = tmp;
+}
+
+static struct Magazine* popMagazine(list_t* list){
+	if (List_isEmpty(list))
+		return NULL;
+
+	struct Magazine* magazine = List_getObject(list->head, struct Magazine, magazine_lnode);
+	List_popFront(list);
+	return magazine;
+}
+
+// Give back all the objects of a magazine to the slabs, and free it
+// Note: IRQs must be disabled, and the cache locked
+static void destroyMagazine(cache_t* cache, struct Magazine* magazine){
+	if (magazine == NULL) return;
+
+	for (int i=0 ; i<magazine->n_rounds ; i++)
+		freeToSlabs(cache, magazine->rounds[i]);
+
+	Cache_free(&m_magazineCache, magazine);
+}
+
+// Note: IRQs must be disabled
+static void* allocateFromMagazines(cache_t* cache, struct CPUCache* cpu_cache){
+	if (isMagazineEmpty(cpu_cache->loaded)){
+		if (!isMagazineEmpty(cpu_cache->previous)){
+			swapMagazines(cpu_cache);
+		}
+		else {
+			// Both are empty: exchange the previous one for a full one from the depot
+			cpu_cache->misses++;
+			spinLock(&cache->lock);
+			struct Magazine* full = popMagazine(&cache->full_magazines);
+			if (full != NULL){
+				if (cpu_cache->previous != NULL)
+					List_pushFront(&cache->empty_magazines, &cpu_cache->previous->magazine_lnode);
+				cpu_cache->previous = cpu_cache->loaded;
+				cpu_cache->loaded = full;
+			}
+			spinUnlock(&cache->lock);
+
+			if (full == NULL)
+				return NULL;
+		}
+	}
+
+	return cpu_cache->loaded->rounds[--cpu_cache->loaded->n_rounds];
+}
+
+/// @note IRQs must be disabled
+/// @return false if the object could not be put in a magazine
+static bool freeToMagazines(cache_t* cache, struct CPUCache* cpu_cache, void* ptr){
+	if (isMagazineFull(cpu_cache->loaded)){
+		if (!isMagazineFull(cpu_cache->previous)){
+			swapMagazines(cpu_cache);
+		}
+		else {
+			// Both are full: exchange the previous one for an empty one from the depot
+			cpu_cache->misses++;
+			spinLock(&cache->lock);
+			struct Magazine* empty = popMagazine(&cache->empty_magazines);
+			spinUnlock(&cache->lock);
+
+			if (empty == NULL){
+				empty = Cache_malloc(&m_magazineCache);
+				if (empty == NULL)
+					return false;
+				empty->n_rounds = 0;
+			}
+
+			if (cpu_cache->previous != NULL){
+				spinLock(&cache->lock);
+				List_pushFront(&cache->full_magazines, &cpu_cache->previous->magazine_lnode);
+				spinUnlock(&cache->lock);
+			}
+			cpu_cache->previous = cpu_cache->loaded;
+			cpu_cache->loaded = empty;
+		}
+	}
+
+	cpu_cache->loaded->rounds[cpu_cache->loaded->n_rounds++] = ptr;
+	return true;
+}
+
+// Give back the depot's objects to the slabs, and free its magazines
+// Note: IRQs must be disabled, and the cache locked
+static void drainDepot(cache_t* cache){
+	while (!List_isEmpty(&cache->full_magazines))
+		destroyMagazine(cache, popMagazine(&cache->full_magazines));
+	while (!List_isEmpty(&cache->empty_magazines))
+		destroyMagazine(cache, popMagazine(&cache->empty_magazines));
+}
+
+static void initCPUCaches(cache_t* cache){
+	struct CPUCache* cpu_caches = kcalloc(m_nCPUs * sizeof(struct CPUCache));
+	if (cpu_caches == NULL){
+		log(WARNING, MODULE, "Could not allocate the per-CPU layer of cache '%s'", cache->name);
+		return;
+	}
+
+	cache->cpuCaches = cpu_caches;
+}
+
+// ================ Reclaim ================
+
+// PMM shrinker: give back the depots' objects to their slabs, and free empty slabs until
+// `n_pages` pages are freed
+static uint64_t shrinkCaches(uint64_t n_pages){
+	uint64_t freed = 0;
+	unsigned long flags;
+	lnode_t* node;
+
+	IRQ_disableSave(flags);
+	spinLock(&m_cachesLock);
+
+	List_foreach(&m_caches, node){
+		struct Cache* cache = List_getObject(node, struct Cache, cache_lnode);
+
+		spinLock(&cache->lock);
+		drainDepot(cache);
+		while (freed < n_pages && cache->stats.n_empty_slabs > 0){
+			shrinkCache(cache, 1);
+			freed += cache->n_pages;
+		}
+		spinUnlock(&cache->lock);
+
+		if (freed >= n_pages)
+			break;
+	}
+
+	spinUnlock(&m_cachesLock);
+	IRQ_restore(flags);
+
+	return freed;
+}
+
 // ================ Misc ================
 
 static void* allocatePages(long n, bool clear){
@@ -467,7 +590,10 @@ static void* allocatePages(long n, bool clear){
 	void* res;
 	size_t size = n*PAGE_SIZE;
 
+	// Note: the caches may be locked, so reclaiming (i.e. shrinking them) could deadlock
+	PMM_disableReclaim();
 	paddr_t addr = PMM_allocatePages(n);
+	PMM_enableReclaim();
 	if (addr == 0) return NULL;
 	res = (void*) VMM_mapInHeap(addr, n, PAGE_READ|PAGE_WRITE|PAGE_KERNEL);
 
@@ -490,6 +616,57 @@ static int getKmallocCache(size_t size){
 	return power_of_two - KMALLOC_CACHES_OFFSET;
 }
 
+// ================ Statistics ================
+
+static inline int countRounds(struct Magazine* magazine){
+	return (magazine == NULL) ? 0 : magazine->n_rounds;
+}
+
+/// @brief Format the statistics of a cache, as a line of the slabinfo dump
+/// @note IRQs must be disabled
+static int formatCacheInfo(struct Cache* cache, char* buffer, size_t size){
+	uint64_t allocs, frees, misses = 0;
+	uint64_t active = 0, free_rounds = 0;
+	lnode_t* node;
+
+	spinLock(&cache->lock);
+
+	allocs = cache->stats.allocs;
+	frees = cache->stats.frees;
+
+	// Objects handed out by the slabs...
+	List_foreach(&cache->full_slabs, node){
+		active += cache->n_objects;
+	}
+	List_foreach(&cache->partial_slabs, node){
+		active += List_getObject(node, struct Slab, slab_lnode)->n_allocated;
+	}
+
+	// ...minus the ones sitting in magazines
+	List_foreach(&cache->full_magazines, node){
+		free_rounds += List_getObject(node, struct Magazine, magazine_lnode)->n_rounds;
+	}
+	if (cache->cpuCaches != NULL){
+		// Note: other CPUs may be updating theirs, this is only a snapshot
+		for (int i=0 ; i<m_nCPUs ; i++){
+			struct CPUCache* cpu_cache = &cache->cpuCaches[i];
+			free_rounds += countRounds(cpu_cache->loaded) + countRounds(cpu_cache->previous);
+			allocs += cpu_cache->allocs;
+			frees += cpu_cache->frees;
+			misses += cpu_cache->misses;
+		}
+	}
+
+	// Note: the name is last, since our printf doesn't pad strings
+	int res = snprintf(buffer, size, "%8lu %8lu %7lu %8d %5ld | %5lu %5lu | %10lu %10lu %8lu %6lu %7lu | %s\n",
+		active - free_rounds, cache->stats.n_slabs * cache->n_objects, cache->objSize,
+		cache->n_objects, cache->n_pages, cache->stats.n_slabs, cache->stats.n_empty_slabs,
+		allocs, frees, misses, cache->stats.grows, cache->stats.shrinks, cache->name);
+
+	spinUnlock(&cache->lock);
+	return res;
+}
+
 // ================ Public cache API and kmalloc ================
 
 void SlabAllocator_init(){
@@ -505,16 +682,63 @@ void SlabAllocator_init(){
 		initCache(m_kmallocCaches+i, name, size, NULL);
 		List_pushFront(&m_caches, &m_kmallocCaches[i].cache_lnode);
 	}
+
+	PMM_registerShrinker(shrinkCaches);
+}
+
+void SlabAllocator_initCPUCaches(int n_cpus){
+	unsigned long flags;
+	lnode_t* node;
+
+	IRQ_disableSave(flags);
+	spinLock(&m_cachesLock);
+
+	m_nCPUs = n_cpus;
+	List_foreach(&m_caches, node){
+		initCPUCaches(List_getObject(node, struct Cache, cache_lnode));
+	}
+
+	spinUnlock(&m_cachesLock);
+	IRQ_restore(flags);
+}
+
+size_t SlabAllocator_dumpInfo(char* buffer, size_t size){
+	unsigned long flags;
+	size_t written;
+	lnode_t* node;
+
+	written = snprintf(buffer, size, "%s", SLABINFO_HEADER);
+
+	IRQ_disableSave(flags);
+	spinLock(&m_cachesLock);
+	List_foreach(&m_caches, node){
+		struct Cache* cache = List_getObject(node, struct Cache, cache_lnode);
+		size_t remaining = (written < size) ? size - written : 0;
+		written += formatCacheInfo(cache, buffer + min(written, size), remaining);
+	}
+	spinUnlock(&m_cachesLock);
+	IRQ_restore(flags);
+
+	return written;
 }
 
 void SlabAllocator_reapAndTear(){
 	struct Cache* cur, *cache_to_reap = NULL;
 	int cur_n_pages, to_reap_n_pages = 0;
+	unsigned long flags;
+	lnode_t* node;
 
-	if (List_isEmpty(&m_caches))
-		return;
+	IRQ_disableSave(flags);
+	spinLock(&m_cachesLock);
+
+	// First, give back the objects in the depots to their slabs
+	List_foreach(&m_caches, node){
+		cur = List_getObject(node, struct Cache, cache_lnode);
+		spinLock(&cur->lock);
+		drainDepot(cur);
+		spinUnlock(&cur->lock);
+	}
 
-	lnode_t* node;
 	List_foreach(&m_caches, node){
 		cur = List_getObject(node, struct Cache, cache_lnode);
 		cur_n_pages = getReapablePages(cur);
@@ -524,17 +748,23 @@ void SlabAllocator_reapAndTear(){
 		}
 	}
 
-	if (cache_to_reap == NULL)
-		return;
+	if (cache_to_reap != NULL){
+		if (to_reap_n_pages > REAP_TARGET)
+			to_reap_n_pages /= 2;
 
-	if (to_reap_n_pages > REAP_TARGET)
-		to_reap_n_pages /= 2;
+		int n_slabs = to_reap_n_pages / cache_to_reap->n_pages;
+		spinLock(&cache_to_reap->lock);
+		shrinkCache(cache_to_reap, n_slabs);
+		spinUnlock(&cache_to_reap->lock);
+	}
 
-	int n_slabs = to_reap_n_pages / cache_to_reap->n_pages;
-	shrinkCache(cache_to_reap, n_slabs);
+	spinUnlock(&m_cachesLock);
+	IRQ_restore(flags);
 }
 
 cache_t* Cache_create(const char* name, size_t objsize, ctor_t ctor){
+	unsigned long flags;
+
 	if (objsize == 0)
 		return NULL;
 
@@ -542,13 +772,38 @@ cache_t* Cache_create(const char* name, size_t objsize, ctor_t ctor){
 	if (cache == NULL) return NULL;
 
 	initCache(cache, name, objsize, ctor);
+
+	IRQ_disableSave(flags);
+	spinLock(&m_cachesLock);
+	if (m_nCPUs > 0)
+		initCPUCaches(cache);
 	List_pushFront(&m_caches, &cache->cache_lnode);
+	spinUnlock(&m_cachesLock);
+	IRQ_restore(flags);
+
 	return cache;
 }
 
 void Cache_destroy(cache_t* cache){
 	if (cache == NULL) return;
 	struct Slab* slab_to_free;
+	unsigned long flags;
+
+	IRQ_disableSave(flags);
+	spinLock(&m_cachesLock);
+	List_pop(&m_caches, &cache->cache_lnode);
+	spinUnlock(&m_cachesLock);
+
+	// Note: the cache must not be in use anymore, on any CPU
+	spinLock(&cache->lock);
+	if (cache->cpuCaches != NULL){
+		for (int i=0 ; i<m_nCPUs ; i++){
+			destroyMagazine(cache, cache->cpuCaches[i].loaded);
+			destroyMagazine(cache, cache->cpuCaches[i].previous);
+		}
+		kfree(cache->cpuCaches);
+	}
+	drainDepot(cache);
 
 	// Delete all slabs
 	while (!List_isEmpty(&cache->empty_slabs)){
@@ -563,53 +818,68 @@ void Cache_destroy(cache_t* cache){
 		slab_to_free = List_getObject(cache->full_slabs.head, struct Slab, slab_lnode);
 		removeCacheSlab(cache, &cache->full_slabs, slab_to_free);
 	}
+	spinUnlock(&cache->lock);
+	IRQ_restore(flags);
 
-	List_pop(&m_caches, &cache->cache_lnode);
 	Cache_free(&m_cacheCache, cache);
 }
 
 void* Cache_malloc(cache_t* cache){
-	struct Slab* slab;
-	bool was_empty = false;
+	unsigned long flags;
+	void* res;
 
 	if (cache == NULL) return NULL;
 
-	// Allocate from partial slabs
-	if (!List_isEmpty(&cache->partial_slabs)){
-		slab = List_getObject(cache->partial_slabs.head, struct Slab, slab_lnode);
-	}
-	// Allocate from free slabs. Grow if necessary
-	else {
-		if (List_isEmpty(&cache->empty_slabs) && !growCache(cache))
-			return NULL;
-		was_empty = true;
-		slab = List_getObject(cache->empty_slabs.head, struct Slab, slab_lnode);
+	IRQ_disableSave(flags);
+
+	// Fast path: this CPU's magazines
+	struct CPUCache* cpu_cache = NULL;
+	if (cache->cpuCaches != NULL){
+		cpu_cache = &cache->cpuCaches[PerCPU_getCpuId()];
+		cpu_cache->allocs++;
+		res = allocateFromMagazines(cache, cpu_cache);
+		if (res != NULL){
+			IRQ_restore(flags);
+			return res;
+		}
 	}
 
-	void* res = allocateObject(slab);
-
-	if (was_empty){
-		List_pop(&cache->empty_slabs, &slab->slab_lnode);
-		List_pushFront(&cache->partial_slabs, &slab->slab_lnode);
-	}
-	else if (isSlabFull(slab)){
-		List_pop(&cache->partial_slabs, &slab->slab_lnode);
-		List_pushFront(&cache->full_slabs, &slab->slab_lnode);
-	}
+	spinLock(&cache->lock);
+	res = allocateFromSlabs(cache);
+	if (cpu_cache == NULL)
+		cache->stats.allocs++;
+	spinUnlock(&cache->lock);
 
+	IRQ_restore(flags);
 	return res;
 }
 
 void Cache_free(cache_t* cache, void* ptr){
-	assert(cache);
+	unsigned long flags;
 
-	entry_t* entry = Hashmap_find(&m_hashmap, ptr);
-	if (entry == NULL) return;
+	assert(cache);
+	if (ptr == NULL) return;
+
+	IRQ_disableSave(flags);
+
+	// Fast path: this CPU's magazines
+	struct CPUCache* cpu_cache = NULL;
+	if (cache->cpuCaches != NULL){
+		cpu_cache = &cache->cpuCaches[PerCPU_getCpuId()];
+		cpu_cache->frees++;
+		if (freeToMagazines(cache, cpu_cache, ptr)){
+			IRQ_restore(flags);
+			return;
+		}
+	}
 
-	struct Slab* slab = entry->value;
-	assert(slab->owner == cache);
+	spinLock(&cache->lock);
+	freeToSlabs(cache, ptr);
+	if (cpu_cache == NULL)
+		cache->stats.frees++;
+	spinUnlock(&cache->lock);
 
-	freeCacheInSlab(cache, slab, ptr);
+	IRQ_restore(flags);
 }
 
 #ifdef KERNEL
@@ -617,9 +887,13 @@ void Cache_free(cache_t* cache, void* ptr){
 void* kmalloc(size_t size){
 	void* res;
 
-	if (size == 0 || size > KMALLOC_MAX_CACHE_SIZE)
+	if (size == 0)
 		return NULL;
 
+	// Big allocations don't need to be physically contiguous
+	if (size > KMALLOC_MAX_CACHE_SIZE)
+		return vmalloc(size);
+
 	// Get in which 'size' cache to allocate
 	int index = getKmallocCache(size);
 	cache_t* cache = m_kmallocCaches + index;
@@ -633,26 +907,31 @@ void kfree(void* ptr){
 	if (ptr == NULL)
 		return;
 
-	entry_t* entry = Hashmap_find(&m_hashmap, ptr);
-	if (entry == NULL){
+	if (VMalloc_isVMallocAddress(ptr)){
+		vfree(ptr);
+		return;
+	}
+
+	struct Page* page = getSlabPage(ptr);
+	if (page == NULL){
 		log(PANIC, MODULE, "Bogus pointer passed to kfree !");
 		panic();
 	}
 
-	struct Slab* slab = entry->value;
-	struct Cache* cache = entry->value->owner;
+	struct Cache* cache = page->cache;
 
 	// Get in which 'size' cache it was allocated
 	int index = getKmallocCache(cache->objSize);
 	struct Cache* kmalloc_cache = m_kmallocCaches + index;
 	assert(cache == kmalloc_cache);
 
-	freeCacheInSlab(kmalloc_cache, slab, ptr);
+	Cache_free(kmalloc_cache, ptr);
 }
 
 void* kcalloc(size_t size){
 	void* res = kmalloc(size);
-	memset(res, 0, size);
+	if (res != NULL)
+		memset(res, 0, size);
 	return res;
 }
 
@@ -667,12 +946,17 @@ void* krealloc(void* ptr, size_t new_size){
 		return NULL;
 	}
 
-	struct HashmapEntry* map_entry = Hashmap_find(&m_hashmap, ptr);
-	if (!map_entry){
-		log(PANIC, MODULE, "Bogus pointer passed to realloc !");
-		panic();
+	if (VMalloc_isVMallocAddress(ptr)){
+		old_size = VMalloc_getSize(ptr);
+	}
+	else {
+		struct Page* page = getSlabPage(ptr);
+		if (page == NULL){
+			log(PANIC, MODULE, "Bogus pointer passed to realloc !");
+			panic();
+		}
+		old_size = ((struct Cache*) page->cache)->objSize;
 	}
-	old_size = map_entry->value->owner->objSize;
 	if (old_size >= new_size)
 		return ptr;
 
@@ -11,9 +11,19 @@ typedef void (*ctor_t)(void* obj);
 
 void SlabAllocator_init();
 
+/// @brief Enable the per-CPU layer of the caches (magazines), making `Cache_malloc` and `Cache_free`
+/// SMP-safe and mostly lock-free. Call once the CPUs IDs are set, before starting them
+/// @param n_cpus Number of CPUs on the system
+void SlabAllocator_initCPUCaches(int n_cpus);
+
 /// @brief Reap (reclaim) free memory. Use when memory is tight
 void SlabAllocator_reapAndTear();
 
+/// @brief Write the statistics of all caches in `buffer`, one line per cache (slabinfo-like format:
+/// active and total objects, slabs, allocations, frees, per-CPU layer misses, grows, shrinks)
+/// @return The length of the full dump, which can be more than `size` (like snprintf)
+size_t SlabAllocator_dumpInfo(char* buffer, size_t size);
+
 // ================ Cache ================
 
 /// @brief Create a cache
@@ -35,7 +45,8 @@ void Cache_free(cache_t* cache, void* ptr);
 // ================ kmalloc ================
 #ifdef KERNEL
 
-/// @brief Allocate an object of size `size` (up to `KMALLOC_MAX_CACHE_SIZE`)
+/// @brief Allocate an object of size `size`. Big objects (above `KMALLOC_MAX_CACHE_SIZE`) are
+/// allocated with vmalloc, and thus not physically contiguous
 /// @return A pointer to valid heap memory, or `NULL` on error
 void* kmalloc(size_t size);
 